@@ -0,0 +1,51 @@
+#!/bin/sh
+# benchmark sweep: runs every engine over a range of body counts and grid
+# sizes and appends their per-phase timings to one CSV file
+#
+# usage: bin/bench.sh [results.csv]
+#
+# POINTS, BINS, STEPS and SEQ_MAX_POINTS override the sweep, e.g.
+#   POINTS="4096 16384" BINS="8 16" bin/bench.sh
+
+OUT=${1:-bench.csv}
+POINTS=${POINTS:-"8192 32768 131072"}
+BINS=${BINS:-"5 10 20"}
+STEPS=${STEPS:-0}
+
+# the brute-force CPU engine is O(N^2); skip it above this many bodies.
+# nbody-seq and nbody-bh-seq are the reference engines and only compute
+# accelerations once whatever STEPS is, so compare them on interactions_per_s
+SEQ_MAX_POINTS=${SEQ_MAX_POINTS:-32768}
+
+run() {
+    echo "$@" >&2
+    "$@" --timing "$OUT" > /dev/null || echo "  failed" >&2
+}
+
+for n in $POINTS; do
+    if [ "$n" -le "$SEQ_MAX_POINTS" ]; then
+        run bin/nbody-seq -n "$n" -s "$STEPS"
+    fi
+
+    run bin/nbody -n "$n" -s "$STEPS"
+    run bin/nbody-bh-seq -n "$n" -s "$STEPS"
+
+    for b in $BINS; do
+        run bin/nbody-opt-seq -n "$n" -b "$b" -s "$STEPS"
+        run bin/nbody-opt -n "$n" -b "$b" -s "$STEPS"
+        run bin/nbody-split -n "$n" -b "$b" -s "$STEPS"
+        run bin/nbody-fmm-seq -n "$n" -b "$b" -s "$STEPS"
+        run bin/nbody-fmm -n "$n" -b "$b" -s "$STEPS"
+
+        # P3M wants about 11 mesh nodes per bin; past 128 the mesh gets large
+        if [ "$b" -le 5 ]; then
+            run bin/nbody-pm-seq -n "$n" -b "$b" --p3m --mesh 64 -s "$STEPS"
+        elif [ "$b" -le 10 ]; then
+            run bin/nbody-pm-seq -n "$n" -b "$b" --p3m --mesh 128 -s "$STEPS"
+        fi
+    done
+
+    run bin/nbody-pm-seq -n "$n" -s "$STEPS"
+done
+
+echo "results in $OUT" >&2
@@ -0,0 +1,167 @@
+/* nbody simulation, accuracy against the exact direct sum */
+
+#include "nbody-accuracy.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+void nbody_reference_acceleration (
+    struct nbody_snapshot const * const snapshot,
+    uint64_t const i,
+    double * const acc
+    )
+{
+    float const * const x = snapshot->x;
+    float const * const y = snapshot->y;
+    float const * const z = snapshot->z;
+    float const * const w = snapshot->w;
+    double const xi = x[i];
+    double const yi = y[i];
+    double const zi = z[i];
+    double ax = 0.0;
+    double ay = 0.0;
+    double az = 0.0;
+
+    for (uint64_t j = 0; j < snapshot->header.points; ++j)
+    {
+        double const dx = x[j] - xi;
+        double const dy = y[j] - yi;
+        double const dz = z[j] - zi;
+        double const dist_sqr = dx * dx + dy * dy + dz * dz + EPS;
+        double const s = w[j] / (dist_sqr * sqrt(dist_sqr));
+
+        ax += dx * s;
+        ay += dy * s;
+        az += dz * s;
+    }
+
+    acc[0] = ax;
+    acc[1] = ay;
+    acc[2] = az;
+}
+
+//
+// xorshift64*, enough for picking samples
+//
+static uint64_t next_random (
+    uint64_t * const state
+    )
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static int compare_doubles (
+    void const * a,
+    void const * b
+    )
+{
+    double const da = *(double const *) a;
+    double const db = *(double const *) b;
+
+    return (da > db) - (da < db);
+}
+
+int nbody_check_accuracy (
+    struct nbody_snapshot const * const snapshot,
+    uint64_t const samples,
+    uint64_t const seed,
+    struct nbody_accuracy * const result
+    )
+{
+    uint64_t const n = snapshot->header.points;
+    uint64_t const k = (samples == 0 || samples > n) ? n : samples;
+    uint64_t * picked;
+    double * errors;
+    double * sorted;
+    double sum;
+    uint64_t state = seed | 1;
+    uint64_t count = 0;
+
+    if (snapshot->ax == NULL || k == 0)
+    {
+        return -1;
+    }
+
+    picked = (uint64_t *) malloc(sizeof(uint64_t) * k);
+    errors = (double *) malloc(sizeof(double) * k);
+    sorted = (double *) malloc(sizeof(double) * k);
+
+    if (picked == NULL || errors == NULL || sorted == NULL)
+    {
+        free(picked);
+        free(errors);
+        free(sorted);
+        return -1;
+    }
+
+    //
+    // Selection sampling (Knuth's algorithm S): one pass, indices come out
+    // sorted, so the reference sums walk the snapshot in order
+    //
+    for (uint64_t i = 0; i < n && count < k; ++i)
+    {
+        double const u = (next_random(&state) >> 11) * (1.0 / 9007199254740992.0);
+
+        if ((n - i) * u < k - count)
+        {
+            picked[count++] = i;
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (uint64_t s = 0; s < k; ++s)
+    {
+        uint64_t const i = picked[s];
+        double ref[3];
+        double dx;
+        double dy;
+        double dz;
+        double norm;
+
+        nbody_reference_acceleration(snapshot, i, ref);
+
+        dx = snapshot->ax[i] - ref[0];
+        dy = snapshot->ay[i] - ref[1];
+        dz = snapshot->az[i] - ref[2];
+        norm = sqrt(ref[0] * ref[0] + ref[1] * ref[1] + ref[2] * ref[2]);
+
+        errors[s] = sqrt(dx * dx + dy * dy + dz * dz) / (norm > 0.0 ? norm : 1.0);
+    }
+
+    sum = 0.0;
+    result->worst = 0;
+
+    for (uint64_t s = 0; s < k; ++s)
+    {
+        sum += errors[s];
+        sorted[s] = errors[s];
+
+        if (errors[s] > errors[result->worst])
+        {
+            result->worst = (int) s;
+        }
+    }
+
+    result->worst = (int) picked[result->worst];
+
+    qsort(sorted, k, sizeof(double), compare_doubles);
+
+    //
+    // Nearest-rank percentiles
+    //
+    result->samples = (int) k;
+    result->mean = sum / k;
+    result->p50 = sorted[(k - 1) * 50 / 100];
+    result->p90 = sorted[(k - 1) * 90 / 100];
+    result->p99 = sorted[(k - 1) * 99 / 100];
+    result->max = sorted[k - 1];
+
+    free(picked);
+    free(errors);
+    free(sorted);
+    return 0;
+}
@@ -0,0 +1,46 @@
+/* nbody simulation, accuracy against the exact direct sum */
+
+#ifndef NBODY_ACCURACY_H
+#define NBODY_ACCURACY_H
+
+#include "nbody-snapshot.h"
+
+//
+// Relative acceleration errors |a - a_ref| / |a_ref| over the checked bodies
+//
+struct nbody_accuracy
+{
+    int samples;            // bodies checked
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+    int worst;              // index of the body with the largest error
+};
+
+//
+// Exact acceleration on body i of snapshot: the O(N) direct sum of
+// body_body_interaction over all bodies, accumulated in double.
+//
+void nbody_reference_acceleration (
+    struct nbody_snapshot const * const snapshot,
+    uint64_t const i,
+    double * const acc
+    );
+
+//
+// Check the accelerations stored in snapshot against the direct sum, for
+// samples bodies picked uniformly at random (all bodies if samples is 0 or
+// at least the body count). The pick is the same for the same seed.
+// Returns 0 on success, -1 if the snapshot has no accelerations or memory
+// runs out.
+//
+int nbody_check_accuracy (
+    struct nbody_snapshot const * const snapshot,
+    uint64_t const samples,
+    uint64_t const seed,
+    struct nbody_accuracy * const result
+    );
+
+#endif
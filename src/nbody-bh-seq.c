@@ -0,0 +1,360 @@
+/* nbody simulation, Barnes-Hut octree version */
+
+#include <CL/cl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "nbody-common.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+
+//
+// Deeper than this and the bodies are (nearly) coincident; stop splitting.
+//
+#define MAX_DEPTH (32)
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//
+// One octree node. Nodes are stored flattened in depth-first (pre-)order:
+// a node's first child, if it has any, directly follows it and next is the
+// index just past its subtree. The force walk is then a forward scan over
+// the array that either descends (i + 1) or skips the subtree (next), with
+// no stack and no child pointers.
+//
+struct bh_node
+{
+    cl_float4 cm;       // centre of mass, total mass in .w
+    float size;         // edge length of the node's cube
+    int first;          // first body below the node in bh_tree.pts
+    int count;          // number of bodies below the node
+    int next;           // index of the node after this subtree
+    int leaf;           // bodies are interacted with directly
+};
+
+struct bh_tree
+{
+    struct bh_node * nodes;
+    int num_nodes;
+    int capacity;
+    cl_float4 * pts;    // bodies in tree order, each node's bodies contiguous
+    int * ids;          // original index of each body in pts
+    cl_float4 * scratch_pts;
+    int * scratch_ids;
+};
+
+static int alloc_node (
+    struct bh_tree * const tree
+    )
+{
+    if (tree->num_nodes == tree->capacity)
+    {
+        tree->capacity *= 2;
+        tree->nodes = (struct bh_node *) realloc(tree->nodes, sizeof(struct bh_node) * tree->capacity);
+
+        if (tree->nodes == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    return tree->num_nodes++;
+}
+
+//
+// Build the subtree over pts[first, first + count), which all lie in the cube
+// of half-width half around center. Returns the index of the subtree root.
+// The node array may be reallocated by the recursion, so nodes are only
+// ever referred to by index here.
+//
+static int build_node (
+    struct nbody_config const * const config,
+    struct bh_tree * const tree,
+    int const first,
+    int const count,
+    cl_float4 const center,
+    float const half,
+    int const depth
+    )
+{
+    int idx;
+    cl_float4 cm;
+
+    idx = alloc_node(tree);
+    tree->nodes[idx].size = 2.0f * half;
+    tree->nodes[idx].first = first;
+    tree->nodes[idx].count = count;
+
+    cm = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
+
+    if (count <= config->leaf_size || depth >= MAX_DEPTH)
+    {
+        for (int i = first; i < first + count; ++i)
+        {
+            cm.x += tree->pts[i].x * tree->pts[i].w;
+            cm.y += tree->pts[i].y * tree->pts[i].w;
+            cm.z += tree->pts[i].z * tree->pts[i].w;
+            cm.w += tree->pts[i].w;
+        }
+
+        tree->nodes[idx].leaf = 1;
+    }
+    else
+    {
+        int octant_counts[8] = {0};
+        int octant_offsets[8];
+        int offset;
+
+        //
+        // Counting sort of the node's bodies into its eight octants
+        //
+        for (int i = first; i < first + count; ++i)
+        {
+            octant_counts[((tree->pts[i].x >= center.x) << 2)
+                          | ((tree->pts[i].y >= center.y) << 1)
+                          | (tree->pts[i].z >= center.z)]++;
+        }
+
+        offset = first;
+        for (int o = 0; o < 8; ++o)
+        {
+            octant_offsets[o] = offset;
+            offset += octant_counts[o];
+        }
+
+        for (int i = first; i < first + count; ++i)
+        {
+            int o = ((tree->pts[i].x >= center.x) << 2)
+                    | ((tree->pts[i].y >= center.y) << 1)
+                    | (tree->pts[i].z >= center.z);
+
+            tree->scratch_pts[octant_offsets[o]] = tree->pts[i];
+            tree->scratch_ids[octant_offsets[o]] = tree->ids[i];
+            octant_offsets[o]++;
+        }
+
+        memcpy(&tree->pts[first], &tree->scratch_pts[first], sizeof(cl_float4) * count);
+        memcpy(&tree->ids[first], &tree->scratch_ids[first], sizeof(int) * count);
+
+        //
+        // Children, in octant order, directly follow this node
+        //
+        offset = first;
+        for (int o = 0; o < 8; ++o)
+        {
+            cl_float4 child_center;
+            int child;
+
+            if (octant_counts[o] == 0)
+            {
+                continue;
+            }
+
+            child_center.x = center.x + ((o & 4) ? 0.5f : -0.5f) * half;
+            child_center.y = center.y + ((o & 2) ? 0.5f : -0.5f) * half;
+            child_center.z = center.z + ((o & 1) ? 0.5f : -0.5f) * half;
+            child_center.w = 0.0f;
+
+            child = build_node(config, tree, offset, octant_counts[o], child_center, 0.5f * half, depth + 1);
+
+            cm.x += tree->nodes[child].cm.x * tree->nodes[child].cm.w;
+            cm.y += tree->nodes[child].cm.y * tree->nodes[child].cm.w;
+            cm.z += tree->nodes[child].cm.z * tree->nodes[child].cm.w;
+            cm.w += tree->nodes[child].cm.w;
+
+            offset += octant_counts[o];
+        }
+
+        tree->nodes[idx].leaf = 0;
+    }
+
+    if (cm.w > 0.0f)
+    {
+        cm.x /= cm.w;
+        cm.y /= cm.w;
+        cm.z /= cm.w;
+    }
+    else
+    {
+        cm.x = center.x;
+        cm.y = center.y;
+        cm.z = center.z;
+    }
+
+    tree->nodes[idx].cm = cm;
+    tree->nodes[idx].next = tree->num_nodes;
+
+    return idx;
+}
+
+//
+// Build the octree over all points. The root is the bounding cube of the
+// points, so bodies anywhere in space are handled.
+//
+void construct_tree (
+    struct nbody_config const * const config,
+    struct bh_tree * const tree,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    cl_float4 lo;
+    cl_float4 hi;
+    cl_float4 center;
+    float half;
+
+    lo = hi = global_p[0];
+
+    for (int i = 0; i < points; ++i)
+    {
+        tree->pts[i] = global_p[i];
+        tree->ids[i] = i;
+
+        lo.x = MIN(lo.x, global_p[i].x);
+        lo.y = MIN(lo.y, global_p[i].y);
+        lo.z = MIN(lo.z, global_p[i].z);
+        hi.x = MAX(hi.x, global_p[i].x);
+        hi.y = MAX(hi.y, global_p[i].y);
+        hi.z = MAX(hi.z, global_p[i].z);
+    }
+
+    center.x = 0.5f * (lo.x + hi.x);
+    center.y = 0.5f * (lo.y + hi.y);
+    center.z = 0.5f * (lo.z + hi.z);
+    center.w = 0.0f;
+
+    half = 0.5f * MAX(hi.x - lo.x, MAX(hi.y - lo.y, hi.z - lo.z));
+
+    tree->num_nodes = 0;
+    build_node(config, tree, 0, points, center, half, 0);
+}
+
+//
+// Acceleration on my_position: a node is accepted as a single point mass
+// when size / distance < theta, otherwise the walk descends into it.
+// Returns the number of interactions evaluated.
+//
+int calculateForces (
+    struct nbody_config const * const config,
+    struct bh_tree const * const tree,
+    cl_float4 const my_position,
+    cl_float4 * const acc
+    )
+{
+    float const theta_sqr = config->theta * config->theta;
+    cl_double4 sum = {{0.0, 0.0, 0.0, 1.0}};
+    int interactions = 0;
+    int i;
+
+    i = 0;
+    while (i < tree->num_nodes)
+    {
+        struct bh_node const * const node = &tree->nodes[i];
+
+        if (node->leaf)
+        {
+            for (int j = node->first; j < node->first + node->count; ++j)
+            {
+                nbody_pair_interaction(config->precision, my_position, tree->pts[j], &sum);
+            }
+
+            interactions += node->count;
+            i = node->next;
+        }
+        else
+        {
+            float dx = node->cm.x - my_position.x;
+            float dy = node->cm.y - my_position.y;
+            float dz = node->cm.z - my_position.z;
+
+            if (node->size * node->size < theta_sqr * (dx * dx + dy * dy + dz * dz))
+            {
+                nbody_pair_interaction(config->precision, my_position, node->cm, &sum);
+                interactions++;
+                i = node->next;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    *acc = nbody_narrow(sum);
+    return interactions;
+}
+
+int main(int argc, char ** argv)
+{
+    struct nbody_config config;
+    struct bh_tree tree;
+    struct nbody_timing timing;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        return 1;
+    }
+
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+
+    tree.capacity = MAX(16, 2 * config.points / config.leaf_size);
+    tree.nodes = (struct bh_node *) malloc(sizeof(struct bh_node) * tree.capacity);
+    tree.pts = (cl_float4 *) malloc(sizeof(cl_float4) * config.points);
+    tree.ids = (int *) malloc(sizeof(int) * config.points);
+    tree.scratch_pts = (cl_float4 *) malloc(sizeof(cl_float4) * config.points);
+    tree.scratch_ids = (int *) malloc(sizeof(int) * config.points);
+
+    if (x == NULL || a == NULL || tree.nodes == NULL || tree.pts == NULL
+        || tree.ids == NULL || tree.scratch_pts == NULL || tree.scratch_ids == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    construct_tree(&config, &tree, x, config.points);
+
+    timing.phase[NBODY_PHASE_BINNING] = nbody_now() - t;
+    t = nbody_now();
+
+    //
+    // Walk the targets in tree order so consecutive walks visit mostly the
+    // same nodes
+    //
+    for (int i = 0; i < config.points; i++)
+    {
+        timing.interactions += calculateForces(&config, &tree, tree.pts[i], &a[tree.ids[i]]);
+    }
+
+    timing.phase[NBODY_PHASE_FORCES] = nbody_now() - t;
+
+    t = nbody_now();
+    nbody_output(&config, x, NULL, a, config.points, 0, 0.0, 0);
+    timing.phase[NBODY_PHASE_OUTPUT] = nbody_now() - t;
+    nbody_timing_report(&config, &timing, "bh-seq");
+
+    free(tree.scratch_ids);
+    free(tree.scratch_pts);
+    free(tree.ids);
+    free(tree.pts);
+    free(tree.nodes);
+    free(x);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,478 @@
+/* nbody simulation, shared run configuration and initial conditions */
+
+#include "nbody-common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+//
+// Values for options that only have a long form
+//
+enum
+{
+    OPT_UNTILED = 256,
+    OPT_THETA,
+    OPT_LEAF_SIZE,
+    OPT_ISA,
+    OPT_IC,
+    OPT_TIMING,
+    OPT_NO_KERNEL_CACHE,
+    OPT_NO_HOST,
+    OPT_MAX_BIN,
+    OPT_ORDER,
+    OPT_PRECISION,
+    OPT_SYMMETRIC,
+    OPT_REBIN_THRESHOLD,
+    OPT_RUNGS,
+    OPT_ETA,
+    OPT_ENSEMBLE,
+    OPT_MESH,
+    OPT_P3M,
+};
+
+static char const * const isa_names[] =
+{
+    "auto",     // NBODY_ISA_AUTO
+    "scalar",   // NBODY_ISA_SCALAR
+    "avx2",     // NBODY_ISA_AVX2
+    "avx512",   // NBODY_ISA_AVX512
+};
+
+static char const * const precision_names[] =
+{
+    "float",    // NBODY_PRECISION_FLOAT
+    "mixed",    // NBODY_PRECISION_MIXED
+    "double",   // NBODY_PRECISION_DOUBLE
+};
+
+static char const * const ic_names[] =
+{
+    "uniform",  // NBODY_IC_UNIFORM
+    "plummer",  // NBODY_IC_PLUMMER
+    "galaxies", // NBODY_IC_GALAXIES
+    "clumps",   // NBODY_IC_CLUMPS
+};
+
+//
+// Index of name in names, -1 if it is not there
+//
+static int find_name (
+    char const * const * const names,
+    int const count,
+    char const * const name
+    )
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+char const * nbody_precision_name (
+    int const precision
+    )
+{
+    return precision_names[precision];
+}
+
+void nbody_default_config (
+    struct nbody_config * const config
+    )
+{
+    config->points = DEFAULT_POINTS;
+    config->space = DEFAULT_SPACE;
+    config->bins_per_dim = DEFAULT_BINS_PER_DIM;
+    config->bin_length = DEFAULT_SPACE / DEFAULT_BINS_PER_DIM;
+    config->steps = 0;
+    config->dt = DEFAULT_DT;
+    config->rungs = 0;
+    config->eta = DEFAULT_ETA;
+    config->output_interval = 0;
+    config->local_size = 0;
+    config->tiled = 1;
+    config->theta = DEFAULT_THETA;
+    config->leaf_size = DEFAULT_LEAF_SIZE;
+    config->max_bin_pts = DEFAULT_MAX_BIN_PTS;
+    config->rebin_threshold = DEFAULT_REBIN_THRESHOLD;
+    config->fmm_order = DEFAULT_FMM_ORDER;
+    config->pm_mesh = DEFAULT_PM_MESH;
+    config->p3m = 0;
+    config->threads = 0;
+    config->isa = NBODY_ISA_AUTO;
+    config->precision = NBODY_PRECISION_FLOAT;
+    config->symmetric = 0;
+    config->ensemble = 0;
+    config->output_path = NULL;
+    config->input_path = NULL;
+    config->ic = NBODY_IC_UNIFORM;
+    config->timing_path = NULL;
+    config->kernel_cache = 1;
+    config->split_host = 1;
+}
+
+static void usage (
+    char const * const name
+    )
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n, --points N           number of bodies (default %d)\n"
+        "  -l, --space L            bodies start in [0, L)^3 (default %.1f)\n"
+        "  -b, --bins B             bins per dimension for the grid engines (default %d)\n"
+        "  -s, --steps S            velocity-Verlet steps, 0 computes accelerations once (default 0)\n"
+        "  -t, --dt DT              timestep (default %.2f)\n"
+        "  -o, --output-interval K  print a snapshot every K steps, 0 prints the last only (default 0)\n"
+        "  -j, --threads J          CPU worker threads (default 0: OMP_NUM_THREADS or one per core)\n"
+        "  -w, --local-size W       OpenCL work-group size (default 0: largest the kernel allows)\n"
+        "  -O, --output FILE        write binary snapshots to FILE instead of text to stdout\n"
+        "  -i, --input FILE         start from the first snapshot in FILE (sets the number of bodies)\n"
+        "      --ic NAME            generated start: uniform, plummer, galaxies or clumps (default uniform)\n"
+        "      --untiled            brute-force OpenCL engine reads bodies straight from global memory\n"
+        "      --ensemble K         brute-force OpenCL engine runs K independent systems in one batch,\n"
+        "                           seeded differently or the first K records of the input (default 0: one)\n"
+        "      --no-kernel-cache    always compile the OpenCL program from source\n"
+        "      --no-host            split engine runs on the OpenCL devices only, CPU devices included\n"
+        "      --theta T            Barnes-Hut opening angle (default %.2f)\n"
+        "      --leaf-size K        Barnes-Hut leaves and grid cells hold at most K bodies (default %d)\n"
+        "      --max-bin K          refine CPU grid bins holding more than K bodies, 0 never (default %d)\n"
+        "      --rebin-threshold F  CPU grid bins are rebuilt when more than fraction F of the bodies\n"
+        "                           changed bin, else patched; 0 always rebuilds (default %.2f)\n"
+        "      --rungs R            block timesteps down to DT / 2^R for the opt engines, 0 to %d (default 0)\n"
+        "      --eta E              block timestep of a body is at most E sqrt(spacing / |a|) (default %.2f)\n"
+        "      --order P            FMM expansion order, 1 to %d (default %d)\n"
+        "      --mesh M             particle-mesh nodes per dimension, %d to %d, rounded up to a power of two\n"
+        "                           (default %d)\n"
+        "      --p3m                particle-mesh engine adds the short-range sum over the 27 neighbouring bins\n"
+        "      --isa NAME           CPU interaction loop: auto, scalar, avx2 or avx512 (default auto)\n"
+        "      --precision NAME     force arithmetic: float, mixed (double sums) or double (default float)\n"
+        "      --symmetric          CPU brute-force and grid engines evaluate each near pair once for both bodies\n"
+        "      --timing FILE        append per-phase timings of the run to FILE as CSV\n",
+        name, DEFAULT_POINTS, DEFAULT_SPACE, DEFAULT_BINS_PER_DIM, DEFAULT_DT,
+        DEFAULT_THETA, DEFAULT_LEAF_SIZE, DEFAULT_MAX_BIN_PTS, DEFAULT_REBIN_THRESHOLD, NBODY_MAX_RUNGS, DEFAULT_ETA, NBODY_FMM_MAX_ORDER, DEFAULT_FMM_ORDER,
+        NBODY_PM_MIN_MESH, NBODY_PM_MAX_MESH, DEFAULT_PM_MESH);
+}
+
+void nbody_parse_args (
+    int argc,
+    char ** argv,
+    struct nbody_config * const config
+    )
+{
+    static struct option const long_options[] =
+    {
+        {"points",          required_argument, NULL, 'n'},
+        {"space",           required_argument, NULL, 'l'},
+        {"bins",            required_argument, NULL, 'b'},
+        {"steps",           required_argument, NULL, 's'},
+        {"dt",              required_argument, NULL, 't'},
+        {"output-interval", required_argument, NULL, 'o'},
+        {"threads",         required_argument, NULL, 'j'},
+        {"local-size",      required_argument, NULL, 'w'},
+        {"output",          required_argument, NULL, 'O'},
+        {"input",           required_argument, NULL, 'i'},
+        {"ic",              required_argument, NULL, OPT_IC},
+        {"untiled",         no_argument,       NULL, OPT_UNTILED},
+        {"ensemble",        required_argument, NULL, OPT_ENSEMBLE},
+        {"no-kernel-cache", no_argument,       NULL, OPT_NO_KERNEL_CACHE},
+        {"no-host",         no_argument,       NULL, OPT_NO_HOST},
+        {"theta",           required_argument, NULL, OPT_THETA},
+        {"leaf-size",       required_argument, NULL, OPT_LEAF_SIZE},
+        {"max-bin",         required_argument, NULL, OPT_MAX_BIN},
+        {"rebin-threshold", required_argument, NULL, OPT_REBIN_THRESHOLD},
+        {"rungs",           required_argument, NULL, OPT_RUNGS},
+        {"eta",             required_argument, NULL, OPT_ETA},
+        {"order",           required_argument, NULL, OPT_ORDER},
+        {"mesh",            required_argument, NULL, OPT_MESH},
+        {"p3m",             no_argument,       NULL, OPT_P3M},
+        {"isa",             required_argument, NULL, OPT_ISA},
+        {"precision",       required_argument, NULL, OPT_PRECISION},
+        {"symmetric",       no_argument,       NULL, OPT_SYMMETRIC},
+        {"timing",          required_argument, NULL, OPT_TIMING},
+        {"help",            no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    nbody_default_config(config);
+
+    while ((opt = getopt_long(argc, argv, "n:l:b:s:t:o:j:w:O:i:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            config->points = atoi(optarg);
+            break;
+        case 'l':
+            config->space = (float) atof(optarg);
+            break;
+        case 'b':
+            config->bins_per_dim = atoi(optarg);
+            break;
+        case 's':
+            config->steps = atoi(optarg);
+            break;
+        case 't':
+            config->dt = (float) atof(optarg);
+            break;
+        case 'o':
+            config->output_interval = atoi(optarg);
+            break;
+        case 'j':
+            config->threads = atoi(optarg);
+            break;
+        case 'w':
+            config->local_size = atoi(optarg);
+            break;
+        case 'O':
+            config->output_path = optarg;
+            break;
+        case 'i':
+            config->input_path = optarg;
+            break;
+        case OPT_IC:
+            config->ic = find_name(ic_names, sizeof(ic_names) / sizeof(ic_names[0]), optarg);
+
+            if (config->ic < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_UNTILED:
+            config->tiled = 0;
+            break;
+        case OPT_ENSEMBLE:
+            config->ensemble = atoi(optarg);
+            break;
+        case OPT_NO_KERNEL_CACHE:
+            config->kernel_cache = 0;
+            break;
+        case OPT_NO_HOST:
+            config->split_host = 0;
+            break;
+        case OPT_THETA:
+            config->theta = (float) atof(optarg);
+            break;
+        case OPT_LEAF_SIZE:
+            config->leaf_size = atoi(optarg);
+            break;
+        case OPT_MAX_BIN:
+            config->max_bin_pts = atoi(optarg);
+            break;
+        case OPT_REBIN_THRESHOLD:
+            config->rebin_threshold = (float) atof(optarg);
+            break;
+        case OPT_RUNGS:
+            config->rungs = atoi(optarg);
+            break;
+        case OPT_ETA:
+            config->eta = (float) atof(optarg);
+            break;
+        case OPT_ORDER:
+            config->fmm_order = atoi(optarg);
+            break;
+        case OPT_MESH:
+            config->pm_mesh = atoi(optarg);
+            break;
+        case OPT_P3M:
+            config->p3m = 1;
+            break;
+        case OPT_ISA:
+            config->isa = find_name(isa_names, sizeof(isa_names) / sizeof(isa_names[0]), optarg);
+
+            if (config->isa < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_PRECISION:
+            config->precision = find_name(precision_names, sizeof(precision_names) / sizeof(precision_names[0]), optarg);
+
+            if (config->precision < 0)
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SYMMETRIC:
+            config->symmetric = 1;
+            break;
+        case OPT_TIMING:
+            config->timing_path = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config->points <= 0 || config->space <= 0.0f || config->bins_per_dim <= 0
+        || config->steps < 0 || config->rungs < 0 || config->rungs > NBODY_MAX_RUNGS || config->eta <= 0.0f
+        || config->output_interval < 0 || config->local_size < 0 || config->threads < 0 || config->ensemble < 0
+        || config->theta < 0.0f || config->leaf_size <= 0 || config->max_bin_pts < 0 || config->rebin_threshold < 0.0f
+        || config->fmm_order < 1 || config->fmm_order > NBODY_FMM_MAX_ORDER
+        || config->pm_mesh < NBODY_PM_MIN_MESH || config->pm_mesh > NBODY_PM_MAX_MESH)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    config->bin_length = config->space / config->bins_per_dim;
+}
+
+void nbody_kick_drift (
+    cl_float4 * const p,
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const points,
+    float const dt
+    )
+{
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        v[i].x += 0.5f * dt * a[i].x;
+        v[i].y += 0.5f * dt * a[i].y;
+        v[i].z += 0.5f * dt * a[i].z;
+
+        p[i].x += dt * v[i].x;
+        p[i].y += dt * v[i].y;
+        p[i].z += dt * v[i].z;
+    }
+}
+
+void nbody_kick (
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const points,
+    float const dt
+    )
+{
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        v[i].x += 0.5f * dt * a[i].x;
+        v[i].y += 0.5f * dt * a[i].y;
+        v[i].z += 0.5f * dt * a[i].z;
+    }
+}
+
+void nbody_kick_rungs (
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const * const rung,
+    int const points,
+    float const dt
+    )
+{
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        float const h = ldexpf(dt, -rung[i]);
+
+        v[i].x += 0.5f * h * a[i].x;
+        v[i].y += 0.5f * h * a[i].y;
+        v[i].z += 0.5f * h * a[i].z;
+    }
+}
+
+void nbody_drift (
+    cl_float4 * const p,
+    cl_float4 const * const v,
+    int const points,
+    float const h
+    )
+{
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        p[i].x += h * v[i].x;
+        p[i].y += h * v[i].y;
+        p[i].z += h * v[i].z;
+    }
+}
+
+void nbody_kick_active (
+    struct nbody_config const * const config,
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int * const rung,
+    int const * const active,
+    int const count,
+    int const min_rung,
+    int const reopen
+    )
+{
+    float const scale = nbody_rung_scale(config);
+
+    #pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; ++k)
+    {
+        int const i = active[k];
+        float h = ldexpf(config->dt, -rung[i]);
+
+        v[i].x += 0.5f * h * a[i].x;
+        v[i].y += 0.5f * h * a[i].y;
+        v[i].z += 0.5f * h * a[i].z;
+
+        rung[i] = nbody_rung(config, scale, a[i]);
+
+        if (rung[i] < min_rung)
+        {
+            rung[i] = min_rung;
+        }
+
+        if (reopen)
+        {
+            h = ldexpf(config->dt, -rung[i]);
+
+            v[i].x += 0.5f * h * a[i].x;
+            v[i].y += 0.5f * h * a[i].y;
+            v[i].z += 0.5f * h * a[i].z;
+        }
+    }
+}
+
+cl_float4 * initializePositions (
+    struct nbody_config const * const config
+    )
+{
+    cl_float4 * pts;
+
+    pts = (cl_float4 *) malloc(sizeof(cl_float4) * config->points);
+
+    if (pts == NULL)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < config->points; ++i)
+    {
+        // quick and dirty generation of points
+        // not random at all, but I don't care.
+        pts[i].x = ((float) rand()) / RAND_MAX * config->space;
+        pts[i].y = ((float) rand()) / RAND_MAX * config->space;
+        pts[i].z = ((float) rand()) / RAND_MAX * config->space;
+        pts[i].w = 1.0f; // size = 1.0f for simplicity.
+    }
+
+    return pts;
+}
+
+cl_float4 * initializeAccelerations (
+    struct nbody_config const * const config
+    )
+{
+    return (cl_float4 *) calloc(config->points, sizeof(cl_float4));
+}
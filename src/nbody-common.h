@@ -0,0 +1,348 @@
+/* nbody simulation, shared run configuration and initial conditions */
+
+#ifndef NBODY_COMMON_H
+#define NBODY_COMMON_H
+
+#include <CL/cl.h>
+#include <math.h>
+
+#define EPS 1e-10
+
+/// runtime on my 2011 computer: 1m; in 2013, 27s.
+// on my 2011 laptop, 1m34s
+#define DEFAULT_POINTS (500 * 64)
+#define DEFAULT_SPACE (1000.0f)
+#define DEFAULT_BINS_PER_DIM (10)
+#define DEFAULT_DT (1.0f)
+#define DEFAULT_THETA (0.5f)
+#define DEFAULT_LEAF_SIZE (8)
+#define DEFAULT_MAX_BIN_PTS (512)
+#define DEFAULT_FMM_ORDER (4)
+#define DEFAULT_REBIN_THRESHOLD (0.25f)
+#define DEFAULT_ETA (0.05f)
+#define DEFAULT_PM_MESH (64)
+#define NBODY_FMM_MAX_ORDER (10)
+#define NBODY_MAX_RUNGS (20)
+#define NBODY_PM_MIN_MESH (16)
+#define NBODY_PM_MAX_MESH (256)
+
+//
+// Instruction sets for the CPU interaction loops (see nbody-simd.h)
+//
+enum nbody_isa
+{
+    NBODY_ISA_AUTO,
+    NBODY_ISA_SCALAR,
+    NBODY_ISA_AVX2,
+    NBODY_ISA_AVX512,
+};
+
+//
+// Arithmetic of the force evaluation. Bodies are always stored as floats;
+// this picks the type of the pair terms and of the sums they go into.
+//
+enum nbody_precision
+{
+    NBODY_PRECISION_FLOAT,      // float pair terms, float sums
+    NBODY_PRECISION_MIXED,      // float pair terms, double sums
+    NBODY_PRECISION_DOUBLE,     // double pair terms, double sums
+};
+
+//
+// Generators for the initial conditions (see nbody-ic.h)
+//
+enum nbody_ic_kind
+{
+    NBODY_IC_UNIFORM,
+    NBODY_IC_PLUMMER,
+    NBODY_IC_GALAXIES,
+    NBODY_IC_CLUMPS,
+};
+
+//
+// Everything that used to be a compile-time #define. Filled in from the
+// command line by nbody_parse_args; programs ignore the fields they do not use.
+//
+struct nbody_config
+{
+    int points;             // number of bodies
+    float space;            // bodies are generated in [0, space)^3
+    int bins_per_dim;       // grid resolution of the opt engines
+    float bin_length;       // derived: space / bins_per_dim
+    int steps;              // velocity-Verlet steps, 0 computes accelerations once
+    float dt;               // timestep
+    int rungs;              // block timesteps go down to dt / 2^rungs, 0 steps all bodies by dt
+    float eta;              // accuracy parameter of the block timestep criterion
+    int output_interval;    // print every output_interval steps, 0 prints the last only
+    int local_size;         // OpenCL work-group size, 0 picks one from the device
+    int tiled;              // brute-force OpenCL engine stages bodies in local memory
+    float theta;            // Barnes-Hut opening angle
+    int leaf_size;          // Barnes-Hut nodes with at most this many bodies are leaves
+    int max_bin_pts;        // CPU grid bins with more bodies are refined into cells, 0 never
+    float rebin_threshold;  // CPU grid rebuilds its bins when more bodies changed bin, 0 always
+    int fmm_order;          // order of the FMM multipole and local expansions
+    int pm_mesh;            // particle-mesh nodes per dimension, rounded up to a power of two
+    int p3m;                // particle-mesh engine adds the short-range sum over neighbouring bins
+    int threads;            // CPU worker threads, 0 uses the OpenMP default
+    int isa;                // enum nbody_isa for the CPU interaction loops
+    int precision;          // enum nbody_precision of the force evaluation
+    int symmetric;          // CPU engines apply each near pair term to both bodies
+    int ensemble;           // brute-force OpenCL engine runs this many systems in one batch, 0 one
+    char const * output_path;   // binary snapshot file, NULL prints text to stdout
+    char const * input_path;    // snapshot to start from, NULL generates config->ic
+    int ic;                 // enum nbody_ic_kind
+    char const * timing_path;   // CSV file per-phase timings are appended to, or NULL
+    int kernel_cache;       // OpenCL engines reuse cached program binaries
+    int split_host;         // split engine gives the host CPU a share of the bodies
+};
+
+void nbody_default_config (
+    struct nbody_config * const config
+    );
+
+//
+// Parse the command line into config. Prints usage and exits on bad input.
+//
+void nbody_parse_args (
+    int argc,
+    char ** argv,
+    struct nbody_config * const config
+    );
+
+//
+// Name of an enum nbody_precision, as --precision takes it
+//
+char const * nbody_precision_name (
+    int const precision
+    );
+
+//
+// Number of bins in the whole grid (bins_per_dim cubed).
+//
+static inline int nbody_num_bins (
+    struct nbody_config const * const config
+    )
+{
+    return config->bins_per_dim * config->bins_per_dim * config->bins_per_dim;
+}
+
+//
+// Acceleration on body bi due to body (or centre of mass) bj, with
+// mass in .w, accumulated into ai.
+//
+static inline void body_body_interaction (
+    cl_float4 bi,
+    cl_float4 bj,
+    cl_float4 * ai
+    )
+{
+    cl_float4 r;
+
+    r.x = bj.x - bi.x;
+    r.y = bj.y - bi.y;
+    r.z = bj.z - bi.z;
+    r.w = 1.0f;
+
+    float distSqr = r.x * r.x + r.y * r.y + r.z * r.z + EPS;
+
+    float distSixth = distSqr * distSqr * distSqr;
+    float invDistCube = 1.0f/sqrtf(distSixth);
+
+    float s = bj.w * invDistCube;
+
+    ai->x += r.x * s;
+    ai->y += r.y * s;
+    ai->z += r.z * s;
+}
+
+//
+// The same pair term in double, from float bodies
+//
+static inline void body_body_interaction_double (
+    cl_float4 bi,
+    cl_float4 bj,
+    cl_double4 * ai
+    )
+{
+    double rx = (double) bj.x - bi.x;
+    double ry = (double) bj.y - bi.y;
+    double rz = (double) bj.z - bi.z;
+
+    double distSqr = rx * rx + ry * ry + rz * rz + EPS;
+
+    double distSixth = distSqr * distSqr * distSqr;
+    double invDistCube = 1.0 / sqrt(distSixth);
+
+    double s = bj.w * invDistCube;
+
+    ai->x += rx * s;
+    ai->y += ry * s;
+    ai->z += rz * s;
+}
+
+//
+// Pair term of the given precision (enum nbody_precision) added to a double
+// accumulator: float arithmetic unless the precision is double.
+//
+static inline void nbody_pair_interaction (
+    int const precision,
+    cl_float4 bi,
+    cl_float4 bj,
+    cl_double4 * ai
+    )
+{
+    if (precision == NBODY_PRECISION_DOUBLE)
+    {
+        body_body_interaction_double(bi, bj, ai);
+    }
+    else
+    {
+        cl_float4 term = {{0.0f, 0.0f, 0.0f, 0.0f}};
+
+        body_body_interaction(bi, bj, &term);
+
+        ai->x += term.x;
+        ai->y += term.y;
+        ai->z += term.z;
+    }
+}
+
+//
+// Accumulated acceleration rounded to the float4 the engines store
+//
+static inline cl_float4 nbody_narrow (
+    cl_double4 const acc
+    )
+{
+    cl_float4 a;
+
+    a.x = (float) acc.x;
+    a.y = (float) acc.y;
+    a.z = (float) acc.z;
+    a.w = (float) acc.w;
+
+    return a;
+}
+
+//
+// Host velocity-Verlet halves, matching the kick_drift and kick kernels:
+// half kick and full drift, then the closing half kick with the new
+// accelerations. Masses in p[i].w are left untouched.
+//
+void nbody_kick_drift (
+    cl_float4 * const p,
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const points,
+    float const dt
+    );
+
+void nbody_kick (
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const points,
+    float const dt
+    );
+
+//
+// Block timesteps (--rungs R): a body on rung r steps by dt / 2^r, so a
+// step of dt is 2^R substeps of dt / 2^R and a body on rung r is active,
+// ending one of its steps, after every 2^(R - r)-th substep. A body wants
+// the smallest rung whose step is at most eta * sqrt(l / |a|), l the mean
+// spacing of the bodies in the starting volume. nbody_rung_scale is
+// eta^2 l, which the OpenCL engine passes to its kernels.
+//
+static inline float nbody_rung_scale (
+    struct nbody_config const * const config
+    )
+{
+    return config->eta * config->eta * config->space / cbrtf((float) config->points);
+}
+
+static inline int nbody_rung (
+    struct nbody_config const * const config,
+    float const scale,
+    cl_float4 const a
+    )
+{
+    float const a_mag = sqrtf(a.x * a.x + a.y * a.y + a.z * a.z);
+    float const r = ceilf(0.5f * log2f(config->dt * config->dt * a_mag / scale));
+
+    //
+    // Negated test so that a NaN also lands on rung 0
+    //
+    if (!(r > 0.0f))
+    {
+        return 0;
+    }
+
+    return r < config->rungs ? (int) r : config->rungs;
+}
+
+//
+// Lowest rung active after the given substep (1 to 2^rungs): the rungs
+// whose step length divides the time elapsed.
+//
+static inline int nbody_min_rung (
+    int const rungs,
+    int const substep
+    )
+{
+    int aligned = 0;
+
+    while (aligned < rungs && (substep & (1 << aligned)) == 0)
+    {
+        aligned++;
+    }
+
+    return rungs - aligned;
+}
+
+//
+// Block timestep halves: nbody_kick_rungs opens the step of every body with
+// a half kick of its own rung's length; nbody_drift moves all bodies by one
+// substep h; nbody_kick_active closes the steps of the active bodies with
+// their new accelerations, moves each to the rung it now wants (no
+// shallower than min_rung, so its next step stays aligned) and, if reopen,
+// opens the next step straight away. With --rungs 0 these are
+// nbody_kick_drift and nbody_kick.
+//
+void nbody_kick_rungs (
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int const * const rung,
+    int const points,
+    float const dt
+    );
+
+void nbody_drift (
+    cl_float4 * const p,
+    cl_float4 const * const v,
+    int const points,
+    float const h
+    );
+
+void nbody_kick_active (
+    struct nbody_config const * const config,
+    cl_float4 * const v,
+    cl_float4 const * const a,
+    int * const rung,
+    int const * const active,
+    int const count,
+    int const min_rung,
+    int const reopen
+    );
+
+//
+// Uniform cube of unit masses drawn from rand(), which the caller seeds
+// (nbody_ic_open does)
+//
+cl_float4 * initializePositions (
+    struct nbody_config const * const config
+    );
+
+cl_float4 * initializeAccelerations (
+    struct nbody_config const * const config
+    );
+
+#endif
@@ -0,0 +1,124 @@
+/* nbody simulation, example program embedding the engine from bin/libnbody.a */
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "nbody-engine.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+//
+// Median relative difference of the accelerations a against the reference
+// ref
+//
+static double median_error (
+    std::vector<cl_float4> const &a,
+    std::vector<cl_float4> const &ref
+    )
+{
+    std::vector<double> errors(a.size());
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        double const dx = a[i].x - ref[i].x;
+        double const dy = a[i].y - ref[i].y;
+        double const dz = a[i].z - ref[i].z;
+        double const norm = sqrt((double) ref[i].x * ref[i].x + (double) ref[i].y * ref[i].y + (double) ref[i].z * ref[i].z);
+
+        errors[i] = norm > 0.0 ? sqrt(dx * dx + dy * dy + dz * dz) / norm : 0.0;
+    }
+
+    std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+
+    return errors[errors.size() / 2];
+}
+
+//
+// Upload the bodies to engine, compute their forces and compare them with
+// ref (when given), then integrate config.steps steps
+//
+static void run (
+    NBodyEngine &engine,
+    struct nbody_config const &config,
+    std::vector<cl_float4> const &p,
+    std::vector<cl_float4> const * const ref,
+    std::vector<cl_float4> &a
+    )
+{
+    std::vector<cl_float4> p_out(config.points);
+    std::vector<cl_float4> v_out(config.points);
+
+    engine.upload(&p[0], NULL, config.points);
+    engine.compute_forces();
+    engine.fetch(NULL, NULL, &a[0]);
+
+    std::cout << engine.name() << ": " << engine.points() << " bodies";
+
+    if (ref != NULL)
+    {
+        std::cout << ", median error against seq " << median_error(a, *ref);
+    }
+
+    engine.step(config.steps);
+    engine.fetch(&p_out[0], &v_out[0], NULL);
+
+    std::cout << ", " << engine.interactions() << " interactions after " << config.steps << " steps" << std::endl;
+}
+
+//
+// Runs the same uniform cube of -n bodies through every backend: the
+// brute-force CPU engine is the reference for the other two. The OpenCL
+// backend is skipped, not failed, on a machine without a device.
+//
+int main (
+    int argc,
+    char ** argv
+    )
+{
+    struct nbody_config config;
+
+    nbody_parse_args(argc, argv, &config);
+    srand(0);
+
+    cl_float4 * const initial = initializePositions(&config);
+
+    if (initial == NULL)
+    {
+        std::cerr << "out of memory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<cl_float4> p(initial, initial + config.points);
+    std::vector<cl_float4> a_seq(config.points);
+    std::vector<cl_float4> a(config.points);
+
+    free(initial);
+
+    try {
+        NBodyEngine seq = NBodyEngine::create(config, NBODY_BACKEND_CPU_SEQ);
+        run(seq, config, p, NULL, a_seq);
+
+        NBodyEngine grid = NBodyEngine::create(config, NBODY_BACKEND_CPU_GRID);
+        run(grid, config, p, &a_seq, a);
+    } catch(std::runtime_error error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        NBodyEngine opencl = NBodyEngine::create(config, NBODY_BACKEND_OPENCL);
+        run(opencl, config, p, &a_seq, a);
+    } catch(cl::Error error) {
+        std::cout << "opencl-tiled skipped: " << error.what() << "(" << error.err() << ")" << std::endl;
+    } catch(std::runtime_error error) {
+        std::cout << "opencl-tiled skipped: " << error.what() << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,699 @@
+/* nbody simulation, reusable force engine for embedding in other programs */
+
+#include "nbody-engine.h"
+#include "nbody-simd.h"
+#include "nbody-grid.h"
+#include "nbody-program.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//
+// Kernel source, embedded at build time from src/nbody_kernel.cl
+//
+static char const kernel_source[] =
+#include "nbody_kernel.cl.h"
+;
+
+#define DEBUG_PRINT(str, ...) /**/
+//#define DEBUG_PRINT(str, ...) printf(str, ##__VA_ARGS__)
+
+//
+// A failed OpenCL call throws, as the header promises, with the call site
+// and the error code in the message
+//
+#define ASSERT(x, str, ...) \
+{ \
+    if ((x) == 0) \
+    { \
+        char message[256]; \
+        snprintf(message, sizeof(message), "%s (%s:%d): " str, __FUNCTION__, __FILE__, __LINE__, ##__VA_ARGS__); \
+        throw std::runtime_error(message); \
+    } \
+}
+
+//
+// What every backend implements. config.points is the number of bodies of
+// the last upload, 0 before the first.
+//
+struct nbody_engine_backend
+{
+    struct nbody_config config;
+    double interactions;
+    bool forces_valid;          // accelerations belong to the current positions
+
+    explicit nbody_engine_backend (
+        struct nbody_config const &config
+        )
+        : config(config), interactions(0.0), forces_valid(false)
+    {
+        this->config.points = 0;
+    }
+
+    virtual ~nbody_engine_backend () {}
+
+    virtual void upload (
+        cl_float4 const * const p,
+        cl_float4 const * const v,
+        int const count
+        ) = 0;
+
+    virtual void compute_forces () = 0;
+
+    //
+    // Velocity-Verlet halves around a force pass, as nbody_kick_drift and
+    // nbody_kick
+    //
+    virtual void kick_drift () = 0;
+    virtual void kick () = 0;
+
+    virtual void fetch (
+        cl_float4 * const p,
+        cl_float4 * const v,
+        cl_float4 * const a
+        ) = 0;
+
+    virtual char const * name () const = 0;
+};
+
+//
+// Bodies kept on the host, shared by the CPU backends. The vectors only
+// ever grow, so uploading the same number of bodies again allocates nothing.
+//
+struct nbody_host_backend : nbody_engine_backend
+{
+    std::vector<cl_float4> x;
+    std::vector<cl_float4> v;
+    std::vector<cl_float4> a;
+
+    explicit nbody_host_backend (
+        struct nbody_config const &config
+        )
+        : nbody_engine_backend(config)
+    {
+    }
+
+    void upload (
+        cl_float4 const * const p,
+        cl_float4 const * const v,
+        int const count
+        )
+    {
+        if ((int) x.size() < count)
+        {
+            x.resize(count);
+            this->v.resize(count);
+            a.resize(count);
+        }
+
+        memcpy(&x[0], p, sizeof(cl_float4) * count);
+
+        if (v != NULL)
+        {
+            memcpy(&this->v[0], v, sizeof(cl_float4) * count);
+        }
+        else
+        {
+            memset(&this->v[0], 0, sizeof(cl_float4) * count);
+        }
+
+        config.points = count;
+        prepare(count);
+    }
+
+    //
+    // Make room in the backend's own storage for count bodies
+    //
+    virtual void prepare (
+        int const count
+        ) = 0;
+
+    void kick_drift ()
+    {
+        nbody_kick_drift(&x[0], &v[0], &a[0], config.points, config.dt);
+    }
+
+    void kick ()
+    {
+        nbody_kick(&v[0], &a[0], config.points, config.dt);
+    }
+
+    void fetch (
+        cl_float4 * const p,
+        cl_float4 * const v,
+        cl_float4 * const a
+        )
+    {
+        size_t const size = sizeof(cl_float4) * config.points;
+
+        if (p != NULL) memcpy(p, &x[0], size);
+        if (v != NULL) memcpy(v, &this->v[0], size);
+        if (a != NULL) memcpy(a, &this->a[0], size);
+    }
+};
+
+//
+// Every pair, as nbody-seq: one vector loop over the SoA sources per body,
+// or each pair once for both bodies with config.symmetric
+//
+struct nbody_cpu_seq_backend : nbody_host_backend
+{
+    struct nbody_soa sources;
+    struct nbody_soa_acc pair_acc;
+    nbody_interaction_fn interact;
+    nbody_pair_fn pair;
+    nbody_pair_block_fn pair_block;
+    int capacity;
+
+    explicit nbody_cpu_seq_backend (
+        struct nbody_config const &config
+        )
+        : nbody_host_backend(config), capacity(0)
+    {
+        memset(&sources, 0, sizeof(sources));
+        memset(&pair_acc, 0, sizeof(pair_acc));
+        interact = nbody_select_interaction(config.isa, config.precision);
+        pair = nbody_select_pair_interaction(config.isa, config.precision);
+        pair_block = nbody_select_pair_block_interaction(config.isa, config.precision);
+    }
+
+    ~nbody_cpu_seq_backend ()
+    {
+        nbody_soa_free(&sources);
+        nbody_soa_acc_free(&pair_acc);
+    }
+
+    void prepare (
+        int const count
+        )
+    {
+        if (count <= capacity)
+        {
+            return;
+        }
+
+        nbody_soa_free(&sources);
+        nbody_soa_acc_free(&pair_acc);
+        memset(&sources, 0, sizeof(sources));
+        memset(&pair_acc, 0, sizeof(pair_acc));
+        capacity = 0;
+
+        if (!nbody_soa_alloc(&sources, count)
+            || (config.symmetric && !nbody_soa_acc_alloc(&pair_acc, count, config.precision)))
+        {
+            throw std::runtime_error("out of memory");
+        }
+
+        capacity = count;
+    }
+
+    void compute_forces ()
+    {
+        int const points = config.points;
+
+        for (int i = 0; i < points; ++i)
+        {
+            nbody_soa_set(&sources, i, x[i]);
+        }
+
+        if (config.symmetric)
+        {
+            nbody_soa_acc_zero(&pair_acc, 0, points);
+
+            //
+            // Blocks of 64 bodies: the pairs inside a block one i at a time,
+            // those with every later body through the blocked loop
+            //
+            for (int begin = 0; begin < points; begin += 64)
+            {
+                int const end = std::min(begin + 64, points);
+
+                for (int i = begin; i < end; ++i)
+                {
+                    pair(&sources, i, i + 1, end, &pair_acc);
+                }
+
+                pair_block(&sources, begin, end, end, points, &pair_acc);
+            }
+
+            for (int i = 0; i < points; ++i)
+            {
+                cl_double4 acc = nbody_soa_acc_get(&pair_acc, i);
+                acc.w = 1.0;
+                a[i] = nbody_narrow(acc);
+            }
+        }
+        else
+        {
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < points; ++i)
+            {
+                cl_double4 acc = {{0.0, 0.0, 0.0, 1.0}};
+
+                interact(x[i], &sources, 0, points, &acc);
+                a[i] = nbody_narrow(acc);
+            }
+        }
+
+        interactions += config.symmetric ? (double) points * (points - 1) : (double) points * points;
+    }
+
+    char const * name () const
+    {
+        return "seq";
+    }
+};
+
+//
+// Binned grid, as nbody-opt-seq. The grid is sized for the largest upload
+// so far; between steps update_bin_pts patches the bins in place.
+//
+struct nbody_cpu_grid_backend : nbody_host_backend
+{
+    struct nbody_grid grid;
+    int capacity;
+
+    explicit nbody_cpu_grid_backend (
+        struct nbody_config const &config
+        )
+        : nbody_host_backend(config), capacity(0)
+    {
+        memset(&grid, 0, sizeof(grid));
+    }
+
+    ~nbody_cpu_grid_backend ()
+    {
+        if (capacity > 0)
+        {
+            destroy_grid(&grid);
+        }
+    }
+
+    void prepare (
+        int const count
+        )
+    {
+        if (count <= capacity)
+        {
+            //
+            // New bodies have nothing to do with the old binning
+            //
+            grid.binned_points = 0;
+            return;
+        }
+
+        if (capacity > 0)
+        {
+            destroy_grid(&grid);
+            memset(&grid, 0, sizeof(grid));
+            capacity = 0;
+        }
+
+        if (!construct_grid(&config, &grid))
+        {
+            throw std::runtime_error("out of memory");
+        }
+
+        capacity = count;
+    }
+
+    void compute_forces ()
+    {
+        int const points = config.points;
+
+        fit_grid(&config, &grid, &x[0], points);
+        update_bin_pts(&config, &grid, &x[0], points);
+        refine_bins(&config, &grid);
+        schedule_bins(&config, &grid);
+
+        interactions += calculate_grid_forces(&config, &grid, &a[0]);
+    }
+
+    char const * name () const
+    {
+        return "opt-seq";
+    }
+};
+
+//
+// Tiled brute-force kernel, as nbody with --tiled. The context, queue,
+// program and kernels are made once; the body buffers grow with the
+// largest upload and keep their kernel arguments until they do.
+//
+struct nbody_opencl_backend : nbody_engine_backend
+{
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::Program program;
+    cl::Kernel nbody_kernel;
+    cl::Kernel kick_drift_kernel;
+    cl::Kernel kick_kernel;
+    cl::Buffer x_buffer;
+    cl::Buffer v_buffer;
+    cl::Buffer a_buffer;
+    cl::Buffer points_buffer;
+    size_t local_size;
+    int capacity;
+    std::vector<cl_float4> zeros;   // velocities of bodies uploaded at rest
+
+    explicit nbody_opencl_backend (
+        struct nbody_config const &config
+        )
+        : nbody_engine_backend(config), capacity(0)
+    {
+        cl_int err = 0;
+        std::vector<cl::Platform> platforms;
+
+        cl::Platform::get(&platforms);
+
+        if (platforms.empty())
+        {
+            throw std::runtime_error("no OpenCL platform");
+        }
+
+        cl_context_properties cps[3] = {
+            CL_CONTEXT_PLATFORM,
+            (cl_context_properties)(platforms[0])(),
+            0
+        };
+
+        context = cl::Context(CL_DEVICE_TYPE_GPU, cps);
+        device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+        queue = cl::CommandQueue(context, device, 0);
+        program = nbody_build_program(&config, context, device, kernel_source, "");
+
+        nbody_kernel = cl::Kernel(program, "nbody_tiled");
+        kick_drift_kernel = cl::Kernel(program, "kick_drift");
+        kick_kernel = cl::Kernel(program, "kick");
+
+        local_size = nbody_tile_local_size(&config, nbody_kernel, device);
+
+        if (local_size == 0)
+        {
+            throw std::runtime_error("work-group size not supported by the device");
+        }
+
+        DEBUG_PRINT("Work-group size %lu\n", (unsigned long) local_size);
+
+        points_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(int), NULL, &err);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = nbody_kernel.setArg(2, points_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = nbody_kernel.setArg(3, local_size * sizeof(cl_float4), NULL);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_drift_kernel.setArg(3, points_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_drift_kernel.setArg(4, config.dt);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_kernel.setArg(2, points_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_kernel.setArg(3, config.dt);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+    }
+
+    //
+    // Body buffers for at least count bodies
+    //
+    void reserve (
+        int const count
+        )
+    {
+        cl_int err = 0;
+        size_t const size = count * sizeof(cl_float4);
+
+        if (count <= capacity)
+        {
+            return;
+        }
+
+        DEBUG_PRINT("Create buffers for %d bodies\n", count);
+        x_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        v_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        a_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = nbody_kernel.setArg(0, x_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = nbody_kernel.setArg(1, a_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_drift_kernel.setArg(0, x_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_drift_kernel.setArg(1, v_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_drift_kernel.setArg(2, a_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_kernel.setArg(0, v_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = kick_kernel.setArg(1, a_buffer);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        capacity = count;
+    }
+
+    void upload (
+        cl_float4 const * const p,
+        cl_float4 const * const v,
+        int const count
+        )
+    {
+        cl_int err = 0;
+        size_t const size = count * sizeof(cl_float4);
+
+        reserve(count);
+        config.points = count;
+
+        if (v == NULL && (int) zeros.size() < count)
+        {
+            zeros.resize(count);
+        }
+
+        //
+        // The last write blocks, so the caller's arrays are free to reuse
+        // once this returns
+        //
+        DEBUG_PRINT("Write %d bodies\n", count);
+        err = queue.enqueueWriteBuffer(points_buffer, CL_FALSE, 0, sizeof(int), &config.points);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = queue.enqueueWriteBuffer(x_buffer, CL_FALSE, 0, size, p);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        err = queue.enqueueWriteBuffer(v_buffer, CL_TRUE, 0, size, v != NULL ? v : &zeros[0]);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+    }
+
+    void compute_forces ()
+    {
+        cl_int err = 0;
+        size_t const global_size = (config.points + local_size - 1) / local_size * local_size;
+
+        err = queue.enqueueNDRangeKernel(nbody_kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size));
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+
+        interactions += (double) config.points * config.points;
+    }
+
+    void kick_drift ()
+    {
+        cl_int err = 0;
+
+        err = queue.enqueueNDRangeKernel(kick_drift_kernel, cl::NDRange(0), cl::NDRange(config.points), cl::NullRange);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+    }
+
+    void kick ()
+    {
+        cl_int err = 0;
+
+        err = queue.enqueueNDRangeKernel(kick_kernel, cl::NDRange(0), cl::NDRange(config.points), cl::NullRange);
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+    }
+
+    void fetch (
+        cl_float4 * const p,
+        cl_float4 * const v,
+        cl_float4 * const a
+        )
+    {
+        cl_int err = 0;
+        size_t const size = config.points * sizeof(cl_float4);
+
+        DEBUG_PRINT("Read %d bodies\n", config.points);
+
+        if (p != NULL)
+        {
+            err = queue.enqueueReadBuffer(x_buffer, CL_FALSE, 0, size, p);
+            ASSERT(err == CL_SUCCESS, "err was %d", err);
+        }
+
+        if (v != NULL)
+        {
+            err = queue.enqueueReadBuffer(v_buffer, CL_FALSE, 0, size, v);
+            ASSERT(err == CL_SUCCESS, "err was %d", err);
+        }
+
+        if (a != NULL)
+        {
+            err = queue.enqueueReadBuffer(a_buffer, CL_FALSE, 0, size, a);
+            ASSERT(err == CL_SUCCESS, "err was %d", err);
+        }
+
+        err = queue.finish();
+        ASSERT(err == CL_SUCCESS, "err was %d", err);
+    }
+
+    char const * name () const
+    {
+        return "opencl-tiled";
+    }
+};
+
+NBodyEngine NBodyEngine::create (
+    struct nbody_config const &config,
+    int const backend
+    )
+{
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
+#endif
+
+    switch (backend)
+    {
+    case NBODY_BACKEND_CPU_SEQ:
+        return NBodyEngine(new nbody_cpu_seq_backend(config));
+    case NBODY_BACKEND_CPU_GRID:
+        return NBodyEngine(new nbody_cpu_grid_backend(config));
+    case NBODY_BACKEND_OPENCL:
+        return NBodyEngine(new nbody_opencl_backend(config));
+    default:
+        throw std::runtime_error("unknown engine backend");
+    }
+}
+
+NBodyEngine::NBodyEngine (
+    nbody_engine_backend * const backend
+    )
+    : backend(backend)
+{
+}
+
+NBodyEngine::NBodyEngine (NBodyEngine &&other) = default;
+NBodyEngine & NBodyEngine::operator= (NBodyEngine &&other) = default;
+NBodyEngine::~NBodyEngine () = default;
+
+nbody_engine_backend & NBodyEngine::checked () const
+{
+    if (!backend)
+    {
+        throw std::runtime_error("engine was moved from");
+    }
+
+    return *backend;
+}
+
+void NBodyEngine::upload (
+    cl_float4 const * const p,
+    cl_float4 const * const v,
+    int const count
+    )
+{
+    nbody_engine_backend &b = checked();
+
+    if (p == NULL || count <= 0)
+    {
+        throw std::runtime_error("upload needs at least one body");
+    }
+
+    b.upload(p, v, count);
+    b.forces_valid = false;
+}
+
+void NBodyEngine::compute_forces ()
+{
+    nbody_engine_backend &b = checked();
+
+    if (b.config.points == 0)
+    {
+        throw std::runtime_error("no bodies uploaded");
+    }
+
+    b.compute_forces();
+    b.forces_valid = true;
+}
+
+void NBodyEngine::step (
+    int const steps
+    )
+{
+    nbody_engine_backend &b = checked();
+
+    if (steps > 0 && !b.forces_valid)
+    {
+        compute_forces();
+    }
+
+    for (int s = 0; s < steps; ++s)
+    {
+        b.kick_drift();
+        b.compute_forces();
+        b.kick();
+    }
+}
+
+void NBodyEngine::fetch (
+    cl_float4 * const p,
+    cl_float4 * const v,
+    cl_float4 * const a
+    )
+{
+    nbody_engine_backend &b = checked();
+
+    if (b.config.points == 0)
+    {
+        throw std::runtime_error("no bodies uploaded");
+    }
+
+    b.fetch(p, v, a);
+}
+
+int NBodyEngine::points () const
+{
+    return checked().config.points;
+}
+
+double NBodyEngine::interactions () const
+{
+    return checked().interactions;
+}
+
+char const * NBodyEngine::name () const
+{
+    return checked().name();
+}
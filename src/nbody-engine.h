@@ -0,0 +1,113 @@
+/* nbody simulation, reusable force engine for embedding in other programs */
+
+#ifndef NBODY_ENGINE_H
+#define NBODY_ENGINE_H
+
+#include <CL/cl.h>
+
+#include <memory>
+
+#include "nbody-common.h"
+
+//
+// Force evaluations an engine can run on
+//
+enum nbody_backend
+{
+    NBODY_BACKEND_CPU_SEQ,      // brute force over SoA sources, as nbody-seq
+    NBODY_BACKEND_CPU_GRID,     // binned grid with refined bins, as nbody-opt-seq
+    NBODY_BACKEND_OPENCL,       // tiled brute-force kernel on the first GPU, as nbody
+};
+
+struct nbody_engine_backend;
+
+//
+// One solver kept alive across calls: the OpenCL context, program, kernels
+// and buffers, or the host grid and SoA copies, are set up by create and
+// reused by every later upload, force pass and step. Storage only grows:
+// uploading fewer bodies than before reuses what is there, more reallocates
+// once. Engines can be moved but not copied, so the bodies are never
+// duplicated behind the caller's back; a moved-from engine can only be
+// assigned to or destroyed.
+//
+// Errors (no device, a kernel that fails to build, out of memory, a call
+// before the first upload) are thrown as std::runtime_error, or cl::Error
+// from the OpenCL wrapper.
+//
+class NBodyEngine
+{
+public:
+    //
+    // Engine for config (from nbody_default_config or nbody_parse_args) on
+    // backend (enum nbody_backend). config->points is only a hint for the
+    // first allocation; config->dt is the step. config->threads, when set,
+    // is passed to omp_set_num_threads.
+    //
+    static NBodyEngine create (
+        struct nbody_config const &config,
+        int const backend
+        );
+
+    NBodyEngine (NBodyEngine &&other);
+    NBodyEngine & operator= (NBodyEngine &&other);
+    NBodyEngine (NBodyEngine const &other) = delete;
+    NBodyEngine & operator= (NBodyEngine const &other) = delete;
+    ~NBodyEngine ();
+
+    //
+    // Replace the bodies with count new ones: positions with the mass in
+    // .w, and velocities, or NULL for bodies at rest. The arrays are copied
+    // and can be reused as soon as this returns.
+    //
+    void upload (
+        cl_float4 const * const p,
+        cl_float4 const * const v,
+        int const count
+        );
+
+    //
+    // Accelerations of the current bodies
+    //
+    void compute_forces ();
+
+    //
+    // steps velocity-Verlet steps of config->dt. Forces are only computed
+    // up front when the last upload has none yet.
+    //
+    void step (
+        int const steps
+        );
+
+    //
+    // Copy the current positions, velocities and accelerations, in upload
+    // order, into arrays of points() elements. Any of them can be NULL.
+    //
+    void fetch (
+        cl_float4 * const p,
+        cl_float4 * const v,
+        cl_float4 * const a
+        );
+
+    int points () const;
+
+    //
+    // Body-body interactions evaluated since create
+    //
+    double interactions () const;
+
+    //
+    // Engine name as in the timing report ("seq", "opt-seq", "opencl-tiled")
+    //
+    char const * name () const;
+
+private:
+    explicit NBodyEngine (
+        nbody_engine_backend * const backend
+        );
+
+    nbody_engine_backend & checked () const;
+
+    std::unique_ptr<nbody_engine_backend> backend;
+};
+
+#endif
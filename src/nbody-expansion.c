@@ -0,0 +1,531 @@
+/* nbody simulation, fast multipole method on the bin hierarchy */
+
+#include "nbody-expansion.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static inline int coef_index (
+    struct nbody_fmm const * const fmm,
+    int const kx,
+    int const ky,
+    int const kz
+    )
+{
+    int const n = fmm->order + 1;
+
+    return fmm->lookup[(kx * n + ky) * n + kz];
+}
+
+static inline double binomial (
+    struct nbody_fmm const * const fmm,
+    int const n,
+    int const k
+    )
+{
+    return fmm->binomial[n * (fmm->order + 1) + k];
+}
+
+//
+// pw[d][i] = v_d^i for i <= order
+//
+static inline void powers (
+    int const order,
+    double const vx,
+    double const vy,
+    double const vz,
+    double pw[3][NBODY_FMM_MAX_ORDER + 1]
+    )
+{
+    pw[0][0] = pw[1][0] = pw[2][0] = 1.0;
+
+    for (int i = 1; i <= order; ++i)
+    {
+        pw[0][i] = pw[0][i - 1] * vx;
+        pw[1][i] = pw[1][i - 1] * vy;
+        pw[2][i] = pw[2][i - 1] * vz;
+    }
+}
+
+//
+// T_k(r) for every coefficient k, by the recurrence in nbody-expansion.h.
+// Coefficients are in order of total degree, so every T_{k - e_i} and
+// T_{k - 2e_i} is ready when T_k needs it.
+//
+static void derivatives (
+    struct nbody_fmm const * const fmm,
+    double const rx,
+    double const ry,
+    double const rz,
+    double * const t
+    )
+{
+    double const r2 = rx * rx + ry * ry + rz * rz;
+
+    t[0] = 1.0 / sqrt(r2);
+
+    for (int i = 1; i < fmm->ncoef; ++i)
+    {
+        int const kx = fmm->k[3 * i];
+        int const ky = fmm->k[3 * i + 1];
+        int const kz = fmm->k[3 * i + 2];
+        int const n = kx + ky + kz;
+        double s1 = 0.0;
+        double s2 = 0.0;
+
+        if (kx > 0) s1 += rx * t[coef_index(fmm, kx - 1, ky, kz)];
+        if (ky > 0) s1 += ry * t[coef_index(fmm, kx, ky - 1, kz)];
+        if (kz > 0) s1 += rz * t[coef_index(fmm, kx, ky, kz - 1)];
+        if (kx > 1) s2 += t[coef_index(fmm, kx - 2, ky, kz)];
+        if (ky > 1) s2 += t[coef_index(fmm, kx, ky - 2, kz)];
+        if (kz > 1) s2 += t[coef_index(fmm, kx, ky, kz - 2)];
+
+        t[i] = ((2 * n - 1) * s1 - (n - 1) * s2) / (n * r2);
+    }
+}
+
+cl_float4 nbody_fmm_cell_center (
+    struct nbody_fmm const * const fmm,
+    int const level,
+    int const x,
+    int const y,
+    int const z
+    )
+{
+    float const size = fmm->grid.bin_length * (1 << (fmm->levels - level));
+    cl_float4 c;
+
+    c.x = fmm->grid.origin.x + (x + 0.5f) * size;
+    c.y = fmm->grid.origin.y + (y + 0.5f) * size;
+    c.z = fmm->grid.origin.z + (z + 0.5f) * size;
+    c.w = 0.0f;
+
+    return c;
+}
+
+int nbody_fmm_init (
+    struct nbody_config const * const config,
+    struct nbody_fmm * const fmm
+    )
+{
+    int n;
+
+    memset(fmm, 0, sizeof(*fmm));
+
+    fmm->order = MIN(MAX(config->fmm_order, 1), NBODY_FMM_MAX_ORDER);
+    fmm->ncoef = nbody_fmm_coefficients(fmm->order);
+
+    while ((1 << fmm->levels) < config->bins_per_dim)
+    {
+        fmm->levels++;
+    }
+
+    fmm->grid_config = *config;
+    fmm->grid_config.bins_per_dim = 1 << fmm->levels;
+    fmm->grid_config.bin_length = config->space / fmm->grid_config.bins_per_dim;
+    fmm->grid_config.max_bin_pts = 0;
+
+    n = fmm->order + 1;
+    fmm->k = (int *) malloc(sizeof(int) * 3 * fmm->ncoef);
+    fmm->lookup = (int *) malloc(sizeof(int) * n * n * n);
+    fmm->binomial = (double *) malloc(sizeof(double) * n * n);
+    fmm->level_offset = (int *) malloc(sizeof(int) * (fmm->levels + 2));
+
+    if (fmm->k == NULL || fmm->lookup == NULL || fmm->binomial == NULL || fmm->level_offset == NULL)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < n * n * n; ++i)
+    {
+        fmm->lookup[i] = -1;
+    }
+
+    for (int degree = 0, i = 0; degree <= fmm->order; ++degree)
+    {
+        for (int kx = degree; kx >= 0; --kx)
+        {
+            for (int ky = degree - kx; ky >= 0; --ky, ++i)
+            {
+                fmm->k[3 * i] = kx;
+                fmm->k[3 * i + 1] = ky;
+                fmm->k[3 * i + 2] = degree - kx - ky;
+                fmm->lookup[(kx * n + ky) * n + degree - kx - ky] = i;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        fmm->binomial[i * n] = 1.0;
+
+        for (int j = 1; j < n; ++j)
+        {
+            fmm->binomial[i * n + j] = j > i ? 0.0 : fmm->binomial[(i - 1) * n + j - 1] + fmm->binomial[(i - 1) * n + j];
+        }
+    }
+
+    //
+    // Flattened M2L terms of every local coefficient b, so the translation
+    // loop is a plain multiply-add over precomputed indices
+    //
+    fmm->m2l_first = (int *) malloc(sizeof(int) * (fmm->ncoef + 1));
+
+    if (fmm->m2l_first == NULL)
+    {
+        return 0;
+    }
+
+    fmm->m2l_first[0] = 0;
+
+    for (int b = 0; b < fmm->ncoef; ++b)
+    {
+        fmm->m2l_first[b + 1] = fmm->m2l_first[b]
+                                + nbody_fmm_coefficients(fmm->order - fmm->k[3 * b] - fmm->k[3 * b + 1] - fmm->k[3 * b + 2]);
+    }
+
+    fmm->m2l_multipole = (int *) malloc(sizeof(int) * fmm->m2l_first[fmm->ncoef]);
+    fmm->m2l_derivative = (int *) malloc(sizeof(int) * fmm->m2l_first[fmm->ncoef]);
+    fmm->m2l_factor = (double *) malloc(sizeof(double) * fmm->m2l_first[fmm->ncoef]);
+
+    if (fmm->m2l_multipole == NULL || fmm->m2l_derivative == NULL || fmm->m2l_factor == NULL)
+    {
+        return 0;
+    }
+
+    for (int b = 0; b < fmm->ncoef; ++b)
+    {
+        int const bx = fmm->k[3 * b];
+        int const by = fmm->k[3 * b + 1];
+        int const bz = fmm->k[3 * b + 2];
+
+        for (int a = 0, term = fmm->m2l_first[b]; term < fmm->m2l_first[b + 1]; ++a, ++term)
+        {
+            int const ax = fmm->k[3 * a];
+            int const ay = fmm->k[3 * a + 1];
+            int const az = fmm->k[3 * a + 2];
+
+            fmm->m2l_multipole[term] = a;
+            fmm->m2l_derivative[term] = coef_index(fmm, ax + bx, ay + by, az + bz);
+            fmm->m2l_factor[term] = (((bx + by + bz) & 1) ? -1.0 : 1.0)
+                                    * binomial(fmm, ax + bx, bx) * binomial(fmm, ay + by, by) * binomial(fmm, az + bz, bz);
+        }
+    }
+
+    fmm->level_offset[0] = 0;
+
+    for (int l = 0; l <= fmm->levels; ++l)
+    {
+        fmm->level_offset[l + 1] = fmm->level_offset[l] + (1 << (3 * l));
+    }
+
+    fmm->multipole = (double *) malloc(sizeof(double) * fmm->ncoef * fmm->level_offset[fmm->levels + 1]);
+    fmm->local = (double *) malloc(sizeof(double) * fmm->ncoef * fmm->level_offset[fmm->levels + 1]);
+
+    return fmm->multipole && fmm->local && construct_grid(&fmm->grid_config, &fmm->grid);
+}
+
+void nbody_fmm_destroy (
+    struct nbody_fmm * const fmm
+    )
+{
+    destroy_grid(&fmm->grid);
+    free(fmm->local);
+    free(fmm->multipole);
+    free(fmm->m2l_factor);
+    free(fmm->m2l_derivative);
+    free(fmm->m2l_multipole);
+    free(fmm->m2l_first);
+    free(fmm->level_offset);
+    free(fmm->binomial);
+    free(fmm->lookup);
+    free(fmm->k);
+}
+
+void nbody_fmm_bin (
+    struct nbody_fmm * const fmm,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    fit_grid(&fmm->grid_config, &fmm->grid, global_p, points);
+    update_bin_pts(&fmm->grid_config, &fmm->grid, global_p, points);
+}
+
+void nbody_fmm_upward (
+    struct nbody_fmm * const fmm
+    )
+{
+    int const ncoef = fmm->ncoef;
+    int const order = fmm->order;
+    int const finest = fmm->levels;
+    int const n = 1 << finest;
+    struct nbody_grid const * const grid = &fmm->grid;
+
+    //
+    // P2M
+    //
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int b = 0; b < n * n * n; ++b)
+    {
+        double * const m = &fmm->multipole[ncoef * (fmm->level_offset[finest] + b)];
+        cl_float4 const c = nbody_fmm_cell_center(fmm, finest, b / (n * n), (b / n) % n, b % n);
+        double pw[3][NBODY_FMM_MAX_ORDER + 1];
+
+        memset(m, 0, sizeof(double) * ncoef);
+
+        for (int i = grid->bin_pts_offsets[b]; i < grid->bin_pts_offsets[b + 1]; ++i)
+        {
+            cl_float4 const pt = grid->bin_pts[i];
+
+            powers(order, pt.x - c.x, pt.y - c.y, pt.z - c.z, pw);
+
+            for (int a = 0; a < ncoef; ++a)
+            {
+                m[a] += pt.w * pw[0][fmm->k[3 * a]] * pw[1][fmm->k[3 * a + 1]] * pw[2][fmm->k[3 * a + 2]];
+            }
+        }
+    }
+
+    //
+    // M2M: M_a(c) = sum over g <= a of C(a, g) M_g(c') (c' - c)^(a - g)
+    //
+    for (int level = finest - 1; level >= 0; --level)
+    {
+        int const cells = 1 << level;
+
+        #pragma omp parallel for schedule(static)
+        for (int p = 0; p < cells * cells * cells; ++p)
+        {
+            int const x = p / (cells * cells);
+            int const y = (p / cells) % cells;
+            int const z = p % cells;
+            double * const m = &fmm->multipole[ncoef * (fmm->level_offset[level] + p)];
+            cl_float4 const c = nbody_fmm_cell_center(fmm, level, x, y, z);
+
+            memset(m, 0, sizeof(double) * ncoef);
+
+            for (int child = 0; child < 8; ++child)
+            {
+                int const cx = 2 * x + (child >> 2);
+                int const cy = 2 * y + ((child >> 1) & 1);
+                int const cz = 2 * z + (child & 1);
+                double const * const mc = &fmm->multipole[ncoef * (fmm->level_offset[level + 1]
+                                                                   + BIN_IDX(2 * cells, cx, cy, cz))];
+                cl_float4 const cc = nbody_fmm_cell_center(fmm, level + 1, cx, cy, cz);
+                double pw[3][NBODY_FMM_MAX_ORDER + 1];
+
+                powers(order, cc.x - c.x, cc.y - c.y, cc.z - c.z, pw);
+
+                for (int a = 0; a < ncoef; ++a)
+                {
+                    int const ax = fmm->k[3 * a];
+                    int const ay = fmm->k[3 * a + 1];
+                    int const az = fmm->k[3 * a + 2];
+                    double sum = 0.0;
+
+                    for (int gx = 0; gx <= ax; ++gx)
+                    {
+                        for (int gy = 0; gy <= ay; ++gy)
+                        {
+                            for (int gz = 0; gz <= az; ++gz)
+                            {
+                                sum += binomial(fmm, ax, gx) * binomial(fmm, ay, gy) * binomial(fmm, az, gz)
+                                       * mc[coef_index(fmm, gx, gy, gz)]
+                                       * pw[0][ax - gx] * pw[1][ay - gy] * pw[2][az - gz];
+                            }
+                        }
+                    }
+
+                    m[a] += sum;
+                }
+            }
+        }
+    }
+}
+
+void nbody_fmm_downward (
+    struct nbody_fmm * const fmm
+    )
+{
+    int const ncoef = fmm->ncoef;
+    int const order = fmm->order;
+    memset(fmm->local, 0, sizeof(double) * ncoef * fmm->level_offset[MIN(2, fmm->levels + 1)]);
+
+    for (int level = 2; level <= fmm->levels; ++level)
+    {
+        int const cells = 1 << level;
+        int const parents = cells / 2;
+
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int b = 0; b < cells * cells * cells; ++b)
+        {
+            int const x = b / (cells * cells);
+            int const y = (b / cells) % cells;
+            int const z = b % cells;
+            double * const l = &fmm->local[ncoef * (fmm->level_offset[level] + b)];
+            cl_float4 const zc = nbody_fmm_cell_center(fmm, level, x, y, z);
+            double t[NBODY_FMM_MAX_COEFFICIENTS];
+            double pw[3][NBODY_FMM_MAX_ORDER + 1];
+
+            memset(l, 0, sizeof(double) * ncoef);
+
+            //
+            // L2L: L'_g = sum over b >= g of C(b, g) L_b (z' - z)^(b - g).
+            // Levels 0 and 1 have no well-separated cells, so level 2
+            // starts from nothing.
+            //
+            if (level > 2)
+            {
+                double const * const lp = &fmm->local[ncoef * (fmm->level_offset[level - 1]
+                                                               + BIN_IDX(parents, x / 2, y / 2, z / 2))];
+                cl_float4 const pc = nbody_fmm_cell_center(fmm, level - 1, x / 2, y / 2, z / 2);
+
+                powers(order, zc.x - pc.x, zc.y - pc.y, zc.z - pc.z, pw);
+
+                for (int g = 0; g < ncoef; ++g)
+                {
+                    int const gx = fmm->k[3 * g];
+                    int const gy = fmm->k[3 * g + 1];
+                    int const gz = fmm->k[3 * g + 2];
+                    double sum = 0.0;
+
+                    for (int bx = gx; bx <= order; ++bx)
+                    {
+                        for (int by = gy; bx + by <= order; ++by)
+                        {
+                            for (int bz = gz; bx + by + bz <= order; ++bz)
+                            {
+                                sum += binomial(fmm, bx, gx) * binomial(fmm, by, gy) * binomial(fmm, bz, gz)
+                                       * lp[coef_index(fmm, bx, by, bz)]
+                                       * pw[0][bx - gx] * pw[1][by - gy] * pw[2][bz - gz];
+                            }
+                        }
+                    }
+
+                    l[g] = sum;
+                }
+            }
+
+            //
+            // M2L over the interaction list:
+            // L_b += (-1)^|b| sum over |a| <= order - |b| of C(a + b, b) M_a T_{a + b}(z - c)
+            //
+            for (int px = MAX(0, x / 2 - 1); px < MIN(parents, x / 2 + 2); ++px)
+            {
+                for (int py = MAX(0, y / 2 - 1); py < MIN(parents, y / 2 + 2); ++py)
+                {
+                    for (int pz = MAX(0, z / 2 - 1); pz < MIN(parents, z / 2 + 2); ++pz)
+                    {
+                        for (int child = 0; child < 8; ++child)
+                        {
+                            int const sx = 2 * px + (child >> 2);
+                            int const sy = 2 * py + ((child >> 1) & 1);
+                            int const sz = 2 * pz + (child & 1);
+
+                            if (abs(sx - x) <= 1 && abs(sy - y) <= 1 && abs(sz - z) <= 1)
+                            {
+                                continue;
+                            }
+
+                            double const * const m = &fmm->multipole[ncoef * (fmm->level_offset[level]
+                                                                              + BIN_IDX(cells, sx, sy, sz))];
+                            cl_float4 const sc = nbody_fmm_cell_center(fmm, level, sx, sy, sz);
+
+                            if (m[0] == 0.0)
+                            {
+                                continue;   // empty cell
+                            }
+
+                            derivatives(fmm, zc.x - sc.x, zc.y - sc.y, zc.z - sc.z, t);
+
+                            for (int b = 0; b < ncoef; ++b)
+                            {
+                                double sum = 0.0;
+
+                                for (int term = fmm->m2l_first[b]; term < fmm->m2l_first[b + 1]; ++term)
+                                {
+                                    sum += fmm->m2l_factor[term] * m[fmm->m2l_multipole[term]] * t[fmm->m2l_derivative[term]];
+                                }
+
+                                l[b] += sum;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+double nbody_fmm_evaluate (
+    struct nbody_fmm const * const fmm,
+    cl_float4 * const global_a
+    )
+{
+    int const ncoef = fmm->ncoef;
+    int const order = fmm->order;
+    int const finest = fmm->levels;
+    int const n = 1 << finest;
+    struct nbody_grid const * const grid = &fmm->grid;
+    double interactions = 0.0;
+
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+: interactions)
+    for (int b = 0; b < n * n * n; ++b)
+    {
+        int const x = b / (n * n);
+        int const y = (b / n) % n;
+        int const z = b % n;
+        int const z_lo = MAX(0, z - 1);
+        int const z_hi = MIN(n, z + 2);
+        double const * const l = &fmm->local[ncoef * (fmm->level_offset[finest] + b)];
+        cl_float4 const zc = nbody_fmm_cell_center(fmm, finest, x, y, z);
+
+        for (int i = grid->bin_pts_offsets[b]; i < grid->bin_pts_offsets[b + 1]; ++i)
+        {
+            cl_float4 const pt = grid->bin_pts[i];
+            cl_double4 acc = {{0.0, 0.0, 0.0, 1.0}};
+            double pw[3][NBODY_FMM_MAX_ORDER + 1];
+
+            //
+            // L2P: the gradient of sum L_b (x - z)^b
+            //
+            powers(order, pt.x - zc.x, pt.y - zc.y, pt.z - zc.z, pw);
+
+            for (int bi = 1; bi < ncoef; ++bi)
+            {
+                int const bx = fmm->k[3 * bi];
+                int const by = fmm->k[3 * bi + 1];
+                int const bz = fmm->k[3 * bi + 2];
+
+                if (bx > 0) acc.x += l[bi] * bx * pw[0][bx - 1] * pw[1][by] * pw[2][bz];
+                if (by > 0) acc.y += l[bi] * by * pw[0][bx] * pw[1][by - 1] * pw[2][bz];
+                if (bz > 0) acc.z += l[bi] * bz * pw[0][bx] * pw[1][by] * pw[2][bz - 1];
+            }
+
+            //
+            // P2P with the neighbours; each z run of them is contiguous
+            //
+            for (int nx = MAX(0, x - 1); nx < MIN(n, x + 2); ++nx)
+            {
+                for (int ny = MAX(0, y - 1); ny < MIN(n, y + 2); ++ny)
+                {
+                    int const begin = grid->bin_pts_offsets[BIN_IDX(n, nx, ny, z_lo)];
+                    int const end = grid->bin_pts_offsets[BIN_IDX(n, nx, ny, z_hi - 1) + 1];
+
+                    grid->interact(pt, &grid->pts_soa, begin, end, &acc);
+                    interactions += end - begin;
+                }
+            }
+
+            global_a[grid->bin_ids[i]] = nbody_narrow(acc);
+        }
+    }
+
+    return interactions;
+}
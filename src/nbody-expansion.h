@@ -0,0 +1,123 @@
+/* nbody simulation, fast multipole method on the bin hierarchy */
+
+#ifndef NBODY_EXPANSION_H
+#define NBODY_EXPANSION_H
+
+#include <CL/cl.h>
+
+#include "nbody-common.h"
+#include "nbody-grid.h"
+
+//
+// Cartesian Taylor expansions of the potential phi(x) = sum m / |x - y|,
+// whose gradient is the acceleration. A cell's multipole expansion about its
+// centre c is M_a = sum m (y - c)^a; a local expansion about z is
+// phi(x) = sum L_b (x - z)^b. Both run over multi-indices with |a| <= order
+// and are stored in nbody_fmm.k order (by total degree). The far-field kernel
+// coefficients T_k(r) = D_y^k (1 / |x - y|) / k! at r = x - y follow the
+// recurrence of Lindsay and Krasny (J. Comput. Phys. 172, 2001)
+//
+//   |k| |r|^2 T_k = (2|k| - 1) sum_i r_i T_{k - e_i} - (|k| - 1) sum_i T_{k - 2e_i}
+//
+// which is what keeps every translation below O(order^6) or better. Orders
+// go up to NBODY_FMM_MAX_ORDER (nbody-common.h).
+//
+// Coefficients of an expansion of the given order: (p + 1)(p + 2)(p + 3) / 6
+//
+static inline int nbody_fmm_coefficients (
+    int const order
+    )
+{
+    return (order + 1) * (order + 2) * (order + 3) / 6;
+}
+
+#define NBODY_FMM_MAX_COEFFICIENTS ((NBODY_FMM_MAX_ORDER + 1) * (NBODY_FMM_MAX_ORDER + 2) * (NBODY_FMM_MAX_ORDER + 3) / 6)
+
+//
+// The octree of the FMM is the bin grid itself: level l has 2^l cells per
+// dimension, the finest level is the grid's bins and the bodies live there.
+// Cells of a level are linearized like the bins (BIN_IDX) and all levels'
+// expansions are stored one after the other, coarsest first.
+//
+struct nbody_fmm
+{
+    int order;
+    int levels;                 // finest level; 2^levels bins per dimension
+    int ncoef;
+    int * k;                    // 3 * ncoef: multi-index of every coefficient
+    int * lookup;               // (order + 1)^3: coefficient of a multi-index, -1 past order
+    double * binomial;          // (order + 1)^2: binomial coefficients up to order
+    int * level_offset;         // levels + 2: first cell of every level
+    int * m2l_first;            // ncoef + 1: first M2L term of every local coefficient
+    int * m2l_multipole;        // per M2L term: multipole coefficient a,
+    int * m2l_derivative;       // kernel coefficient a + b
+    double * m2l_factor;        // and (-1)^|b| C(a + b, b)
+    double * multipole;         // ncoef per cell of every level
+    double * local;
+    struct nbody_config grid_config;    // config with the finest level as its grid
+    struct nbody_grid grid;
+};
+
+//
+// Set up the expansions for config->fmm_order and the hierarchy for
+// config->bins_per_dim rounded up to a power of two. Returns 0 when out of
+// memory.
+//
+int nbody_fmm_init (
+    struct nbody_config const * const config,
+    struct nbody_fmm * const fmm
+    );
+
+void nbody_fmm_destroy (
+    struct nbody_fmm * const fmm
+    );
+
+//
+// Fit the finest grid over the bodies and bin them
+//
+void nbody_fmm_bin (
+    struct nbody_fmm * const fmm,
+    cl_float4 const * const global_p,
+    int const points
+    );
+
+//
+// Multipoles of the finest cells from their bodies (P2M), then of every
+// coarser cell from its eight children (M2M)
+//
+void nbody_fmm_upward (
+    struct nbody_fmm * const fmm
+    );
+
+//
+// Local expansions of every cell from level 2 down: the parent's local
+// expansion shifted to the cell (L2L) plus the multipoles of its
+// interaction list (M2L), the children of the parent's neighbours that are
+// not the cell's own neighbours.
+//
+void nbody_fmm_downward (
+    struct nbody_fmm * const fmm
+    );
+
+//
+// Accelerations into global_a, in original body order: the local expansion
+// of a body's finest cell (L2P) plus direct sums over the 27 neighbouring
+// cells (P2P). Returns the number of direct interactions.
+//
+double nbody_fmm_evaluate (
+    struct nbody_fmm const * const fmm,
+    cl_float4 * const global_a
+    );
+
+//
+// Centre of cell (x, y, z) of level
+//
+cl_float4 nbody_fmm_cell_center (
+    struct nbody_fmm const * const fmm,
+    int const level,
+    int const x,
+    int const y,
+    int const z
+    );
+
+#endif
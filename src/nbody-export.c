@@ -0,0 +1,57 @@
+/* nbody simulation, text export of binary snapshot files */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nbody-snapshot.h"
+
+//
+// usage: nbody-export FILE [RECORD]
+//
+// Prints the records of FILE (or only record RECORD) in the text format the
+// programs print without -O, each preceded by a "# step" line.
+//
+int main(int argc, char ** argv)
+{
+    struct nbody_snapshot snapshot;
+    int first;
+    int last;
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s FILE [RECORD]\n", argv[0]);
+        return 1;
+    }
+
+    first = (argc == 3) ? atoi(argv[2]) : 0;
+    last = (argc == 3) ? first : -1;
+
+    for (int r = first; last < 0 || r <= last; ++r)
+    {
+        if (nbody_snapshot_map(argv[1], r, &snapshot) != 0)
+        {
+            if (r == first)
+            {
+                fprintf(stderr, "cannot read record %d of %s\n", r, argv[1]);
+                return 1;
+            }
+
+            break;
+        }
+
+        printf("# step %llu time %f\n", (unsigned long long) snapshot.header.step, snapshot.header.time);
+
+        for (uint64_t i = 0; i < snapshot.header.points; ++i)
+        {
+            printf("(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
+                snapshot.x[i], snapshot.y[i], snapshot.z[i], snapshot.w[i],
+                snapshot.ax ? snapshot.ax[i] : 0.0f,
+                snapshot.ay ? snapshot.ay[i] : 0.0f,
+                snapshot.az ? snapshot.az[i] : 0.0f);
+        }
+
+        nbody_snapshot_unmap(&snapshot);
+    }
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* nbody simulation, bundled radix-2 FFT for the particle-mesh solver */
+
+#include "nbody-fft.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+int nbody_fft_init (
+    struct nbody_fft * const fft,
+    int const n
+    )
+{
+    int bits = 0;
+
+    while ((1 << bits) < n)
+    {
+        bits++;
+    }
+
+    fft->n = n;
+    fft->reverse = (int *) malloc(sizeof(int) * n);
+    fft->twiddle = (double *) malloc(sizeof(double) * 2 * (n / 2 > 0 ? n / 2 : 1));
+
+    if (fft->reverse == NULL || fft->twiddle == NULL)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        int r = 0;
+
+        for (int b = 0; b < bits; ++b)
+        {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+
+        fft->reverse[i] = r;
+    }
+
+    for (int k = 0; k < n / 2; ++k)
+    {
+        fft->twiddle[2 * k] = cos(2.0 * M_PI * k / n);
+        fft->twiddle[2 * k + 1] = -sin(2.0 * M_PI * k / n);
+    }
+
+    return 1;
+}
+
+void nbody_fft_destroy (
+    struct nbody_fft * const fft
+    )
+{
+    free(fft->reverse);
+    free(fft->twiddle);
+}
+
+//
+// Iterative decimation in time: bit-reversal permutation, then log2(n)
+// passes of butterflies over blocks of doubling length
+//
+void nbody_fft_transform (
+    struct nbody_fft const * const fft,
+    double * const data,
+    int const inverse
+    )
+{
+    int const n = fft->n;
+    double const sign = inverse ? -1.0 : 1.0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        int const j = fft->reverse[i];
+
+        if (i < j)
+        {
+            double const re = data[2 * i];
+            double const im = data[2 * i + 1];
+
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    for (int length = 2; length <= n; length *= 2)
+    {
+        int const half = length / 2;
+        int const stride = n / length;
+
+        for (int start = 0; start < n; start += length)
+        {
+            for (int k = 0; k < half; ++k)
+            {
+                double const w_re = fft->twiddle[2 * k * stride];
+                double const w_im = sign * fft->twiddle[2 * k * stride + 1];
+                double * const u = &data[2 * (start + k)];
+                double * const v = &data[2 * (start + k + half)];
+                double const t_re = w_re * v[0] - w_im * v[1];
+                double const t_im = w_re * v[1] + w_im * v[0];
+
+                v[0] = u[0] - t_re;
+                v[1] = u[1] - t_im;
+                u[0] += t_re;
+                u[1] += t_im;
+            }
+        }
+    }
+}
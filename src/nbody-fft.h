@@ -0,0 +1,39 @@
+/* nbody simulation, bundled radix-2 FFT for the particle-mesh solver */
+
+#ifndef NBODY_FFT_H
+#define NBODY_FFT_H
+
+//
+// Tables for transforms of one power-of-two length n. Data is n complex
+// doubles, real and imaginary parts interleaved.
+//
+struct nbody_fft
+{
+    int n;
+    int * reverse;              // bit-reversed index of every element
+    double * twiddle;           // exp(-2 pi i k / n) for k < n / 2, interleaved
+};
+
+//
+// Tables for length n, a power of two. Returns 0 when out of memory.
+//
+int nbody_fft_init (
+    struct nbody_fft * const fft,
+    int const n
+    );
+
+void nbody_fft_destroy (
+    struct nbody_fft * const fft
+    );
+
+//
+// In-place transform of data, forward (exp(-2 pi i jk / n)) or, with
+// inverse, backward. Neither direction divides by n.
+//
+void nbody_fft_transform (
+    struct nbody_fft const * const fft,
+    double * const data,
+    int const inverse
+    );
+
+#endif
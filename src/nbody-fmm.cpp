@@ -0,0 +1,485 @@
+/* nbody simulation, fast multipole method with the downward pass and evaluation in OpenCL */
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "nbody-common.h"
+#include "nbody-expansion.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+#include "nbody-program.h"
+
+//
+// Kernel source, embedded at build time from src/nbody_kernel-fmm.cl
+//
+static char const kernel_source[] =
+#include "nbody_kernel-fmm.cl.h"
+;
+
+#define DEBUG_PRINT(str, ...) /**/
+//#define DEBUG_PRINT(str, ...) printf(str, ##__VA_ARGS__)
+
+#define ASSERT(x, str, ...) \
+{ \
+    if ((x) == 0) \
+    { \
+        printf("**Assertion Error in function [%s] in file [%s:%d]: " str, __FUNCTION__, \
+            __FILE__, __LINE__, ##__VA_ARGS__); \
+        exit(EXIT_FAILURE); \
+    } \
+}
+
+//
+// Device side of the FMM. The coefficient tables are uploaded once; the
+// multipoles, bodies and offsets every force pass.
+//
+struct fmm_device
+{
+    cl::CommandQueue queue;
+    cl::Kernel downward_kernel;
+    cl::Kernel evaluate_kernel;
+    cl::Buffer k_buffer;
+    cl::Buffer lookup_buffer;
+    cl::Buffer binomial_buffer;
+    cl::Buffer m2l_first_buffer;
+    cl::Buffer m2l_multipole_buffer;
+    cl::Buffer m2l_derivative_buffer;
+    cl::Buffer m2l_factor_buffer;
+    cl::Buffer multipole_buffer;
+    cl::Buffer local_buffer;
+    cl::Buffer bin_pts_buffer;
+    cl::Buffer bin_pts_offsets_buffer;
+    cl::Buffer pt_bins_buffer;
+    cl::Buffer a_buffer;
+    std::vector<float> multipole;   // float copy of the host multipoles
+    std::vector<int> pt_bins;       // finest cell of every sorted body
+    std::vector<cl::Event> upload;
+    std::vector<cl::Event> forces;
+    std::vector<cl::Event> download;
+};
+
+//
+// Create a read-only buffer holding count elements of data
+//
+template <typename T>
+cl::Buffer table_buffer (
+    cl::Context &context,
+    cl::CommandQueue &queue,
+    T const * const data,
+    int const count
+    )
+{
+    cl_int err;
+
+    cl::Buffer buffer(context, CL_MEM_READ_ONLY, sizeof(T) * count, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sizeof(T) * count, data);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    return buffer;
+}
+
+void init_fmm_device (
+    struct nbody_config const * const config,
+    struct nbody_fmm const * const fmm,
+    cl::Context &context,
+    cl::Device &device,
+    struct fmm_device * const dev
+    )
+{
+    int const n = fmm->order + 1;
+    int const cells = fmm->level_offset[fmm->levels + 1];
+    int const num_bins = nbody_num_bins(&fmm->grid_config);
+    int const terms = fmm->m2l_first[fmm->ncoef];
+    int const points = config->points;
+    cl_int err;
+
+    dev->queue = cl::CommandQueue(context, device, config->timing_path != NULL ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+    //
+    // Expansion order and depth are build options, so the private
+    // coefficient arrays have a fixed size
+    //
+    char build_options[128];
+
+    snprintf(build_options, sizeof(build_options), "-D ORDER=%d -D NCOEF=%d -D LEVELS=%d",
+        fmm->order, fmm->ncoef, fmm->levels);
+
+    cl::Program program = nbody_build_program(config, context, device, kernel_source, build_options);
+
+    dev->downward_kernel = cl::Kernel(program, "fmm_downward");
+    dev->evaluate_kernel = cl::Kernel(program, "fmm_evaluate");
+
+    std::vector<float> binomial(fmm->binomial, fmm->binomial + n * n);
+    std::vector<float> m2l_factor(fmm->m2l_factor, fmm->m2l_factor + terms);
+
+    dev->k_buffer = table_buffer(context, dev->queue, fmm->k, 3 * fmm->ncoef);
+    dev->lookup_buffer = table_buffer(context, dev->queue, fmm->lookup, n * n * n);
+    dev->binomial_buffer = table_buffer(context, dev->queue, &binomial[0], n * n);
+    dev->m2l_first_buffer = table_buffer(context, dev->queue, fmm->m2l_first, fmm->ncoef + 1);
+    dev->m2l_multipole_buffer = table_buffer(context, dev->queue, fmm->m2l_multipole, terms);
+    dev->m2l_derivative_buffer = table_buffer(context, dev->queue, fmm->m2l_derivative, terms);
+    dev->m2l_factor_buffer = table_buffer(context, dev->queue, &m2l_factor[0], terms);
+
+    dev->multipole.resize(fmm->ncoef * cells);
+    dev->pt_bins.resize(points);
+
+    dev->multipole_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * fmm->ncoef * cells, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->local_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * fmm->ncoef * cells, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->bin_pts_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4) * points, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->bin_pts_offsets_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * (num_bins + 1), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->pt_bins_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int) * points, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->a_buffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4) * points, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Set fmm_downward args\n");
+    err = dev->downward_kernel.setArg(0, dev->multipole_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(1, dev->local_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(2, dev->k_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(3, dev->lookup_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(4, dev->binomial_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(5, dev->m2l_first_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(6, dev->m2l_multipole_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(7, dev->m2l_derivative_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(8, dev->m2l_factor_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Set fmm_evaluate args\n");
+    err = dev->evaluate_kernel.setArg(0, dev->bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(1, dev->bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(2, dev->pt_bins_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(3, dev->local_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(4, dev->k_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(5, dev->a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(6, points);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(7, fmm->level_offset[fmm->levels]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Execution time of a command from its profiling counters
+//
+double event_seconds (
+    cl::Event &event
+    )
+{
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    return 1e-9 * (end - start);
+}
+
+//
+// One force pass: bin the bodies and build the multipoles on the host, run
+// the downward pass level by level and the evaluation on the device, then
+// scatter the sorted accelerations back to body order. The upward pass
+// touches every body once and the coarse levels hardly at all, while M2L
+// and the near field are where the work is.
+//
+void calculate_fmm_forces (
+    struct nbody_config const * const config,
+    struct nbody_fmm * const fmm,
+    struct fmm_device * const dev,
+    cl_float4 const * const x,
+    cl_float4 * const sorted_a,
+    cl_float4 * const a,
+    struct nbody_timing * const timing
+    )
+{
+    struct nbody_grid const * const grid = &fmm->grid;
+    int const cells = fmm->level_offset[fmm->levels + 1];
+    int const num_bins = nbody_num_bins(&fmm->grid_config);
+    int const points = config->points;
+    double t = nbody_now();
+    cl_int err;
+
+    nbody_fmm_bin(fmm, x, points);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        dev->pt_bins[i] = grid->pt_bins[grid->bin_ids[i]];
+    }
+
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+    t = nbody_now();
+
+    nbody_fmm_upward(fmm);
+
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < fmm->ncoef * cells; ++c)
+    {
+        dev->multipole[c] = (float) fmm->multipole[c];
+    }
+
+    timing->phase[NBODY_PHASE_FORCES] += nbody_now() - t;
+    t = nbody_now();
+
+    dev->upload.resize(4);
+    dev->forces.resize(std::max(fmm->levels - 1, 0) + 1);
+    dev->download.resize(1);
+
+    DEBUG_PRINT("Write buffers\n");
+    err = dev->queue.enqueueWriteBuffer(dev->multipole_buffer, CL_FALSE, 0, sizeof(float) * fmm->ncoef * cells,
+        &dev->multipole[0], NULL, &dev->upload[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->bin_pts_buffer, CL_FALSE, 0, sizeof(cl_float4) * points,
+        grid->bin_pts, NULL, &dev->upload[1]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->bin_pts_offsets_buffer, CL_FALSE, 0, sizeof(cl_int) * (num_bins + 1),
+        grid->bin_pts_offsets, NULL, &dev->upload[2]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->pt_bins_buffer, CL_FALSE, 0, sizeof(cl_int) * points,
+        &dev->pt_bins[0], NULL, &dev->upload[3]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Levels 0 and 1 have no interaction lists; each finer level needs its
+    // parent's local expansions, and the in-order queue provides that
+    //
+    err = dev->downward_kernel.setArg(12, grid->origin);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->downward_kernel.setArg(13, grid->bin_length);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    for (int level = 2; level <= fmm->levels; ++level)
+    {
+        err = dev->downward_kernel.setArg(9, level);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        err = dev->downward_kernel.setArg(10, fmm->level_offset[level]);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        err = dev->downward_kernel.setArg(11, fmm->level_offset[level - 1]);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        DEBUG_PRINT("Run fmm_downward on level %d\n", level);
+        err = dev->queue.enqueueNDRangeKernel(dev->downward_kernel, cl::NDRange(0), cl::NDRange(1 << (3 * level)),
+            cl::NullRange, NULL, &dev->forces[level - 2]);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+    }
+
+    err = dev->evaluate_kernel.setArg(8, grid->origin);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->evaluate_kernel.setArg(9, grid->bin_length);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run fmm_evaluate\n");
+    err = dev->queue.enqueueNDRangeKernel(dev->evaluate_kernel, cl::NDRange(0), cl::NDRange(points),
+        cl::NullRange, NULL, &dev->forces.back());
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueReadBuffer(dev->a_buffer, CL_TRUE, 0, sizeof(cl_float4) * points,
+        sorted_a, NULL, &dev->download[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        a[grid->bin_ids[i]] = sorted_a[i];
+    }
+
+    if (config->timing_path == NULL)
+    {
+        return;
+    }
+
+    //
+    // Device phases come from the profiling counters; the wall time of the
+    // device part is left out so it is not counted twice
+    //
+    for (size_t i = 0; i < dev->upload.size(); ++i)
+    {
+        timing->phase[NBODY_PHASE_UPLOAD] += event_seconds(dev->upload[i]);
+    }
+
+    for (size_t i = 0; i < dev->forces.size(); ++i)
+    {
+        timing->phase[NBODY_PHASE_FORCES] += event_seconds(dev->forces[i]);
+    }
+
+    timing->phase[NBODY_PHASE_DOWNLOAD] += event_seconds(dev->download[0]);
+
+    std::vector<int> counts(num_bins);
+
+    for (int b = 0; b < num_bins; ++b)
+    {
+        counts[b] = grid->bin_pts_offsets[b + 1] - grid->bin_pts_offsets[b];
+    }
+
+    timing->interactions += nbody_grid_interactions(&fmm->grid_config, &counts[0]);
+}
+
+int main(int argc, char ** argv) {
+    struct nbody_config config;
+    struct nbody_timing timing;
+    struct nbody_fmm fmm;
+    struct fmm_device dev;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
+
+    config.threads = omp_get_max_threads();
+#endif
+
+    try {
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        std::cerr << "cannot read initial conditions from " << config.input_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int points = config.points;
+
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * v = nbody_ic_velocities(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    cl_float4 * sorted_a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+
+    if (x == NULL || v == NULL || a == NULL || sorted_a == NULL || !nbody_fmm_init(&config, &fmm))
+    {
+        std::cerr << "out of memory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Get available platforms
+    std::vector<cl::Platform> platforms;
+
+    cl::Platform::get(&platforms);
+
+    // Select the default platform and create a context using this platform and the GPU
+    cl_context_properties cps[3] = {
+        CL_CONTEXT_PLATFORM,
+        (cl_context_properties)(platforms[0])(),
+        0
+    };
+    cl::Context context(CL_DEVICE_TYPE_GPU, cps);
+
+    // Get a list of devices on this platform
+    std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    init_fmm_device(&config, &fmm, context, devices[0], &dev);
+
+    timing.phase[NBODY_PHASE_BUILD] = nbody_now() - t;
+
+    calculate_fmm_forces(&config, &fmm, &dev, x, sorted_a, a, &timing);
+
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        t = nbody_now();
+        nbody_output(&config, x, v, a, points, 0, 0.0, config.steps > 0);
+        timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+    }
+
+    for (int step = 1; step <= config.steps; ++step)
+    {
+        t = nbody_now();
+        nbody_kick_drift(x, v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        calculate_fmm_forces(&config, &fmm, &dev, x, sorted_a, a, &timing);
+
+        t = nbody_now();
+        nbody_kick(v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+        {
+            t = nbody_now();
+            nbody_output(&config, x, v, a, points, step, step * config.dt, true);
+            timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+        }
+    }
+
+    if (config.timing_path != NULL)
+    {
+        nbody_timing_report(&config, &timing, "fmm");
+    }
+
+    nbody_fmm_destroy(&fmm);
+    free(x);
+    free(v);
+    free(a);
+    free(sorted_a);
+
+    } catch(cl::Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1197 @@
+/* nbody simulation, binned CPU force engine */
+
+#include "nbody-grid.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//
+// Deeper than this the bodies of a refined bin are (nearly) coincident;
+// stop splitting.
+//
+#define MAX_CELL_DEPTH (24)
+
+//
+// Bodies a thread scans between adding its bin leavers to the shared count
+// that decides whether patching is still worth it
+//
+#define MIGRANT_CHECK_INTERVAL (4096)
+
+//
+// Bin a coordinate falls in along one dimension. Bodies outside the grid
+// are clamped into the edge bins so they are never lost.
+//
+static inline int bin_coord (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    float const pos,
+    float const origin
+    )
+{
+    int bin = (int) ((pos - origin) / grid->bin_length);
+
+    return MIN(MAX(bin, 0), config->bins_per_dim - 1);
+}
+
+static inline int bin_of (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 const pt
+    )
+{
+    return BIN_IDX(config->bins_per_dim,
+                   bin_coord(config, grid, pt.x, grid->origin.x),
+                   bin_coord(config, grid, pt.y, grid->origin.y),
+                   bin_coord(config, grid, pt.z, grid->origin.z));
+}
+
+int construct_grid (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+
+#ifdef _OPENMP
+    //
+    // The binning splits its work by thread id, so it needs exactly the
+    // threads it asked for
+    //
+    omp_set_dynamic(0);
+    grid->num_threads = omp_get_max_threads();
+#else
+    grid->num_threads = 1;
+#endif
+
+    grid->cm = (cl_float4 *) malloc(sizeof(cl_float4) * num_bins);
+    grid->bin_pts_offsets = (int *) malloc(sizeof(int) * (num_bins + 1));
+    grid->bin_pts = (cl_float4 *) malloc(sizeof(cl_float4) * config->points);
+    grid->bin_ids = (int *) malloc(sizeof(int) * config->points);
+    grid->pt_bins = (int *) malloc(sizeof(int) * config->points);
+    grid->thread_offsets = (int *) malloc(sizeof(int) * num_bins * grid->num_threads);
+    grid->bin_order = (int *) malloc(sizeof(int) * num_bins);
+    grid->bin_cost = (long *) malloc(sizeof(long) * num_bins);
+    grid->interact = nbody_select_interaction(config->isa, config->precision);
+    grid->pair_interact = nbody_select_pair_interaction(config->isa, config->precision);
+    grid->pair_block_interact = nbody_select_pair_block_interaction(config->isa, config->precision);
+    grid->origin = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
+    grid->bin_length = config->bin_length;
+    grid->bin_root = (int *) malloc(sizeof(int) * num_bins);
+    grid->cells_capacity = 64;
+    grid->cells = (struct nbody_cell *) malloc(sizeof(struct nbody_cell) * grid->cells_capacity);
+    grid->num_cells = 0;
+    grid->scratch_pts = (cl_float4 *) malloc(sizeof(cl_float4) * config->points);
+    grid->scratch_ids = (int *) malloc(sizeof(int) * config->points);
+    grid->binned_points = 0;
+    grid->departures = (int *) malloc(sizeof(int) * (num_bins + 1));
+    grid->arrival_offsets = (int *) malloc(sizeof(int) * (num_bins + 1));
+    grid->new_offsets = (int *) malloc(sizeof(int) * (num_bins + 1));
+    grid->migrants = (int *) malloc(sizeof(int) * config->points);
+    grid->arrivals = (int *) malloc(sizeof(int) * config->points);
+    grid->slot_of = (int *) malloc(sizeof(int) * config->points);
+    grid->migrant_counts = (int *) malloc(sizeof(int) * grid->num_threads);
+
+    for (int b = 0; grid->bin_root && b < num_bins; ++b)
+    {
+        grid->bin_root[b] = -1;
+    }
+
+    return grid->cm && grid->bin_pts_offsets && grid->bin_pts && grid->bin_ids
+        && grid->pt_bins && grid->thread_offsets && grid->bin_order && grid->bin_cost
+        && grid->bin_root && grid->cells && grid->scratch_pts && grid->scratch_ids
+        && grid->departures && grid->arrival_offsets && grid->new_offsets
+        && grid->migrants && grid->arrivals && grid->slot_of && grid->migrant_counts
+        && nbody_soa_alloc(&grid->cm_soa, num_bins) && nbody_soa_alloc(&grid->pts_soa, config->points)
+        && nbody_soa_acc_alloc(&grid->pair_acc, config->symmetric ? config->points : 0, config->precision);
+}
+
+void destroy_grid (
+    struct nbody_grid * const grid
+    )
+{
+    nbody_soa_acc_free(&grid->pair_acc);
+    free(grid->migrant_counts);
+    free(grid->slot_of);
+    free(grid->arrivals);
+    free(grid->migrants);
+    free(grid->new_offsets);
+    free(grid->arrival_offsets);
+    free(grid->departures);
+    nbody_soa_free(&grid->pts_soa);
+    nbody_soa_free(&grid->cm_soa);
+    free(grid->scratch_ids);
+    free(grid->scratch_pts);
+    free(grid->cells);
+    free(grid->bin_root);
+    free(grid->bin_cost);
+    free(grid->bin_order);
+    free(grid->thread_offsets);
+    free(grid->pt_bins);
+    free(grid->bin_ids);
+    free(grid->bin_pts);
+    free(grid->bin_pts_offsets);
+    free(grid->cm);
+}
+
+void fit_grid (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    float lo_x = 0.0f, lo_y = 0.0f, lo_z = 0.0f;
+    float hi_x = config->space, hi_y = config->space, hi_z = config->space;
+    float side;
+
+    #pragma omp parallel for schedule(static) reduction(min: lo_x, lo_y, lo_z) reduction(max: hi_x, hi_y, hi_z)
+    for (int i = 0; i < points; ++i)
+    {
+        lo_x = MIN(lo_x, global_p[i].x);
+        lo_y = MIN(lo_y, global_p[i].y);
+        lo_z = MIN(lo_z, global_p[i].z);
+        hi_x = MAX(hi_x, global_p[i].x);
+        hi_y = MAX(hi_y, global_p[i].y);
+        hi_z = MAX(hi_z, global_p[i].z);
+    }
+
+    side = MAX(hi_x - lo_x, MAX(hi_y - lo_y, hi_z - lo_z));
+
+    grid->origin = (cl_float4) {lo_x, lo_y, lo_z, 0.0f};
+    grid->bin_length = side == config->space ? config->bin_length : side / config->bins_per_dim;
+}
+
+//
+// Sort the points into bin order with a parallel counting sort. Each thread
+// takes a contiguous chunk of the points and histograms it; the per-thread
+// histograms are scanned bin-major so that, within a bin, thread t's points
+// land after those of threads 0..t-1. The scatter is therefore stable and
+// bin_pts comes out the same for any number of threads.
+//
+void construct_bin_pts (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+    int const num_threads = grid->num_threads;
+    int * const thread_offsets = grid->thread_offsets;
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef _OPENMP
+        int const t = omp_get_thread_num();
+#else
+        int const t = 0;
+#endif
+        int const chunk_start = (int) ((long) points * t / num_threads);
+        int const chunk_end = (int) ((long) points * (t + 1) / num_threads);
+
+        for (int b = 0; b < num_bins; ++b)
+        {
+            thread_offsets[b * num_threads + t] = 0;
+        }
+
+        for (int i = chunk_start; i < chunk_end; ++i)
+        {
+            grid->pt_bins[i] = bin_of(config, grid, global_p[i]);
+            thread_offsets[grid->pt_bins[i] * num_threads + t]++;
+        }
+
+        #pragma omp barrier
+
+        //
+        // Exclusive scan of the histogram, bin major. Each thread first turns
+        // a block of bins into local offsets; the block totals are then
+        // scanned serially and added back in.
+        //
+        int const bin_start = (int) ((long) num_bins * t / num_threads);
+        int const bin_end = (int) ((long) num_bins * (t + 1) / num_threads);
+
+        for (int b = bin_start; b < bin_end; ++b)
+        {
+            int total = 0;
+
+            for (int u = 0; u < num_threads; ++u)
+            {
+                int count = thread_offsets[b * num_threads + u];
+
+                thread_offsets[b * num_threads + u] = total;
+                total += count;
+            }
+
+            grid->bin_pts_offsets[b + 1] = total;
+        }
+
+        #pragma omp barrier
+
+        #pragma omp single
+        {
+            grid->bin_pts_offsets[0] = 0;
+
+            for (int b = 0; b < num_bins; ++b)
+            {
+                grid->bin_pts_offsets[b + 1] += grid->bin_pts_offsets[b];
+            }
+        }
+
+        for (int b = bin_start; b < bin_end; ++b)
+        {
+            for (int u = 0; u < num_threads; ++u)
+            {
+                thread_offsets[b * num_threads + u] += grid->bin_pts_offsets[b];
+            }
+        }
+
+        #pragma omp barrier
+
+        //
+        // Stable scatter, using the scanned histogram as cursors
+        //
+        for (int i = chunk_start; i < chunk_end; ++i)
+        {
+            int dst = thread_offsets[grid->pt_bins[i] * num_threads + t]++;
+
+            grid->bin_pts[dst] = global_p[i];
+            grid->bin_ids[dst] = i;
+            grid->slot_of[i] = dst;
+            nbody_soa_set(&grid->pts_soa, dst, global_p[i]);
+        }
+    }
+
+    grid->binned_points = points;
+    grid->binned_origin = grid->origin;
+    grid->binned_length = grid->bin_length;
+}
+
+//
+// Centre of mass of the points [begin, end) of bin_pts, their total mass in
+// .w. Without mass (an empty bin) the position stays zero, and the zero
+// mass makes it contribute nothing instead of propagating 0/0.
+//
+static cl_float4 range_cm (
+    cl_float4 const * const pts,
+    int const begin,
+    int const end
+    )
+{
+    double x = 0.0, y = 0.0, z = 0.0, m = 0.0;
+    cl_float4 val = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
+
+    for (int i = begin; i < end; ++i)
+    {
+        x += (double) pts[i].w * pts[i].x;
+        y += (double) pts[i].w * pts[i].y;
+        z += (double) pts[i].w * pts[i].z;
+        m += pts[i].w;
+    }
+
+    if (m > 0.0)
+    {
+        val.x = (float) (x / m);
+        val.y = (float) (y / m);
+        val.z = (float) (z / m);
+        val.w = (float) m;
+    }
+
+    return val;
+}
+
+//
+// Centre of mass of every bin from its now contiguous points
+//
+void construct_bins_cm (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < num_bins; ++b)
+    {
+        cl_float4 const val = range_cm(grid->bin_pts, grid->bin_pts_offsets[b], grid->bin_pts_offsets[b + 1]);
+
+        grid->cm[b] = val;
+        nbody_soa_set(&grid->cm_soa, b, val);
+    }
+}
+
+//
+// Bodies drift by a fraction of a bin per step, so after the first binning
+// most of them are still in their bin. The update streams over the bodies
+// in their own order, as construct_bin_pts does, in three passes:
+//
+//  1. per thread chunk, write every body that stayed into its old slot
+//     (slot_of), mark the slots of those that left with bin_ids = -1 and
+//     list the leavers in body order;
+//  2. counting-sort the leavers by their new bin and work out the new bin
+//     offsets from the old counts, the departures and the arrivals;
+//  3. per bin, write the stayers and then the arrivals at the bin's new
+//     offset into the scratch arrays, which become bin_pts and bin_ids.
+//
+// Pass 3 is skipped when no body changed bin. Every body moves each step,
+// so the SoA copy and the centres of mass are then refreshed from bin_pts
+// in one sequential pass per bin.
+//
+int update_bin_pts (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+    int const num_threads = grid->num_threads;
+    int * const departures = grid->departures;
+    int * const arrival_offsets = grid->arrival_offsets;
+    int * const new_offsets = grid->new_offsets;
+    int const max_migrants = (int) (config->rebin_threshold * points);
+    int num_migrants = 0;
+    int migrants_seen = 0;
+
+    if (config->rebin_threshold <= 0.0f || grid->binned_points != points
+        || grid->origin.x != grid->binned_origin.x || grid->origin.y != grid->binned_origin.y
+        || grid->origin.z != grid->binned_origin.z || grid->bin_length != grid->binned_length)
+    {
+        construct_bin_pts(config, grid, global_p, points);
+        construct_bins_cm(config, grid);
+        return 0;
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef _OPENMP
+        int const t = omp_get_thread_num();
+#else
+        int const t = 0;
+#endif
+        int const chunk_start = (int) ((long) points * t / num_threads);
+        int const chunk_end = (int) ((long) points * (t + 1) / num_threads);
+        int count = 0;
+        int reported = 0;
+
+        //
+        // A chunk's leavers go to the front of its own range of migrants,
+        // with their old bin at the same index of arrivals. Every
+        // MIGRANT_CHECK_INTERVAL bodies the chunks add their new leavers to
+        // the shared total, and once the total over all chunks is past the
+        // threshold a chunk gives up (count -1): the bins get rebuilt
+        // anyway. One dense chunk alone does not force a rebuild.
+        //
+        for (int i = chunk_start; i < chunk_end; ++i)
+        {
+            if (i > chunk_start && (i - chunk_start) % MIGRANT_CHECK_INTERVAL == 0)
+            {
+                int total;
+
+                #pragma omp atomic capture
+                total = migrants_seen += count - reported;
+
+                reported = count;
+
+                if (total > max_migrants)
+                {
+                    count = -1;
+                    break;
+                }
+            }
+
+            int const nb = bin_of(config, grid, global_p[i]);
+
+            if (nb == grid->pt_bins[i])
+            {
+                grid->bin_pts[grid->slot_of[i]] = global_p[i];
+                continue;
+            }
+
+            grid->bin_ids[grid->slot_of[i]] = -1;
+            grid->migrants[chunk_start + count] = i;
+            grid->arrivals[chunk_start + count] = grid->pt_bins[i];
+            grid->pt_bins[i] = nb;
+            count++;
+        }
+
+        grid->migrant_counts[t] = count;
+
+        #pragma omp barrier
+
+        #pragma omp single
+        {
+            for (int u = 0; u < num_threads; ++u)
+            {
+                int const start = (int) ((long) points * u / num_threads);
+
+                if (grid->migrant_counts[u] < 0)
+                {
+                    num_migrants = points;
+                    break;
+                }
+
+                memmove(&grid->migrants[num_migrants], &grid->migrants[start], sizeof(int) * grid->migrant_counts[u]);
+                memmove(&grid->arrivals[num_migrants], &grid->arrivals[start], sizeof(int) * grid->migrant_counts[u]);
+                num_migrants += grid->migrant_counts[u];
+            }
+        }
+    }
+
+    if (num_migrants > max_migrants)
+    {
+        construct_bin_pts(config, grid, global_p, points);
+        construct_bins_cm(config, grid);
+        return 0;
+    }
+
+    if (num_migrants > 0)
+    {
+        int total = 0;
+
+        for (int b = 0; b <= num_bins; ++b)
+        {
+            departures[b] = 0;
+            arrival_offsets[b] = 0;
+        }
+
+        for (int m = 0; m < num_migrants; ++m)
+        {
+            departures[grid->arrivals[m]]++;
+            arrival_offsets[grid->pt_bins[grid->migrants[m]] + 1]++;
+        }
+
+        //
+        // Scan the arrivals into offsets and the new bin sizes into
+        // new_offsets, then place the leavers by new bin, in body order
+        //
+        new_offsets[0] = 0;
+
+        for (int b = 0; b < num_bins; ++b)
+        {
+            int const arriving = arrival_offsets[b + 1];
+
+            arrival_offsets[b + 1] += arrival_offsets[b];
+            total += grid->bin_pts_offsets[b + 1] - grid->bin_pts_offsets[b] - departures[b] + arriving;
+            new_offsets[b + 1] = total;
+        }
+
+        for (int m = 0; m < num_migrants; ++m)
+        {
+            int const id = grid->migrants[m];
+
+            grid->arrivals[arrival_offsets[grid->pt_bins[id]]++] = id;
+        }
+
+        //
+        // The placement left every arrival offset at the next bin's start
+        //
+        for (int b = num_bins; b > 0; --b)
+        {
+            arrival_offsets[b] = arrival_offsets[b - 1];
+        }
+
+        arrival_offsets[0] = 0;
+
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int b = 0; b < num_bins; ++b)
+        {
+            int dst = new_offsets[b];
+
+            for (int k = grid->bin_pts_offsets[b]; k < grid->bin_pts_offsets[b + 1]; ++k)
+            {
+                if (grid->bin_ids[k] >= 0)
+                {
+                    grid->scratch_pts[dst] = grid->bin_pts[k];
+                    grid->scratch_ids[dst] = grid->bin_ids[k];
+                    grid->slot_of[grid->bin_ids[k]] = dst;
+                    dst++;
+                }
+            }
+
+            for (int m = arrival_offsets[b]; m < arrival_offsets[b + 1]; ++m)
+            {
+                int const id = grid->arrivals[m];
+
+                grid->scratch_pts[dst] = global_p[id];
+                grid->scratch_ids[dst] = id;
+                grid->slot_of[id] = dst;
+                dst++;
+            }
+        }
+
+        cl_float4 * const pts = grid->bin_pts;
+        int * const ids = grid->bin_ids;
+
+        grid->bin_pts = grid->scratch_pts;
+        grid->bin_ids = grid->scratch_ids;
+        grid->scratch_pts = pts;
+        grid->scratch_ids = ids;
+        memcpy(grid->bin_pts_offsets, new_offsets, sizeof(int) * (num_bins + 1));
+    }
+
+    #pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (int b = 0; b < num_bins; ++b)
+    {
+        cl_float4 const val = range_cm(grid->bin_pts, grid->bin_pts_offsets[b], grid->bin_pts_offsets[b + 1]);
+
+        for (int k = grid->bin_pts_offsets[b]; k < grid->bin_pts_offsets[b + 1]; ++k)
+        {
+            nbody_soa_set(&grid->pts_soa, k, grid->bin_pts[k]);
+        }
+
+        grid->cm[b] = val;
+        nbody_soa_set(&grid->cm_soa, b, val);
+    }
+
+    return 1;
+}
+
+static int alloc_cell (
+    struct nbody_grid * const grid
+    )
+{
+    if (grid->num_cells == grid->cells_capacity)
+    {
+        grid->cells_capacity *= 2;
+        grid->cells = (struct nbody_cell *) realloc(grid->cells, sizeof(struct nbody_cell) * grid->cells_capacity);
+
+        if (grid->cells == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    return grid->num_cells++;
+}
+
+//
+// Build the subtree over bin_pts[first, first + count), which all lie in the
+// cube of half-width half around center. Returns the index of its root.
+// Cells may be reallocated by the recursion, so they are only referred to
+// by index here.
+//
+static int build_cell (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    int const first,
+    int const count,
+    cl_float4 const center,
+    float const half,
+    int const depth
+    )
+{
+    int idx;
+    cl_float4 cm;
+
+    idx = alloc_cell(grid);
+    grid->cells[idx].size = 2.0f * half;
+    grid->cells[idx].first = first;
+    grid->cells[idx].count = count;
+
+    cm = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
+
+    if (count <= config->leaf_size || depth >= MAX_CELL_DEPTH)
+    {
+        cm = range_cm(grid->bin_pts, first, first + count);
+
+        grid->cells[idx].leaf = 1;
+    }
+    else
+    {
+        int octant_counts[8] = {0};
+        int octant_offsets[8];
+        int offset;
+
+        //
+        // Counting sort of the cell's bodies into its eight octants
+        //
+        for (int i = first; i < first + count; ++i)
+        {
+            octant_counts[((grid->bin_pts[i].x >= center.x) << 2)
+                          | ((grid->bin_pts[i].y >= center.y) << 1)
+                          | (grid->bin_pts[i].z >= center.z)]++;
+        }
+
+        offset = first;
+        for (int o = 0; o < 8; ++o)
+        {
+            octant_offsets[o] = offset;
+            offset += octant_counts[o];
+        }
+
+        for (int i = first; i < first + count; ++i)
+        {
+            int o = ((grid->bin_pts[i].x >= center.x) << 2)
+                    | ((grid->bin_pts[i].y >= center.y) << 1)
+                    | (grid->bin_pts[i].z >= center.z);
+
+            grid->scratch_pts[octant_offsets[o]] = grid->bin_pts[i];
+            grid->scratch_ids[octant_offsets[o]] = grid->bin_ids[i];
+            octant_offsets[o]++;
+        }
+
+        memcpy(&grid->bin_pts[first], &grid->scratch_pts[first], sizeof(cl_float4) * count);
+        memcpy(&grid->bin_ids[first], &grid->scratch_ids[first], sizeof(int) * count);
+
+        //
+        // Children, in octant order, directly follow this cell
+        //
+        offset = first;
+        for (int o = 0; o < 8; ++o)
+        {
+            cl_float4 child_center;
+            int child;
+
+            if (octant_counts[o] == 0)
+            {
+                continue;
+            }
+
+            child_center.x = center.x + ((o & 4) ? 0.5f : -0.5f) * half;
+            child_center.y = center.y + ((o & 2) ? 0.5f : -0.5f) * half;
+            child_center.z = center.z + ((o & 1) ? 0.5f : -0.5f) * half;
+            child_center.w = 0.0f;
+
+            child = build_cell(config, grid, offset, octant_counts[o], child_center, 0.5f * half, depth + 1);
+
+            cm.x += grid->cells[child].cm.x * grid->cells[child].cm.w;
+            cm.y += grid->cells[child].cm.y * grid->cells[child].cm.w;
+            cm.z += grid->cells[child].cm.z * grid->cells[child].cm.w;
+            cm.w += grid->cells[child].cm.w;
+
+            offset += octant_counts[o];
+        }
+
+        if (cm.w > 0.0f)
+        {
+            cm.x /= cm.w;
+            cm.y /= cm.w;
+            cm.z /= cm.w;
+        }
+
+        grid->cells[idx].leaf = 0;
+    }
+
+    grid->cells[idx].cm = cm;
+    grid->cells[idx].next = grid->num_cells;
+
+    return idx;
+}
+
+//
+// Overfull bins are rare and the octant sorts share one scratch array, so
+// the bins are refined one after another. The root cell of a bin is the
+// bounding cube of its bodies rather than the bin itself, which also keeps
+// bodies clamped in from outside the grid inside their cells.
+//
+void refine_bins (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+
+    grid->num_cells = 0;
+
+    for (int b = 0; b < num_bins; ++b)
+    {
+        int const first = grid->bin_pts_offsets[b];
+        int const count = grid->bin_pts_offsets[b + 1] - first;
+        cl_float4 lo;
+        cl_float4 hi;
+        cl_float4 center;
+
+        grid->bin_root[b] = -1;
+
+        if (config->max_bin_pts <= 0 || count <= config->max_bin_pts)
+        {
+            continue;
+        }
+
+        lo = hi = grid->bin_pts[first];
+
+        for (int i = first; i < first + count; ++i)
+        {
+            lo.x = MIN(lo.x, grid->bin_pts[i].x);
+            lo.y = MIN(lo.y, grid->bin_pts[i].y);
+            lo.z = MIN(lo.z, grid->bin_pts[i].z);
+            hi.x = MAX(hi.x, grid->bin_pts[i].x);
+            hi.y = MAX(hi.y, grid->bin_pts[i].y);
+            hi.z = MAX(hi.z, grid->bin_pts[i].z);
+        }
+
+        center.x = 0.5f * (lo.x + hi.x);
+        center.y = 0.5f * (lo.y + hi.y);
+        center.z = 0.5f * (lo.z + hi.z);
+        center.w = 0.0f;
+
+        grid->bin_root[b] = build_cell(config, grid, first, count, center,
+                                       0.5f * MAX(hi.x - lo.x, MAX(hi.y - lo.y, hi.z - lo.z)), 0);
+
+        for (int i = first; i < first + count; ++i)
+        {
+            nbody_soa_set(&grid->pts_soa, i, grid->bin_pts[i]);
+            grid->slot_of[grid->bin_ids[i]] = i;
+        }
+    }
+}
+
+static int compare_bin_cost (
+    void const * a,
+    void const * b,
+    void * cost
+    )
+{
+    long const ca = ((long const *) cost)[*(int const *) a];
+    long const cb = ((long const *) cost)[*(int const *) b];
+
+    return (ca < cb) - (ca > cb);
+}
+
+//
+// Order the bins by estimated force cost, largest first: the bodies in a bin
+// times the bodies in its 27-bin neighbourhood plus one monopole per bin.
+// Threads pull bins off this list dynamically, so the expensive (crowded)
+// bins start first and the cheap ones fill in the tail.
+//
+void schedule_bins (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    int const num_bins = nbody_num_bins(config);
+
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < num_bins; ++b)
+    {
+        int x_bin = b / (bins_per_dim * bins_per_dim);
+        int y_bin = (b / bins_per_dim) % bins_per_dim;
+        int z_bin = b % bins_per_dim;
+        long near = 0;
+
+        for (int x = MAX(0, x_bin - 1); x < MIN(bins_per_dim, x_bin + 2); ++x)
+        {
+            for (int y = MAX(0, y_bin - 1); y < MIN(bins_per_dim, y_bin + 2); ++y)
+            {
+                for (int z = MAX(0, z_bin - 1); z < MIN(bins_per_dim, z_bin + 2); ++z)
+                {
+                    int const n = BIN_IDX(bins_per_dim, x, y, z);
+
+                    near += grid->bin_pts_offsets[n + 1] - grid->bin_pts_offsets[n];
+                }
+            }
+        }
+
+        grid->bin_cost[b] = (long) (grid->bin_pts_offsets[b + 1] - grid->bin_pts_offsets[b]) * (near + num_bins);
+        grid->bin_order[b] = b;
+    }
+
+    qsort_r(grid->bin_order, num_bins, sizeof(int), compare_bin_cost, grid->bin_cost);
+}
+
+//
+// Acceleration on my_position from the cells of a refined bin: a cell is
+// taken as a single point mass when size / distance < theta, otherwise the
+// walk descends into it.
+//
+static int walk_cells (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 const my_position,
+    int const root,
+    cl_double4 * const acc
+    )
+{
+    float const theta_sqr = config->theta * config->theta;
+    int const end = grid->cells[root].next;
+    int interactions = 0;
+    int i = root;
+
+    while (i < end)
+    {
+        struct nbody_cell const * const cell = &grid->cells[i];
+
+        if (cell->leaf)
+        {
+            grid->interact(my_position, &grid->pts_soa, cell->first, cell->first + cell->count, acc);
+            interactions += cell->count;
+            i = cell->next;
+        }
+        else
+        {
+            float dx = cell->cm.x - my_position.x;
+            float dy = cell->cm.y - my_position.y;
+            float dz = cell->cm.z - my_position.z;
+
+            if (cell->size * cell->size < theta_sqr * (dx * dx + dy * dy + dz * dz))
+            {
+                nbody_pair_interaction(config->precision, my_position, cell->cm, acc);
+                interactions++;
+                i = cell->next;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    return interactions;
+}
+
+//
+// calculateForces, optionally after the symmetric pass: when near holds the
+// body's sum from calculate_grid_pairs and its own bin is flat, its flat
+// neighbours are already in near and are skipped here.
+//
+static int body_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 const my_position,
+    int const x_bin,
+    int const y_bin,
+    int const z_bin,
+    cl_double4 const * const near,
+    cl_float4 * const global_acc
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    int const num_bins = nbody_num_bins(config);
+    cl_float4 const * const global_cm = grid->cm;
+    cl_double4 acc = {{0.0, 0.0, 0.0, 1.0}};
+    int interactions = num_bins;
+    int const paired = near != NULL && grid->bin_root[BIN_IDX(bins_per_dim, x_bin, y_bin, z_bin)] < 0;
+
+    int const z_lo = MAX(0, z_bin - 1);
+    int const z_hi = MIN(bins_per_dim, z_bin + 2);
+
+    //
+    // Bin approx for all bins
+    //
+    grid->interact(my_position, &grid->cm_soa, 0, num_bins, &acc);
+
+    for (int x = MAX(0, x_bin - 1); x < MIN(bins_per_dim, x_bin + 2); ++x)
+    {
+        for (int y = MAX(0, y_bin - 1); y < MIN(bins_per_dim, y_bin + 2); ++y)
+        {
+            //
+            // Bins along z are adjacent in bin_pts, so the points of a run
+            // of flat neighbours are one contiguous range. Refined bins end
+            // the run and are walked instead.
+            //
+            int run_begin = grid->bin_pts_offsets[BIN_IDX(bins_per_dim, x, y, z_lo)];
+            int run_end = run_begin;
+
+            for (int z = z_lo; z < z_hi; ++z)
+            {
+                int const b = BIN_IDX(bins_per_dim, x, y, z);
+                cl_double4 bin_acc = {{0.0, 0.0, 0.0, 0.0}};
+
+                //
+                // Take back the bin's centre of mass term from the pass
+                // above; its bodies are summed directly instead
+                //
+                nbody_pair_interaction(config->precision, my_position, global_cm[b], &bin_acc);
+
+                acc.x -= bin_acc.x;
+                acc.y -= bin_acc.y;
+                acc.z -= bin_acc.z;
+
+                interactions++;
+
+                if (grid->bin_root[b] < 0 && paired)
+                {
+                    run_begin = run_end = grid->bin_pts_offsets[b + 1];
+                    continue;
+                }
+
+                if (grid->bin_root[b] < 0)
+                {
+                    run_end = grid->bin_pts_offsets[b + 1];
+                    continue;
+                }
+
+                grid->interact(my_position, &grid->pts_soa, run_begin, run_end, &acc);
+                interactions += run_end - run_begin;
+                interactions += walk_cells(config, grid, my_position, grid->bin_root[b], &acc);
+
+                run_begin = run_end = grid->bin_pts_offsets[b + 1];
+            }
+
+            grid->interact(my_position, &grid->pts_soa, run_begin, run_end, &acc);
+            interactions += run_end - run_begin;
+        }
+    }
+
+    if (near != NULL)
+    {
+        acc.x += near->x;
+        acc.y += near->y;
+        acc.z += near->z;
+    }
+
+    *global_acc = nbody_narrow(acc);
+    return interactions;
+}
+
+int calculateForces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 const my_position,
+    int const x_bin,
+    int const y_bin,
+    int const z_bin,
+    cl_float4 * const global_acc
+    )
+{
+    return body_forces(config, grid, my_position, x_bin, y_bin, z_bin, NULL, global_acc);
+}
+
+//
+// Points of the flat bins in the z-run (x, y, z_lo .. z_hi - 1) as ranges of
+// bin_pts, split where a refined bin interrupts the run. Returns the number
+// of ranges written.
+//
+static int flat_runs (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    int const x,
+    int const y,
+    int const z_lo,
+    int const z_hi,
+    int (* const runs)[2]
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    int count = 0;
+
+    for (int z = z_lo; z < z_hi; ++z)
+    {
+        int const b = BIN_IDX(bins_per_dim, x, y, z);
+
+        if (grid->bin_root[b] >= 0)
+        {
+            continue;
+        }
+
+        if (count > 0 && runs[count - 1][1] == grid->bin_pts_offsets[b])
+        {
+            runs[count - 1][1] = grid->bin_pts_offsets[b + 1];
+        }
+        else
+        {
+            runs[count][0] = grid->bin_pts_offsets[b];
+            runs[count][1] = grid->bin_pts_offsets[b + 1];
+            count++;
+        }
+    }
+
+    return count;
+}
+
+//
+// Newton's third law pass of --symmetric: each pair of bodies in flat,
+// neighbouring bins is evaluated once, into grid->pair_acc for both. A flat
+// bin takes its own pairs (i, j > i) and those with the 13 neighbours that
+// come after it in x, y, z order: (x, y, z + 1), the z-run at (x, y + 1) and
+// the three z-runs at x + 1.
+//
+// A bin's pairs write to bodies up to one bin away in every direction, so
+// bins are processed in 27 colours, (x % 3, y % 3, z % 3): two bins of one
+// colour are at least three bins apart along some axis, their write sets are
+// disjoint, and a colour runs in parallel without atomics. The barrier at the
+// end of each colour orders it before the next.
+//
+static double calculate_grid_pairs (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    struct nbody_soa_acc pair_acc = grid->pair_acc;
+    double interactions = 0.0;
+
+    nbody_soa_acc_zero(&pair_acc, 0, config->points);
+
+    #pragma omp parallel num_threads(grid->num_threads) reduction(+: interactions)
+    {
+        for (int colour = 0; colour < 27; ++colour)
+        {
+            #pragma omp for collapse(3) schedule(dynamic, 1)
+            for (int x_bin = colour / 9; x_bin < bins_per_dim; x_bin += 3)
+            {
+                for (int y_bin = (colour / 3) % 3; y_bin < bins_per_dim; y_bin += 3)
+                {
+                    for (int z_bin = colour % 3; z_bin < bins_per_dim; z_bin += 3)
+                    {
+                        int const b = BIN_IDX(bins_per_dim, x_bin, y_bin, z_bin);
+                        int runs[1 + 4 * 3][2];
+                        int num_runs = 0;
+                        int const begin = grid->bin_pts_offsets[b];
+                        int const end = grid->bin_pts_offsets[b + 1];
+
+                        if (grid->bin_root[b] >= 0)
+                        {
+                            continue;
+                        }
+
+                        //
+                        // (x, y, z + 1) directly follows the bin in bin_pts
+                        //
+                        if (z_bin + 1 < bins_per_dim && grid->bin_root[b + 1] < 0)
+                        {
+                            runs[num_runs][0] = end;
+                            runs[num_runs][1] = grid->bin_pts_offsets[b + 2];
+                            num_runs++;
+                        }
+
+                        if (y_bin + 1 < bins_per_dim)
+                        {
+                            num_runs += flat_runs(config, grid, x_bin, y_bin + 1,
+                                                  MAX(0, z_bin - 1), MIN(bins_per_dim, z_bin + 2), &runs[num_runs]);
+                        }
+
+                        for (int y = MAX(0, y_bin - 1); x_bin + 1 < bins_per_dim && y < MIN(bins_per_dim, y_bin + 2); ++y)
+                        {
+                            num_runs += flat_runs(config, grid, x_bin + 1, y,
+                                                  MAX(0, z_bin - 1), MIN(bins_per_dim, z_bin + 2), &runs[num_runs]);
+                        }
+
+                        for (int i = begin; i < end; ++i)
+                        {
+                            grid->pair_interact(&grid->pts_soa, i, i + 1, end, &pair_acc);
+                            interactions += 2.0 * (end - i - 1);
+                        }
+
+                        //
+                        // Every body of the bin sees the same neighbour runs,
+                        // so they go through the blocked loop
+                        //
+                        for (int r = 0; r < num_runs; ++r)
+                        {
+                            grid->pair_block_interact(&grid->pts_soa, begin, end, runs[r][0], runs[r][1], &pair_acc);
+                            interactions += 2.0 * (end - begin) * (runs[r][1] - runs[r][0]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return interactions;
+}
+
+//
+// Forces on every body, one bin at a time. All bodies of a bin share the
+// same 27-bin neighbourhood, so a thread working on a bin keeps reusing the
+// same neighbour points from cache. With config->symmetric the flat
+// near-field pairs come from calculate_grid_pairs first and this pass adds
+// the far field and the refined bins.
+//
+double calculate_grid_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 * const global_a
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    int const num_bins = nbody_num_bins(config);
+    double interactions = 0.0;
+
+    if (config->symmetric)
+    {
+        interactions = calculate_grid_pairs(config, grid);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(grid->num_threads) reduction(+: interactions)
+    for (int k = 0; k < num_bins; ++k)
+    {
+        int const b = grid->bin_order[k];
+        int const x_bin = b / (bins_per_dim * bins_per_dim);
+        int const y_bin = (b / bins_per_dim) % bins_per_dim;
+        int const z_bin = b % bins_per_dim;
+
+        for (int i = grid->bin_pts_offsets[b]; i < grid->bin_pts_offsets[b + 1]; ++i)
+        {
+            cl_double4 near;
+
+            if (config->symmetric)
+            {
+                near = nbody_soa_acc_get(&grid->pair_acc, i);
+            }
+
+            interactions += body_forces(config, grid, grid->bin_pts[i], x_bin, y_bin, z_bin,
+                                        config->symmetric ? &near : NULL, &global_a[grid->bin_ids[i]]);
+        }
+    }
+
+    return interactions;
+}
+
+//
+// Forces on a contiguous run of the sorted bodies. The run covers whole bins
+// apart from its two ends, so neighbouring iterations still share their
+// neighbour points; chunks are kept small for balance since a run is a
+// fraction of the work.
+//
+void calculate_grid_forces_range (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    int const begin,
+    int const end,
+    cl_float4 * const sorted_a
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+
+    #pragma omp parallel for schedule(dynamic, 64) num_threads(grid->num_threads)
+    for (int i = begin; i < end; ++i)
+    {
+        int const b = grid->pt_bins[grid->bin_ids[i]];
+
+        calculateForces(config, grid, grid->bin_pts[i],
+                        b / (bins_per_dim * bins_per_dim), (b / bins_per_dim) % bins_per_dim, b % bins_per_dim,
+                        &sorted_a[i]);
+    }
+}
+
+//
+// Forces on the listed bodies only, for block timesteps. The list is in bin
+// order, so consecutive bodies still share their neighbour points; sources
+// are every body, active or not, at its current position.
+//
+double calculate_grid_forces_active (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    int const * const active,
+    int const count,
+    cl_float4 * const global_a
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    double interactions = 0.0;
+
+    #pragma omp parallel for schedule(dynamic, 64) num_threads(grid->num_threads) reduction(+: interactions)
+    for (int k = 0; k < count; ++k)
+    {
+        int const i = active[k];
+        int const b = grid->pt_bins[i];
+
+        interactions += calculateForces(config, grid, grid->bin_pts[grid->slot_of[i]],
+                                        b / (bins_per_dim * bins_per_dim), (b / bins_per_dim) % bins_per_dim, b % bins_per_dim,
+                                        &global_a[i]);
+    }
+
+    return interactions;
+}
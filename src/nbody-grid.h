@@ -0,0 +1,202 @@
+/* nbody simulation, binned CPU force engine */
+
+#ifndef NBODY_GRID_H
+#define NBODY_GRID_H
+
+#include <CL/cl.h>
+
+#include "nbody-common.h"
+#include "nbody-simd.h"
+
+//
+// Bins are stored linearized, x major, so the grid resolution can be
+// picked at runtime.
+//
+#define BIN_IDX(bins_per_dim, x, y, z) \
+    (((x) * (bins_per_dim) + (y)) * (bins_per_dim) + (z))
+
+//
+// Sub-cell of a refined bin. A bin holding more than config->max_bin_pts
+// bodies is split into an octree whose cells are stored flattened in
+// depth-first order: a cell's first child directly follows it and next is
+// the index just past its subtree. Each cell's bodies are contiguous in
+// bin_pts.
+//
+struct nbody_cell
+{
+    cl_float4 cm;               // centre of mass of the cell's bodies, their mass in .w
+    float size;                 // edge length of the cell's cube
+    int first;                  // first body of the cell in bin_pts
+    int count;                  // number of bodies, from first
+    int next;                   // index of the cell after this subtree
+    int leaf;                   // bodies are interacted with directly
+};
+
+//
+// Binned copy of the bodies. Every array is sized once and reused, apart
+// from the cells, which grow with the clustering.
+//
+struct nbody_grid
+{
+    cl_float4 * cm;             // per-bin centre of mass, total mass in .w
+    int * bin_pts_offsets;      // num_bins + 1 offsets of each bin's points in bin_pts
+    cl_float4 * bin_pts;        // points sorted by bin
+    int * bin_ids;              // original index of each point in bin_pts
+    int * pt_bins;              // bin of each original point
+    int * thread_offsets;       // num_bins x num_threads histogram, then scatter cursors
+    int * bin_order;            // bins sorted by estimated force cost, largest first
+    long * bin_cost;
+    struct nbody_soa cm_soa;    // SoA copies of cm and bin_pts for the vector loops
+    struct nbody_soa pts_soa;
+    nbody_interaction_fn interact;
+    nbody_pair_fn pair_interact;
+    nbody_pair_block_fn pair_block_interact;
+    struct nbody_soa_acc pair_acc;  // --symmetric near-field sums, by bin_pts index
+    int num_threads;
+    cl_float4 origin;           // low corner of the grid
+    float bin_length;
+    int * bin_root;             // root cell of every refined bin, -1 for flat bins
+    struct nbody_cell * cells;
+    int num_cells;
+    int cells_capacity;
+    cl_float4 * scratch_pts;    // octant sort of refined bins, update_bin_pts compaction
+    int * scratch_ids;
+    int binned_points;          // bodies of the last binning, 0 before the first
+    cl_float4 binned_origin;    // grid placement of the last binning
+    float binned_length;
+    int * slot_of;              // index in bin_pts of each original point
+    int * departures;           // update_bin_pts per-bin scratch, num_bins + 1 each
+    int * arrival_offsets;
+    int * new_offsets;
+    int * migrants;             // bodies that changed bin, in body order
+    int * arrivals;             // their old bins, then the same bodies by new bin
+    int * migrant_counts;       // per thread
+};
+
+//
+// Allocate the grid for config->points bodies. Returns 0 when out of memory.
+//
+int construct_grid (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    );
+
+void destroy_grid (
+    struct nbody_grid * const grid
+    );
+
+//
+// Place the grid over the bodies: [0, space)^3 when they are all inside it,
+// else the smallest cube that holds both that box and every body. Engines
+// that do not call this keep [0, space)^3 and clamp strays into the edge
+// bins.
+//
+void fit_grid (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    );
+
+//
+// Sort the points into bin order (bin_pts, bin_ids, bin_pts_offsets)
+//
+void construct_bin_pts (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    );
+
+//
+// construct_bin_pts and construct_bins_cm for bodies that have moved since
+// the last binning. Bodies that stayed in their bin are updated in place
+// and only those that crossed a bin boundary are re-sorted; when more than
+// config->rebin_threshold of them did, or the grid was placed differently,
+// the bins are rebuilt from scratch instead. Returns 1 if the bins were
+// patched, 0 if they were rebuilt.
+//
+int update_bin_pts (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const global_p,
+    int const points
+    );
+
+//
+// Per-bin centres of mass from the sorted points
+//
+void construct_bins_cm (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    );
+
+//
+// Split every bin holding more than config->max_bin_pts bodies into an
+// octree of cells with at most config->leaf_size bodies per leaf. Reorders
+// those bins' bodies in bin_pts. Needs the centres of mass.
+//
+void refine_bins (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    );
+
+//
+// Order the bins for calculate_grid_forces, most expensive first
+//
+void schedule_bins (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid
+    );
+
+//
+// Acceleration on my_position, which lies in bin (x_bin, y_bin, z_bin).
+// Returns the number of interactions evaluated.
+//
+int calculateForces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 const my_position,
+    int const x_bin,
+    int const y_bin,
+    int const z_bin,
+    cl_float4 * const global_acc
+    );
+
+//
+// Accelerations of all bodies into global_a, in their original order. With
+// config->symmetric the pairs between flat neighbouring bins are evaluated
+// once for both bodies, each counting as two interactions.
+// Returns the number of interactions evaluated.
+//
+double calculate_grid_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    cl_float4 * const global_a
+    );
+
+//
+// Accelerations of the count bodies listed in active (original indices,
+// best in bin order) into global_a. Returns the number of interactions.
+//
+double calculate_grid_forces_active (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    int const * const active,
+    int const count,
+    cl_float4 * const global_a
+    );
+
+//
+// Accelerations of the sorted bodies bin_pts[begin, end) into
+// sorted_a[begin, end), for engines that split the sorted range
+//
+void calculate_grid_forces_range (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    int const begin,
+    int const end,
+    cl_float4 * const sorted_a
+    );
+
+#endif
@@ -0,0 +1,414 @@
+/* nbody simulation, initial conditions */
+
+#include "nbody-ic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define PI (3.14159265358979f)
+
+//
+// Plummer spheres are cut off where they enclose this fraction of their
+// mass, about 12 scale radii, since the radius diverges as the enclosed
+// mass goes to 1. That still reaches past the domain: with the 0.1 L scale
+// radius of --ic plummer the outer bodies lie up to 0.7 L outside [0, L),
+// and the grid engines clamp them into the boundary bins.
+//
+#define PLUMMER_MASS_CUTOFF (0.99f)
+
+//
+// Generated sets are built in chunks of IC_CHUNK bodies, each drawing from
+// its own random stream seeded by the member and the chunk's index, so any
+// range of bodies comes out the same without building the bodies before
+// it. nbody_ic_read builds just the range it copies; a rank of nbody-mpi
+// never holds more than its share of the set.
+//
+#define IC_CHUNK (4096)
+
+struct ic_stream
+{
+    uint64_t state;
+    cl_float4 center;       // clump of the chunk for --ic clumps
+};
+
+//
+// splitmix64
+//
+static uint64_t next_random (
+    uint64_t * const state
+    )
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+//
+// Uniform in (0, 1), never exactly 0 or 1
+//
+static float uniform (
+    struct ic_stream * const stream
+    )
+{
+    return ((float) (next_random(&stream->state) >> 41) + 0.5f) / 8388608.0f;
+}
+
+//
+// Standard normal by Box-Muller
+//
+static float gaussian (
+    struct ic_stream * const stream
+    )
+{
+    float const r = sqrtf(-2.0f * logf(uniform(stream)));
+
+    return r * cosf(2.0f * PI * uniform(stream));
+}
+
+//
+// Vector of length r in a uniformly random direction
+//
+static cl_float4 isotropic (
+    struct ic_stream * const stream,
+    float const r
+    )
+{
+    float z = 2.0f * uniform(stream) - 1.0f;
+    float phi = 2.0f * PI * uniform(stream);
+    float s = sqrtf(1.0f - z * z);
+    cl_float4 out;
+
+    out.x = r * s * cosf(phi);
+    out.y = r * s * sinf(phi);
+    out.z = r * z;
+    out.w = 0.0f;
+
+    return out;
+}
+
+//
+// One unit-mass body of a Plummer sphere of count bodies with scale radius
+// a, in virial equilibrium, centred on center and moving with bulk velocity
+// bulk. The radius comes from inverting the cumulative mass profile, the
+// speed from rejection sampling the isotropic distribution function
+// (Aarseth, Henon and Wielen 1974).
+//
+static void plummer (
+    struct ic_stream * const stream,
+    int const count,
+    float const a,
+    cl_float4 const center,
+    cl_float4 const bulk,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    float const v_scale = sqrtf((float) count / a);
+    float m;
+    float r;
+    float q;
+    float g;
+    cl_float4 pos;
+    cl_float4 vel;
+
+    do
+    {
+        m = uniform(stream);
+    } while (m > PLUMMER_MASS_CUTOFF);
+
+    r = 1.0f / sqrtf(powf(m, -2.0f / 3.0f) - 1.0f);
+
+    //
+    // q = v / v_escape has density q^2 (1 - q^2)^(7/2), at most 0.1
+    //
+    do
+    {
+        q = uniform(stream);
+        g = 0.1f * uniform(stream);
+    } while (g > q * q * powf(1.0f - q * q, 3.5f));
+
+    pos = isotropic(stream, a * r);
+    vel = isotropic(stream, q * sqrtf(2.0f) * powf(1.0f + r * r, -0.25f) * v_scale);
+
+    p->x = center.x + pos.x;
+    p->y = center.y + pos.y;
+    p->z = center.z + pos.z;
+    p->w = 1.0f;
+
+    v->x = bulk.x + vel.x;
+    v->y = bulk.y + vel.y;
+    v->z = bulk.z + vel.z;
+    v->w = 0.0f;
+}
+
+//
+// --ic plummer: one sphere of scale radius 0.1 L in the middle of the
+// domain
+//
+static void generate_plummer (
+    struct nbody_ic const * const ic,
+    struct ic_stream * const stream,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    float const h = 0.5f * ic->space;
+    cl_float4 const center = {{h, h, h, 0.0f}};
+    cl_float4 const rest = {{0.0f, 0.0f, 0.0f, 0.0f}};
+
+    plummer(stream, ic->points, 0.1f * ic->space, center, rest, p, v);
+}
+
+//
+// --ic galaxies: two Plummer spheres half the domain apart on a parabolic
+// orbit, offset by a tenth of the domain so they collide off-centre. The
+// first half of the bodies make up the first sphere.
+//
+static void generate_galaxies (
+    struct nbody_ic const * const ic,
+    struct ic_stream * const stream,
+    int const i,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    float const s = ic->space;
+    int const first = ic->points / 2;
+    int const second = ic->points - first;
+    float const speed = 0.5f * sqrtf(2.0f * ic->points / (0.5f * s));
+    cl_float4 const center_a = {{0.25f * s, 0.45f * s, 0.5f * s, 0.0f}};
+    cl_float4 const center_b = {{0.75f * s, 0.55f * s, 0.5f * s, 0.0f}};
+    cl_float4 const bulk_a = {{speed, 0.0f, 0.0f, 0.0f}};
+    cl_float4 const bulk_b = {{-speed, 0.0f, 0.0f, 0.0f}};
+
+    if (i < first)
+    {
+        plummer(stream, first, 0.05f * s, center_a, bulk_a, p, v);
+    }
+    else
+    {
+        plummer(stream, second, 0.05f * s, center_b, bulk_b, p, v);
+    }
+}
+
+//
+// --ic clumps: Gaussian clumps at rest around random centres, one clump per
+// chunk
+//
+static void generate_clumps (
+    struct nbody_ic const * const ic,
+    struct ic_stream * const stream,
+    int const i,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    float const sigma = 0.02f * ic->space;
+
+    if (i % IC_CHUNK == 0)
+    {
+        stream->center.x = (0.1f + 0.8f * uniform(stream)) * ic->space;
+        stream->center.y = (0.1f + 0.8f * uniform(stream)) * ic->space;
+        stream->center.z = (0.1f + 0.8f * uniform(stream)) * ic->space;
+    }
+
+    p->x = stream->center.x + sigma * gaussian(stream);
+    p->y = stream->center.y + sigma * gaussian(stream);
+    p->z = stream->center.z + sigma * gaussian(stream);
+    p->w = 1.0f;
+
+    *v = (cl_float4) {{0.0f, 0.0f, 0.0f, 0.0f}};
+}
+
+//
+// --ic uniform: unit masses at rest, uniform in [0, L)^3
+//
+static void generate_uniform (
+    struct nbody_ic const * const ic,
+    struct ic_stream * const stream,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    p->x = uniform(stream) * ic->space;
+    p->y = uniform(stream) * ic->space;
+    p->z = uniform(stream) * ic->space;
+    p->w = 1.0f;
+
+    *v = (cl_float4) {{0.0f, 0.0f, 0.0f, 0.0f}};
+}
+
+//
+// Build bodies [begin, begin + count) into p and v, either of which may be
+// NULL. The chunks holding the range are built from their start, and the
+// bodies before begin thrown away.
+//
+static void generate (
+    struct nbody_ic const * const ic,
+    int const begin,
+    int const count,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    for (int chunk = begin / IC_CHUNK; chunk * (long) IC_CHUNK < (long) begin + count; ++chunk)
+    {
+        int const first = chunk * IC_CHUNK;
+        int const last = (first + IC_CHUNK < begin + count) ? first + IC_CHUNK : begin + count;
+        uint64_t seed = ((uint64_t) (42 + ic->member) << 32) ^ (uint64_t) chunk;
+        struct ic_stream stream;
+
+        memset(&stream, 0, sizeof(stream));
+        stream.state = next_random(&seed);
+
+        for (int i = first; i < last; ++i)
+        {
+            cl_float4 body_p;
+            cl_float4 body_v;
+
+            switch (ic->generator)
+            {
+            case NBODY_IC_PLUMMER:
+                generate_plummer(ic, &stream, &body_p, &body_v);
+                break;
+            case NBODY_IC_GALAXIES:
+                generate_galaxies(ic, &stream, i, &body_p, &body_v);
+                break;
+            case NBODY_IC_CLUMPS:
+                generate_clumps(ic, &stream, i, &body_p, &body_v);
+                break;
+            default:
+                generate_uniform(ic, &stream, &body_p, &body_v);
+                break;
+            }
+
+            if (i >= begin)
+            {
+                if (p)
+                {
+                    p[i - begin] = body_p;
+                }
+
+                if (v)
+                {
+                    v[i - begin] = body_v;
+                }
+            }
+        }
+    }
+}
+
+int nbody_ic_open (
+    struct nbody_config * const config,
+    struct nbody_ic * const ic
+    )
+{
+    return nbody_ic_open_member(config, ic, 0);
+}
+
+int nbody_ic_open_member (
+    struct nbody_config * const config,
+    struct nbody_ic * const ic,
+    int const member
+    )
+{
+    memset(ic, 0, sizeof(*ic));
+
+    if (config->input_path != NULL)
+    {
+        if (nbody_snapshot_map(config->input_path, member, &ic->snapshot) != 0
+            || ic->snapshot.header.points == 0 || ic->snapshot.header.points > 0x7fffffff)
+        {
+            nbody_snapshot_unmap(&ic->snapshot);
+            return -1;
+        }
+
+        ic->points = (int) ic->snapshot.header.points;
+        config->points = ic->points;
+        return 0;
+    }
+
+    //
+    // Nothing is built yet; deterministic, with different streams for
+    // every member
+    //
+    ic->points = config->points;
+    ic->generator = config->ic;
+    ic->space = config->space;
+    ic->member = member;
+
+    return 0;
+}
+
+void nbody_ic_read (
+    struct nbody_ic const * const ic,
+    int const begin,
+    int const count,
+    cl_float4 * const p,
+    cl_float4 * const v
+    )
+{
+    struct nbody_snapshot const * const s = &ic->snapshot;
+
+    if (s->map == NULL)
+    {
+        generate(ic, begin, count, p, v);
+        return;
+    }
+
+    for (int i = 0; p && i < count; ++i)
+    {
+        p[i].x = s->x[begin + i];
+        p[i].y = s->y[begin + i];
+        p[i].z = s->z[begin + i];
+        p[i].w = s->w[begin + i];
+    }
+
+    for (int i = 0; v && i < count; ++i)
+    {
+        v[i].x = s->vx ? s->vx[begin + i] : 0.0f;
+        v[i].y = s->vy ? s->vy[begin + i] : 0.0f;
+        v[i].z = s->vz ? s->vz[begin + i] : 0.0f;
+        v[i].w = 0.0f;
+    }
+}
+
+cl_float4 * nbody_ic_positions (
+    struct nbody_ic const * const ic
+    )
+{
+    cl_float4 * p = (cl_float4 *) malloc(sizeof(cl_float4) * ic->points);
+
+    if (p)
+    {
+        nbody_ic_read(ic, 0, ic->points, p, NULL);
+    }
+
+    return p;
+}
+
+cl_float4 * nbody_ic_velocities (
+    struct nbody_ic const * const ic
+    )
+{
+    cl_float4 * v = (cl_float4 *) malloc(sizeof(cl_float4) * ic->points);
+
+    if (v)
+    {
+        nbody_ic_read(ic, 0, ic->points, NULL, v);
+    }
+
+    return v;
+}
+
+void nbody_ic_close (
+    struct nbody_ic * const ic
+    )
+{
+    nbody_snapshot_unmap(&ic->snapshot);
+}
@@ -0,0 +1,76 @@
+/* nbody simulation, initial conditions */
+
+#ifndef NBODY_IC_H
+#define NBODY_IC_H
+
+#include <CL/cl.h>
+
+#include "nbody-common.h"
+#include "nbody-snapshot.h"
+
+//
+// Where the bodies of a run come from: the first record of the snapshot
+// file config->input_path if one was given, else the generator config->ic.
+// Neither is held in memory whole: file sets stay memory-mapped and are
+// transposed from the file's SoA arrays range by range on reading, and
+// generated sets are built range by range on reading.
+//
+struct nbody_ic
+{
+    int points;
+    int generator;                      // config->ic, when not reading a file
+    float space;
+    int member;
+    struct nbody_snapshot snapshot;     // mapped input file
+};
+
+//
+// Open the initial conditions of config. A file input sets config->points
+// to the number of bodies in the file. Returns 0 on success.
+//
+int nbody_ic_open (
+    struct nbody_config * const config,
+    struct nbody_ic * const ic
+    );
+
+//
+// nbody_ic_open for member member of an ensemble (--ensemble): record
+// member of the input file, or the generator seeded differently for every
+// member. Member 0 is what nbody_ic_open gives.
+//
+int nbody_ic_open_member (
+    struct nbody_config * const config,
+    struct nbody_ic * const ic,
+    int const member
+    );
+
+//
+// Copy bodies [begin, begin + count) into p and v. Either may be NULL; files
+// without velocities read as bodies at rest. A range of a generated set is
+// the same whether it is read alone or as part of a larger one.
+//
+void nbody_ic_read (
+    struct nbody_ic const * const ic,
+    int const begin,
+    int const count,
+    cl_float4 * const p,
+    cl_float4 * const v
+    );
+
+//
+// Newly allocated copies of all positions or all velocities, NULL when out
+// of memory.
+//
+cl_float4 * nbody_ic_positions (
+    struct nbody_ic const * const ic
+    );
+
+cl_float4 * nbody_ic_velocities (
+    struct nbody_ic const * const ic
+    );
+
+void nbody_ic_close (
+    struct nbody_ic * const ic
+    );
+
+#endif
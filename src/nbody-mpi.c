@@ -0,0 +1,940 @@
+/* nbody simulation, grid engine distributed over MPI ranks in slabs of bins */
+
+#include <mpi.h>
+#include <CL/cl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "nbody-common.h"
+#include "nbody-grid.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//
+// A body on its way between ranks. The id is the body's index in the
+// initial conditions; output is put back in that order.
+//
+struct mpi_body
+{
+    cl_float4 x;
+    cl_float4 v;
+    cl_float4 a;
+    int id;
+    int pad[3];
+};
+
+//
+// One rank's part of the run. Rank r owns a slab of consecutive x planes
+// of bins and every body in them. Bins are linearized x major, so the
+// slab's bins, and their bodies once sorted, are one contiguous range. The
+// halo is the two planes either side of the slab, which the 27-bin
+// neighbourhoods of the slab's bodies reach into; it is received afresh
+// before every force pass.
+//
+struct mpi_domain
+{
+    int rank;
+    int ranks;
+    int plane_begin;            // owned x planes [plane_begin, plane_end)
+    int plane_end;
+    int * plane_owner;          // rank owning each x plane
+    int count;                  // owned bodies
+    int capacity;
+    cl_float4 * x;
+    cl_float4 * v;
+    cl_float4 * a;
+    int * id;
+    int pts_count;              // owned bodies plus halo
+    int pts_capacity;
+    cl_float4 * pts;            // owned positions, then the halo's
+    cl_float4 * sorted_a;
+    double * cm_sums;           // per bin: sum of m*x, m*y, m*z and the mass
+    struct nbody_grid grid;     // sized for pts_capacity bodies
+    MPI_Datatype body_type;
+    MPI_Offset output_end;      // bytes of snapshot file written so far
+};
+
+static inline int plane_of (
+    struct nbody_config const * const config,
+    float const pos
+    )
+{
+    int plane = (int) (pos / config->bin_length);
+
+    return MIN(MAX(plane, 0), config->bins_per_dim - 1);
+}
+
+//
+// First initial index of rank r's share of the bodies: rank r starts with
+// the bodies [share_begin(r), share_begin(r + 1)) and writes them out
+//
+static inline int share_begin (
+    int const points,
+    int const ranks,
+    int const r
+    )
+{
+    return (int) ((long) points * r / ranks);
+}
+
+//
+// Rank whose share holds initial index id
+//
+static int share_owner (
+    int const points,
+    int const ranks,
+    int const id
+    )
+{
+    int r = (int) ((long) id * ranks / points);
+
+    while (r + 1 < ranks && share_begin(points, ranks, r + 1) <= id)
+    {
+        r++;
+    }
+
+    while (share_begin(points, ranks, r) > id)
+    {
+        r--;
+    }
+
+    return r;
+}
+
+static void out_of_memory (
+    void
+    )
+{
+    fprintf(stderr, "out of memory\n");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+//
+// Make room for count owned bodies
+//
+static void reserve_bodies (
+    struct mpi_domain * const dom,
+    int const count
+    )
+{
+    if (count <= dom->capacity)
+    {
+        return;
+    }
+
+    dom->capacity = MAX(count, dom->capacity + dom->capacity / 2);
+    dom->x = (cl_float4 *) realloc(dom->x, sizeof(cl_float4) * dom->capacity);
+    dom->v = (cl_float4 *) realloc(dom->v, sizeof(cl_float4) * dom->capacity);
+    dom->a = (cl_float4 *) realloc(dom->a, sizeof(cl_float4) * dom->capacity);
+    dom->id = (int *) realloc(dom->id, sizeof(int) * dom->capacity);
+
+    if (dom->x == NULL || dom->v == NULL || dom->a == NULL || dom->id == NULL)
+    {
+        out_of_memory();
+    }
+}
+
+//
+// Make room for count owned and halo bodies in the grid. The grid is
+// rebuilt at the new size, which only happens while the populations settle.
+//
+static void reserve_pts (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    int const count
+    )
+{
+    struct nbody_config grid_config = *config;
+
+    if (count <= dom->pts_capacity)
+    {
+        return;
+    }
+
+    if (dom->pts_capacity > 0)
+    {
+        destroy_grid(&dom->grid);
+    }
+
+    dom->pts_capacity = MAX(count, dom->pts_capacity + dom->pts_capacity / 2);
+    dom->pts = (cl_float4 *) realloc(dom->pts, sizeof(cl_float4) * dom->pts_capacity);
+    dom->sorted_a = (cl_float4 *) realloc(dom->sorted_a, sizeof(cl_float4) * dom->pts_capacity);
+    grid_config.points = dom->pts_capacity;
+
+    if (dom->pts == NULL || dom->sorted_a == NULL || !construct_grid(&grid_config, &dom->grid))
+    {
+        out_of_memory();
+    }
+}
+
+//
+// Split the x planes as evenly as possible; every rank gets at least one
+// since there are no more ranks than planes
+//
+static void init_domain (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+
+    memset(dom, 0, sizeof(*dom));
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &dom->rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &dom->ranks);
+
+    dom->plane_owner = (int *) malloc(sizeof(int) * bins_per_dim);
+    dom->cm_sums = (double *) malloc(sizeof(double) * 4 * nbody_num_bins(config));
+
+    if (dom->plane_owner == NULL || dom->cm_sums == NULL)
+    {
+        out_of_memory();
+    }
+
+    for (int r = 0; r < dom->ranks; ++r)
+    {
+        int const begin = (int) ((long) bins_per_dim * r / dom->ranks);
+        int const end = (int) ((long) bins_per_dim * (r + 1) / dom->ranks);
+
+        for (int plane = begin; plane < end; ++plane)
+        {
+            dom->plane_owner[plane] = r;
+        }
+
+        if (r == dom->rank)
+        {
+            dom->plane_begin = begin;
+            dom->plane_end = end;
+        }
+    }
+
+    MPI_Type_contiguous(sizeof(struct mpi_body), MPI_BYTE, &dom->body_type);
+    MPI_Type_commit(&dom->body_type);
+}
+
+static void destroy_domain (
+    struct mpi_domain * const dom
+    )
+{
+    MPI_Type_free(&dom->body_type);
+
+    if (dom->pts_capacity > 0)
+    {
+        destroy_grid(&dom->grid);
+    }
+
+    free(dom->sorted_a);
+    free(dom->pts);
+    free(dom->id);
+    free(dom->a);
+    free(dom->v);
+    free(dom->x);
+    free(dom->cm_sums);
+    free(dom->plane_owner);
+}
+
+//
+// Each rank starts with its share of the initial conditions by index,
+// wherever those bodies are; the first migration sorts them out. A file is
+// read straight from its mapping and a generator builds only the bodies it
+// is asked for, so no rank holds more than its share.
+//
+static int load_initial_conditions (
+    struct nbody_config * const config,
+    struct mpi_domain * const dom
+    )
+{
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(config, &ic) != 0)
+    {
+        return -1;
+    }
+
+    int const begin = share_begin(config->points, dom->ranks, dom->rank);
+    int const end = share_begin(config->points, dom->ranks, dom->rank + 1);
+
+    reserve_bodies(dom, end - begin);
+    nbody_ic_read(&ic, begin, end - begin, dom->x, dom->v);
+    nbody_ic_close(&ic);
+
+    for (int i = 0; i < end - begin; ++i)
+    {
+        dom->a[i] = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
+        dom->id[i] = begin + i;
+    }
+
+    dom->count = end - begin;
+    return 0;
+}
+
+//
+// Send every body that has left the slab to the rank owning its plane.
+// Bodies that stay are compacted in place; arrivals are appended.
+//
+static void migrate_bodies (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom
+    )
+{
+    int const ranks = dom->ranks;
+    int * const send_counts = (int *) calloc(ranks, sizeof(int));
+    int * const send_offsets = (int *) malloc(sizeof(int) * ranks);
+    int * const recv_counts = (int *) malloc(sizeof(int) * ranks);
+    int * const recv_offsets = (int *) malloc(sizeof(int) * ranks);
+    int * const dest = (int *) malloc(sizeof(int) * MAX(dom->count, 1));
+    int leaving = 0;
+    int arriving = 0;
+    int kept = 0;
+
+    if (send_counts == NULL || send_offsets == NULL || recv_counts == NULL || recv_offsets == NULL || dest == NULL)
+    {
+        out_of_memory();
+    }
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        dest[i] = dom->plane_owner[plane_of(config, dom->x[i].x)];
+
+        if (dest[i] != dom->rank)
+        {
+            send_counts[dest[i]]++;
+            leaving++;
+        }
+    }
+
+    for (int r = 0, offset = 0; r < ranks; ++r)
+    {
+        send_offsets[r] = offset;
+        offset += send_counts[r];
+    }
+
+    struct mpi_body * const send = (struct mpi_body *) malloc(sizeof(struct mpi_body) * MAX(leaving, 1));
+
+    if (send == NULL)
+    {
+        out_of_memory();
+    }
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        if (dest[i] == dom->rank)
+        {
+            dom->x[kept] = dom->x[i];
+            dom->v[kept] = dom->v[i];
+            dom->a[kept] = dom->a[i];
+            dom->id[kept] = dom->id[i];
+            kept++;
+        }
+        else
+        {
+            struct mpi_body * const body = &send[send_offsets[dest[i]]++];
+
+            body->x = dom->x[i];
+            body->v = dom->v[i];
+            body->a = dom->a[i];
+            body->id = dom->id[i];
+        }
+    }
+
+    for (int r = 0; r < ranks; ++r)
+    {
+        send_offsets[r] -= send_counts[r];
+    }
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (int r = 0; r < ranks; ++r)
+    {
+        recv_offsets[r] = arriving;
+        arriving += recv_counts[r];
+    }
+
+    struct mpi_body * const recv = (struct mpi_body *) malloc(sizeof(struct mpi_body) * MAX(arriving, 1));
+
+    if (recv == NULL)
+    {
+        out_of_memory();
+    }
+
+    MPI_Alltoallv(send, send_counts, send_offsets, dom->body_type,
+                  recv, recv_counts, recv_offsets, dom->body_type, MPI_COMM_WORLD);
+
+    reserve_bodies(dom, kept + arriving);
+
+    for (int i = 0; i < arriving; ++i)
+    {
+        dom->x[kept + i] = recv[i].x;
+        dom->v[kept + i] = recv[i].v;
+        dom->a[kept + i] = recv[i].a;
+        dom->id[kept + i] = recv[i].id;
+    }
+
+    dom->count = kept + arriving;
+
+    free(recv);
+    free(send);
+    free(dest);
+    free(recv_offsets);
+    free(recv_counts);
+    free(send_offsets);
+    free(send_counts);
+}
+
+//
+// Send the positions in the slab's first plane to the rank on the left and
+// those in its last plane to the rank on the right, receiving theirs in
+// return. pts ends up holding the owned positions followed by the halo.
+//
+static void exchange_halo (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom
+    )
+{
+    int const left = dom->rank > 0 ? dom->rank - 1 : MPI_PROC_NULL;
+    int const right = dom->rank < dom->ranks - 1 ? dom->rank + 1 : MPI_PROC_NULL;
+    int send_left = 0;
+    int send_right = 0;
+    int recv_left = 0;
+    int recv_right = 0;
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        int const plane = plane_of(config, dom->x[i].x);
+
+        send_left += plane == dom->plane_begin;
+        send_right += plane == dom->plane_end - 1;
+    }
+
+    MPI_Sendrecv(&send_left, 1, MPI_INT, left, 0, &recv_right, 1, MPI_INT, right, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&send_right, 1, MPI_INT, right, 1, &recv_left, 1, MPI_INT, left, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    //
+    // Outgoing planes are staged past the halo, so the whole exchange
+    // happens inside pts
+    //
+    reserve_pts(config, dom, dom->count + recv_left + recv_right + send_left + send_right);
+
+    cl_float4 * const halo_left = &dom->pts[dom->count];
+    cl_float4 * const halo_right = halo_left + recv_left;
+    cl_float4 * const out_left = halo_right + recv_right;
+    cl_float4 * const out_right = out_left + send_left;
+    int n_left = 0;
+    int n_right = 0;
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        int const plane = plane_of(config, dom->x[i].x);
+
+        dom->pts[i] = dom->x[i];
+
+        if (plane == dom->plane_begin)
+        {
+            out_left[n_left++] = dom->x[i];
+        }
+
+        if (plane == dom->plane_end - 1)
+        {
+            out_right[n_right++] = dom->x[i];
+        }
+    }
+
+    MPI_Sendrecv(out_left, 4 * send_left, MPI_FLOAT, left, 2,
+                 halo_right, 4 * recv_right, MPI_FLOAT, right, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(out_right, 4 * send_right, MPI_FLOAT, right, 3,
+                 halo_left, 4 * recv_left, MPI_FLOAT, left, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    dom->pts_count = dom->count + recv_left + recv_right;
+}
+
+//
+// Global centres of mass: every rank sums the bins of its slab, which hold
+// only its own bodies, and an allreduce adds the slabs together. The
+// mass-weighted sums are divided by the total mass, which goes in .w; they
+// are in double so the result does not depend much on the number of ranks.
+//
+static void reduce_bins_cm (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+    int const plane_bins = config->bins_per_dim * config->bins_per_dim;
+    struct nbody_grid * const grid = &dom->grid;
+
+    memset(dom->cm_sums, 0, sizeof(double) * 4 * num_bins);
+
+    #pragma omp parallel for schedule(static)
+    for (int b = dom->plane_begin * plane_bins; b < dom->plane_end * plane_bins; ++b)
+    {
+        double * const sum = &dom->cm_sums[4 * b];
+
+        for (int i = grid->bin_pts_offsets[b]; i < grid->bin_pts_offsets[b + 1]; ++i)
+        {
+            double const m = grid->bin_pts[i].w;
+
+            sum[0] += m * grid->bin_pts[i].x;
+            sum[1] += m * grid->bin_pts[i].y;
+            sum[2] += m * grid->bin_pts[i].z;
+            sum[3] += m;
+        }
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, dom->cm_sums, 4 * num_bins, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < num_bins; ++b)
+    {
+        double const * const sum = &dom->cm_sums[4 * b];
+        cl_float4 val = (cl_float4) {0.0f, 0.0f, 0.0f, (float) sum[3]};
+
+        if (sum[3] > 0.0)
+        {
+            val.x = (float) (sum[0] / sum[3]);
+            val.y = (float) (sum[1] / sum[3]);
+            val.z = (float) (sum[2] / sum[3]);
+        }
+
+        grid->cm[b] = val;
+        nbody_soa_set(&grid->cm_soa, b, val);
+    }
+}
+
+//
+// Accelerations of the owned bodies. The slab's sorted bodies are all owned,
+// so their accelerations scatter straight back through bin_ids.
+//
+static void calculate_forces (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    struct nbody_timing * const timing
+    )
+{
+    int const plane_bins = config->bins_per_dim * config->bins_per_dim;
+    struct nbody_grid * const grid = &dom->grid;
+    double t = nbody_now();
+
+    exchange_halo(config, dom);
+
+    timing->phase[NBODY_PHASE_EXCHANGE] += nbody_now() - t;
+    t = nbody_now();
+
+    construct_bin_pts(config, grid, dom->pts, dom->pts_count);
+
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+    t = nbody_now();
+
+    reduce_bins_cm(config, dom);
+
+    timing->phase[NBODY_PHASE_EXCHANGE] += nbody_now() - t;
+    t = nbody_now();
+
+    //
+    // Every bin a slab body can see holds all of its bodies on this rank,
+    // halo bins included, so overfull bins are refined locally
+    //
+    refine_bins(config, grid);
+
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+    t = nbody_now();
+
+    int const begin = grid->bin_pts_offsets[dom->plane_begin * plane_bins];
+    int const end = grid->bin_pts_offsets[dom->plane_end * plane_bins];
+
+    calculate_grid_forces_range(config, grid, begin, end, dom->sorted_a);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = begin; i < end; ++i)
+    {
+        dom->a[grid->bin_ids[i]] = dom->sorted_a[i];
+    }
+
+    timing->phase[NBODY_PHASE_FORCES] += nbody_now() - t;
+
+    //
+    // Bin populations for the interaction count: every rank knows those of
+    // its own slab, and rank 0 adds them up
+    //
+    if (config->timing_path != NULL)
+    {
+        int const num_bins = nbody_num_bins(config);
+        int * counts = (int *) calloc(num_bins, sizeof(int));
+
+        if (counts == NULL)
+        {
+            out_of_memory();
+        }
+
+        for (int b = dom->plane_begin * plane_bins; b < dom->plane_end * plane_bins; ++b)
+        {
+            counts[b] = grid->bin_pts_offsets[b + 1] - grid->bin_pts_offsets[b];
+        }
+
+        MPI_Reduce(dom->rank == 0 ? MPI_IN_PLACE : counts, counts, num_bins, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+        if (dom->rank == 0)
+        {
+            timing->interactions += nbody_grid_interactions(config, counts);
+        }
+
+        free(counts);
+    }
+}
+
+//
+// Send every body to the rank whose share holds its initial index. Returns
+// the rank's share in initial order, the count bodies from begin on.
+//
+static struct mpi_body * collect_share (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    int const begin,
+    int const count
+    )
+{
+    int const ranks = dom->ranks;
+    int * const send_counts = (int *) calloc(ranks, sizeof(int));
+    int * const send_offsets = (int *) malloc(sizeof(int) * ranks);
+    int * const recv_counts = (int *) malloc(sizeof(int) * ranks);
+    int * const recv_offsets = (int *) malloc(sizeof(int) * ranks);
+    int * const dest = (int *) malloc(sizeof(int) * MAX(dom->count, 1));
+    struct mpi_body * const send = (struct mpi_body *) malloc(sizeof(struct mpi_body) * MAX(dom->count, 1));
+    struct mpi_body * const recv = (struct mpi_body *) malloc(sizeof(struct mpi_body) * MAX(count, 1));
+    struct mpi_body * const share = (struct mpi_body *) malloc(sizeof(struct mpi_body) * MAX(count, 1));
+
+    if (send_counts == NULL || send_offsets == NULL || recv_counts == NULL || recv_offsets == NULL || dest == NULL
+        || send == NULL || recv == NULL || share == NULL)
+    {
+        out_of_memory();
+    }
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        dest[i] = share_owner(config->points, ranks, dom->id[i]);
+        send_counts[dest[i]]++;
+    }
+
+    for (int r = 0, offset = 0; r < ranks; ++r)
+    {
+        send_offsets[r] = offset;
+        offset += send_counts[r];
+    }
+
+    for (int i = 0; i < dom->count; ++i)
+    {
+        struct mpi_body * const body = &send[send_offsets[dest[i]]++];
+
+        body->x = dom->x[i];
+        body->v = dom->v[i];
+        body->a = dom->a[i];
+        body->id = dom->id[i];
+    }
+
+    for (int r = 0; r < ranks; ++r)
+    {
+        send_offsets[r] -= send_counts[r];
+    }
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (int r = 0, offset = 0; r < ranks; ++r)
+    {
+        recv_offsets[r] = offset;
+        offset += recv_counts[r];
+    }
+
+    MPI_Alltoallv(send, send_counts, send_offsets, dom->body_type,
+                  recv, recv_counts, recv_offsets, dom->body_type, MPI_COMM_WORLD);
+
+    for (int i = 0; i < count; ++i)
+    {
+        share[recv[i].id - begin] = recv[i];
+    }
+
+    free(recv);
+    free(send);
+    free(dest);
+    free(recv_offsets);
+    free(recv_counts);
+    free(send_offsets);
+    free(send_counts);
+
+    return share;
+}
+
+static void check_io (
+    struct nbody_config const * const config,
+    int const err
+    )
+{
+    if (err != MPI_SUCCESS)
+    {
+        fprintf(stderr, "cannot write snapshot to %s\n", config->output_path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+//
+// Append one record to config->output_path, the first output of the run
+// truncating it. Rank 0 writes the header; every rank writes its share of
+// each array at its place in the record, one collective write per array.
+//
+static void write_share (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    struct mpi_body const * const share,
+    int const begin,
+    int const count,
+    int const step,
+    float const time
+    )
+{
+    struct nbody_snapshot_header header;
+    MPI_Offset const record = dom->output_end;
+    float * const values = (float *) malloc(sizeof(float) * MAX(count, 1));
+    MPI_File file;
+
+    if (values == NULL)
+    {
+        out_of_memory();
+    }
+
+    nbody_snapshot_init_header(&header, NBODY_SNAPSHOT_VELOCITIES | NBODY_SNAPSHOT_ACCELERATIONS,
+                               config->points, step, time);
+
+    check_io(config, MPI_File_open(MPI_COMM_WORLD, config->output_path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                   MPI_INFO_NULL, &file));
+
+    if (record == 0)
+    {
+        check_io(config, MPI_File_set_size(file, 0));
+    }
+
+    if (dom->rank == 0)
+    {
+        check_io(config, MPI_File_write_at(file, record, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE));
+    }
+
+    //
+    // x, y, z, mass, then velocities and accelerations, as in
+    // nbody_snapshot_write
+    //
+    for (int c = 0; c < 10; ++c)
+    {
+        MPI_Offset const offset = record + sizeof(header) + ((MPI_Offset) c * config->points + begin) * sizeof(float);
+
+        for (int i = 0; i < count; ++i)
+        {
+            values[i] = c < 4 ? share[i].x.s[c] : (c < 7 ? share[i].v.s[c - 4] : share[i].a.s[c - 7]);
+        }
+
+        check_io(config, MPI_File_write_at_all(file, offset, values, count, MPI_FLOAT, MPI_STATUS_IGNORE));
+    }
+
+    check_io(config, MPI_File_close(&file));
+    dom->output_end = record + nbody_snapshot_record_size(&header);
+    free(values);
+}
+
+//
+// The text dump on stdout: rank 0 prints the shares in rank order, taking
+// one at a time
+//
+static void print_share (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    struct mpi_body const * const share,
+    int const count,
+    int const step,
+    float const time,
+    int const print_header
+    )
+{
+    if (dom->rank != 0)
+    {
+        MPI_Send(share, count, dom->body_type, 0, 0, MPI_COMM_WORLD);
+        return;
+    }
+
+    int const largest = share_begin(config->points, dom->ranks, 1) + 1;
+    struct mpi_body * const other = (struct mpi_body *) malloc(sizeof(struct mpi_body) * largest);
+    cl_float4 * const x = (cl_float4 *) malloc(sizeof(cl_float4) * largest);
+    cl_float4 * const a = (cl_float4 *) malloc(sizeof(cl_float4) * largest);
+
+    if (other == NULL || x == NULL || a == NULL)
+    {
+        out_of_memory();
+    }
+
+    if (print_header)
+    {
+        printf("# step %d time %f\n", step, time);
+    }
+
+    for (int r = 0; r < dom->ranks; ++r)
+    {
+        int const n = share_begin(config->points, dom->ranks, r + 1) - share_begin(config->points, dom->ranks, r);
+        struct mpi_body const * bodies = share;
+
+        if (r > 0)
+        {
+            MPI_Recv(other, n, dom->body_type, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            bodies = other;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            x[i] = bodies[i].x;
+            a[i] = bodies[i].a;
+        }
+
+        nbody_print_text(stdout, x, a, n);
+    }
+
+    free(a);
+    free(x);
+    free(other);
+}
+
+//
+// Write the bodies out in their initial order. Each rank only ever holds
+// its own share, so no rank needs memory for the whole set.
+//
+static void output_snapshot (
+    struct nbody_config const * const config,
+    struct mpi_domain * const dom,
+    int const step,
+    float const time,
+    int const print_header
+    )
+{
+    int const begin = share_begin(config->points, dom->ranks, dom->rank);
+    int const count = share_begin(config->points, dom->ranks, dom->rank + 1) - begin;
+    struct mpi_body * const share = collect_share(config, dom, begin, count);
+
+    if (config->output_path != NULL)
+    {
+        write_share(config, dom, share, begin, count, step, time);
+    }
+    else
+    {
+        print_share(config, dom, share, count, step, time, print_header);
+    }
+
+    free(share);
+}
+
+int main(int argc, char ** argv)
+{
+    struct nbody_config config;
+    struct nbody_timing timing;
+    struct mpi_domain dom;
+    int provided;
+    double t;
+
+    //
+    // Only the main thread calls MPI; OpenMP threads do the local work
+    //
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
+
+    config.threads = omp_get_max_threads();
+#endif
+
+    init_domain(&config, &dom);
+
+    if (dom.ranks > config.bins_per_dim)
+    {
+        if (dom.rank == 0)
+        {
+            fprintf(stderr, "%d ranks need at least %d bins per dimension\n", dom.ranks, dom.ranks);
+        }
+
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (load_initial_conditions(&config, &dom) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    t = nbody_now();
+    migrate_bodies(&config, &dom);
+    timing.phase[NBODY_PHASE_EXCHANGE] += nbody_now() - t;
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    calculate_forces(&config, &dom, &timing);
+
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        t = nbody_now();
+        output_snapshot(&config, &dom, 0, 0.0f, config.steps > 0);
+        timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+    }
+
+    //
+    // Velocity-Verlet integration. Bodies drifting out of the slab move to
+    // their new owner before the next force pass.
+    //
+    for (int step = 1; step <= config.steps; ++step)
+    {
+        t = nbody_now();
+        nbody_kick_drift(dom.x, dom.v, dom.a, dom.count, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        t = nbody_now();
+        migrate_bodies(&config, &dom);
+        timing.phase[NBODY_PHASE_EXCHANGE] += nbody_now() - t;
+
+        calculate_forces(&config, &dom, &timing);
+
+        t = nbody_now();
+        nbody_kick(dom.v, dom.a, dom.count, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+        {
+            t = nbody_now();
+            output_snapshot(&config, &dom, step, step * config.dt, 1);
+            timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+        }
+    }
+
+    //
+    // Every phase is reported at its slowest rank, so the force pass is not
+    // credited with time a light rank spent waiting in an exchange. The
+    // thread count covers all ranks.
+    //
+    MPI_Reduce(dom.rank == 0 ? MPI_IN_PLACE : timing.phase, timing.phase, NBODY_NUM_PHASES,
+               MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (dom.rank == 0)
+    {
+        config.threads *= dom.ranks;
+        nbody_timing_report(&config, &timing, "mpi");
+    }
+
+    destroy_domain(&dom);
+    MPI_Finalize();
+    return 0;
+}
@@ -6,282 +6,200 @@
 #include <stdio.h>
 #include <math.h>
 
-#define EPS 1e-10
-#define BIN_LENGTH (100.0f)
-#define BINS_PER_DIM (10)
-
-/// runtime on my 2011 computer: 1m; in 2013, 27s.
-// on my 2011 laptop, 1m34s
-#define POINTS 500 * 64
-#define SPACE 1000.0f;
-
-#define IS_IN(min_value, max_value, value)  \
-    (((value) >= (min_value)) && ((value) < (max_value)))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-cl_float4 cm[BINS_PER_DIM][BINS_PER_DIM][BINS_PER_DIM];
-int bin_pts_offsets[BINS_PER_DIM][BINS_PER_DIM][BINS_PER_DIM];
-cl_float4 bin_pts[POINTS];
-
-void construct_bins_cm (
-    cl_float4 const * const global_p,
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "nbody-common.h"
+#include "nbody-grid.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+
+//
+// Bodies on min_rung or deeper, listed in bin order. Returns their number.
+//
+static int collect_active (
+    struct nbody_grid const * const grid,
+    int const * const rung,
     int const points,
-    cl_float4 (* const global_cm)[BINS_PER_DIM][BINS_PER_DIM]
+    int const min_rung,
+    int * const active
     )
 {
-    for (int x = 0; x < BINS_PER_DIM; ++x)
+    int count = 0;
+
+    for (int k = 0; k < points; ++k)
     {
-        for (int y = 0; y < BINS_PER_DIM; ++y)
+        int const id = grid->bin_ids[k];
+
+        if (rung[id] >= min_rung)
         {
-            for (int z = 0; z < BINS_PER_DIM; ++z)
-            {
-                float min_x, min_y, min_z;
-                float max_x, max_y, max_z;
-                cl_float4 val;
-
-                //
-                // Calculate bounds for the bin
-                //
-                min_x = (float) (x * BIN_LENGTH);
-                max_x = min_x + BIN_LENGTH;
-
-                min_y = (float) (y * BIN_LENGTH);
-                max_y = min_y + BIN_LENGTH;
-
-                min_z = (float) (z * BIN_LENGTH);
-                max_z = min_z + BIN_LENGTH;
-
-                val = (cl_float4) {0.0f, 0.0f, 0.0f, 0.0f};
-
-                //
-                // Iterate through all the points and find the points that should lie within this bin
-                //
-                for (int i = 0; i < points; ++i)
-                {
-                    if (IS_IN(min_x, max_x, global_p[i].x)
-                        && IS_IN(min_y, max_y, global_p[i].y)
-                        && IS_IN(min_z, max_z, global_p[i].z))
-                    {
-                        val.x += global_p[i].x;
-                        val.y += global_p[i].y;
-                        val.z += global_p[i].z;
-                        val.w += 1.0f;
-                    }
-                }
-
-                val.x /= val.w;
-                val.y /= val.w;
-                val.z /= val.w;
-
-                global_cm[x][y][z] = val;
-            }
+            active[count++] = id;
         }
     }
+
+    return count;
 }
 
-void construct_bin_pts (
-    cl_float4 * const global_bin_pts,
-    int (* const global_bin_pts_offsets)[BINS_PER_DIM][BINS_PER_DIM],
-    cl_float4 const * const global_p,
-    int const points,
-    cl_float4 (* const global_cm)[BINS_PER_DIM][BINS_PER_DIM]
+//
+// Rebin the drifted bodies and evaluate the forces on those on min_rung or
+// deeper, listed into active. When every body is active the full bin-by-bin
+// pass is used. Returns the number of active bodies.
+//
+static int calculate_active_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    cl_float4 const * const x,
+    cl_float4 * const a,
+    int const * const rung,
+    int const min_rung,
+    int * const active,
+    struct nbody_timing * const timing
     )
 {
-    cl_float4 * global_cm_linearized;
+    int const points = config->points;
+    double t = nbody_now();
+    int count;
+
+    fit_grid(config, grid, x, points);
+    update_bin_pts(config, grid, x, points);
+    refine_bins(config, grid);
+    count = collect_active(grid, rung, points, min_rung, active);
 
-    global_cm_linearized = (cl_float4 *) global_cm;
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+    t = nbody_now();
 
-    for (int x = 0; x < BINS_PER_DIM; ++x)
+    if (count == points)
     {
-        for (int y = 0; y < BINS_PER_DIM; ++y)
-        {
-            for (int z = 0; z < BINS_PER_DIM; ++z)
-            {
-                int offset;
-                float min_x, min_y, min_z;
-                float max_x, max_y, max_z;
-                int counter;
-                int idx;
-
-                idx = (x * BINS_PER_DIM * BINS_PER_DIM) +
-                    (y * BINS_PER_DIM) + z;
-
-                //
-                // Calculate offset from beginning of bin_pts array to the beginning
-                // of where this bin's points start
-                //
-                offset = 0;
-                for (int i = 0; i < idx; ++i)
-                {
-                    offset += (int) global_cm_linearized[i].w;
-                }
-
-                global_bin_pts_offsets[x][y][z] = offset;
-
-                //
-                // Calculate bounds for the bin
-                //
-                min_x = (float) (x * BIN_LENGTH);
-                max_x = min_x + BIN_LENGTH;
-
-                min_y = (float) (y * BIN_LENGTH);
-                max_y = min_y + BIN_LENGTH;
-
-                min_z = (float) (z * BIN_LENGTH);
-                max_z = min_z + BIN_LENGTH;
-
-                counter = 0;
-
-                //
-                // Iterate through all the points and find the points that should lie within this bin
-                //
-                for (int i = 0; i < points; ++i)
-                {
-                    if (IS_IN(min_x, max_x, global_p[i].x)
-                        && IS_IN(min_y, max_y, global_p[i].y)
-                        && IS_IN(min_z, max_z, global_p[i].z))
-                    {
-                        global_bin_pts[offset + counter] = global_p[i];
-                        counter++;
-                    }
-                }
-            }
-        }
+        schedule_bins(config, grid);
+        timing->interactions += calculate_grid_forces(config, grid, a);
+    }
+    else
+    {
+        timing->interactions += calculate_grid_forces_active(config, grid, active, count, a);
     }
-}
 
-void body_body_interaction(cl_float4 bi, cl_float4 bj, cl_float4 *ai) {
-    cl_float4 r;
+    timing->phase[NBODY_PHASE_FORCES] += nbody_now() - t;
+    return count;
+}
 
-    r.x = bj.x - bi.x;
-    r.y = bj.y - bi.y;
-    r.z = bj.z - bi.z;
-    r.w = 1.0f;
+int main(int argc, char ** argv)
+{
+    struct nbody_config config;
+    struct nbody_grid grid;
+    struct nbody_timing timing;
+    double t;
 
-    float distSqr = r.x * r.x + r.y * r.y + r.z * r.z + EPS;
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
 
-    float distSixth = distSqr * distSqr * distSqr;
-    float invDistCube = 1.0f/sqrtf(distSixth);
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
 
-    float s = bj.w * invDistCube;
+    config.threads = omp_get_max_threads();
+#endif
 
-    ai->x += r.x * s;
-    ai->y += r.y * s;
-    ai->z += r.z * s;
-}
+    struct nbody_ic ic;
 
-void calculateForces (
-    int points,
-    int global_id,
-    cl_float4 * global_p,
-    cl_float4 * global_a,
-    cl_float4 const (* const global_cm)[BINS_PER_DIM][BINS_PER_DIM],
-    cl_float4 const * const global_bin_pts,
-    int const (* const global_bin_pts_offsets)[BINS_PER_DIM][BINS_PER_DIM]
-    )
-{
-    cl_float4 my_position = global_p[global_id];
-    cl_float4 acc = {{0.0f, 0.0f, 0.0f, 1.0f}};
-    int x_bin, y_bin, z_bin;
-    cl_float4 const * global_cm_linear;
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        return 1;
+    }
 
-    global_cm_linear = (cl_float4 *) global_cm;
+    int points = config.points;
 
-    x_bin = (int) (my_position.x / BIN_LENGTH);
-    y_bin = (int) (my_position.y / BIN_LENGTH);
-    z_bin = (int) (my_position.z / BIN_LENGTH);
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * v = nbody_ic_velocities(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    int * rung = (int *) calloc(points, sizeof(int));
+    int * active = (int *) malloc(sizeof(int) * points);
+    nbody_ic_close(&ic);
 
-    //
-    // Bin approx for all bins
-    //
-    for (int i = 0; i < (BINS_PER_DIM * BINS_PER_DIM * BINS_PER_DIM); ++i)
+    if (x == NULL || v == NULL || a == NULL || rung == NULL || active == NULL || !construct_grid(&config, &grid))
     {
-        body_body_interaction(my_position, global_cm_linear[i], &acc);
+        fprintf(stderr, "out of memory\n");
+        return 1;
     }
 
-    for (int x = MAX(0, x_bin - 1); x < MIN(BINS_PER_DIM, x_bin + 2); ++x)
-    {
-        for (int y = MAX(0, y_bin - 1); y < MIN(BINS_PER_DIM, y_bin + 2); ++y)
-        {
-            for (int z = MAX(0, z_bin - 1); z < MIN(BINS_PER_DIM, z_bin + 2); ++z)
-            {
-                cl_float4 neg_bin;
-                int offset;
-
-                neg_bin.x = 2 * my_position.x - global_cm[x][y][z].x;
-                neg_bin.y = 2 * my_position.y - global_cm[x][y][z].y;
-                neg_bin.z = 2 * my_position.z - global_cm[x][y][z].z;
-                neg_bin.w = global_cm[x][y][z].w;
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
 
-                body_body_interaction(my_position, neg_bin, &acc);
+    fit_grid(&config, &grid, x, points);
+    construct_bin_pts(&config, &grid, x, points);
+    construct_bins_cm(&config, &grid);
+    refine_bins(&config, &grid);
+    schedule_bins(&config, &grid);
 
-                offset = global_bin_pts_offsets[x][y][z];
+    timing.phase[NBODY_PHASE_BINNING] = nbody_now() - t;
+    t = nbody_now();
 
-                for (int i = 0; i < ((int) global_cm[x][y][z].w); ++i)
-                {
-                    body_body_interaction(my_position, global_bin_pts[offset + i], &acc);
-                }
-            }
-        }
-    }
+    timing.interactions = calculate_grid_forces(&config, &grid, a);
 
-    global_a[global_id] = acc;
-}
+    timing.phase[NBODY_PHASE_FORCES] = nbody_now() - t;
 
-cl_float4 * initializePositions() {
-    cl_float4 * pts = (cl_float4*) malloc(sizeof(cl_float4)*POINTS);
-    int i;
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        t = nbody_now();
+        nbody_output(&config, x, v, a, points, 0, 0.0, config.steps > 0);
+        timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+    }
 
-    srand(42L); // for deterministic results
+    //
+    // Every body starts on the rung its first acceleration asks for. Each
+    // step opens all of them, then runs the substeps: drift everything,
+    // close (and reopen) the steps that end. The last substep closes every
+    // step, so velocities are in sync at the snapshots.
+    //
+    int const substeps = 1 << config.rungs;
+    float const h = ldexpf(config.dt, -config.rungs);
 
-    for (i = 0; i < POINTS; i++) {
-    // quick and dirty generation of points
-    // not random at all, but I don't care.
-    pts[i].x = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].y = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].z = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].w = 1.0f; // size = 1.0f for simplicity.
+    for (int i = 0; i < points; ++i)
+    {
+        rung[i] = nbody_rung(&config, nbody_rung_scale(&config), a[i]);
     }
-    return pts;
-}
 
-cl_float4 * initializeAccelerations() {
-    cl_float4 * pts = (cl_float4*) malloc(sizeof(cl_float4)*POINTS);
-    int i;
+    for (int step = 1; step <= config.steps; ++step)
+    {
+        t = nbody_now();
+        nbody_kick_rungs(v, a, rung, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
 
-    for (i = 0; i < POINTS; i++) {
-    pts[i].x = pts[i].y = pts[i].z = pts[i].w = 0;
-    }
-    return pts;
-}
+        for (int substep = 1; substep <= substeps; ++substep)
+        {
+            int const min_rung = nbody_min_rung(config.rungs, substep);
+            int count;
 
-int main(int argc, char ** argv)
-{
-    cl_float4 * x = initializePositions();
-    cl_float4 * a = initializeAccelerations();
+            t = nbody_now();
+            nbody_drift(x, v, points, h);
+            timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
 
-    construct_bins_cm(x, POINTS, (cl_float4 (*)[BINS_PER_DIM][BINS_PER_DIM]) &cm);
-    construct_bin_pts((cl_float4 *) &bin_pts,
-                      (int (*)[BINS_PER_DIM][BINS_PER_DIM]) &bin_pts_offsets,
-                      x,
-                      POINTS,
-                      (cl_float4 (*)[BINS_PER_DIM][BINS_PER_DIM]) &cm);
+            count = calculate_active_forces(&config, &grid, x, a, rung, min_rung, active, &timing);
 
-    for (int i = 0; i < POINTS; i++)
-    {
-        calculateForces(POINTS, i, x, a,
-                        (cl_float4 (*)[BINS_PER_DIM][BINS_PER_DIM]) &cm,
-                        (cl_float4 *) &bin_pts,
-                        (int (*)[BINS_PER_DIM][BINS_PER_DIM]) &bin_pts_offsets);
+            t = nbody_now();
+            nbody_kick_active(&config, v, a, rung, active, count, min_rung, substep < substeps);
+            timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+        }
+
+        if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+        {
+            t = nbody_now();
+            nbody_output(&config, x, v, a, points, step, step * config.dt, 1);
+            timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+        }
     }
 
-    for (int i = 0; i < POINTS; i++)
-    printf("(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
-           x[i].x, x[i].y, x[i].z, x[i].w,
-           a[i].x, a[i].y, a[i].z);
+    nbody_timing_report(&config, &timing, "opt-seq");
 
+    destroy_grid(&grid);
+    free(active);
+    free(rung);
     free(x);
+    free(v);
     free(a);
     return 0;
 }
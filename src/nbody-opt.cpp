@@ -3,15 +3,30 @@
 #include <CL/cl.hpp>
 
 #include <iostream>
-#include <fstream>
+#include <stdexcept>
 #include <string>
+#include <cstring>
 #include <utility>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#define POINTS (500 * 64)
-#define SPACE (1000.0f)
-#define BINS_PER_DIM (10)
+#include "nbody-common.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+#include "nbody-program.h"
+
+//
+// Kernel source, embedded at build time from src/nbody_kernel-opt.cl
+//
+static char const kernel_source[] =
+#include "nbody_kernel-opt.cl.h"
+;
 
 #define DEBUG_PRINT(str, ...) /**/
 //#define DEBUG_PRINT(str, ...) printf(str, ##__VA_ARGS__)
@@ -26,102 +41,867 @@
     } \
 }
 
-cl_float4 * initializePositions ()
+//
+// Commands whose CL_QUEUE_PROFILING_ENABLE counters make up the device
+// phases of the timing report, by phase. Helpers take a NULL profile when
+// timing is off.
+//
+struct device_profile
+{
+    std::vector<cl::Event> events[NBODY_NUM_PHASES];
+};
+
+//
+// Event for the next command of phase, or NULL when not profiling. The
+// pointer is only valid until the next call.
+//
+cl::Event * profile_event (
+    struct device_profile * const profile,
+    int const phase
+    )
+{
+    if (profile == NULL)
+    {
+        return NULL;
+    }
+
+    profile->events[phase].push_back(cl::Event());
+    return &profile->events[phase].back();
+}
+
+//
+// Execution time of a command from its profiling counters
+//
+double event_seconds (
+    cl::Event &event
+    )
+{
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    return 1e-9 * (end - start);
+}
+
+void calculate_nbody (
+    cl::CommandQueue &queue,
+    cl::Kernel &nbody_kernel,
+    cl::Buffer &x_buffer,
+    cl::Buffer &cm_buffer,
+    cl::Buffer &bin_pts_buffer,
+    cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    //
+    // Set Args
+    //
+    DEBUG_PRINT("Set nbody_kernel args\n");
+    err = nbody_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(1, cm_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(2, bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(3, bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(4, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(5, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Run Kernel
+    //
+    DEBUG_PRINT("Run nbody_kernel\n");
+    err = queue.enqueueNDRangeKernel(nbody_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_FORCES));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Half kick of the velocities followed by a full drift of the positions
+// (first half of a velocity-Verlet step).
+//
+void kick_drift (
+    cl::CommandQueue &queue,
+    cl::Kernel &kick_drift_kernel,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    cl_float dt,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set kick_drift_kernel args\n");
+    err = kick_drift_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(1, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(2, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(3, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(4, dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run kick_drift_kernel\n");
+    err = queue.enqueueNDRangeKernel(kick_drift_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_INTEGRATE));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Closing half kick of the velocities with the freshly computed
+// accelerations (second half of a velocity-Verlet step).
+//
+void kick (
+    cl::CommandQueue &queue,
+    cl::Kernel &kick_kernel,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    cl_float dt,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set kick_kernel args\n");
+    err = kick_kernel.setArg(0, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(1, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(2, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(3, dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run kick_kernel\n");
+    err = queue.enqueueNDRangeKernel(kick_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_INTEGRATE));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Block timestep helpers (--rungs, see nbody-common.h). collect_active
+// lists the bodies on min_rung or deeper and reads their number back: the
+// host needs it to size the force and kick launches that follow.
+//
+int collect_active (
+    cl::CommandQueue &queue,
+    cl::Kernel &collect_active_kernel,
+    cl::Buffer &rung_buffer,
+    cl::Buffer &points_buffer,
+    cl::Buffer &active_buffer,
+    cl::Buffer &active_count_buffer,
+    int const points,
+    int const min_rung,
+    size_t const local_size,
+    struct device_profile * const profile
+    )
+{
+    static cl_int const zero = 0;
+    size_t const global_size = (points + local_size - 1) / local_size * local_size;
+    cl_int count;
+    cl_int err;
+
+    err = queue.enqueueWriteBuffer(active_count_buffer, CL_FALSE, 0, sizeof(cl_int), &zero);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Set collect_active_kernel args\n");
+    err = collect_active_kernel.setArg(0, rung_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = collect_active_kernel.setArg(1, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = collect_active_kernel.setArg(2, min_rung);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = collect_active_kernel.setArg(3, active_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = collect_active_kernel.setArg(4, active_count_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = collect_active_kernel.setArg(5, local_size * sizeof(cl_int), NULL);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run collect_active_kernel\n");
+    err = queue.enqueueNDRangeKernel(collect_active_kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size),
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueReadBuffer(active_count_buffer, CL_TRUE, 0, sizeof(cl_int), &count);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    return count;
+}
+
+void calculate_nbody_active (
+    cl::CommandQueue &queue,
+    cl::Kernel &nbody_active_kernel,
+    cl::Buffer &x_buffer,
+    cl::Buffer &cm_buffer,
+    cl::Buffer &bin_pts_buffer,
+    cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &active_buffer,
+    cl::Buffer &active_count_buffer,
+    int const count,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set nbody_active_kernel args\n");
+    err = nbody_active_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(1, cm_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(2, bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(3, bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(4, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(5, active_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_active_kernel.setArg(6, active_count_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run nbody_active_kernel\n");
+    err = queue.enqueueNDRangeKernel(nbody_active_kernel, cl::NDRange(0), cl::NDRange(count), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_FORCES));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+void kick_rungs (
+    cl::CommandQueue &queue,
+    cl::Kernel &kick_rungs_kernel,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &rung_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    cl_float dt,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set kick_rungs_kernel args\n");
+    err = kick_rungs_kernel.setArg(0, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_rungs_kernel.setArg(1, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_rungs_kernel.setArg(2, rung_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_rungs_kernel.setArg(3, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_rungs_kernel.setArg(4, dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run kick_rungs_kernel\n");
+    err = queue.enqueueNDRangeKernel(kick_rungs_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_INTEGRATE));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+void drift (
+    cl::CommandQueue &queue,
+    cl::Kernel &drift_kernel,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    cl_float h,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set drift_kernel args\n");
+    err = drift_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = drift_kernel.setArg(1, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = drift_kernel.setArg(2, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = drift_kernel.setArg(3, h);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run drift_kernel\n");
+    err = queue.enqueueNDRangeKernel(drift_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_INTEGRATE));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Close the steps of the count listed bodies and move them to their new
+// rungs; close = reopen = false only assigns the rungs
+//
+void kick_active (
+    struct nbody_config const * const config,
+    cl::CommandQueue &queue,
+    cl::Kernel &kick_active_kernel,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &rung_buffer,
+    cl::Buffer &active_buffer,
+    cl::Buffer &active_count_buffer,
+    int const count,
+    int const min_rung,
+    bool const close,
+    bool const reopen,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    DEBUG_PRINT("Set kick_active_kernel args\n");
+    err = kick_active_kernel.setArg(0, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(1, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(2, rung_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(3, active_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(4, active_count_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(5, config->dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(6, nbody_rung_scale(config));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(7, config->rungs);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(8, min_rung);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(9, (cl_int) close);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_active_kernel.setArg(10, (cl_int) reopen);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run kick_active_kernel\n");
+    err = queue.enqueueNDRangeKernel(kick_active_kernel, cl::NDRange(0), cl::NDRange(count), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_INTEGRATE));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Snapshots leave the device through a pipeline so the integration never
+// waits on PCIe or the disk. The state is first copied on the device into
+// one of SNAPSHOT_SLOTS slots, after which the compute queue is free to
+// overwrite it with the next step. The copy queue reads the slot back into
+// pinned host memory behind that copy, and the writer thread writes the
+// snapshot out once the read has completed, then hands the slot back.
+// The state is kept in bin order on the device, so the slot carries the
+// original index of every body and the writer puts them back in order.
+//
+#define SNAPSHOT_SLOTS (2)
+
+struct snapshot_slot
+{
+    cl::Buffer x_buffer;        // device copies of the state
+    cl::Buffer v_buffer;
+    cl::Buffer a_buffer;
+    cl::Buffer ids_buffer;
+    cl::Buffer x_pinned;        // CL_MEM_ALLOC_HOST_PTR staging
+    cl::Buffer v_pinned;
+    cl::Buffer a_pinned;
+    cl::Buffer ids_pinned;
+    cl_float4 * x;              // staging, mapped for the whole run
+    cl_float4 * v;
+    cl_float4 * a;
+    cl_int * ids;
+    cl::Event read_done;
+    bool busy;                  // owned by the writer thread until cleared
+    int step;
+    float time;
+    bool print_header;
+};
+
+struct snapshot_writer
+{
+    struct nbody_config const * config;
+    int points;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<struct snapshot_slot *> jobs;
+    bool done;
+    double output_seconds;      // time spent in nbody_output
+    std::vector<cl_float4> x;   // snapshot back in original body order
+    std::vector<cl_float4> v;
+    std::vector<cl_float4> a;
+};
+
+void init_snapshot_slot (
+    cl::Context &context,
+    cl::CommandQueue &queue,
+    struct snapshot_slot * const slot,
+    int const points
+    )
+{
+    size_t const size = points * sizeof(cl_float4);
+    cl_int err;
+
+    slot->x_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->v_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->a_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->ids_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, points * sizeof(cl_int), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->x_pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->v_pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->a_pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->ids_pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, points * sizeof(cl_int), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->x = (cl_float4 *) queue.enqueueMapBuffer(slot->x_pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, NULL, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->v = (cl_float4 *) queue.enqueueMapBuffer(slot->v_pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, NULL, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->a = (cl_float4 *) queue.enqueueMapBuffer(slot->a_pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, NULL, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->ids = (cl_int *) queue.enqueueMapBuffer(slot->ids_pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, points * sizeof(cl_int), NULL, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    slot->busy = false;
+}
+
+void release_snapshot_slot (
+    cl::CommandQueue &queue,
+    struct snapshot_slot * const slot
+    )
+{
+    cl_int err;
+
+    err = queue.enqueueUnmapMemObject(slot->x_pinned, slot->x);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueUnmapMemObject(slot->v_pinned, slot->v);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueUnmapMemObject(slot->a_pinned, slot->a);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueUnmapMemObject(slot->ids_pinned, slot->ids);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.finish();
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Writer thread: write out snapshots in the order they were queued
+//
+void snapshot_writer_main (
+    struct snapshot_writer * const writer
+    )
+{
+    struct nbody_config const * const config = writer->config;
+
+    for (;;)
+    {
+        struct snapshot_slot * slot;
+
+        {
+            std::unique_lock<std::mutex> guard(writer->lock);
+
+            while (writer->jobs.empty() && !writer->done)
+            {
+                writer->changed.wait(guard);
+            }
+
+            if (writer->jobs.empty())
+            {
+                return;
+            }
+
+            slot = writer->jobs.front();
+            writer->jobs.pop_front();
+        }
+
+        //
+        // A read that failed drops the snapshot; the error itself reaches
+        // the main thread through the queue it was enqueued on
+        //
+        try {
+            slot->read_done.wait();
+        } catch(cl::Error error) {
+            std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+
+            {
+                std::lock_guard<std::mutex> guard(writer->lock);
+                slot->busy = false;
+            }
+
+            writer->changed.notify_all();
+            continue;
+        }
+
+        double t = nbody_now();
+
+        for (int i = 0; i < writer->points; ++i)
+        {
+            writer->x[slot->ids[i]] = slot->x[i];
+            writer->v[slot->ids[i]] = slot->v[i];
+            writer->a[slot->ids[i]] = slot->a[i];
+        }
+
+        nbody_output(config, &writer->x[0], config->output_path != NULL ? &writer->v[0] : NULL, &writer->a[0], writer->points,
+            slot->step, slot->time, slot->print_header);
+        writer->output_seconds += nbody_now() - t;
+
+        {
+            std::lock_guard<std::mutex> guard(writer->lock);
+            slot->busy = false;
+        }
+
+        writer->changed.notify_all();
+    }
+}
+
+//
+// Let the writer thread finish the queued snapshots and join it. Safe to
+// call again once the thread is joined.
+//
+void stop_snapshot_writer (
+    struct snapshot_writer * const writer,
+    std::thread &thread
+    )
+{
+    if (!thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(writer->lock);
+        writer->done = true;
+    }
+
+    writer->changed.notify_all();
+    thread.join();
+}
+
+//
+// Joins the writer thread when main unwinds on an error: the destructor of
+// a still joinable std::thread would call std::terminate before the error
+// reached its handler
+//
+struct snapshot_writer_guard
+{
+    struct snapshot_writer * writer;
+    std::thread &thread;
+
+    ~snapshot_writer_guard ()
+    {
+        stop_snapshot_writer(writer, thread);
+    }
+};
+
+//
+// Queue a snapshot of the current state. Only blocks when the slot is still
+// being written out from an earlier snapshot. Velocities are only copied for
+// binary snapshots; the text dump has no use for them.
+//
+void output_snapshot (
+    struct nbody_config const * const config,
+    cl::CommandQueue &compute_queue,
+    cl::CommandQueue &copy_queue,
+    struct snapshot_writer * const writer,
+    struct snapshot_slot * const slot,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    cl::Buffer &ids_buffer,
+    int const points,
+    int step,
+    float time,
+    bool print_header,
+    struct device_profile * const profile
+    )
 {
-    int i;
-    cl_float4 * pts;
+    size_t const size = points * sizeof(cl_float4);
+    bool const with_v = config->output_path != NULL;
+    std::vector<cl::Event> copied(with_v ? 4 : 3);
+    cl_int err;
+
+    {
+        std::unique_lock<std::mutex> guard(writer->lock);
+
+        while (slot->busy)
+        {
+            writer->changed.wait(guard);
+        }
+    }
+
+    DEBUG_PRINT("Copy state for snapshot of step %d\n", step);
+    err = compute_queue.enqueueCopyBuffer(x_buffer, slot->x_buffer, 0, 0, size, NULL, &copied[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = compute_queue.enqueueCopyBuffer(a_buffer, slot->a_buffer, 0, 0, size, NULL, &copied[1]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = compute_queue.enqueueCopyBuffer(ids_buffer, slot->ids_buffer, 0, 0, points * sizeof(cl_int), NULL, &copied[2]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    if (with_v)
+    {
+        err = compute_queue.enqueueCopyBuffer(v_buffer, slot->v_buffer, 0, 0, size, NULL, &copied[3]);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+    }
+
+    err = compute_queue.flush();
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // For deterministic results;
+    // The copy queue is in order, so the last read completing means all of
+    // them have
     //
-    srand(42L);
+    DEBUG_PRINT("Read snapshot of step %d\n", step);
+    err = copy_queue.enqueueReadBuffer(slot->x_buffer, CL_FALSE, 0, size, slot->x, &copied,
+        profile_event(profile, NBODY_PHASE_DOWNLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    if (with_v)
+    {
+        err = copy_queue.enqueueReadBuffer(slot->v_buffer, CL_FALSE, 0, size, slot->v, &copied,
+            profile_event(profile, NBODY_PHASE_DOWNLOAD));
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+    }
+
+    err = copy_queue.enqueueReadBuffer(slot->ids_buffer, CL_FALSE, 0, points * sizeof(cl_int), slot->ids, &copied,
+        profile_event(profile, NBODY_PHASE_DOWNLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    pts = (cl_float4 *) malloc(sizeof(cl_float4) * POINTS);
-    ASSERT(pts, "PTR NOT VALID\n");
+    err = copy_queue.enqueueReadBuffer(slot->a_buffer, CL_FALSE, 0, size, slot->a, &copied, &slot->read_done);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
+    err = copy_queue.flush();
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    for (i = 0; i < POINTS; ++i)
+    if (profile != NULL)
     {
-        pts[i].x = (((float) std::rand()) / RAND_MAX) * SPACE;
-        pts[i].y = (((float) std::rand()) / RAND_MAX) * SPACE;
-        pts[i].z = (((float) std::rand()) / RAND_MAX) * SPACE;
+        profile->events[NBODY_PHASE_DOWNLOAD].insert(profile->events[NBODY_PHASE_DOWNLOAD].end(), copied.begin(), copied.end());
+        profile->events[NBODY_PHASE_DOWNLOAD].push_back(slot->read_done);
+    }
 
-        //
-        // Size is 1.0f for simplicity.
-        //
-        pts[i].w = 1.0f;
+    slot->step = step;
+    slot->time = time;
+    slot->print_header = print_header;
+
+    {
+        std::lock_guard<std::mutex> guard(writer->lock);
+        slot->busy = true;
+        writer->jobs.push_back(slot);
     }
 
-    return pts;
+    writer->changed.notify_all();
 }
 
-cl_float4 * initializeAccelerations ()
+//
+// Bodies per chunk of the initial upload
+//
+#define UPLOAD_CHUNK (65536)
+
+//
+// Stream positions and velocities to the device in chunks through two
+// staging buffers: while the non-blocking writes out of one are in flight
+// the next chunk is transposed from the (possibly memory-mapped) input into
+// the other. A staging buffer is refilled only after its writes complete.
+//
+void upload_initial_conditions (
+    cl::CommandQueue &queue,
+    struct nbody_ic const * const ic,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    int const points,
+    struct device_profile * const profile
+    )
 {
-    cl_float4 * pts;
+    std::vector<cl_float4> staging_x[2];
+    std::vector<cl_float4> staging_v[2];
+    std::vector<cl::Event> pending[2];
+    cl_int err;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        staging_x[i].resize(std::min(points, UPLOAD_CHUNK));
+        staging_v[i].resize(std::min(points, UPLOAD_CHUNK));
+    }
+
+    for (int begin = 0, chunk = 0; begin < points; begin += UPLOAD_CHUNK, ++chunk)
+    {
+        int const buf = chunk & 1;
+        int const count = std::min(points - begin, UPLOAD_CHUNK);
+        cl::Event x_event;
+        cl::Event v_event;
+
+        if (!pending[buf].empty())
+        {
+            err = cl::Event::waitForEvents(pending[buf]);
+            ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+            pending[buf].clear();
+        }
+
+        nbody_ic_read(ic, begin, count, &staging_x[buf][0], &staging_v[buf][0]);
+
+        DEBUG_PRINT("Write initial conditions [%d, %d)\n", begin, begin + count);
+        err = queue.enqueueWriteBuffer(x_buffer, CL_FALSE, begin * sizeof(cl_float4), count * sizeof(cl_float4),
+            &staging_x[buf][0], NULL, &x_event);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        err = queue.enqueueWriteBuffer(v_buffer, CL_FALSE, begin * sizeof(cl_float4), count * sizeof(cl_float4),
+            &staging_v[buf][0], NULL, &v_event);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    pts = (cl_float4 *) malloc(POINTS * sizeof(cl_float4));
-    ASSERT(pts, "PTR NOT VALID\n");
+        pending[buf].push_back(x_event);
+        pending[buf].push_back(v_event);
 
-    return pts;
+        if (profile != NULL)
+        {
+            profile->events[NBODY_PHASE_UPLOAD].push_back(x_event);
+            profile->events[NBODY_PHASE_UPLOAD].push_back(v_event);
+        }
+    }
+
+    //
+    // The staging buffers go out of scope here
+    //
+    err = queue.finish();
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 }
 
-void calculate_nbody (
+void count_bins (
+    struct nbody_config const * const config,
     cl::CommandQueue &queue,
-    cl::Kernel &nbody_kernel,
+    cl::Kernel &clear_bin_counts_kernel,
+    cl::Kernel &count_bins_kernel,
+    cl::Buffer &bin_counts_buffer,
+    cl::Buffer &pt_bins_buffer,
     cl::Buffer &x_buffer,
-    cl::Buffer &cm_buffer,
-    cl::Buffer &bin_pts_buffer,
-    cl::Buffer &bin_pts_offsets_buffer,
-    cl::Buffer &a_buffer,
     cl::Buffer &points_buffer,
-    cl_float4 * a
+    int const points,
+    size_t const bin_local_size,
+    struct device_profile * const profile
     )
 {
+    size_t const global_size = (points + bin_local_size - 1) / bin_local_size * bin_local_size;
     cl_int err;
 
     //
-    // Set Args
+    // Reset the histogram
     //
-    DEBUG_PRINT("Set nbody_kernel args\n");
-    err = nbody_kernel.setArg(0, x_buffer);
+    DEBUG_PRINT("Set args for clear_bin_counts kernel\n");
+    err = clear_bin_counts_kernel.setArg(0, bin_counts_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = nbody_kernel.setArg(1, cm_buffer);
+    DEBUG_PRINT("Run clear_bin_counts_kernel\n");
+    err = queue.enqueueNDRangeKernel(clear_bin_counts_kernel, cl::NDRange(0), cl::NDRange(nbody_num_bins(config)), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = nbody_kernel.setArg(2, bin_pts_buffer);
+    //
+    // Set arguments to kernel
+    //
+    DEBUG_PRINT("Set args for count_bins kernel\n");
+    err = count_bins_kernel.setArg(0, bin_counts_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = nbody_kernel.setArg(3, bin_pts_offsets_buffer);
+    err = count_bins_kernel.setArg(1, pt_bins_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = nbody_kernel.setArg(4, a_buffer);
+    err = count_bins_kernel.setArg(2, x_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = nbody_kernel.setArg(5, points_buffer);
+    err = count_bins_kernel.setArg(3, points_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    //
-    // Run Kernel
-    //
-    DEBUG_PRINT("Run nbody_kernel\n");
-    err = queue.enqueueNDRangeKernel(nbody_kernel, cl::NDRange(0), cl::NDRange(POINTS), cl::NullRange);
+    err = count_bins_kernel.setArg(4, bin_local_size * sizeof(cl_int), NULL);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = count_bins_kernel.setArg(5, bin_local_size * sizeof(cl_int), NULL);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // Read buffer(s)
+    // Runs of equal bins are found within a work-group, so its size is fixed
     //
-    DEBUG_PRINT("Read buffers after nbody_kernel\n");
-    err = queue.enqueueReadBuffer(a_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), a);
+    DEBUG_PRINT("Run count_bins_kernel\n");
+    err = queue.enqueueNDRangeKernel(count_bins_kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(bin_local_size),
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 }
 
-void calculate_bins_cm (
+void scan_bin_counts (
     cl::CommandQueue &queue,
-    cl::Kernel &calculate_bins_cm_kernel,
-    cl::Buffer &cm_buffer,
-    cl::Buffer &x_buffer,
-    cl::Buffer &points_buffer
+    cl::Kernel &scan_bin_counts_kernel,
+    cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &bin_counts_buffer,
+    size_t const scan_local_size,
+    struct device_profile * const profile
     )
 {
     cl_int err;
@@ -129,21 +909,22 @@ void calculate_bins_cm (
     //
     // Set arguments to kernel
     //
-    DEBUG_PRINT("Set args for calculate_bins_cm kernel\n");
-    err = calculate_bins_cm_kernel.setArg(0, cm_buffer);
+    DEBUG_PRINT("Set args for scan_bin_counts kernel\n");
+    err = scan_bin_counts_kernel.setArg(0, bin_pts_offsets_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = calculate_bins_cm_kernel.setArg(1, x_buffer);
+    err = scan_bin_counts_kernel.setArg(1, bin_counts_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = calculate_bins_cm_kernel.setArg(2, points_buffer);
+    err = scan_bin_counts_kernel.setArg(2, scan_local_size * sizeof(cl_int), NULL);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // Run the nbody_kernel on specific ND range
+    // A single work-group scans the whole histogram
     //
-    DEBUG_PRINT("Run calculate_bins_cm_kernel\n");
-    err = queue.enqueueNDRangeKernel(calculate_bins_cm_kernel, cl::NDRange(0, 0, 0), cl::NDRange(BINS_PER_DIM, BINS_PER_DIM, BINS_PER_DIM), cl::NullRange);
+    DEBUG_PRINT("Run scan_bin_counts_kernel\n");
+    err = queue.enqueueNDRangeKernel(scan_bin_counts_kernel, cl::NDRange(0), cl::NDRange(scan_local_size), cl::NDRange(scan_local_size),
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 }
 
@@ -151,10 +932,18 @@ void construct_bin_pts (
     cl::CommandQueue &queue,
     cl::Kernel &construct_bin_pts_kernel,
     cl::Buffer &bin_pts_buffer,
+    cl::Buffer &bin_v_buffer,
+    cl::Buffer &bin_ids_buffer,
+    cl::Buffer &bin_rung_buffer,
     cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &pt_bins_buffer,
     cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &ids_buffer,
+    cl::Buffer &rung_buffer,
     cl::Buffer &points_buffer,
-    cl::Buffer &cm_buffer
+    int const points,
+    struct device_profile * const profile
     )
 {
     cl_int err;
@@ -166,27 +955,144 @@ void construct_bin_pts (
     err = construct_bin_pts_kernel.setArg(0, bin_pts_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = construct_bin_pts_kernel.setArg(1, bin_pts_offsets_buffer);
+    err = construct_bin_pts_kernel.setArg(1, bin_v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(2, bin_ids_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(3, bin_rung_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(4, bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(5, pt_bins_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(6, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = construct_bin_pts_kernel.setArg(7, v_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = construct_bin_pts_kernel.setArg(2, x_buffer);
+    err = construct_bin_pts_kernel.setArg(8, ids_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = construct_bin_pts_kernel.setArg(3, points_buffer);
+    err = construct_bin_pts_kernel.setArg(9, rung_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = construct_bin_pts_kernel.setArg(4, cm_buffer);
+    err = construct_bin_pts_kernel.setArg(10, points_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
     // Run the nbody_kernel on specific ND range
     //
     DEBUG_PRINT("Run construct_bin_pts_kernel\n");
-    err = queue.enqueueNDRangeKernel(construct_bin_pts_kernel, cl::NDRange(0, 0, 0), cl::NDRange(BINS_PER_DIM, BINS_PER_DIM, BINS_PER_DIM), cl::NullRange);
+    err = queue.enqueueNDRangeKernel(construct_bin_pts_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+void calculate_bins_cm (
+    struct nbody_config const * const config,
+    cl::CommandQueue &queue,
+    cl::Kernel &calculate_bins_cm_kernel,
+    cl::Buffer &cm_buffer,
+    cl::Buffer &bin_pts_buffer,
+    cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &bin_counts_buffer,
+    struct device_profile * const profile
+    )
+{
+    cl_int err;
+
+    //
+    // Set arguments to kernel
+    //
+    DEBUG_PRINT("Set args for calculate_bins_cm kernel\n");
+    err = calculate_bins_cm_kernel.setArg(0, cm_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = calculate_bins_cm_kernel.setArg(1, bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = calculate_bins_cm_kernel.setArg(2, bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = calculate_bins_cm_kernel.setArg(3, bin_counts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Run the nbody_kernel on specific ND range
+    //
+    DEBUG_PRINT("Run calculate_bins_cm_kernel\n");
+    err = queue.enqueueNDRangeKernel(calculate_bins_cm_kernel, cl::NDRange(0), cl::NDRange(nbody_num_bins(config)), cl::NullRange,
+        NULL, profile_event(profile, NBODY_PHASE_BINNING));
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 }
 
-int main() {
+//
+// Rebuild cm and bin_pts_offsets from the current positions with a counting
+// sort: histogram, exclusive scan, scatter, then the per-bin centres of
+// mass. Every pass is O(N) or O(bins). The scatter writes the whole state in
+// bin order into the sorted buffers, which are then swapped with the state
+// buffers: x_buffer comes out sorted, doubling as bin_pts, and ids_buffer
+// keeps the original index of every body for output. The accelerations are
+// left in the old order; the next force pass overwrites them, or with block
+// timesteps those of the active bodies, the only ones read before the next
+// full pass.
+//
+void rebin (
+    struct nbody_config const * const config,
+    cl::CommandQueue &queue,
+    cl::Kernel &clear_bin_counts_kernel,
+    cl::Kernel &count_bins_kernel,
+    cl::Kernel &scan_bin_counts_kernel,
+    cl::Kernel &construct_bin_pts_kernel,
+    cl::Kernel &calculate_bins_cm_kernel,
+    cl::Buffer &cm_buffer,
+    cl::Buffer &bin_pts_buffer,
+    cl::Buffer &bin_v_buffer,
+    cl::Buffer &bin_ids_buffer,
+    cl::Buffer &bin_rung_buffer,
+    cl::Buffer &bin_pts_offsets_buffer,
+    cl::Buffer &bin_counts_buffer,
+    cl::Buffer &pt_bins_buffer,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &ids_buffer,
+    cl::Buffer &rung_buffer,
+    cl::Buffer &points_buffer,
+    int const points,
+    size_t const bin_local_size,
+    size_t const scan_local_size,
+    struct device_profile * const profile
+    )
+{
+    count_bins(config, queue, clear_bin_counts_kernel, count_bins_kernel, bin_counts_buffer, pt_bins_buffer, x_buffer, points_buffer, points, bin_local_size, profile);
+    scan_bin_counts(queue, scan_bin_counts_kernel, bin_pts_offsets_buffer, bin_counts_buffer, scan_local_size, profile);
+    construct_bin_pts(queue, construct_bin_pts_kernel, bin_pts_buffer, bin_v_buffer, bin_ids_buffer, bin_rung_buffer, bin_pts_offsets_buffer, pt_bins_buffer,
+        x_buffer, v_buffer, ids_buffer, rung_buffer, points_buffer, points, profile);
+    calculate_bins_cm(config, queue, calculate_bins_cm_kernel, cm_buffer, bin_pts_buffer, bin_pts_offsets_buffer, bin_counts_buffer, profile);
+
+    std::swap(x_buffer, bin_pts_buffer);
+    std::swap(v_buffer, bin_v_buffer);
+    std::swap(ids_buffer, bin_ids_buffer);
+    std::swap(rung_buffer, bin_rung_buffer);
+}
+
+int main(int argc, char ** argv) {
+    struct nbody_config config;
+    struct nbody_timing timing;
+    struct device_profile device_profile;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+    struct device_profile * const profile = config.timing_path != NULL ? &device_profile : NULL;
+
     try {
     // Get available platforms
     std::vector<cl::Platform> platforms;
@@ -204,54 +1110,79 @@ int main() {
     // Get a list of devices on this platform
     std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
 
-    // Create a command queue and use the first device
-    cl::CommandQueue queue = cl::CommandQueue(context, devices[0]);
+    //
+    // Kernels and the device-side snapshot copies go in order on queue;
+    // snapshot reads go on copy_queue so they overlap the next steps
+    //
+    cl_command_queue_properties const queue_properties = profile != NULL ? CL_QUEUE_PROFILING_ENABLE : 0;
+    cl::CommandQueue queue = cl::CommandQueue(context, devices[0], queue_properties);
+    cl::CommandQueue copy_queue = cl::CommandQueue(context, devices[0], queue_properties);
 
-    // Read source file
-    std::ifstream sourceFile("src/nbody_kernel-opt.cl");
+    //
+    // Grid dimensions are baked in as build options so the kernel compiler
+    // can still constant-fold them
+    //
+    char build_options[128];
 
-    if(!sourceFile.is_open()) {
-        std::cerr << "Cannot find kernel file" << std::endl;
-        throw;
-    }
+    snprintf(build_options, sizeof(build_options), "-D BINS_PER_DIM=%d -D BIN_LENGTH=%.9ef",
+        config.bins_per_dim, config.bin_length);
 
-    std::string sourceCode(std::istreambuf_iterator<char>(sourceFile), (std::istreambuf_iterator<char>()));
-    cl::Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length() + 1));
+    // Build program for this device, or load it from the binary cache
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
 
-    // Make program of the source code in the context
-    cl::Program program = cl::Program(context, source);
+    cl::Program program = nbody_build_program(&config, context, devices[0], kernel_source, build_options);
 
-    // Build program for these specific devices
-    try {
-        program.build(devices);
-    } catch(cl::Error error) {
-        std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
-        throw;
-    }
+    timing.phase[NBODY_PHASE_BUILD] = nbody_now() - t;
+    t = nbody_now();
 
     // Make kernel
     cl::Kernel nbody_kernel(program, "nbody");
-    cl::Kernel calculate_bins_cm_kernel(program, "calculate_bins_cm");
+    cl::Kernel clear_bin_counts_kernel(program, "clear_bin_counts");
+    cl::Kernel count_bins_kernel(program, "count_bins");
+    cl::Kernel scan_bin_counts_kernel(program, "scan_bin_counts");
     cl::Kernel construct_bin_pts_kernel(program, "construct_bin_pts");
+    cl::Kernel calculate_bins_cm_kernel(program, "calculate_bins_cm");
+    cl::Kernel kick_drift_kernel(program, "kick_drift");
+    cl::Kernel kick_kernel(program, "kick");
+    cl::Kernel nbody_active_kernel(program, "nbody_active");
+    cl::Kernel collect_active_kernel(program, "collect_active");
+    cl::Kernel kick_rungs_kernel(program, "kick_rungs");
+    cl::Kernel drift_kernel(program, "drift");
+    cl::Kernel kick_active_kernel(program, "kick_active");
 
     // Create buffers
     cl_int err = 0;
 
     DEBUG_PRINT("Create buffers\n");
-    cl_float4 * x = initializePositions();
-    cl_float4 * a = initializeAccelerations();
-    int points = POINTS;
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        std::cerr << "cannot read initial conditions from " << config.input_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int points = config.points;
+    int num_bins = nbody_num_bins(&config);
+
+    //
+    // Buffer for positions array. Positions, velocities and accelerations
+    // stay resident on the device for the whole run.
+    //
+    cl::Buffer x_buffer(context, CL_MEM_READ_WRITE, points * sizeof(cl_float4), &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // Buffer for positions array
+    // Buffer for velocity array
     //
-    cl::Buffer x_buffer(context, CL_MEM_READ_ONLY, POINTS * sizeof(cl_float4), &err);
+    cl::Buffer v_buffer(context, CL_MEM_READ_WRITE, points * sizeof(cl_float4), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
     // Buffer for acceleration array
     //
-    cl::Buffer a_buffer(context, CL_MEM_WRITE_ONLY, POINTS * sizeof(cl_float4), &err);
+    cl::Buffer a_buffer(context, CL_MEM_READ_WRITE, points * sizeof(cl_float4), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
@@ -263,48 +1194,266 @@ int main() {
     //
     // Buffer for center of masses for bins
     //
-    cl::Buffer cm_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * BINS_PER_DIM * BINS_PER_DIM * BINS_PER_DIM, &err);
+    cl::Buffer cm_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * num_bins, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Buffer for the original index of every body in x_buffer
+    //
+    cl::Buffer ids_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Buffers the binning scatters positions, velocities and ids into.
+    // They trade places with x_buffer, v_buffer and ids_buffer every rebin.
+    //
+    cl::Buffer bin_pts_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer bin_v_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer bin_ids_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * points, &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // Buffer for bin pts
+    // Block timestep rung of every body in x_buffer, its partner in the
+    // binning, and the list of active bodies with its length
     //
-    cl::Buffer bin_pts_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * POINTS, &err);
+    cl::Buffer rung_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer bin_rung_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer active_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * points, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer active_count_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
     // Buffer for bin pts offsets for each bin
     //
-    cl::Buffer bin_pts_offsets_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * BINS_PER_DIM * BINS_PER_DIM * BINS_PER_DIM, &err);
+    cl::Buffer bin_pts_offsets_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * (num_bins + 1), &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Buffer for the number of pts in each bin (histogram)
+    //
+    cl::Buffer bin_counts_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * num_bins, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Buffer for the (bin, rank within bin) pair of every point
+    //
+    cl::Buffer pt_bins_buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * 2 * points, &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
+    //
+    // The scan runs as one work-group, as wide as the device allows
+    //
+    size_t scan_local_size = scan_bin_counts_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[0]);
+    scan_local_size = std::min(scan_local_size, (size_t) 256);
+
+    size_t bin_local_size = count_bins_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[0]);
+    bin_local_size = std::min(bin_local_size, (size_t) 256);
+
     // Write buffers
     DEBUG_PRINT("Write buffers\n");
-    err = queue.enqueueWriteBuffer(x_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), x);
+    upload_initial_conditions(queue, &ic, x_buffer, v_buffer, points, profile);
+    nbody_ic_close(&ic);
+
+    err = queue.enqueueWriteBuffer(points_buffer,  CL_FALSE, 0, sizeof(int), &points);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = queue.enqueueWriteBuffer(points_buffer,  CL_TRUE, 0, sizeof(int), &points);
+    std::vector<cl_int> ids(points);
+
+    for (int i = 0; i < points; ++i)
+    {
+        ids[i] = i;
+    }
+
+    err = queue.enqueueWriteBuffer(ids_buffer, CL_FALSE, 0, points * sizeof(cl_int), &ids[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // Rungs start at 0 until the first accelerations assign them
+    //
+    std::vector<cl_int> rungs(points, 0);
+
+    err = queue.enqueueWriteBuffer(rung_buffer, CL_TRUE, 0, points * sizeof(cl_int), &rungs[0]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
-    // Set args, run kernel and read buffers
+    // Snapshot slots and the writer thread
+    //
+    struct snapshot_slot slots[SNAPSHOT_SLOTS];
+    struct snapshot_writer writer;
+    int snapshots = 0;
+
+    for (int i = 0; i < SNAPSHOT_SLOTS; ++i)
+    {
+        init_snapshot_slot(context, copy_queue, &slots[i], points);
+    }
+
+    writer.config = &config;
+    writer.points = points;
+    writer.done = false;
+    writer.output_seconds = 0.0;
+    writer.x.resize(points);
+    writer.v.resize(points);
+    writer.a.resize(points);
+
+    timing.phase[NBODY_PHASE_SETUP] += nbody_now() - t;
+
+    std::thread writer_thread(snapshot_writer_main, &writer);
+    struct snapshot_writer_guard writer_guard = {&writer, writer_thread};
+
+    //
+    // Set args, run kernels for the initial accelerations
+    //
+    rebin(&config, queue, clear_bin_counts_kernel, count_bins_kernel, scan_bin_counts_kernel, construct_bin_pts_kernel, calculate_bins_cm_kernel,
+        cm_buffer, bin_pts_buffer, bin_v_buffer, bin_ids_buffer, bin_rung_buffer, bin_pts_offsets_buffer, bin_counts_buffer, pt_bins_buffer,
+        x_buffer, v_buffer, ids_buffer, rung_buffer, points_buffer, points, bin_local_size, scan_local_size, profile);
+    calculate_nbody(queue, nbody_kernel, x_buffer, cm_buffer, x_buffer, bin_pts_offsets_buffer, a_buffer, points_buffer, points, profile);
+
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        output_snapshot(&config, queue, copy_queue, &writer, &slots[snapshots++ % SNAPSHOT_SLOTS],
+            x_buffer, v_buffer, a_buffer, ids_buffer, points, 0, 0.0f, config.steps > 0, profile);
+    }
+
+    //
+    // Velocity-Verlet integration. Everything stays on the device; the bins
+    // are rebuilt from the drifted positions before every force pass, which
+    // also re-sorts the bodies so neighbouring work-items share neighbour
+    // bins. evaluations counts the bodies forces were computed for.
     //
-    calculate_bins_cm(queue, calculate_bins_cm_kernel, cm_buffer, x_buffer, points_buffer);
-    construct_bin_pts(queue, construct_bin_pts_kernel, bin_pts_buffer, bin_pts_offsets_buffer, x_buffer, points_buffer, cm_buffer);
-    calculate_nbody(queue, nbody_kernel, x_buffer, cm_buffer, bin_pts_buffer, bin_pts_offsets_buffer, a_buffer, points_buffer, a);
+    double evaluations = points;
 
-    for (int i = 0; i < POINTS; ++i)
+    if (config.rungs == 0)
     {
-        printf("(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
-           x[i].x, x[i].y, x[i].z, x[i].w,
-           a[i].x, a[i].y, a[i].z);
+        for (int step = 1; step <= config.steps; ++step)
+        {
+            kick_drift(queue, kick_drift_kernel, x_buffer, v_buffer, a_buffer, points_buffer, points, config.dt, profile);
+
+            rebin(&config, queue, clear_bin_counts_kernel, count_bins_kernel, scan_bin_counts_kernel, construct_bin_pts_kernel, calculate_bins_cm_kernel,
+                cm_buffer, bin_pts_buffer, bin_v_buffer, bin_ids_buffer, bin_rung_buffer, bin_pts_offsets_buffer, bin_counts_buffer, pt_bins_buffer,
+                x_buffer, v_buffer, ids_buffer, rung_buffer, points_buffer, points, bin_local_size, scan_local_size, profile);
+            calculate_nbody(queue, nbody_kernel, x_buffer, cm_buffer, x_buffer, bin_pts_offsets_buffer, a_buffer, points_buffer, points, profile);
+            evaluations += points;
+
+            kick(queue, kick_kernel, v_buffer, a_buffer, points_buffer, points, config.dt, profile);
+
+            if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+            {
+                output_snapshot(&config, queue, copy_queue, &writer, &slots[snapshots++ % SNAPSHOT_SLOTS],
+                    x_buffer, v_buffer, a_buffer, ids_buffer, points, step, step * config.dt, true, profile);
+            }
+        }
+    }
+    else
+    {
+        //
+        // The same with block timesteps (see nbody-common.h): each step
+        // opens every body's step, then runs 2^rungs substeps of drift,
+        // rebin and forces on the active bodies only, whose steps are
+        // closed and, but for the last substep, reopened. The bins still
+        // hold every body, so the inactive ones act as sources at their
+        // drifted positions.
+        //
+        int const substeps = 1 << config.rungs;
+        cl_float const h = ldexpf(config.dt, -config.rungs);
+        int count;
+
+        count = collect_active(queue, collect_active_kernel, rung_buffer, points_buffer, active_buffer, active_count_buffer,
+            points, 0, bin_local_size, profile);
+        kick_active(&config, queue, kick_active_kernel, v_buffer, a_buffer, rung_buffer, active_buffer, active_count_buffer,
+            count, 0, false, false, profile);
+
+        for (int step = 1; step <= config.steps; ++step)
+        {
+            kick_rungs(queue, kick_rungs_kernel, v_buffer, a_buffer, rung_buffer, points_buffer, points, config.dt, profile);
+
+            for (int substep = 1; substep <= substeps; ++substep)
+            {
+                int const min_rung = nbody_min_rung(config.rungs, substep);
+
+                drift(queue, drift_kernel, x_buffer, v_buffer, points_buffer, points, h, profile);
+
+                rebin(&config, queue, clear_bin_counts_kernel, count_bins_kernel, scan_bin_counts_kernel, construct_bin_pts_kernel, calculate_bins_cm_kernel,
+                    cm_buffer, bin_pts_buffer, bin_v_buffer, bin_ids_buffer, bin_rung_buffer, bin_pts_offsets_buffer, bin_counts_buffer, pt_bins_buffer,
+                    x_buffer, v_buffer, ids_buffer, rung_buffer, points_buffer, points, bin_local_size, scan_local_size, profile);
+
+                count = collect_active(queue, collect_active_kernel, rung_buffer, points_buffer, active_buffer, active_count_buffer,
+                    points, min_rung, bin_local_size, profile);
+
+                if (count == 0)
+                {
+                    continue;
+                }
+
+                calculate_nbody_active(queue, nbody_active_kernel, x_buffer, cm_buffer, x_buffer, bin_pts_offsets_buffer, a_buffer,
+                    active_buffer, active_count_buffer, count, profile);
+                evaluations += count;
+
+                kick_active(&config, queue, kick_active_kernel, v_buffer, a_buffer, rung_buffer, active_buffer, active_count_buffer,
+                    count, min_rung, true, substep < substeps, profile);
+            }
+
+            if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+            {
+                output_snapshot(&config, queue, copy_queue, &writer, &slots[snapshots++ % SNAPSHOT_SLOTS],
+                    x_buffer, v_buffer, a_buffer, ids_buffer, points, step, step * config.dt, true, profile);
+            }
+        }
+    }
+
+    //
+    // Drain the pipeline
+    //
+    stop_snapshot_writer(&writer, writer_thread);
+
+    for (int i = 0; i < SNAPSHOT_SLOTS; ++i)
+    {
+        release_snapshot_slot(copy_queue, &slots[i]);
     }
 
-    free(x);
-    free(a);
+    if (profile != NULL)
+    {
+        std::vector<cl_int> counts(num_bins);
+
+        err = queue.finish();
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        for (int phase = 0; phase < NBODY_NUM_PHASES; ++phase)
+        {
+            for (size_t i = 0; i < profile->events[phase].size(); ++i)
+            {
+                timing.phase[phase] += event_seconds(profile->events[phase][i]);
+            }
+        }
+
+        timing.phase[NBODY_PHASE_OUTPUT] = writer.output_seconds;
+
+        //
+        // Interactions are counted from the final binning; bin populations
+        // drift slowly enough over a run for this to stand in for every pass
+        // (per body, for the active lists of block timesteps)
+        //
+        err = queue.enqueueReadBuffer(bin_counts_buffer, CL_TRUE, 0, num_bins * sizeof(cl_int), &counts[0]);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        timing.interactions = nbody_grid_interactions(&config, &counts[0]) * evaluations / points;
+        nbody_timing_report(&config, &timing, "opencl-opt");
+    }
 
     } catch(cl::Error error) {
         std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+    } catch(std::runtime_error error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,127 @@
+/* nbody simulation, particle-mesh version */
+
+#include <CL/cl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "nbody-common.h"
+#include "nbody-pm.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+
+//
+// One full PM (or P3M) pass over x into a
+//
+static void calculate_pm_forces (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm,
+    cl_float4 const * const x,
+    cl_float4 * const a,
+    int const points,
+    struct nbody_timing * const timing
+    )
+{
+    double t;
+
+    t = nbody_now();
+    nbody_pm_assign(config, pm, x, points);
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+
+    t = nbody_now();
+    nbody_pm_solve(pm);
+    nbody_pm_interpolate(pm, x, a, points);
+
+    if (config->p3m)
+    {
+        timing->interactions += nbody_pm_short_range(config, pm, a);
+    }
+
+    timing->phase[NBODY_PHASE_FORCES] += nbody_now() - t;
+}
+
+int main(int argc, char ** argv)
+{
+    struct nbody_config config;
+    struct nbody_pm pm;
+    struct nbody_timing timing;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
+
+    config.threads = omp_get_max_threads();
+#endif
+
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        return 1;
+    }
+
+    int points = config.points;
+
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * v = nbody_ic_velocities(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+
+    if (x == NULL || v == NULL || a == NULL || !nbody_pm_init(&config, &pm))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    calculate_pm_forces(&config, &pm, x, a, points, &timing);
+
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        t = nbody_now();
+        nbody_output(&config, x, v, a, points, 0, 0.0, config.steps > 0);
+        timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+    }
+
+    for (int step = 1; step <= config.steps; ++step)
+    {
+        t = nbody_now();
+        nbody_kick_drift(x, v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        calculate_pm_forces(&config, &pm, x, a, points, &timing);
+
+        t = nbody_now();
+        nbody_kick(v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+        {
+            t = nbody_now();
+            nbody_output(&config, x, v, a, points, step, step * config.dt, 1);
+            timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+        }
+    }
+
+    nbody_timing_report(&config, &timing, config.p3m ? "p3m-seq" : "pm-seq");
+
+    nbody_pm_destroy(&config, &pm);
+    free(x);
+    free(v);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,515 @@
+/* nbody simulation, particle-mesh solver on the bin grid */
+
+#include "nbody-pm.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//
+// Spare nodes on each side of the bodies, for the reach of the stencil
+//
+#define PM_MARGIN (2)
+
+//
+// Mean of 1 / r over a cube of unit edge centred on the origin, which
+// stands in for the unsoftened Green's function at r = 0
+//
+#define PM_SELF_POTENTIAL (2.3800774)
+
+//
+// P3M split: the short-range sum reaches at least one bin length, which is
+// PM_CUTOFF_SPLITS times r_s, where about 2% of the pair force is left.
+// The mesh only resolves the long-range force when r_s is PM_MIN_SPLIT
+// node spacings or more; on 20000 clumped bodies the median force error
+// is 5e-3 at 2.7 spacings (-b 10 --mesh 128) and 2e-2 at 1.3 (--mesh 64).
+//
+#define PM_CUTOFF_SPLITS (4.5)
+#define PM_MIN_SPLIT (2.5)
+
+//
+// Short-range factor table: PM_TABLE_SIZE steps over u = |r| / 2r_s in
+// [0, PM_TABLE_MAX); past it the factor is below 1e-26 and taken as 0
+//
+#define PM_TABLE_SIZE (1024)
+#define PM_TABLE_MAX (8.0f)
+
+static inline long mesh_idx (
+    int const n,
+    int const x,
+    int const y,
+    int const z
+    )
+{
+    return ((long) x * n + y) * n + z;
+}
+
+//
+// Transform every line along one axis of the padded mesh. Elements of a
+// line are stride apart; the lines start at o * outer_stride + i *
+// inner_stride for o < outer_count, i < inner_count, so the transforms of
+// the zero padding, or of what is thrown away, can be skipped.
+//
+static void transform_lines (
+    struct nbody_pm * const pm,
+    double * const data,
+    long const stride,
+    long const outer_stride,
+    int const outer_count,
+    long const inner_stride,
+    int const inner_count,
+    int const inverse
+    )
+{
+    int const n = pm->padded;
+
+    #pragma omp parallel for schedule(static) num_threads(pm->num_threads)
+    for (int l = 0; l < outer_count * inner_count; ++l)
+    {
+#ifdef _OPENMP
+        double * const line = &pm->lines[2L * n * omp_get_thread_num()];
+#else
+        double * const line = pm->lines;
+#endif
+        double * const first = &data[2 * ((l / inner_count) * outer_stride + (l % inner_count) * inner_stride)];
+
+        if (stride == 1)
+        {
+            nbody_fft_transform(&pm->fft, first, inverse);
+            continue;
+        }
+
+        for (int k = 0; k < n; ++k)
+        {
+            line[2 * k] = first[2 * k * stride];
+            line[2 * k + 1] = first[2 * k * stride + 1];
+        }
+
+        nbody_fft_transform(&pm->fft, line, inverse);
+
+        for (int k = 0; k < n; ++k)
+        {
+            first[2 * k * stride] = line[2 * k];
+            first[2 * k * stride + 1] = line[2 * k + 1];
+        }
+    }
+}
+
+//
+// Forward 3-D transform of the padded mesh. With padding only the first
+// mesh nodes of every axis can be nonzero, so the z lines are only
+// transformed where x and y are below it and the y lines where x is.
+//
+static void forward_transform (
+    struct nbody_pm * const pm,
+    double * const data,
+    int const padding
+    )
+{
+    int const n = pm->padded;
+    int const m = padding ? pm->mesh : n;
+
+    transform_lines(pm, data, 1, (long) n * n, m, n, m, 0);
+    transform_lines(pm, data, n, (long) n * n, m, 1, n, 0);
+    transform_lines(pm, data, (long) n * n, n, n, 1, n, 0);
+}
+
+//
+// Inverse of forward_transform, which only needs to be right in the
+// unpadded corner: x lines everywhere, then y lines where x is below the
+// mesh and z lines where x and y are
+//
+static void inverse_transform (
+    struct nbody_pm * const pm,
+    double * const data
+    )
+{
+    int const n = pm->padded;
+    int const m = pm->mesh;
+
+    transform_lines(pm, data, (long) n * n, n, n, 1, n, 1);
+    transform_lines(pm, data, n, (long) n * n, m, 1, n, 1);
+    transform_lines(pm, data, 1, (long) n * n, m, n, m, 1);
+}
+
+//
+// Cloud-in-cell node and weights of a position along one axis. u is in
+// node spacings from node 0 and is clamped to the nodes the bodies may
+// occupy, so the stencil of both nodes stays on the mesh.
+//
+static inline int cic_node (
+    struct nbody_pm const * const pm,
+    float const u,
+    float * const frac
+    )
+{
+    float const clamped = MIN(MAX(u, (float) PM_MARGIN), (float) (pm->mesh - 2 * PM_MARGIN));
+    int const i = MIN((int) clamped, pm->mesh - 2 * PM_MARGIN);
+
+    *frac = clamped - i;
+    return i;
+}
+
+int nbody_pm_init (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm
+    )
+{
+    int n;
+
+    memset(pm, 0, sizeof(*pm));
+
+    pm->mesh = NBODY_PM_MIN_MESH;
+
+    while (pm->mesh < config->pm_mesh)
+    {
+        pm->mesh *= 2;
+    }
+
+    pm->padded = n = 2 * pm->mesh;
+
+    //
+    // The bodies span mesh - 6 node spacings, and so does the grid
+    //
+    pm->split = config->p3m ? (pm->mesh - 3 * PM_MARGIN) / (PM_CUTOFF_SPLITS * config->bins_per_dim) : 0.0;
+
+    if (config->p3m && pm->split < PM_MIN_SPLIT)
+    {
+        int wanted = NBODY_PM_MIN_MESH;
+
+        while (wanted < PM_CUTOFF_SPLITS * PM_MIN_SPLIT * config->bins_per_dim + 3 * PM_MARGIN)
+        {
+            wanted *= 2;
+        }
+
+        fprintf(stderr, "warning: --mesh %d is too coarse for %d bins per dimension: r_s is %.2f mesh spacings,"
+                " at least %.1f keeps the median force error below 1%%; ",
+                pm->mesh, config->bins_per_dim, pm->split, PM_MIN_SPLIT);
+
+        if (wanted <= NBODY_PM_MAX_MESH)
+        {
+            fprintf(stderr, "use --mesh %d\n", wanted);
+        }
+        else
+        {
+            fprintf(stderr, "use fewer bins\n");
+        }
+    }
+
+#ifdef _OPENMP
+    pm->num_threads = omp_get_max_threads();
+#else
+    pm->num_threads = 1;
+#endif
+
+    pm->potential = (double *) malloc(sizeof(double) * 2 * n * n * n);
+    pm->green = (double *) malloc(sizeof(double) * n * n * n);
+    pm->mesh_a = (cl_float4 *) malloc(sizeof(cl_float4) * pm->mesh * pm->mesh * pm->mesh);
+    pm->lines = (double *) malloc(sizeof(double) * 2 * n * pm->num_threads);
+    pm->short_factor = (float *) malloc(sizeof(float) * (PM_TABLE_SIZE + 1));
+
+    if (pm->potential == NULL || pm->green == NULL || pm->mesh_a == NULL || pm->lines == NULL
+        || pm->short_factor == NULL || !nbody_fft_init(&pm->fft, n)
+        || (config->p3m && !construct_grid(config, &pm->grid)))
+    {
+        return 0;
+    }
+
+    //
+    // What the long-range potential -erf(u) / r leaves of the pair force
+    // m r / |r|^3: erfc(u) + 2u / sqrt(pi) e^-u^2
+    //
+    for (int k = 0; k <= PM_TABLE_SIZE; ++k)
+    {
+        double const u = k * (double) PM_TABLE_MAX / PM_TABLE_SIZE;
+
+        pm->short_factor[k] = (float) (erfc(u) + 2.0 / sqrt(M_PI) * u * exp(-u * u));
+    }
+
+    //
+    // Green's function at the periodic distances of the padded mesh, which
+    // equal the true ones for every pair of nodes in the unpadded corner
+    //
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < n; ++x)
+    {
+        for (int y = 0; y < n; ++y)
+        {
+            for (int z = 0; z < n; ++z)
+            {
+                double const dx = MIN(x, n - x);
+                double const dy = MIN(y, n - y);
+                double const dz = MIN(z, n - z);
+                double const r = sqrt(dx * dx + dy * dy + dz * dz);
+                long const i = mesh_idx(n, x, y, z);
+                double g;
+
+                if (pm->split > 0.0)
+                {
+                    g = r == 0.0 ? -1.0 / (pm->split * sqrt(M_PI)) : -erf(r / (2.0 * pm->split)) / r;
+                }
+                else
+                {
+                    g = r == 0.0 ? -PM_SELF_POTENTIAL : -1.0 / r;
+                }
+
+                pm->potential[2 * i] = g;
+                pm->potential[2 * i + 1] = 0.0;
+            }
+        }
+    }
+
+    forward_transform(pm, pm->potential, 0);
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < (long) n * n * n; ++i)
+    {
+        pm->green[i] = pm->potential[2 * i];
+    }
+
+    return 1;
+}
+
+void nbody_pm_destroy (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm
+    )
+{
+    free(pm->potential);
+    free(pm->green);
+    free(pm->mesh_a);
+    free(pm->lines);
+    free(pm->short_factor);
+    nbody_fft_destroy(&pm->fft);
+
+    if (config->p3m)
+    {
+        destroy_grid(&pm->grid);
+    }
+}
+
+void nbody_pm_assign (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm,
+    cl_float4 const * const global_p,
+    int const points
+    )
+{
+    int const n = pm->padded;
+    double * const rho = pm->potential;
+
+    fit_grid(config, &pm->grid, global_p, points);
+
+    if (config->p3m)
+    {
+        update_bin_pts(config, &pm->grid, global_p, points);
+    }
+
+    pm->h = config->bins_per_dim * pm->grid.bin_length / (pm->mesh - 3 * PM_MARGIN);
+    pm->origin.x = pm->grid.origin.x - PM_MARGIN * pm->h;
+    pm->origin.y = pm->grid.origin.y - PM_MARGIN * pm->h;
+    pm->origin.z = pm->grid.origin.z - PM_MARGIN * pm->h;
+
+    memset(rho, 0, sizeof(double) * 2 * n * n * n);
+
+    //
+    // Serial: the scatter would race, and it is O(N) against the
+    // transforms' O(M^3 log M)
+    //
+    for (int i = 0; i < points; ++i)
+    {
+        float fx, fy, fz;
+        int const x = cic_node(pm, (global_p[i].x - pm->origin.x) / pm->h, &fx);
+        int const y = cic_node(pm, (global_p[i].y - pm->origin.y) / pm->h, &fy);
+        int const z = cic_node(pm, (global_p[i].z - pm->origin.z) / pm->h, &fz);
+        double const m = global_p[i].w;
+
+        for (int c = 0; c < 8; ++c)
+        {
+            int const cx = c >> 2;
+            int const cy = (c >> 1) & 1;
+            int const cz = c & 1;
+            double const w = (cx ? fx : 1.0f - fx) * (cy ? fy : 1.0f - fy) * (cz ? fz : 1.0f - fz);
+
+            rho[2 * mesh_idx(n, x + cx, y + cy, z + cz)] += m * w;
+        }
+    }
+}
+
+void nbody_pm_solve (
+    struct nbody_pm * const pm
+    )
+{
+    int const m = pm->mesh;
+    int const n = pm->padded;
+    double * const phi = pm->potential;
+
+    //
+    // Transforms leave a factor n^3; the difference is in node spacings
+    // and so is the Green's function, hence h^2
+    //
+    double const scale = -1.0 / ((double) n * n * n * pm->h * pm->h * 12.0);
+
+    forward_transform(pm, phi, 1);
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < (long) n * n * n; ++i)
+    {
+        phi[2 * i] *= pm->green[i];
+        phi[2 * i + 1] *= pm->green[i];
+    }
+
+    inverse_transform(pm, phi);
+
+    #pragma omp parallel for schedule(static)
+    for (int x = 0; x < m; ++x)
+    {
+        for (int y = 0; y < m; ++y)
+        {
+            for (int z = 0; z < m; ++z)
+            {
+                cl_float4 a = {{0.0f, 0.0f, 0.0f, 0.0f}};
+
+                if (x >= PM_MARGIN && x < m - PM_MARGIN && y >= PM_MARGIN && y < m - PM_MARGIN
+                    && z >= PM_MARGIN && z < m - PM_MARGIN)
+                {
+#define PHI(dx, dy, dz) phi[2 * mesh_idx(n, x + (dx), y + (dy), z + (dz))]
+                    a.x = (float) (scale * (8.0 * (PHI(1, 0, 0) - PHI(-1, 0, 0)) - (PHI(2, 0, 0) - PHI(-2, 0, 0))));
+                    a.y = (float) (scale * (8.0 * (PHI(0, 1, 0) - PHI(0, -1, 0)) - (PHI(0, 2, 0) - PHI(0, -2, 0))));
+                    a.z = (float) (scale * (8.0 * (PHI(0, 0, 1) - PHI(0, 0, -1)) - (PHI(0, 0, 2) - PHI(0, 0, -2))));
+#undef PHI
+                }
+
+                pm->mesh_a[mesh_idx(m, x, y, z)] = a;
+            }
+        }
+    }
+}
+
+void nbody_pm_interpolate (
+    struct nbody_pm const * const pm,
+    cl_float4 const * const global_p,
+    cl_float4 * const global_a,
+    int const points
+    )
+{
+    int const m = pm->mesh;
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        float fx, fy, fz;
+        int const x = cic_node(pm, (global_p[i].x - pm->origin.x) / pm->h, &fx);
+        int const y = cic_node(pm, (global_p[i].y - pm->origin.y) / pm->h, &fy);
+        int const z = cic_node(pm, (global_p[i].z - pm->origin.z) / pm->h, &fz);
+        cl_double4 acc = {{0.0, 0.0, 0.0, 1.0}};
+
+        for (int c = 0; c < 8; ++c)
+        {
+            int const cx = c >> 2;
+            int const cy = (c >> 1) & 1;
+            int const cz = c & 1;
+            double const w = (cx ? fx : 1.0f - fx) * (cy ? fy : 1.0f - fy) * (cz ? fz : 1.0f - fz);
+            cl_float4 const node = pm->mesh_a[mesh_idx(m, x + cx, y + cy, z + cz)];
+
+            acc.x += w * node.x;
+            acc.y += w * node.y;
+            acc.z += w * node.z;
+        }
+
+        global_a[i] = nbody_narrow(acc);
+    }
+}
+
+//
+// Short-range part of the pair force, m r / |r|^3 times the tabulated
+// factor at u = |r| / 2r_s, interpolated linearly
+//
+static inline void short_range_interaction (
+    cl_float4 const bi,
+    cl_float4 const bj,
+    float const table_scale,
+    float const * const short_factor,
+    cl_double4 * const ai
+    )
+{
+    float const rx = bj.x - bi.x;
+    float const ry = bj.y - bi.y;
+    float const rz = bj.z - bi.z;
+    float const dist_sqr = rx * rx + ry * ry + rz * rz + (float) EPS;
+    float const dist = sqrtf(dist_sqr);
+    float const t = dist * table_scale;
+    int const k = (int) t;
+
+    if (k >= PM_TABLE_SIZE)
+    {
+        return;
+    }
+
+    float const f = short_factor[k] + (t - k) * (short_factor[k + 1] - short_factor[k]);
+    float const s = bj.w * f / (dist_sqr * dist);
+
+    ai->x += rx * s;
+    ai->y += ry * s;
+    ai->z += rz * s;
+}
+
+double nbody_pm_short_range (
+    struct nbody_config const * const config,
+    struct nbody_pm const * const pm,
+    cl_float4 * const global_a
+    )
+{
+    int const n = config->bins_per_dim;
+    struct nbody_grid const * const grid = &pm->grid;
+    float const table_scale = (float) (PM_TABLE_SIZE / (PM_TABLE_MAX * 2.0 * pm->split * pm->h));
+    double interactions = 0.0;
+
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+: interactions)
+    for (int b = 0; b < n * n * n; ++b)
+    {
+        int const x = b / (n * n);
+        int const y = (b / n) % n;
+        int const z = b % n;
+        int const z_lo = MAX(0, z - 1);
+        int const z_hi = MIN(n, z + 2);
+
+        for (int i = grid->bin_pts_offsets[b]; i < grid->bin_pts_offsets[b + 1]; ++i)
+        {
+            cl_float4 const pt = grid->bin_pts[i];
+            cl_float4 * const a = &global_a[grid->bin_ids[i]];
+            cl_double4 acc = {{a->x, a->y, a->z, 1.0}};
+
+            //
+            // Each z run of the neighbours is contiguous
+            //
+            for (int nx = MAX(0, x - 1); nx < MIN(n, x + 2); ++nx)
+            {
+                for (int ny = MAX(0, y - 1); ny < MIN(n, y + 2); ++ny)
+                {
+                    int const begin = grid->bin_pts_offsets[BIN_IDX(n, nx, ny, z_lo)];
+                    int const end = grid->bin_pts_offsets[BIN_IDX(n, nx, ny, z_hi - 1) + 1];
+
+                    for (int j = begin; j < end; ++j)
+                    {
+                        short_range_interaction(pt, grid->bin_pts[j], table_scale, pm->short_factor, &acc);
+                    }
+
+                    interactions += end - begin;
+                }
+            }
+
+            *a = nbody_narrow(acc);
+        }
+    }
+
+    return interactions;
+}
@@ -0,0 +1,100 @@
+/* nbody simulation, particle-mesh solver on the bin grid */
+
+#ifndef NBODY_PM_H
+#define NBODY_PM_H
+
+#include <CL/cl.h>
+
+#include "nbody-common.h"
+#include "nbody-grid.h"
+#include "nbody-fft.h"
+
+//
+// Potential on a mesh of M^3 nodes laid over the bin grid, with two spare
+// nodes on every side for the difference stencil. Masses are assigned to
+// the nodes cloud-in-cell, convolved with the Green's function by FFT on
+// the mesh zero-padded to (2M)^3, so the boundaries are isolated rather
+// than periodic (Hockney and Eastwood, ch. 6), differenced into node
+// accelerations with a four-point stencil and interpolated back to the
+// bodies cloud-in-cell. A pass is O(N + M^3 log M).
+//
+// With config->p3m the mesh only carries the long-range part of the force,
+// -erf(r / 2r_s) / r as the potential, and the rest is summed directly
+// over the 27 neighbouring bins. r_s is a 4.5th of the bin length, so the
+// short-range term has fallen to about 2% of the full force at the edge of
+// the neighbourhood. The mesh resolves the long-range part when r_s is at
+// least 2.5 node spacings, that is, M of at least 11.25 times the bins per
+// dimension plus 6; init warns about a coarser mesh.
+// All mesh quantities are kept in units of the node spacing, in which the
+// Green's function does not change when the grid is refitted.
+//
+struct nbody_pm
+{
+    int mesh;                   // M nodes per dimension
+    int padded;                 // 2M
+    double split;               // r_s in node spacings, 0 without p3m
+    double * potential;         // padded^3 complex, interleaved: masses in, potential out
+    double * green;             // padded^3 transform of the Green's function, which is real
+    cl_float4 * mesh_a;         // M^3 node accelerations
+    double * lines;             // per thread, one padded line of complex values
+    float * short_factor;       // p3m: short-range fraction of the pair force, tabulated over |r| / 2r_s
+    int num_threads;
+    struct nbody_fft fft;
+    cl_float4 origin;           // position of node (0, 0, 0)
+    float h;                    // node spacing
+    struct nbody_grid grid;     // mesh placement, and the bins of the short-range sum
+};
+
+//
+// Set up the mesh for config->pm_mesh rounded up to a power of two, and the
+// grid when config->p3m. Returns 0 when out of memory.
+//
+int nbody_pm_init (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm
+    );
+
+void nbody_pm_destroy (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm
+    );
+
+//
+// Fit the grid over the bodies, place the mesh on it and assign the masses
+// to the nodes; with config->p3m also bin the bodies
+//
+void nbody_pm_assign (
+    struct nbody_config const * const config,
+    struct nbody_pm * const pm,
+    cl_float4 const * const global_p,
+    int const points
+    );
+
+//
+// Potential of the assigned masses and its gradient at the nodes
+//
+void nbody_pm_solve (
+    struct nbody_pm * const pm
+    );
+
+//
+// Mesh accelerations of the bodies into global_a, in original body order
+//
+void nbody_pm_interpolate (
+    struct nbody_pm const * const pm,
+    cl_float4 const * const global_p,
+    cl_float4 * const global_a,
+    int const points
+    );
+
+//
+// With config->p3m: add the short-range force over the 27 neighbouring
+// bins to global_a. Returns the number of interactions evaluated.
+//
+double nbody_pm_short_range (
+    struct nbody_config const * const config,
+    struct nbody_pm const * const pm,
+    cl_float4 * const global_a
+    );
+
+#endif
@@ -0,0 +1,316 @@
+/* nbody simulation, OpenCL program building with an on-disk binary cache */
+
+#include "nbody-program.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// Bumped when the cache entry format or key changes
+//
+#define CACHE_VERSION "1"
+
+//
+// 64-bit FNV-1a, continuing from hash
+//
+static unsigned long long fnv1a (
+    unsigned long long hash,
+    char const * const data,
+    size_t const length
+    )
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static unsigned long long fnv1a (
+    unsigned long long hash,
+    std::string const &s
+    )
+{
+    //
+    // Hash the terminator too so that ("ab", "c") and ("a", "bc") differ
+    //
+    return fnv1a(hash, s.c_str(), s.length() + 1);
+}
+
+//
+// The cache directory, created if needed; empty if there is none to use
+//
+static std::string cache_dir (
+    void
+    )
+{
+    std::string dir;
+    char const * env;
+
+    if ((env = getenv("NBODY_CACHE_DIR")) != NULL && env[0] != '\0')
+    {
+        dir = env;
+    }
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+    {
+        dir = std::string(env) + "/nbody";
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        dir = std::string(env) + "/.cache/nbody";
+    }
+    else
+    {
+        return std::string();
+    }
+
+    //
+    // mkdir -p
+    //
+    for (size_t pos = 1; pos <= dir.length(); ++pos)
+    {
+        if (pos == dir.length() || dir[pos] == '/')
+        {
+            mkdir(dir.substr(0, pos).c_str(), 0755);
+        }
+    }
+
+    if (access(dir.c_str(), W_OK | X_OK) != 0)
+    {
+        return std::string();
+    }
+
+    return dir;
+}
+
+static bool read_file (
+    std::string const &path,
+    std::vector<char> &data
+    )
+{
+    FILE * file = fopen(path.c_str(), "rb");
+    long size;
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return false;
+    }
+
+    data.resize(size);
+
+    if (fread(&data[0], 1, size, file) != (size_t) size)
+    {
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+//
+// Write through a temporary file and rename it into place, so concurrent
+// runs never see a partial entry
+//
+static void write_file (
+    std::string const &path,
+    unsigned char const * const data,
+    size_t const size
+    )
+{
+    char tmp_suffix[32];
+    std::string tmp;
+    FILE * file;
+
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%ld.tmp", (long) getpid());
+    tmp = path + tmp_suffix;
+
+    file = fopen(tmp.c_str(), "wb");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    if (fwrite(data, 1, size, file) != size)
+    {
+        fclose(file);
+        remove(tmp.c_str());
+        return;
+    }
+
+    fclose(file);
+
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+    }
+}
+
+static void build (
+    cl::Program &program,
+    std::vector<cl::Device> &devices,
+    char const * const options
+    )
+{
+    try {
+        program.build(devices, options);
+    } catch(cl::Error error) {
+        std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+        throw;
+    }
+}
+
+//
+// Kernel arithmetic for config->precision, see the top of the kernel files
+//
+static std::string precision_options (
+    struct nbody_config const * const config,
+    cl::Device &device
+    )
+{
+    switch (config->precision)
+    {
+    case NBODY_PRECISION_MIXED:
+    case NBODY_PRECISION_DOUBLE:
+        if (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") == std::string::npos)
+        {
+            throw std::runtime_error(device.getInfo<CL_DEVICE_NAME>()
+                + " has no double precision (cl_khr_fp64), use --precision float");
+        }
+
+        return config->precision == NBODY_PRECISION_MIXED
+            ? " -D NBODY_FP64 -D REAL=float -D ACCUM=double"
+            : " -D NBODY_FP64 -D REAL=double -D ACCUM=double";
+    default:
+        return " -D REAL=float -D ACCUM=float";
+    }
+}
+
+cl::Program nbody_build_program (
+    struct nbody_config const * const config,
+    cl::Context &context,
+    cl::Device &device,
+    char const * const source,
+    char const * const engine_options
+    )
+{
+    std::vector<cl::Device> devices(1, device);
+    std::string const all_options = std::string(engine_options) + precision_options(config, device);
+    char const * const options = all_options.c_str();
+    std::string dir;
+    std::string path;
+
+    if (config->kernel_cache)
+    {
+        dir = cache_dir();
+    }
+
+    if (!dir.empty())
+    {
+        unsigned long long key = 0xcbf29ce484222325ULL;
+        char name[32];
+        std::vector<char> binary;
+
+        key = fnv1a(key, std::string(CACHE_VERSION));
+        key = fnv1a(key, device.getInfo<CL_DEVICE_VENDOR>());
+        key = fnv1a(key, device.getInfo<CL_DEVICE_NAME>());
+        key = fnv1a(key, device.getInfo<CL_DEVICE_VERSION>());
+        key = fnv1a(key, device.getInfo<CL_DRIVER_VERSION>());
+        key = fnv1a(key, std::string(options));
+        key = fnv1a(key, std::string(source));
+
+        snprintf(name, sizeof(name), "/%016llx.clbin", key);
+        path = dir + name;
+
+        if (read_file(path, binary))
+        {
+            try {
+                cl::Program::Binaries binaries(1, std::make_pair((void const *) &binary[0], binary.size()));
+                cl::Program program(context, devices, binaries);
+
+                program.build(devices, options);
+                return program;
+            } catch(cl::Error error) {
+                // stale or foreign entry: rebuild from source and replace it
+            }
+        }
+    }
+
+    cl::Program::Sources sources(1, std::make_pair(source, strlen(source)));
+    cl::Program program(context, sources);
+
+    build(program, devices, options);
+
+    if (!path.empty())
+    {
+        size_t size = 0;
+        cl_int err;
+
+        err = clGetProgramInfo((cl_program) program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+
+        if (err == CL_SUCCESS && size > 0)
+        {
+            std::vector<unsigned char> binary(size);
+            unsigned char * ptr = &binary[0];
+
+            err = clGetProgramInfo((cl_program) program(), CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL);
+
+            if (err == CL_SUCCESS)
+            {
+                write_file(path, ptr, size);
+            }
+        }
+    }
+
+    return program;
+}
+
+//
+// Work-group size for the tiled kernels: what the user asked for, or the
+// largest the device allows for the kernel. One tile of float4s has to fit
+// in local memory. Returns 0 if the request is too large.
+//
+size_t nbody_tile_local_size (
+    struct nbody_config const * const config,
+    cl::Kernel &kernel,
+    cl::Device &device
+    )
+{
+    size_t local_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    size_t max_tile = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / sizeof(cl_float4);
+
+    if (config->local_size > 0)
+    {
+        if ((size_t) config->local_size > local_size)
+        {
+            std::cerr << "Local size " << config->local_size << " is larger than the kernel allows ("
+                << local_size << ")" << std::endl;
+            return 0;
+        }
+
+        local_size = config->local_size;
+    }
+
+    if (local_size > max_tile)
+    {
+        local_size = max_tile;
+    }
+
+    return local_size;
+}
@@ -0,0 +1,44 @@
+/* nbody simulation, OpenCL program building with an on-disk binary cache */
+
+#ifndef NBODY_PROGRAM_H
+#define NBODY_PROGRAM_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "nbody-common.h"
+
+//
+// Build source with options for device, plus the -D REAL and -D ACCUM
+// options for config->precision; a device without double precision for a
+// precision that needs it throws std::runtime_error. When
+// config->kernel_cache is set, the program binary is kept under the cache
+// directory ($NBODY_CACHE_DIR, else $XDG_CACHE_HOME/nbody, else
+// ~/.cache/nbody), keyed by a hash of the device, its driver version, the
+// options and the source, and later builds load it with
+// clCreateProgramWithBinary instead of compiling. A cache entry the driver
+// rejects is ignored and overwritten. The build log is printed on stderr if
+// the program fails to build.
+//
+cl::Program nbody_build_program (
+    struct nbody_config const * const config,
+    cl::Context &context,
+    cl::Device &device,
+    char const * const source,
+    char const * const options
+    );
+
+//
+// Work-group size for a kernel that stages one float4 per work-item in
+// local memory: config->local_size if set, else the largest the device
+// allows for kernel, capped by the local memory. Returns 0, after saying
+// why, if config->local_size is more than the kernel allows.
+//
+size_t nbody_tile_local_size (
+    struct nbody_config const * const config,
+    cl::Kernel &kernel,
+    cl::Device &device
+    );
+
+#endif
@@ -6,85 +6,110 @@
 #include <stdio.h>
 #include <math.h>
 
-#define EPS 1e-10
-
-/// runtime on my 2011 computer: 1m; in 2013, 27s.
-// on my 2011 laptop, 1m34s
-#define POINTS 500 * 64
-#define SPACE 1000.0f;
+#include "nbody-common.h"
+#include "nbody-simd.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+
+void calculateForces(int points, int global_id, cl_float4 * globalP, struct nbody_soa const * sources,
+                     nbody_interaction_fn interact, cl_float4 * globalA) {
+    cl_float4 myPosition = globalP[global_id];
 
-void bodyBodyInteraction(cl_float4 bi, cl_float4 bj, cl_float4 *ai) {
-    cl_float4 r;
+    cl_double4 acc = {{0.0, 0.0, 0.0, 1.0}};
 
-    r.x = bj.x - bi.x;
-    r.y = bj.y - bi.y;
-    r.z = bj.z - bi.z;
-    r.w = 1.0f;
+    interact(myPosition, sources, 0, points, &acc);
+    globalA[global_id] = nbody_narrow(acc);
+}
 
-    float distSqr = r.x * r.x + r.y * r.y + r.z * r.z + EPS;
+//
+// --symmetric: every pair (i, j > i) once, applied to both bodies. The
+// bodies go in blocks of PAIR_BLOCK: the pairs inside a block one i at a
+// time, those with every later body through the blocked loop.
+//
+#define PAIR_BLOCK (64)
 
-    float distSixth = distSqr * distSqr * distSqr;
-    float invDistCube = 1.0f/sqrtf(distSixth);
+void calculateForcesSymmetric(int points, struct nbody_soa const * sources, nbody_pair_fn pair,
+                              nbody_pair_block_fn pair_block, struct nbody_soa_acc * acc, cl_float4 * globalA) {
+    nbody_soa_acc_zero(acc, 0, points);
 
-    float s = bj.w * invDistCube;
+    for (int begin = 0; begin < points; begin += PAIR_BLOCK) {
+    int const end = begin + PAIR_BLOCK < points ? begin + PAIR_BLOCK : points;
 
-    ai->x += r.x * s;
-    ai->y += r.y * s;
-    ai->z += r.z * s;
-}
+    for (int i = begin; i < end; i++)
+    pair(sources, i, i + 1, end, acc);
 
-void calculateForces(int points, int global_id, cl_float4 * globalP, cl_float4 * globalA) {
-    cl_float4 myPosition = globalP[global_id];
-    int i;
-
-    cl_float4 acc = {{0.0f, 0.0f, 0.0f, 1.0f}};
+    pair_block(sources, begin, end, end, points, acc);
+    }
 
-    for (i = 0; i < points; i ++) {
-    bodyBodyInteraction(myPosition, globalP[i], &acc);
+    for (int i = 0; i < points; i++) {
+    cl_double4 a = nbody_soa_acc_get(acc, i);
+    a.w = 1.0;
+    globalA[i] = nbody_narrow(a);
     }
-    globalA[global_id] = acc;
 }
 
-cl_float4 * initializePositions() {
-    cl_float4 * pts = (cl_float4*) malloc(sizeof(cl_float4)*POINTS);
-    int i;
-
-    srand(42L); // for deterministic results
+int main(int argc, char ** argv)
+{
+    struct nbody_config config;
+    struct nbody_timing timing;
+    double t;
 
-    for (i = 0; i < POINTS; i++) {
-    // quick and dirty generation of points
-    // not random at all, but I don't care.
-    pts[i].x = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].y = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].z = ((float)rand())/RAND_MAX * SPACE;
-    pts[i].w = 1.0f; // size = 1.0f for simplicity.
-    }
-    return pts;
-}
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
 
-cl_float4 * initializeAccelerations() {
-    cl_float4 * pts = (cl_float4*) malloc(sizeof(cl_float4)*POINTS);
-    int i;
+    struct nbody_ic ic;
 
-    for (i = 0; i < POINTS; i++) {
-    pts[i].x = pts[i].y = pts[i].z = pts[i].w = 0;
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        return 1;
     }
-    return pts;
-}
 
-int main(int argc, char ** argv)
-{
-    cl_float4 * x = initializePositions();
-    cl_float4 * a = initializeAccelerations();
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+    struct nbody_soa sources;
+    struct nbody_soa_acc pair_acc = {NULL, NULL, NULL, NULL, NULL, NULL};
+    nbody_interaction_fn interact = nbody_select_interaction(config.isa, config.precision);
+    nbody_pair_fn pair = nbody_select_pair_interaction(config.isa, config.precision);
+    nbody_pair_block_fn pair_block = nbody_select_pair_block_interaction(config.isa, config.precision);
+
+    if (x == NULL || a == NULL || !nbody_soa_alloc(&sources, config.points)
+        || (config.symmetric && !nbody_soa_acc_alloc(&pair_acc, config.points, config.precision))) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+    }
 
     int i;
-    for (i = 0; i < POINTS; i++)
-    calculateForces(POINTS, i, x, a);
+    for (i = 0; i < config.points; i++)
+    nbody_soa_set(&sources, i, x[i]);
+
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    if (config.symmetric) {
+    calculateForcesSymmetric(config.points, &sources, pair, pair_block, &pair_acc, a);
+    } else {
+    for (i = 0; i < config.points; i++)
+    calculateForces(config.points, i, x, &sources, interact, a);
+    }
 
-    for (i = 0; i < POINTS; i++)
-    printf("(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
-           x[i].x, x[i].y, x[i].z, x[i].w,
-           a[i].x, a[i].y, a[i].z);
+    timing.phase[NBODY_PHASE_FORCES] = nbody_now() - t;
+    //
+    // The symmetric pass evaluates each of the N (N - 1) / 2 pairs once for
+    // both bodies, and skips the self pairs the plain loop counts
+    //
+    timing.interactions = config.symmetric
+        ? (double) config.points * (config.points - 1)
+        : (double) config.points * config.points;
+
+    t = nbody_now();
+    nbody_output(&config, x, NULL, a, config.points, 0, 0.0, 0);
+    timing.phase[NBODY_PHASE_OUTPUT] = nbody_now() - t;
+    nbody_timing_report(&config, &timing, "seq");
+    nbody_soa_free(&sources);
+    nbody_soa_acc_free(&pair_acc);
     free(x);
     free(a);
     return 0;
@@ -0,0 +1,1232 @@
+/* nbody simulation, vectorized body-body interaction over SoA sources */
+
+#include "nbody-simd.h"
+
+#include <stdlib.h>
+#include <immintrin.h>
+
+int nbody_soa_alloc (
+    struct nbody_soa * const soa,
+    int const count
+    )
+{
+    size_t const bytes = sizeof(float) * (count > 0 ? count : 1);
+    void * x = NULL;
+    void * y = NULL;
+    void * z = NULL;
+    void * w = NULL;
+
+    if (posix_memalign(&x, 64, bytes) || posix_memalign(&y, 64, bytes)
+        || posix_memalign(&z, 64, bytes) || posix_memalign(&w, 64, bytes))
+    {
+        free(x);
+        free(y);
+        free(z);
+        free(w);
+        return 0;
+    }
+
+    soa->x = (float *) x;
+    soa->y = (float *) y;
+    soa->z = (float *) z;
+    soa->w = (float *) w;
+
+    return 1;
+}
+
+void nbody_soa_free (
+    struct nbody_soa * const soa
+    )
+{
+    free(soa->x);
+    free(soa->y);
+    free(soa->z);
+    free(soa->w);
+}
+
+int nbody_soa_acc_alloc (
+    struct nbody_soa_acc * const acc,
+    int const count,
+    int const precision
+    )
+{
+    size_t const n = count > 0 ? count : 1;
+    void * x = NULL;
+    void * y = NULL;
+    void * z = NULL;
+    int failed;
+
+    if (precision == NBODY_PRECISION_FLOAT)
+    {
+        failed = posix_memalign(&x, 64, sizeof(float) * n) || posix_memalign(&y, 64, sizeof(float) * n)
+            || posix_memalign(&z, 64, sizeof(float) * n);
+    }
+    else
+    {
+        failed = posix_memalign(&x, 64, sizeof(double) * n) || posix_memalign(&y, 64, sizeof(double) * n)
+            || posix_memalign(&z, 64, sizeof(double) * n);
+    }
+
+    acc->x = acc->y = acc->z = NULL;
+    acc->dx = acc->dy = acc->dz = NULL;
+
+    if (failed)
+    {
+        free(x);
+        free(y);
+        free(z);
+        return 0;
+    }
+
+    if (precision == NBODY_PRECISION_FLOAT)
+    {
+        acc->x = (float *) x;
+        acc->y = (float *) y;
+        acc->z = (float *) z;
+    }
+    else
+    {
+        acc->dx = (double *) x;
+        acc->dy = (double *) y;
+        acc->dz = (double *) z;
+    }
+
+    return 1;
+}
+
+void nbody_soa_acc_free (
+    struct nbody_soa_acc * const acc
+    )
+{
+    free(acc->x);
+    free(acc->y);
+    free(acc->z);
+    free(acc->dx);
+    free(acc->dy);
+    free(acc->dz);
+}
+
+void nbody_soa_acc_zero (
+    struct nbody_soa_acc * const acc,
+    int const begin,
+    int const end
+    )
+{
+    for (int i = begin; acc->x != NULL && i < end; ++i)
+    {
+        acc->x[i] = acc->y[i] = acc->z[i] = 0.0f;
+    }
+
+    for (int i = begin; acc->dx != NULL && i < end; ++i)
+    {
+        acc->dx[i] = acc->dy[i] = acc->dz[i] = 0.0;
+    }
+}
+
+//
+// Reference implementations, same arithmetic as body_body_interaction and
+// body_body_interaction_double.
+//
+static void interaction_scalar (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    cl_float4 acc = {{0.0f, 0.0f, 0.0f, 0.0f}};
+
+    for (int j = begin; j < end; ++j)
+    {
+        cl_float4 bj;
+
+        bj.x = sources->x[j];
+        bj.y = sources->y[j];
+        bj.z = sources->z[j];
+        bj.w = sources->w[j];
+
+        body_body_interaction(bi, bj, &acc);
+    }
+
+    ai->x += acc.x;
+    ai->y += acc.y;
+    ai->z += acc.z;
+}
+
+static void interaction_scalar_mixed (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    for (int j = begin; j < end; ++j)
+    {
+        cl_float4 bj;
+
+        bj.x = sources->x[j];
+        bj.y = sources->y[j];
+        bj.z = sources->z[j];
+        bj.w = sources->w[j];
+
+        nbody_pair_interaction(NBODY_PRECISION_MIXED, bi, bj, ai);
+    }
+}
+
+static void interaction_scalar_double (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    for (int j = begin; j < end; ++j)
+    {
+        cl_float4 bj;
+
+        bj.x = sources->x[j];
+        bj.y = sources->y[j];
+        bj.z = sources->z[j];
+        bj.w = sources->w[j];
+
+        body_body_interaction_double(bi, bj, ai);
+    }
+}
+
+//
+// The float vector versions replace 1/sqrt(d^6) with y^3, where y is the
+// hardware reciprocal square root estimate of d^2 refined by one
+// Newton-Raphson step, y' = y * (1.5 - 0.5 * d^2 * y^2), which brings it to
+// about float precision. The mixed versions compute the same float terms and
+// widen each one into double accumulators; the double versions widen the
+// bodies and divide by a true square root.
+//
+__attribute__((target("avx2,fma")))
+static inline __m256 pair_scale_avx2 (
+    __m256 const rx,
+    __m256 const ry,
+    __m256 const rz,
+    __m256 const w
+    )
+{
+    __m256 const dist_sqr = _mm256_fmadd_ps(rx, rx, _mm256_fmadd_ps(ry, ry, _mm256_fmadd_ps(rz, rz, _mm256_set1_ps((float) EPS))));
+    __m256 inv_dist = _mm256_rsqrt_ps(dist_sqr);
+
+    inv_dist = _mm256_mul_ps(inv_dist,
+        _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), dist_sqr), _mm256_mul_ps(inv_dist, inv_dist), _mm256_set1_ps(1.5f)));
+
+    return _mm256_mul_ps(w, _mm256_mul_ps(inv_dist, _mm256_mul_ps(inv_dist, inv_dist)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline double hsum_pd_avx2 (
+    __m256d const v
+    )
+{
+    double sum[4];
+
+    _mm256_storeu_pd(sum, v);
+
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+__attribute__((target("avx2,fma")))
+static void interaction_avx2 (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m256 const px = _mm256_set1_ps(bi.x);
+    __m256 const py = _mm256_set1_ps(bi.y);
+    __m256 const pz = _mm256_set1_ps(bi.z);
+    __m256 ax = _mm256_setzero_ps();
+    __m256 ay = _mm256_setzero_ps();
+    __m256 az = _mm256_setzero_ps();
+    float sum[8];
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m256 rx = _mm256_sub_ps(_mm256_loadu_ps(&sources->x[j]), px);
+        __m256 ry = _mm256_sub_ps(_mm256_loadu_ps(&sources->y[j]), py);
+        __m256 rz = _mm256_sub_ps(_mm256_loadu_ps(&sources->z[j]), pz);
+        __m256 s = pair_scale_avx2(rx, ry, rz, _mm256_loadu_ps(&sources->w[j]));
+
+        ax = _mm256_fmadd_ps(rx, s, ax);
+        ay = _mm256_fmadd_ps(ry, s, ay);
+        az = _mm256_fmadd_ps(rz, s, az);
+    }
+
+    _mm256_storeu_ps(sum, ax);
+    ai->x += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+    _mm256_storeu_ps(sum, ay);
+    ai->y += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+    _mm256_storeu_ps(sum, az);
+    ai->z += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+
+    interaction_scalar(bi, sources, j, end, ai);
+}
+
+__attribute__((target("avx2,fma")))
+static void interaction_avx2_mixed (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m256 const px = _mm256_set1_ps(bi.x);
+    __m256 const py = _mm256_set1_ps(bi.y);
+    __m256 const pz = _mm256_set1_ps(bi.z);
+    __m256d ax = _mm256_setzero_pd();
+    __m256d ay = _mm256_setzero_pd();
+    __m256d az = _mm256_setzero_pd();
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m256 rx = _mm256_sub_ps(_mm256_loadu_ps(&sources->x[j]), px);
+        __m256 ry = _mm256_sub_ps(_mm256_loadu_ps(&sources->y[j]), py);
+        __m256 rz = _mm256_sub_ps(_mm256_loadu_ps(&sources->z[j]), pz);
+        __m256 s = pair_scale_avx2(rx, ry, rz, _mm256_loadu_ps(&sources->w[j]));
+        __m256 fx = _mm256_mul_ps(rx, s);
+        __m256 fy = _mm256_mul_ps(ry, s);
+        __m256 fz = _mm256_mul_ps(rz, s);
+
+        ax = _mm256_add_pd(ax, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(fx)), _mm256_cvtps_pd(_mm256_extractf128_ps(fx, 1))));
+        ay = _mm256_add_pd(ay, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(fy)), _mm256_cvtps_pd(_mm256_extractf128_ps(fy, 1))));
+        az = _mm256_add_pd(az, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(fz)), _mm256_cvtps_pd(_mm256_extractf128_ps(fz, 1))));
+    }
+
+    ai->x += hsum_pd_avx2(ax);
+    ai->y += hsum_pd_avx2(ay);
+    ai->z += hsum_pd_avx2(az);
+
+    interaction_scalar_mixed(bi, sources, j, end, ai);
+}
+
+__attribute__((target("avx2,fma")))
+static void interaction_avx2_double (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m256d const px = _mm256_set1_pd(bi.x);
+    __m256d const py = _mm256_set1_pd(bi.y);
+    __m256d const pz = _mm256_set1_pd(bi.z);
+    __m256d const eps = _mm256_set1_pd(EPS);
+    __m256d const one = _mm256_set1_pd(1.0);
+    __m256d ax = _mm256_setzero_pd();
+    __m256d ay = _mm256_setzero_pd();
+    __m256d az = _mm256_setzero_pd();
+    int j;
+
+    for (j = begin; j + 4 <= end; j += 4)
+    {
+        __m256d rx = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&sources->x[j])), px);
+        __m256d ry = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&sources->y[j])), py);
+        __m256d rz = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&sources->z[j])), pz);
+        __m256d dist_sqr = _mm256_fmadd_pd(rx, rx, _mm256_fmadd_pd(ry, ry, _mm256_fmadd_pd(rz, rz, eps)));
+        __m256d inv_dist_cube = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_mul_pd(dist_sqr, _mm256_mul_pd(dist_sqr, dist_sqr))));
+        __m256d s = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(&sources->w[j])), inv_dist_cube);
+
+        ax = _mm256_fmadd_pd(rx, s, ax);
+        ay = _mm256_fmadd_pd(ry, s, ay);
+        az = _mm256_fmadd_pd(rz, s, az);
+    }
+
+    ai->x += hsum_pd_avx2(ax);
+    ai->y += hsum_pd_avx2(ay);
+    ai->z += hsum_pd_avx2(az);
+
+    interaction_scalar_double(bi, sources, j, end, ai);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 pair_scale_avx512 (
+    __m512 const rx,
+    __m512 const ry,
+    __m512 const rz,
+    __m512 const w
+    )
+{
+    __m512 const dist_sqr = _mm512_fmadd_ps(rx, rx, _mm512_fmadd_ps(ry, ry, _mm512_fmadd_ps(rz, rz, _mm512_set1_ps((float) EPS))));
+    __m512 inv_dist = _mm512_rsqrt14_ps(dist_sqr);
+
+    inv_dist = _mm512_mul_ps(inv_dist,
+        _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), dist_sqr), _mm512_mul_ps(inv_dist, inv_dist), _mm512_set1_ps(1.5f)));
+
+    return _mm512_mul_ps(w, _mm512_mul_ps(inv_dist, _mm512_mul_ps(inv_dist, inv_dist)));
+}
+
+//
+// Both halves of a float vector widened to double and added
+//
+__attribute__((target("avx512f")))
+static inline __m512d widen_sum_avx512 (
+    __m512 const v
+    )
+{
+    __m256 const lo = _mm512_castps512_ps256(v);
+    __m256 const hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+
+    return _mm512_add_pd(_mm512_cvtps_pd(lo), _mm512_cvtps_pd(hi));
+}
+
+__attribute__((target("avx512f")))
+static void interaction_avx512 (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m512 const px = _mm512_set1_ps(bi.x);
+    __m512 const py = _mm512_set1_ps(bi.y);
+    __m512 const pz = _mm512_set1_ps(bi.z);
+    __m512 ax = _mm512_setzero_ps();
+    __m512 ay = _mm512_setzero_ps();
+    __m512 az = _mm512_setzero_ps();
+
+    for (int j = begin; j < end; j += 16)
+    {
+        //
+        // Masked loads handle the tail; masked-off lanes load zero mass
+        //
+        __mmask16 const mask = (end - j >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (end - j)) - 1);
+        __m512 rx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->x[j]), px);
+        __m512 ry = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->y[j]), py);
+        __m512 rz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->z[j]), pz);
+        __m512 s = pair_scale_avx512(rx, ry, rz, _mm512_maskz_loadu_ps(mask, &sources->w[j]));
+
+        ax = _mm512_fmadd_ps(rx, s, ax);
+        ay = _mm512_fmadd_ps(ry, s, ay);
+        az = _mm512_fmadd_ps(rz, s, az);
+    }
+
+    ai->x += _mm512_reduce_add_ps(ax);
+    ai->y += _mm512_reduce_add_ps(ay);
+    ai->z += _mm512_reduce_add_ps(az);
+}
+
+__attribute__((target("avx512f")))
+static void interaction_avx512_mixed (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m512 const px = _mm512_set1_ps(bi.x);
+    __m512 const py = _mm512_set1_ps(bi.y);
+    __m512 const pz = _mm512_set1_ps(bi.z);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+
+    for (int j = begin; j < end; j += 16)
+    {
+        __mmask16 const mask = (end - j >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (end - j)) - 1);
+        __m512 rx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->x[j]), px);
+        __m512 ry = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->y[j]), py);
+        __m512 rz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &sources->z[j]), pz);
+        __m512 s = pair_scale_avx512(rx, ry, rz, _mm512_maskz_loadu_ps(mask, &sources->w[j]));
+
+        ax = _mm512_add_pd(ax, widen_sum_avx512(_mm512_mul_ps(rx, s)));
+        ay = _mm512_add_pd(ay, widen_sum_avx512(_mm512_mul_ps(ry, s)));
+        az = _mm512_add_pd(az, widen_sum_avx512(_mm512_mul_ps(rz, s)));
+    }
+
+    ai->x += _mm512_reduce_add_pd(ax);
+    ai->y += _mm512_reduce_add_pd(ay);
+    ai->z += _mm512_reduce_add_pd(az);
+}
+
+__attribute__((target("avx512f")))
+static void interaction_avx512_double (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    )
+{
+    __m512d const px = _mm512_set1_pd(bi.x);
+    __m512d const py = _mm512_set1_pd(bi.y);
+    __m512d const pz = _mm512_set1_pd(bi.z);
+    __m512d const eps = _mm512_set1_pd(EPS);
+    __m512d const one = _mm512_set1_pd(1.0);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m512d rx = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&sources->x[j])), px);
+        __m512d ry = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&sources->y[j])), py);
+        __m512d rz = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&sources->z[j])), pz);
+        __m512d dist_sqr = _mm512_fmadd_pd(rx, rx, _mm512_fmadd_pd(ry, ry, _mm512_fmadd_pd(rz, rz, eps)));
+        __m512d inv_dist_cube = _mm512_div_pd(one, _mm512_sqrt_pd(_mm512_mul_pd(dist_sqr, _mm512_mul_pd(dist_sqr, dist_sqr))));
+        __m512d s = _mm512_mul_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&sources->w[j])), inv_dist_cube);
+
+        ax = _mm512_fmadd_pd(rx, s, ax);
+        ay = _mm512_fmadd_pd(ry, s, ay);
+        az = _mm512_fmadd_pd(rz, s, az);
+    }
+
+    ai->x += _mm512_reduce_add_pd(ax);
+    ai->y += _mm512_reduce_add_pd(ay);
+    ai->z += _mm512_reduce_add_pd(az);
+
+    interaction_scalar_double(bi, sources, j, end, ai);
+}
+
+//
+// Symmetric pair loops. Each computes the mass-free term q = r / |r|^3 once
+// and applies m_j q to body i and -m_i q to body j, so the two bodies get
+// exactly opposite momentum changes. The float versions sum in float, like
+// the one-sided ones; the mixed versions widen the same float terms into the
+// double accumulators.
+//
+static void pair_scalar (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    float const px = bodies->x[i];
+    float const py = bodies->y[i];
+    float const pz = bodies->z[i];
+    float const mi = bodies->w[i];
+    float ax = 0.0f;
+    float ay = 0.0f;
+    float az = 0.0f;
+
+    for (int j = begin; j < end; ++j)
+    {
+        float const rx = bodies->x[j] - px;
+        float const ry = bodies->y[j] - py;
+        float const rz = bodies->z[j] - pz;
+        float const dist_sqr = rx * rx + ry * ry + rz * rz + EPS;
+        float const inv_dist_cube = 1.0f / sqrtf(dist_sqr * dist_sqr * dist_sqr);
+        float const qx = rx * inv_dist_cube;
+        float const qy = ry * inv_dist_cube;
+        float const qz = rz * inv_dist_cube;
+        float const mj = bodies->w[j];
+
+        ax += mj * qx;
+        ay += mj * qy;
+        az += mj * qz;
+        acc->x[j] -= mi * qx;
+        acc->y[j] -= mi * qy;
+        acc->z[j] -= mi * qz;
+    }
+
+    acc->x[i] += ax;
+    acc->y[i] += ay;
+    acc->z[i] += az;
+}
+
+static void pair_scalar_mixed (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    float const px = bodies->x[i];
+    float const py = bodies->y[i];
+    float const pz = bodies->z[i];
+    float const mi = bodies->w[i];
+    double ax = 0.0;
+    double ay = 0.0;
+    double az = 0.0;
+
+    for (int j = begin; j < end; ++j)
+    {
+        float const rx = bodies->x[j] - px;
+        float const ry = bodies->y[j] - py;
+        float const rz = bodies->z[j] - pz;
+        float const dist_sqr = rx * rx + ry * ry + rz * rz + EPS;
+        float const inv_dist_cube = 1.0f / sqrtf(dist_sqr * dist_sqr * dist_sqr);
+        float const qx = rx * inv_dist_cube;
+        float const qy = ry * inv_dist_cube;
+        float const qz = rz * inv_dist_cube;
+        float const mj = bodies->w[j];
+
+        ax += mj * qx;
+        ay += mj * qy;
+        az += mj * qz;
+        acc->dx[j] -= mi * qx;
+        acc->dy[j] -= mi * qy;
+        acc->dz[j] -= mi * qz;
+    }
+
+    acc->dx[i] += ax;
+    acc->dy[i] += ay;
+    acc->dz[i] += az;
+}
+
+static void pair_scalar_double (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    double const px = bodies->x[i];
+    double const py = bodies->y[i];
+    double const pz = bodies->z[i];
+    double const mi = bodies->w[i];
+    double ax = 0.0;
+    double ay = 0.0;
+    double az = 0.0;
+
+    for (int j = begin; j < end; ++j)
+    {
+        double const rx = bodies->x[j] - px;
+        double const ry = bodies->y[j] - py;
+        double const rz = bodies->z[j] - pz;
+        double const dist_sqr = rx * rx + ry * ry + rz * rz + EPS;
+        double const inv_dist_cube = 1.0 / sqrt(dist_sqr * dist_sqr * dist_sqr);
+        double const mj = bodies->w[j];
+
+        ax += mj * rx * inv_dist_cube;
+        ay += mj * ry * inv_dist_cube;
+        az += mj * rz * inv_dist_cube;
+        acc->dx[j] -= mi * rx * inv_dist_cube;
+        acc->dy[j] -= mi * ry * inv_dist_cube;
+        acc->dz[j] -= mi * rz * inv_dist_cube;
+    }
+
+    acc->dx[i] += ax;
+    acc->dy[i] += ay;
+    acc->dz[i] += az;
+}
+
+//
+// acc[j .. j + 7] -= v, v a float vector widened to double
+//
+__attribute__((target("avx2,fma")))
+static inline void scatter_sub_avx2 (
+    double * const acc,
+    __m256 const v
+    )
+{
+    _mm256_storeu_pd(acc, _mm256_sub_pd(_mm256_loadu_pd(acc), _mm256_cvtps_pd(_mm256_castps256_ps128(v))));
+    _mm256_storeu_pd(acc + 4, _mm256_sub_pd(_mm256_loadu_pd(acc + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1))));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d widen_sum_avx2 (
+    __m256 const v
+    )
+{
+    return _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static void pair_avx2 (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m256 const px = _mm256_set1_ps(bodies->x[i]);
+    __m256 const py = _mm256_set1_ps(bodies->y[i]);
+    __m256 const pz = _mm256_set1_ps(bodies->z[i]);
+    __m256 const mi = _mm256_set1_ps(bodies->w[i]);
+    __m256 const one = _mm256_set1_ps(1.0f);
+    __m256 ax = _mm256_setzero_ps();
+    __m256 ay = _mm256_setzero_ps();
+    __m256 az = _mm256_setzero_ps();
+    float sum[8];
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m256 rx = _mm256_sub_ps(_mm256_loadu_ps(&bodies->x[j]), px);
+        __m256 ry = _mm256_sub_ps(_mm256_loadu_ps(&bodies->y[j]), py);
+        __m256 rz = _mm256_sub_ps(_mm256_loadu_ps(&bodies->z[j]), pz);
+        __m256 inv_dist_cube = pair_scale_avx2(rx, ry, rz, one);
+        __m256 mj = _mm256_loadu_ps(&bodies->w[j]);
+        __m256 qx = _mm256_mul_ps(rx, inv_dist_cube);
+        __m256 qy = _mm256_mul_ps(ry, inv_dist_cube);
+        __m256 qz = _mm256_mul_ps(rz, inv_dist_cube);
+
+        ax = _mm256_fmadd_ps(mj, qx, ax);
+        ay = _mm256_fmadd_ps(mj, qy, ay);
+        az = _mm256_fmadd_ps(mj, qz, az);
+        _mm256_storeu_ps(&acc->x[j], _mm256_fnmadd_ps(mi, qx, _mm256_loadu_ps(&acc->x[j])));
+        _mm256_storeu_ps(&acc->y[j], _mm256_fnmadd_ps(mi, qy, _mm256_loadu_ps(&acc->y[j])));
+        _mm256_storeu_ps(&acc->z[j], _mm256_fnmadd_ps(mi, qz, _mm256_loadu_ps(&acc->z[j])));
+    }
+
+    _mm256_storeu_ps(sum, ax);
+    acc->x[i] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+    _mm256_storeu_ps(sum, ay);
+    acc->y[i] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+    _mm256_storeu_ps(sum, az);
+    acc->z[i] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+
+    pair_scalar(bodies, i, j, end, acc);
+}
+
+__attribute__((target("avx2,fma")))
+static void pair_avx2_mixed (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m256 const px = _mm256_set1_ps(bodies->x[i]);
+    __m256 const py = _mm256_set1_ps(bodies->y[i]);
+    __m256 const pz = _mm256_set1_ps(bodies->z[i]);
+    __m256 const mi = _mm256_set1_ps(bodies->w[i]);
+    __m256 const one = _mm256_set1_ps(1.0f);
+    __m256d ax = _mm256_setzero_pd();
+    __m256d ay = _mm256_setzero_pd();
+    __m256d az = _mm256_setzero_pd();
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m256 rx = _mm256_sub_ps(_mm256_loadu_ps(&bodies->x[j]), px);
+        __m256 ry = _mm256_sub_ps(_mm256_loadu_ps(&bodies->y[j]), py);
+        __m256 rz = _mm256_sub_ps(_mm256_loadu_ps(&bodies->z[j]), pz);
+        __m256 inv_dist_cube = pair_scale_avx2(rx, ry, rz, one);
+        __m256 mj = _mm256_loadu_ps(&bodies->w[j]);
+        __m256 qx = _mm256_mul_ps(rx, inv_dist_cube);
+        __m256 qy = _mm256_mul_ps(ry, inv_dist_cube);
+        __m256 qz = _mm256_mul_ps(rz, inv_dist_cube);
+
+        ax = _mm256_add_pd(ax, widen_sum_avx2(_mm256_mul_ps(mj, qx)));
+        ay = _mm256_add_pd(ay, widen_sum_avx2(_mm256_mul_ps(mj, qy)));
+        az = _mm256_add_pd(az, widen_sum_avx2(_mm256_mul_ps(mj, qz)));
+        scatter_sub_avx2(&acc->dx[j], _mm256_mul_ps(mi, qx));
+        scatter_sub_avx2(&acc->dy[j], _mm256_mul_ps(mi, qy));
+        scatter_sub_avx2(&acc->dz[j], _mm256_mul_ps(mi, qz));
+    }
+
+    acc->dx[i] += hsum_pd_avx2(ax);
+    acc->dy[i] += hsum_pd_avx2(ay);
+    acc->dz[i] += hsum_pd_avx2(az);
+
+    pair_scalar_mixed(bodies, i, j, end, acc);
+}
+
+__attribute__((target("avx2,fma")))
+static void pair_avx2_double (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m256d const px = _mm256_set1_pd(bodies->x[i]);
+    __m256d const py = _mm256_set1_pd(bodies->y[i]);
+    __m256d const pz = _mm256_set1_pd(bodies->z[i]);
+    __m256d const mi = _mm256_set1_pd(bodies->w[i]);
+    __m256d const eps = _mm256_set1_pd(EPS);
+    __m256d const one = _mm256_set1_pd(1.0);
+    __m256d ax = _mm256_setzero_pd();
+    __m256d ay = _mm256_setzero_pd();
+    __m256d az = _mm256_setzero_pd();
+    int j;
+
+    for (j = begin; j + 4 <= end; j += 4)
+    {
+        __m256d rx = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&bodies->x[j])), px);
+        __m256d ry = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&bodies->y[j])), py);
+        __m256d rz = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(&bodies->z[j])), pz);
+        __m256d dist_sqr = _mm256_fmadd_pd(rx, rx, _mm256_fmadd_pd(ry, ry, _mm256_fmadd_pd(rz, rz, eps)));
+        __m256d inv_dist_cube = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_mul_pd(dist_sqr, _mm256_mul_pd(dist_sqr, dist_sqr))));
+        __m256d mj = _mm256_cvtps_pd(_mm_loadu_ps(&bodies->w[j]));
+        __m256d qx = _mm256_mul_pd(rx, inv_dist_cube);
+        __m256d qy = _mm256_mul_pd(ry, inv_dist_cube);
+        __m256d qz = _mm256_mul_pd(rz, inv_dist_cube);
+
+        ax = _mm256_fmadd_pd(mj, qx, ax);
+        ay = _mm256_fmadd_pd(mj, qy, ay);
+        az = _mm256_fmadd_pd(mj, qz, az);
+        _mm256_storeu_pd(&acc->dx[j], _mm256_fnmadd_pd(mi, qx, _mm256_loadu_pd(&acc->dx[j])));
+        _mm256_storeu_pd(&acc->dy[j], _mm256_fnmadd_pd(mi, qy, _mm256_loadu_pd(&acc->dy[j])));
+        _mm256_storeu_pd(&acc->dz[j], _mm256_fnmadd_pd(mi, qz, _mm256_loadu_pd(&acc->dz[j])));
+    }
+
+    acc->dx[i] += hsum_pd_avx2(ax);
+    acc->dy[i] += hsum_pd_avx2(ay);
+    acc->dz[i] += hsum_pd_avx2(az);
+
+    pair_scalar_double(bodies, i, j, end, acc);
+}
+
+//
+// acc[j .. j + 15] -= v under mask, v a float vector widened to double
+//
+__attribute__((target("avx512f")))
+static inline void scatter_sub_avx512 (
+    double * const acc,
+    __mmask16 const mask,
+    __m512 const v
+    )
+{
+    __mmask8 const lo_mask = (__mmask8) (mask & 0xFF);
+    __mmask8 const hi_mask = (__mmask8) (mask >> 8);
+    __m256 const lo = _mm512_castps512_ps256(v);
+    __m256 const hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+
+    _mm512_mask_storeu_pd(acc, lo_mask, _mm512_sub_pd(_mm512_maskz_loadu_pd(lo_mask, acc), _mm512_cvtps_pd(lo)));
+    _mm512_mask_storeu_pd(acc + 8, hi_mask, _mm512_sub_pd(_mm512_maskz_loadu_pd(hi_mask, acc + 8), _mm512_cvtps_pd(hi)));
+}
+
+__attribute__((target("avx512f")))
+static void pair_avx512 (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m512 const px = _mm512_set1_ps(bodies->x[i]);
+    __m512 const py = _mm512_set1_ps(bodies->y[i]);
+    __m512 const pz = _mm512_set1_ps(bodies->z[i]);
+    __m512 const mi = _mm512_set1_ps(bodies->w[i]);
+    __m512 const one = _mm512_set1_ps(1.0f);
+    __m512 ax = _mm512_setzero_ps();
+    __m512 ay = _mm512_setzero_ps();
+    __m512 az = _mm512_setzero_ps();
+
+    for (int j = begin; j < end; j += 16)
+    {
+        //
+        // Masked-off lanes load zero mass and are not stored
+        //
+        __mmask16 const mask = (end - j >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (end - j)) - 1);
+        __m512 rx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->x[j]), px);
+        __m512 ry = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->y[j]), py);
+        __m512 rz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->z[j]), pz);
+        __m512 inv_dist_cube = pair_scale_avx512(rx, ry, rz, one);
+        __m512 mj = _mm512_maskz_loadu_ps(mask, &bodies->w[j]);
+        __m512 qx = _mm512_mul_ps(rx, inv_dist_cube);
+        __m512 qy = _mm512_mul_ps(ry, inv_dist_cube);
+        __m512 qz = _mm512_mul_ps(rz, inv_dist_cube);
+
+        ax = _mm512_fmadd_ps(mj, qx, ax);
+        ay = _mm512_fmadd_ps(mj, qy, ay);
+        az = _mm512_fmadd_ps(mj, qz, az);
+        _mm512_mask_storeu_ps(&acc->x[j], mask, _mm512_fnmadd_ps(mi, qx, _mm512_maskz_loadu_ps(mask, &acc->x[j])));
+        _mm512_mask_storeu_ps(&acc->y[j], mask, _mm512_fnmadd_ps(mi, qy, _mm512_maskz_loadu_ps(mask, &acc->y[j])));
+        _mm512_mask_storeu_ps(&acc->z[j], mask, _mm512_fnmadd_ps(mi, qz, _mm512_maskz_loadu_ps(mask, &acc->z[j])));
+    }
+
+    acc->x[i] += _mm512_reduce_add_ps(ax);
+    acc->y[i] += _mm512_reduce_add_ps(ay);
+    acc->z[i] += _mm512_reduce_add_ps(az);
+}
+
+__attribute__((target("avx512f")))
+static void pair_avx512_mixed (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m512 const px = _mm512_set1_ps(bodies->x[i]);
+    __m512 const py = _mm512_set1_ps(bodies->y[i]);
+    __m512 const pz = _mm512_set1_ps(bodies->z[i]);
+    __m512 const mi = _mm512_set1_ps(bodies->w[i]);
+    __m512 const one = _mm512_set1_ps(1.0f);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+
+    for (int j = begin; j < end; j += 16)
+    {
+        //
+        // Masked-off lanes load zero mass and are not stored
+        //
+        __mmask16 const mask = (end - j >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (end - j)) - 1);
+        __m512 rx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->x[j]), px);
+        __m512 ry = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->y[j]), py);
+        __m512 rz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &bodies->z[j]), pz);
+        __m512 inv_dist_cube = pair_scale_avx512(rx, ry, rz, one);
+        __m512 mj = _mm512_maskz_loadu_ps(mask, &bodies->w[j]);
+        __m512 qx = _mm512_mul_ps(rx, inv_dist_cube);
+        __m512 qy = _mm512_mul_ps(ry, inv_dist_cube);
+        __m512 qz = _mm512_mul_ps(rz, inv_dist_cube);
+
+        ax = _mm512_add_pd(ax, widen_sum_avx512(_mm512_mul_ps(mj, qx)));
+        ay = _mm512_add_pd(ay, widen_sum_avx512(_mm512_mul_ps(mj, qy)));
+        az = _mm512_add_pd(az, widen_sum_avx512(_mm512_mul_ps(mj, qz)));
+        scatter_sub_avx512(&acc->dx[j], mask, _mm512_mul_ps(mi, qx));
+        scatter_sub_avx512(&acc->dy[j], mask, _mm512_mul_ps(mi, qy));
+        scatter_sub_avx512(&acc->dz[j], mask, _mm512_mul_ps(mi, qz));
+    }
+
+    acc->dx[i] += _mm512_reduce_add_pd(ax);
+    acc->dy[i] += _mm512_reduce_add_pd(ay);
+    acc->dz[i] += _mm512_reduce_add_pd(az);
+}
+
+__attribute__((target("avx512f")))
+static void pair_avx512_double (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m512d const px = _mm512_set1_pd(bodies->x[i]);
+    __m512d const py = _mm512_set1_pd(bodies->y[i]);
+    __m512d const pz = _mm512_set1_pd(bodies->z[i]);
+    __m512d const mi = _mm512_set1_pd(bodies->w[i]);
+    __m512d const eps = _mm512_set1_pd(EPS);
+    __m512d const one = _mm512_set1_pd(1.0);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+    int j;
+
+    for (j = begin; j + 8 <= end; j += 8)
+    {
+        __m512d rx = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&bodies->x[j])), px);
+        __m512d ry = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&bodies->y[j])), py);
+        __m512d rz = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(&bodies->z[j])), pz);
+        __m512d dist_sqr = _mm512_fmadd_pd(rx, rx, _mm512_fmadd_pd(ry, ry, _mm512_fmadd_pd(rz, rz, eps)));
+        __m512d inv_dist_cube = _mm512_div_pd(one, _mm512_sqrt_pd(_mm512_mul_pd(dist_sqr, _mm512_mul_pd(dist_sqr, dist_sqr))));
+        __m512d mj = _mm512_cvtps_pd(_mm256_loadu_ps(&bodies->w[j]));
+        __m512d qx = _mm512_mul_pd(rx, inv_dist_cube);
+        __m512d qy = _mm512_mul_pd(ry, inv_dist_cube);
+        __m512d qz = _mm512_mul_pd(rz, inv_dist_cube);
+
+        ax = _mm512_fmadd_pd(mj, qx, ax);
+        ay = _mm512_fmadd_pd(mj, qy, ay);
+        az = _mm512_fmadd_pd(mj, qz, az);
+        _mm512_storeu_pd(&acc->dx[j], _mm512_fnmadd_pd(mi, qx, _mm512_loadu_pd(&acc->dx[j])));
+        _mm512_storeu_pd(&acc->dy[j], _mm512_fnmadd_pd(mi, qy, _mm512_loadu_pd(&acc->dy[j])));
+        _mm512_storeu_pd(&acc->dz[j], _mm512_fnmadd_pd(mi, qz, _mm512_loadu_pd(&acc->dz[j])));
+    }
+
+    acc->dx[i] += _mm512_reduce_add_pd(ax);
+    acc->dy[i] += _mm512_reduce_add_pd(ay);
+    acc->dz[i] += _mm512_reduce_add_pd(az);
+
+    pair_scalar_double(bodies, i, j, end, acc);
+}
+
+//
+// Blocked pair loops for two disjoint ranges, every i in [i_begin, i_end)
+// against every j in [begin, end). The float vector versions take four bodies
+// i per pass over j, so each vector of acc[j] is loaded and stored once for
+// four bodies instead of once per body; the read-modify-write of acc[j] is
+// what made the symmetric loop cost more per pair than the one-sided one.
+// The other precisions run the per-i loop.
+//
+#define PAIR_BLOCK_PER_I(name, pair)                                    \
+    static void name (                                                  \
+        struct nbody_soa const * const bodies,                          \
+        int const i_begin,                                              \
+        int const i_end,                                                \
+        int const begin,                                                \
+        int const end,                                                  \
+        struct nbody_soa_acc * const acc                                \
+        )                                                               \
+    {                                                                   \
+        for (int i = i_begin; i < i_end; ++i)                           \
+        {                                                               \
+            pair(bodies, i, begin, end, acc);                           \
+        }                                                               \
+    }
+
+PAIR_BLOCK_PER_I(pair_block_scalar, pair_scalar)
+PAIR_BLOCK_PER_I(pair_block_scalar_mixed, pair_scalar_mixed)
+PAIR_BLOCK_PER_I(pair_block_scalar_double, pair_scalar_double)
+PAIR_BLOCK_PER_I(pair_block_avx2_mixed, pair_avx2_mixed)
+PAIR_BLOCK_PER_I(pair_block_avx2_double, pair_avx2_double)
+PAIR_BLOCK_PER_I(pair_block_avx512_mixed, pair_avx512_mixed)
+PAIR_BLOCK_PER_I(pair_block_avx512_double, pair_avx512_double)
+
+__attribute__((target("avx2,fma")))
+static void pair_block_avx2 (
+    struct nbody_soa const * const bodies,
+    int const i_begin,
+    int const i_end,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m256 const one = _mm256_set1_ps(1.0f);
+    float sum[8];
+    int i;
+
+    for (i = i_begin; i + 4 <= i_end; i += 4)
+    {
+        __m256 ax[4];
+        __m256 ay[4];
+        __m256 az[4];
+        int j;
+
+        for (int k = 0; k < 4; ++k)
+        {
+            ax[k] = _mm256_setzero_ps();
+            ay[k] = _mm256_setzero_ps();
+            az[k] = _mm256_setzero_ps();
+        }
+
+        for (j = begin; j + 8 <= end; j += 8)
+        {
+            __m256 const xj = _mm256_loadu_ps(&bodies->x[j]);
+            __m256 const yj = _mm256_loadu_ps(&bodies->y[j]);
+            __m256 const zj = _mm256_loadu_ps(&bodies->z[j]);
+            __m256 const mj = _mm256_loadu_ps(&bodies->w[j]);
+            __m256 sx = _mm256_loadu_ps(&acc->x[j]);
+            __m256 sy = _mm256_loadu_ps(&acc->y[j]);
+            __m256 sz = _mm256_loadu_ps(&acc->z[j]);
+
+            for (int k = 0; k < 4; ++k)
+            {
+                __m256 rx = _mm256_sub_ps(xj, _mm256_set1_ps(bodies->x[i + k]));
+                __m256 ry = _mm256_sub_ps(yj, _mm256_set1_ps(bodies->y[i + k]));
+                __m256 rz = _mm256_sub_ps(zj, _mm256_set1_ps(bodies->z[i + k]));
+                __m256 inv_dist_cube = pair_scale_avx2(rx, ry, rz, one);
+                __m256 mi = _mm256_set1_ps(bodies->w[i + k]);
+                __m256 qx = _mm256_mul_ps(rx, inv_dist_cube);
+                __m256 qy = _mm256_mul_ps(ry, inv_dist_cube);
+                __m256 qz = _mm256_mul_ps(rz, inv_dist_cube);
+
+                ax[k] = _mm256_fmadd_ps(mj, qx, ax[k]);
+                ay[k] = _mm256_fmadd_ps(mj, qy, ay[k]);
+                az[k] = _mm256_fmadd_ps(mj, qz, az[k]);
+                sx = _mm256_fnmadd_ps(mi, qx, sx);
+                sy = _mm256_fnmadd_ps(mi, qy, sy);
+                sz = _mm256_fnmadd_ps(mi, qz, sz);
+            }
+
+            _mm256_storeu_ps(&acc->x[j], sx);
+            _mm256_storeu_ps(&acc->y[j], sy);
+            _mm256_storeu_ps(&acc->z[j], sz);
+        }
+
+        for (int k = 0; k < 4; ++k)
+        {
+            _mm256_storeu_ps(sum, ax[k]);
+            acc->x[i + k] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+            _mm256_storeu_ps(sum, ay[k]);
+            acc->y[i + k] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+            _mm256_storeu_ps(sum, az[k]);
+            acc->z[i + k] += ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+
+            pair_scalar(bodies, i + k, j, end, acc);
+        }
+    }
+
+    for (; i < i_end; ++i)
+    {
+        pair_avx2(bodies, i, begin, end, acc);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void pair_block_avx512 (
+    struct nbody_soa const * const bodies,
+    int const i_begin,
+    int const i_end,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    )
+{
+    __m512 const one = _mm512_set1_ps(1.0f);
+    int i;
+
+    for (i = i_begin; i + 4 <= i_end; i += 4)
+    {
+        __m512 ax[4];
+        __m512 ay[4];
+        __m512 az[4];
+
+        for (int k = 0; k < 4; ++k)
+        {
+            ax[k] = _mm512_setzero_ps();
+            ay[k] = _mm512_setzero_ps();
+            az[k] = _mm512_setzero_ps();
+        }
+
+        for (int j = begin; j < end; j += 16)
+        {
+            //
+            // Masked-off lanes load zero mass and are not stored
+            //
+            __mmask16 const mask = (end - j >= 16) ? (__mmask16) 0xFFFF : (__mmask16) ((1u << (end - j)) - 1);
+            __m512 const xj = _mm512_maskz_loadu_ps(mask, &bodies->x[j]);
+            __m512 const yj = _mm512_maskz_loadu_ps(mask, &bodies->y[j]);
+            __m512 const zj = _mm512_maskz_loadu_ps(mask, &bodies->z[j]);
+            __m512 const mj = _mm512_maskz_loadu_ps(mask, &bodies->w[j]);
+            __m512 sx = _mm512_maskz_loadu_ps(mask, &acc->x[j]);
+            __m512 sy = _mm512_maskz_loadu_ps(mask, &acc->y[j]);
+            __m512 sz = _mm512_maskz_loadu_ps(mask, &acc->z[j]);
+
+            for (int k = 0; k < 4; ++k)
+            {
+                __m512 rx = _mm512_sub_ps(xj, _mm512_set1_ps(bodies->x[i + k]));
+                __m512 ry = _mm512_sub_ps(yj, _mm512_set1_ps(bodies->y[i + k]));
+                __m512 rz = _mm512_sub_ps(zj, _mm512_set1_ps(bodies->z[i + k]));
+                __m512 inv_dist_cube = pair_scale_avx512(rx, ry, rz, one);
+                __m512 mi = _mm512_set1_ps(bodies->w[i + k]);
+                __m512 qx = _mm512_mul_ps(rx, inv_dist_cube);
+                __m512 qy = _mm512_mul_ps(ry, inv_dist_cube);
+                __m512 qz = _mm512_mul_ps(rz, inv_dist_cube);
+
+                ax[k] = _mm512_fmadd_ps(mj, qx, ax[k]);
+                ay[k] = _mm512_fmadd_ps(mj, qy, ay[k]);
+                az[k] = _mm512_fmadd_ps(mj, qz, az[k]);
+                sx = _mm512_fnmadd_ps(mi, qx, sx);
+                sy = _mm512_fnmadd_ps(mi, qy, sy);
+                sz = _mm512_fnmadd_ps(mi, qz, sz);
+            }
+
+            _mm512_mask_storeu_ps(&acc->x[j], mask, sx);
+            _mm512_mask_storeu_ps(&acc->y[j], mask, sy);
+            _mm512_mask_storeu_ps(&acc->z[j], mask, sz);
+        }
+
+        for (int k = 0; k < 4; ++k)
+        {
+            acc->x[i + k] += _mm512_reduce_add_ps(ax[k]);
+            acc->y[i + k] += _mm512_reduce_add_ps(ay[k]);
+            acc->z[i + k] += _mm512_reduce_add_ps(az[k]);
+        }
+    }
+
+    for (; i < i_end; ++i)
+    {
+        pair_avx512(bodies, i, begin, end, acc);
+    }
+}
+
+static int cpu_supports (
+    int const isa
+    )
+{
+    __builtin_cpu_init();
+
+    switch (isa)
+    {
+    case NBODY_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case NBODY_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return 1;
+    }
+}
+
+//
+// Implementations by precision (rows) and ISA (scalar, avx2, avx512, the
+// columns resolve_isa picks)
+//
+static nbody_interaction_fn const interactions[][3] =
+{
+    {interaction_scalar,        interaction_avx2,        interaction_avx512},          // NBODY_PRECISION_FLOAT
+    {interaction_scalar_mixed,  interaction_avx2_mixed,  interaction_avx512_mixed},    // NBODY_PRECISION_MIXED
+    {interaction_scalar_double, interaction_avx2_double, interaction_avx512_double},   // NBODY_PRECISION_DOUBLE
+};
+
+//
+// ISA to run: the widest the CPU supports for NBODY_ISA_AUTO, scalar for an
+// explicit ISA the CPU lacks
+//
+static int resolve_isa (
+    int const isa
+    )
+{
+    int selected = isa;
+
+    if (selected == NBODY_ISA_AUTO)
+    {
+        selected = cpu_supports(NBODY_ISA_AVX512) ? NBODY_ISA_AVX512
+            : cpu_supports(NBODY_ISA_AVX2) ? NBODY_ISA_AVX2
+            : NBODY_ISA_SCALAR;
+    }
+
+    if (!cpu_supports(selected))
+    {
+        selected = NBODY_ISA_SCALAR;
+    }
+
+    switch (selected)
+    {
+    case NBODY_ISA_AVX512:
+        return 2;
+    case NBODY_ISA_AVX2:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+nbody_interaction_fn nbody_select_interaction (
+    int const isa,
+    int const precision
+    )
+{
+    return interactions[precision][resolve_isa(isa)];
+}
+
+static nbody_pair_fn const pair_interactions[][3] =
+{
+    {pair_scalar,        pair_avx2,        pair_avx512},          // NBODY_PRECISION_FLOAT
+    {pair_scalar_mixed,  pair_avx2_mixed,  pair_avx512_mixed},    // NBODY_PRECISION_MIXED
+    {pair_scalar_double, pair_avx2_double, pair_avx512_double},   // NBODY_PRECISION_DOUBLE
+};
+
+nbody_pair_fn nbody_select_pair_interaction (
+    int const isa,
+    int const precision
+    )
+{
+    return pair_interactions[precision][resolve_isa(isa)];
+}
+
+static nbody_pair_block_fn const pair_block_interactions[][3] =
+{
+    {pair_block_scalar,        pair_block_avx2,        pair_block_avx512},          // NBODY_PRECISION_FLOAT
+    {pair_block_scalar_mixed,  pair_block_avx2_mixed,  pair_block_avx512_mixed},    // NBODY_PRECISION_MIXED
+    {pair_block_scalar_double, pair_block_avx2_double, pair_block_avx512_double},   // NBODY_PRECISION_DOUBLE
+};
+
+nbody_pair_block_fn nbody_select_pair_block_interaction (
+    int const isa,
+    int const precision
+    )
+{
+    return pair_block_interactions[precision][resolve_isa(isa)];
+}
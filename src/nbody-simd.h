@@ -0,0 +1,159 @@
+/* nbody simulation, vectorized body-body interaction over SoA sources */
+
+#ifndef NBODY_SIMD_H
+#define NBODY_SIMD_H
+
+#include <CL/cl.h>
+
+#include "nbody-common.h"
+
+//
+// Structure-of-arrays copy of a set of source bodies (mass in w), so a
+// vector loop can load 8 or 16 consecutive coordinates at once.
+//
+struct nbody_soa
+{
+    float * x;
+    float * y;
+    float * z;
+    float * w;
+};
+
+int nbody_soa_alloc (
+    struct nbody_soa * const soa,
+    int const count
+    );
+
+void nbody_soa_free (
+    struct nbody_soa * const soa
+    );
+
+static inline void nbody_soa_set (
+    struct nbody_soa * const soa,
+    int const i,
+    cl_float4 const pt
+    )
+{
+    soa->x[i] = pt.x;
+    soa->y[i] = pt.y;
+    soa->z[i] = pt.z;
+    soa->w[i] = pt.w;
+}
+
+//
+// Accumulate into ai the acceleration on bi due to sources [begin, end).
+// The pair terms and the sum over the range are in the precision the
+// function was selected for; ai is double so the sums of several ranges
+// add up without losing what the range kept.
+//
+typedef void (* nbody_interaction_fn) (
+    cl_float4 const bi,
+    struct nbody_soa const * const sources,
+    int const begin,
+    int const end,
+    cl_double4 * const ai
+    );
+
+//
+// Pick the implementation for isa and precision (enum nbody_precision).
+// NBODY_ISA_AUTO picks the widest one the CPU supports; an explicit ISA the
+// CPU lacks falls back to scalar.
+//
+nbody_interaction_fn nbody_select_interaction (
+    int const isa,
+    int const precision
+    );
+
+//
+// Accumulators for a set of bodies, by the same index as its SoA copy: float
+// for NBODY_PRECISION_FLOAT, double (dx, dy, dz) otherwise. Only the set the
+// precision sums in is allocated; the other stays NULL.
+//
+struct nbody_soa_acc
+{
+    float * x;
+    float * y;
+    float * z;
+    double * dx;
+    double * dy;
+    double * dz;
+};
+
+int nbody_soa_acc_alloc (
+    struct nbody_soa_acc * const acc,
+    int const count,
+    int const precision
+    );
+
+void nbody_soa_acc_free (
+    struct nbody_soa_acc * const acc
+    );
+
+void nbody_soa_acc_zero (
+    struct nbody_soa_acc * const acc,
+    int const begin,
+    int const end
+    );
+
+static inline cl_double4 nbody_soa_acc_get (
+    struct nbody_soa_acc const * const acc,
+    int const i
+    )
+{
+    cl_double4 a = {{0.0, 0.0, 0.0, 0.0}};
+
+    if (acc->x != NULL)
+    {
+        a.x = acc->x[i];
+        a.y = acc->y[i];
+        a.z = acc->z[i];
+    }
+    else
+    {
+        a.x = acc->dx[i];
+        a.y = acc->dy[i];
+        a.z = acc->dz[i];
+    }
+
+    return a;
+}
+
+//
+// Each pair (i, j), j in [begin, end), of one set of bodies evaluated once
+// for both of them: adds the acceleration on i to acc[i] and subtracts the
+// reaction on every j from acc[j], m_i / m_j times the same term. i must not
+// be in [begin, end). acc must have been allocated for the same precision.
+//
+typedef void (* nbody_pair_fn) (
+    struct nbody_soa const * const bodies,
+    int const i,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    );
+
+nbody_pair_fn nbody_select_pair_interaction (
+    int const isa,
+    int const precision
+    );
+
+//
+// The same for every i in [i_begin, i_end) against [begin, end), the two
+// ranges disjoint. Faster than one nbody_pair_fn call per i where several
+// bodies share the same j range, as the bodies of one bin do.
+//
+typedef void (* nbody_pair_block_fn) (
+    struct nbody_soa const * const bodies,
+    int const i_begin,
+    int const i_end,
+    int const begin,
+    int const end,
+    struct nbody_soa_acc * const acc
+    );
+
+nbody_pair_block_fn nbody_select_pair_block_interaction (
+    int const isa,
+    int const precision
+    );
+
+#endif
@@ -0,0 +1,284 @@
+/* nbody simulation, binary snapshot files */
+
+#include "nbody-snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Values transposed per fwrite
+//
+#define CHUNK (16384)
+
+static int write_component (
+    FILE * const file,
+    cl_float4 const * const src,
+    int const component,
+    int const points
+    )
+{
+    float chunk[CHUNK];
+
+    for (int start = 0; start < points; start += CHUNK)
+    {
+        int const n = (points - start < CHUNK) ? points - start : CHUNK;
+
+        for (int i = 0; i < n; ++i)
+        {
+            chunk[i] = src[start + i].s[component];
+        }
+
+        if (fwrite(chunk, sizeof(float), n, file) != (size_t) n)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void nbody_snapshot_init_header (
+    struct nbody_snapshot_header * const header,
+    uint32_t const flags,
+    uint64_t const points,
+    int const step,
+    double const time
+    )
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, NBODY_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = NBODY_SNAPSHOT_VERSION;
+    header->precision = sizeof(float);
+    header->flags = flags;
+    header->points = points;
+    header->step = step;
+    header->time = time;
+}
+
+int nbody_snapshot_write (
+    FILE * const file,
+    cl_float4 const * const p,
+    cl_float4 const * const v,
+    cl_float4 const * const a,
+    int const points,
+    int const step,
+    double const time
+    )
+{
+    struct nbody_snapshot_header header;
+    int err = 0;
+
+    nbody_snapshot_init_header(&header, (v ? NBODY_SNAPSHOT_VELOCITIES : 0) | (a ? NBODY_SNAPSHOT_ACCELERATIONS : 0),
+                               points, step, time);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        return -1;
+    }
+
+    for (int c = 0; c < 4; ++c)
+    {
+        err |= write_component(file, p, c, points);
+    }
+
+    for (int c = 0; v && c < 3; ++c)
+    {
+        err |= write_component(file, v, c, points);
+    }
+
+    for (int c = 0; a && c < 3; ++c)
+    {
+        err |= write_component(file, a, c, points);
+    }
+
+    return err;
+}
+
+size_t nbody_snapshot_record_size (
+    struct nbody_snapshot_header const * const header
+    )
+{
+    size_t arrays = 4;
+
+    arrays += (header->flags & NBODY_SNAPSHOT_VELOCITIES) ? 3 : 0;
+    arrays += (header->flags & NBODY_SNAPSHOT_ACCELERATIONS) ? 3 : 0;
+
+    return sizeof(*header) + arrays * header->points * header->precision;
+}
+
+int nbody_snapshot_map (
+    char const * const path,
+    int const record,
+    struct nbody_snapshot * const snapshot
+    )
+{
+    struct stat st;
+    char const * base;
+    char const * data;
+    size_t pos;
+    int fd;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct nbody_snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    snapshot->map_size = st.st_size;
+    snapshot->map = mmap(NULL, snapshot->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (snapshot->map == MAP_FAILED)
+    {
+        snapshot->map = NULL;
+        return -1;
+    }
+
+    //
+    // Walk the record headers up to the one asked for
+    //
+    base = (char const *) snapshot->map;
+    pos = 0;
+
+    for (int r = 0; ; ++r)
+    {
+        if (pos + sizeof(struct nbody_snapshot_header) > snapshot->map_size)
+        {
+            nbody_snapshot_unmap(snapshot);
+            return -1;
+        }
+
+        memcpy(&snapshot->header, base + pos, sizeof(snapshot->header));
+
+        if (memcmp(snapshot->header.magic, NBODY_SNAPSHOT_MAGIC, sizeof(snapshot->header.magic)) != 0
+            || snapshot->header.version != NBODY_SNAPSHOT_VERSION
+            || snapshot->header.precision != sizeof(float)
+            || pos + nbody_snapshot_record_size(&snapshot->header) > snapshot->map_size)
+        {
+            nbody_snapshot_unmap(snapshot);
+            return -1;
+        }
+
+        if (r == record)
+        {
+            break;
+        }
+
+        pos += nbody_snapshot_record_size(&snapshot->header);
+    }
+
+    //
+    // Hand out pointers to the arrays in file order
+    //
+    data = base + pos + sizeof(struct nbody_snapshot_header);
+
+#define NEXT_ARRAY(field) \
+    { \
+        snapshot->field = (float const *) data; \
+        data += snapshot->header.points * sizeof(float); \
+    }
+
+    NEXT_ARRAY(x);
+    NEXT_ARRAY(y);
+    NEXT_ARRAY(z);
+    NEXT_ARRAY(w);
+
+    if (snapshot->header.flags & NBODY_SNAPSHOT_VELOCITIES)
+    {
+        NEXT_ARRAY(vx);
+        NEXT_ARRAY(vy);
+        NEXT_ARRAY(vz);
+    }
+
+    if (snapshot->header.flags & NBODY_SNAPSHOT_ACCELERATIONS)
+    {
+        NEXT_ARRAY(ax);
+        NEXT_ARRAY(ay);
+        NEXT_ARRAY(az);
+    }
+
+#undef NEXT_ARRAY
+
+    return 0;
+}
+
+void nbody_snapshot_unmap (
+    struct nbody_snapshot * const snapshot
+    )
+{
+    if (snapshot->map)
+    {
+        munmap(snapshot->map, snapshot->map_size);
+    }
+
+    snapshot->map = NULL;
+    snapshot->map_size = 0;
+}
+
+void nbody_print_text (
+    FILE * const file,
+    cl_float4 const * const p,
+    cl_float4 const * const a,
+    int const points
+    )
+{
+    for (int i = 0; i < points; i++)
+    {
+        fprintf(file, "(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
+            p[i].x, p[i].y, p[i].z, p[i].w,
+            a[i].x, a[i].y, a[i].z);
+    }
+}
+
+void nbody_output (
+    struct nbody_config const * const config,
+    cl_float4 const * const p,
+    cl_float4 const * const v,
+    cl_float4 const * const a,
+    int const points,
+    int const step,
+    double const time,
+    int const print_header
+    )
+{
+    static int first = 1;
+    FILE * file;
+
+    if (config->output_path == NULL)
+    {
+        if (print_header)
+        {
+            printf("# step %d time %f\n", step, time);
+        }
+
+        nbody_print_text(stdout, p, a, points);
+        return;
+    }
+
+    //
+    // The first output of a run truncates the file, later ones append
+    //
+    file = fopen(config->output_path, first ? "wb" : "ab");
+    first = 0;
+
+    if (file == NULL || nbody_snapshot_write(file, p, v, a, points, step, time) != 0)
+    {
+        fprintf(stderr, "cannot write snapshot to %s\n", config->output_path);
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(file);
+}
@@ -0,0 +1,137 @@
+/* nbody simulation, binary snapshot files */
+
+#ifndef NBODY_SNAPSHOT_H
+#define NBODY_SNAPSHOT_H
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "nbody-common.h"
+
+#define NBODY_SNAPSHOT_MAGIC "NBODYSNP"
+#define NBODY_SNAPSHOT_VERSION (1)
+
+//
+// Which optional arrays follow the positions and masses
+//
+#define NBODY_SNAPSHOT_VELOCITIES (1u << 0)
+#define NBODY_SNAPSHOT_ACCELERATIONS (1u << 1)
+
+//
+// A snapshot file is one or more records, each a header followed by raw
+// arrays of header.points values (SoA):
+//   x, y, z, mass                  always
+//   vx, vy, vz                     if NBODY_SNAPSHOT_VELOCITIES
+//   ax, ay, az                     if NBODY_SNAPSHOT_ACCELERATIONS
+// Values are native-endian floats of header.precision bytes. Later outputs
+// of a run are appended as further records.
+//
+struct nbody_snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t precision;     // bytes per value
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t points;
+    uint64_t step;
+    double time;
+};
+
+//
+// A record of a memory-mapped snapshot file. The array pointers point into
+// the mapping; the optional ones are NULL when the record does not have them.
+//
+struct nbody_snapshot
+{
+    struct nbody_snapshot_header header;
+    float const * x;
+    float const * y;
+    float const * z;
+    float const * w;
+    float const * vx;
+    float const * vy;
+    float const * vz;
+    float const * ax;
+    float const * ay;
+    float const * az;
+    void * map;
+    size_t map_size;
+};
+
+//
+// Fill in the header of a record of points bodies with the arrays flags
+// says follow. For writers laying out records themselves, like the ranks of
+// nbody-mpi writing their shares of one record.
+//
+void nbody_snapshot_init_header (
+    struct nbody_snapshot_header * const header,
+    uint32_t const flags,
+    uint64_t const points,
+    int const step,
+    double const time
+    );
+
+//
+// Bytes taken by a record with this header, the header included
+//
+size_t nbody_snapshot_record_size (
+    struct nbody_snapshot_header const * const header
+    );
+
+//
+// Append one record to file. v and a may be NULL. The AoS arrays are
+// transposed and written in fixed-size chunks, so no full SoA copy is made.
+// Returns 0 on success.
+//
+int nbody_snapshot_write (
+    FILE * const file,
+    cl_float4 const * const p,
+    cl_float4 const * const v,
+    cl_float4 const * const a,
+    int const points,
+    int const step,
+    double const time
+    );
+
+//
+// Map the record'th record (0 based) of path. Returns 0 on success.
+//
+int nbody_snapshot_map (
+    char const * const path,
+    int const record,
+    struct nbody_snapshot * const snapshot
+    );
+
+void nbody_snapshot_unmap (
+    struct nbody_snapshot * const snapshot
+    );
+
+//
+// The original text dump: "(x,y,z,m) (ax,ay,az)" per body.
+//
+void nbody_print_text (
+    FILE * const file,
+    cl_float4 const * const p,
+    cl_float4 const * const a,
+    int const points
+    );
+
+//
+// Write an output of a run: a binary record appended to config->output_path
+// if one was given, the text dump on stdout otherwise. print_header adds a
+// "# step" line before the text so multi-step dumps can be told apart.
+//
+void nbody_output (
+    struct nbody_config const * const config,
+    cl_float4 const * const p,
+    cl_float4 const * const v,
+    cl_float4 const * const a,
+    int const points,
+    int const step,
+    double const time,
+    int const print_header
+    );
+
+#endif
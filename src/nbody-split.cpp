@@ -0,0 +1,553 @@
+/* nbody simulation, force pass split between every OpenCL device and the host */
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "nbody-common.h"
+#include "nbody-grid.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+#include "nbody-program.h"
+
+//
+// Kernel source, embedded at build time from src/nbody_kernel-opt.cl
+//
+static char const kernel_source[] =
+#include "nbody_kernel-opt.cl.h"
+;
+
+#define DEBUG_PRINT(str, ...) /**/
+//#define DEBUG_PRINT(str, ...) printf(str, ##__VA_ARGS__)
+
+#define ASSERT(x, str, ...) \
+{ \
+    if ((x) == 0) \
+    { \
+        printf("**Assertion Error in function [%s] in file [%s:%d]: " str, __FUNCTION__, \
+            __FILE__, __LINE__, ##__VA_ARGS__); \
+        exit(EXIT_FAILURE); \
+    } \
+}
+
+//
+// Weight of the newest throughput measurement against the running estimate.
+// Below one so a single noisy step does not swing the split.
+//
+#define SPLIT_SMOOTHING (0.5)
+
+//
+// One OpenCL device taking part in the split. Each device gets its own
+// context, so devices of different platforms can be mixed. The commands of
+// the current force pass are kept for timing the device's share.
+//
+struct split_device
+{
+    std::string name;
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Kernel nbody_kernel;
+    cl::Buffer bin_pts_buffer;
+    cl::Buffer cm_buffer;
+    cl::Buffer bin_pts_offsets_buffer;
+    cl::Buffer a_buffer;
+    cl::Buffer points_buffer;
+    std::vector<cl::Event> upload;
+    std::vector<cl::Event> forces;
+    std::vector<cl::Event> download;
+};
+
+//
+// Range of the bin-sorted bodies a worker computes this pass, and its
+// measured throughput in bodies per second. Workers are the devices in
+// order, then the host.
+//
+struct split_share
+{
+    int begin;
+    int end;
+    double rate;
+    double seconds;
+};
+
+//
+// Every device of every platform. CPU devices are left out while the host
+// engine runs, since it already keeps all cores busy.
+//
+std::vector<cl::Device> find_devices (
+    struct nbody_config const * const config
+    )
+{
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> devices;
+
+    cl::Platform::get(&platforms);
+
+    for (size_t p = 0; p < platforms.size(); ++p)
+    {
+        std::vector<cl::Device> platform_devices;
+
+        try {
+            platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &platform_devices);
+        } catch (cl::Error error) {
+            continue;   // CL_DEVICE_NOT_FOUND
+        }
+
+        for (size_t d = 0; d < platform_devices.size(); ++d)
+        {
+            if (config->split_host && (platform_devices[d].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU))
+            {
+                continue;
+            }
+
+            devices.push_back(platform_devices[d]);
+        }
+    }
+
+    return devices;
+}
+
+void init_split_device (
+    struct nbody_config const * const config,
+    cl::Device &device,
+    struct split_device * const dev,
+    char const * const build_options
+    )
+{
+    int const num_bins = nbody_num_bins(config);
+    int const points = config->points;
+    cl_int err;
+
+    dev->name = device.getInfo<CL_DEVICE_NAME>();
+
+    std::vector<cl::Device> context_devices(1, device);
+
+    dev->context = cl::Context(context_devices);
+    dev->queue = cl::CommandQueue(dev->context, device, CL_QUEUE_PROFILING_ENABLE);
+
+    cl::Program program = nbody_build_program(config, dev->context, device, kernel_source, build_options);
+
+    dev->nbody_kernel = cl::Kernel(program, "nbody");
+
+    //
+    // Full-size buffers, so the kernel indexes a share with the same sorted
+    // indices as the host
+    //
+    dev->bin_pts_buffer = cl::Buffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_float4) * points, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->cm_buffer = cl::Buffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_float4) * num_bins, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->bin_pts_offsets_buffer = cl::Buffer(dev->context, CL_MEM_READ_ONLY, sizeof(cl_int) * (num_bins + 1), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->a_buffer = cl::Buffer(dev->context, CL_MEM_WRITE_ONLY, sizeof(cl_float4) * points, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    dev->points_buffer = cl::Buffer(dev->context, CL_MEM_READ_ONLY, sizeof(int), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->points_buffer, CL_TRUE, 0, sizeof(int), &points);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // The bodies a share works on are read from bin_pts, so global_p and
+    // global_bin_pts are the same buffer
+    //
+    DEBUG_PRINT("Set nbody_kernel args\n");
+    err = dev->nbody_kernel.setArg(0, dev->bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->nbody_kernel.setArg(1, dev->cm_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->nbody_kernel.setArg(2, dev->bin_pts_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->nbody_kernel.setArg(3, dev->bin_pts_offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->nbody_kernel.setArg(4, dev->a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->nbody_kernel.setArg(5, dev->points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Cut the sorted bodies into consecutive ranges in proportion to the
+// workers' throughputs. Sorted order is bin order, so every worker gets a
+// run of whole bins plus at most two partial ones.
+//
+void partition_shares (
+    std::vector<struct split_share> &shares,
+    int const points
+    )
+{
+    double total_rate = 0.0;
+    double cumulative = 0.0;
+    int begin = 0;
+
+    for (size_t w = 0; w < shares.size(); ++w)
+    {
+        total_rate += shares[w].rate;
+    }
+
+    for (size_t w = 0; w < shares.size(); ++w)
+    {
+        cumulative += shares[w].rate;
+
+        shares[w].begin = begin;
+        shares[w].end = w + 1 == shares.size() ? points : (int) (points * (cumulative / total_rate));
+        shares[w].end = std::max(shares[w].end, begin);
+        begin = shares[w].end;
+    }
+}
+
+//
+// Fold the pass just timed into the throughput estimates. A worker whose
+// share was empty keeps its old estimate, so it is tried again next pass.
+//
+void update_rates (
+    std::vector<struct split_share> &shares
+    )
+{
+    for (size_t w = 0; w < shares.size(); ++w)
+    {
+        int const count = shares[w].end - shares[w].begin;
+
+        if (count > 0 && shares[w].seconds > 0.0)
+        {
+            shares[w].rate = (1.0 - SPLIT_SMOOTHING) * shares[w].rate + SPLIT_SMOOTHING * (count / shares[w].seconds);
+        }
+    }
+}
+
+//
+// Queue one device's share: upload the centres of mass, the bin offsets and
+// the bodies its bins can see, run the kernel over the share's sorted
+// indices and read the accelerations back into sorted_a. Nothing blocks.
+//
+void enqueue_device_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid const * const grid,
+    struct split_device * const dev,
+    struct split_share const * const share,
+    cl_float4 * const sorted_a
+    )
+{
+    int const bins_per_dim = config->bins_per_dim;
+    int const num_bins = nbody_num_bins(config);
+    int const count = share->end - share->begin;
+    cl_int err;
+
+    dev->upload.clear();
+    dev->forces.clear();
+    dev->download.clear();
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    //
+    // The neighbours of bin b are the linear bins within halo of it, so the
+    // share only needs the bodies of those bins uploaded
+    //
+    int const halo = bins_per_dim * bins_per_dim + bins_per_dim + 1;
+    int const first_bin = grid->pt_bins[grid->bin_ids[share->begin]];
+    int const last_bin = grid->pt_bins[grid->bin_ids[share->end - 1]];
+    int const window_begin = grid->bin_pts_offsets[std::max(0, first_bin - halo)];
+    int const window_end = grid->bin_pts_offsets[std::min(num_bins, last_bin + halo + 1)];
+
+    dev->upload.resize(3);
+    dev->forces.resize(1);
+    dev->download.resize(1);
+
+    DEBUG_PRINT("Write %s window [%d, %d)\n", dev->name.c_str(), window_begin, window_end);
+    err = dev->queue.enqueueWriteBuffer(dev->cm_buffer, CL_FALSE, 0, sizeof(cl_float4) * num_bins,
+        grid->cm, NULL, &dev->upload[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->bin_pts_offsets_buffer, CL_FALSE, 0, sizeof(cl_int) * (num_bins + 1),
+        grid->bin_pts_offsets, NULL, &dev->upload[1]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueWriteBuffer(dev->bin_pts_buffer, CL_FALSE, sizeof(cl_float4) * window_begin,
+        sizeof(cl_float4) * (window_end - window_begin), &grid->bin_pts[window_begin], NULL, &dev->upload[2]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run nbody_kernel on %s for [%d, %d)\n", dev->name.c_str(), share->begin, share->end);
+    err = dev->queue.enqueueNDRangeKernel(dev->nbody_kernel, cl::NDRange(share->begin), cl::NDRange(count), cl::NullRange,
+        NULL, &dev->forces[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.enqueueReadBuffer(dev->a_buffer, CL_FALSE, sizeof(cl_float4) * share->begin, sizeof(cl_float4) * count,
+        &sorted_a[share->begin], NULL, &dev->download[0]);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = dev->queue.flush();
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+}
+
+//
+// Execution time of a command from its profiling counters
+//
+double event_seconds (
+    cl::Event &event
+    )
+{
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    return 1e-9 * (end - start);
+}
+
+//
+// One force pass: bin the bodies on the host, hand every worker its share
+// of the sorted bodies, compute the host's share while the devices run,
+// then scatter the sorted accelerations back to body order. Each worker's
+// time for its share (transfers included for devices) feeds its
+// throughput estimate for the next pass.
+//
+void calculate_split_forces (
+    struct nbody_config const * const config,
+    struct nbody_grid * const grid,
+    std::vector<struct split_device> &devices,
+    std::vector<struct split_share> &shares,
+    cl_float4 const * const x,
+    cl_float4 * const sorted_a,
+    cl_float4 * const a,
+    struct nbody_timing * const timing
+    )
+{
+    int const points = config->points;
+    double t = nbody_now();
+    cl_int err;
+
+    update_bin_pts(config, grid, x, points);
+
+    timing->phase[NBODY_PHASE_BINNING] += nbody_now() - t;
+    t = nbody_now();
+
+    partition_shares(shares, points);
+
+    for (size_t d = 0; d < devices.size(); ++d)
+    {
+        enqueue_device_forces(config, grid, &devices[d], &shares[d], sorted_a);
+    }
+
+    if (config->split_host)
+    {
+        struct split_share * const host = &shares.back();
+        double const host_start = nbody_now();
+
+        calculate_grid_forces_range(config, grid, host->begin, host->end, sorted_a);
+        host->seconds = nbody_now() - host_start;
+    }
+
+    for (size_t d = 0; d < devices.size(); ++d)
+    {
+        struct split_device * const dev = &devices[d];
+
+        shares[d].seconds = 0.0;
+
+        if (dev->download.empty())
+        {
+            continue;
+        }
+
+        err = dev->download[0].wait();
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        cl_ulong start = dev->upload[0].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong end = dev->download[0].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+        shares[d].seconds = 1e-9 * (end - start);
+
+        for (size_t i = 0; i < dev->upload.size(); ++i)
+        {
+            timing->phase[NBODY_PHASE_UPLOAD] += event_seconds(dev->upload[i]);
+        }
+
+        timing->phase[NBODY_PHASE_DOWNLOAD] += event_seconds(dev->download[0]);
+    }
+
+    update_rates(shares);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < points; ++i)
+    {
+        a[grid->bin_ids[i]] = sorted_a[i];
+    }
+
+    timing->phase[NBODY_PHASE_FORCES] += nbody_now() - t;
+
+    if (config->timing_path != NULL)
+    {
+        std::vector<int> counts(nbody_num_bins(config));
+
+        for (int b = 0; b < nbody_num_bins(config); ++b)
+        {
+            counts[b] = grid->bin_pts_offsets[b + 1] - grid->bin_pts_offsets[b];
+        }
+
+        timing->interactions += nbody_grid_interactions(config, &counts[0]);
+    }
+}
+
+int main(int argc, char ** argv) {
+    struct nbody_config config;
+    struct nbody_timing timing;
+    struct nbody_grid grid;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
+
+#ifdef _OPENMP
+    if (config.threads > 0)
+    {
+        omp_set_num_threads(config.threads);
+    }
+
+    config.threads = omp_get_max_threads();
+#endif
+
+    try {
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        std::cerr << "cannot read initial conditions from " << config.input_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int points = config.points;
+
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * v = nbody_ic_velocities(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    cl_float4 * sorted_a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+
+    if (x == NULL || v == NULL || a == NULL || sorted_a == NULL || !construct_grid(&config, &grid))
+    {
+        std::cerr << "out of memory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<cl::Device> cl_devices = find_devices(&config);
+
+    if (cl_devices.empty() && !config.split_host)
+    {
+        std::cerr << "no OpenCL devices" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    //
+    // Grid dimensions are baked in as build options so the kernel compiler
+    // can still constant-fold them
+    //
+    char build_options[128];
+
+    snprintf(build_options, sizeof(build_options), "-D BINS_PER_DIM=%d -D BIN_LENGTH=%.9ef",
+        config.bins_per_dim, config.bin_length);
+
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    std::vector<struct split_device> devices(cl_devices.size());
+
+    for (size_t d = 0; d < cl_devices.size(); ++d)
+    {
+        init_split_device(&config, cl_devices[d], &devices[d], build_options);
+    }
+
+    timing.phase[NBODY_PHASE_BUILD] = nbody_now() - t;
+
+    //
+    // Nothing is known about the workers yet, so the first pass splits
+    // evenly and the later ones follow the measured throughputs
+    //
+    std::vector<struct split_share> shares(devices.size() + (config.split_host ? 1 : 0));
+
+    for (size_t w = 0; w < shares.size(); ++w)
+    {
+        shares[w].rate = 1.0;
+        shares[w].seconds = 0.0;
+    }
+
+    calculate_split_forces(&config, &grid, devices, shares, x, sorted_a, a, &timing);
+
+    if (config.steps == 0 || config.output_interval > 0)
+    {
+        t = nbody_now();
+        nbody_output(&config, x, v, a, points, 0, 0.0, config.steps > 0);
+        timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+    }
+
+    //
+    // Velocity-Verlet integration on the host; only the force passes are
+    // split
+    //
+    for (int step = 1; step <= config.steps; ++step)
+    {
+        t = nbody_now();
+        nbody_kick_drift(x, v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        calculate_split_forces(&config, &grid, devices, shares, x, sorted_a, a, &timing);
+
+        t = nbody_now();
+        nbody_kick(v, a, points, config.dt);
+        timing.phase[NBODY_PHASE_INTEGRATE] += nbody_now() - t;
+
+        if (step == config.steps || (config.output_interval > 0 && step % config.output_interval == 0))
+        {
+            t = nbody_now();
+            nbody_output(&config, x, v, a, points, step, step * config.dt, true);
+            timing.phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
+        }
+    }
+
+    if (config.timing_path != NULL)
+    {
+        for (size_t w = 0; w < shares.size(); ++w)
+        {
+            std::cerr << "split: " << (w < devices.size() ? devices[w].name : std::string("host"))
+                      << " " << 100.0 * (shares[w].end - shares[w].begin) / points << "% of bodies, "
+                      << shares[w].rate << " bodies/s" << std::endl;
+        }
+
+        nbody_timing_report(&config, &timing, "split");
+    }
+
+    destroy_grid(&grid);
+    free(x);
+    free(v);
+    free(a);
+    free(sorted_a);
+
+    } catch(cl::Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::runtime_error error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/* nbody simulation, per-phase timing */
+
+#include "nbody-timing.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static char const * const phase_names[] =
+{
+    "setup",        // NBODY_PHASE_SETUP
+    "build",        // NBODY_PHASE_BUILD
+    "upload",       // NBODY_PHASE_UPLOAD
+    "binning",      // NBODY_PHASE_BINNING
+    "forces",       // NBODY_PHASE_FORCES
+    "integrate",    // NBODY_PHASE_INTEGRATE
+    "download",     // NBODY_PHASE_DOWNLOAD
+    "exchange",     // NBODY_PHASE_EXCHANGE
+    "output",       // NBODY_PHASE_OUTPUT
+};
+
+double nbody_now (
+    void
+    )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+void nbody_timing_start (
+    struct nbody_timing * const timing
+    )
+{
+    for (int i = 0; i < NBODY_NUM_PHASES; ++i)
+    {
+        timing->phase[i] = 0.0;
+    }
+
+    timing->interactions = 0.0;
+    timing->start = nbody_now();
+}
+
+double nbody_grid_interactions (
+    struct nbody_config const * const config,
+    int const * const counts
+    )
+{
+    int const bpd = config->bins_per_dim;
+    int const num_bins = nbody_num_bins(config);
+    double total = 0.0;
+
+    for (int z = 0; z < bpd; ++z)
+    {
+        for (int y = 0; y < bpd; ++y)
+        {
+            for (int x = 0; x < bpd; ++x)
+            {
+                double near = 0.0;
+
+                for (int k = z - 1; k <= z + 1; ++k)
+                {
+                    for (int j = y - 1; j <= y + 1; ++j)
+                    {
+                        for (int i = x - 1; i <= x + 1; ++i)
+                        {
+                            if (i >= 0 && i < bpd && j >= 0 && j < bpd && k >= 0 && k < bpd)
+                            {
+                                near += 1.0 + counts[(k * bpd + j) * bpd + i];
+                            }
+                        }
+                    }
+                }
+
+                total += counts[(z * bpd + y) * bpd + x] * (num_bins + near);
+            }
+        }
+    }
+
+    return total;
+}
+
+void nbody_timing_report (
+    struct nbody_config const * const config,
+    struct nbody_timing const * const timing,
+    char const * const engine
+    )
+{
+    double const total = nbody_now() - timing->start;
+    double const forces = timing->phase[NBODY_PHASE_FORCES];
+    FILE * file;
+    long size;
+
+    if (config->timing_path == NULL)
+    {
+        return;
+    }
+
+    file = fopen(config->timing_path, "a");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot write timings to %s\n", config->timing_path);
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+
+    if (size == 0)
+    {
+        fprintf(file, "engine,points,bins_per_dim,steps,threads,precision");
+
+        for (int i = 0; i < NBODY_NUM_PHASES; ++i)
+        {
+            fprintf(file, ",%s_s", phase_names[i]);
+        }
+
+        fprintf(file, ",total_s,interactions,interactions_per_s,gflops\n");
+    }
+
+    fprintf(file, "%s,%d,%d,%d,%d,%s", engine, config->points, config->bins_per_dim, config->steps, config->threads,
+        nbody_precision_name(config->precision));
+
+    for (int i = 0; i < NBODY_NUM_PHASES; ++i)
+    {
+        fprintf(file, ",%.6f", timing->phase[i]);
+    }
+
+    fprintf(file, ",%.6f,%.0f,%.6e,%.3f\n", total, timing->interactions,
+        forces > 0.0 ? timing->interactions / forces : 0.0,
+        forces > 0.0 ? timing->interactions * NBODY_FLOPS_PER_INTERACTION / forces * 1e-9 : 0.0);
+
+    fclose(file);
+}
@@ -0,0 +1,71 @@
+/* nbody simulation, per-phase timing */
+
+#ifndef NBODY_TIMING_H
+#define NBODY_TIMING_H
+
+#include "nbody-common.h"
+
+//
+// Conventional cost of one body-body interaction (GPU Gems 3, ch. 31), used
+// for the GFLOP/s figure
+//
+#define NBODY_FLOPS_PER_INTERACTION (20)
+
+//
+// Phases of a run. CPU engines record host wall time for each. OpenCL
+// engines record wall time for setup, build and output, and the
+// CL_QUEUE_PROFILING_ENABLE time of the commands for the device phases.
+//
+enum nbody_phase
+{
+    NBODY_PHASE_SETUP,          // platform, context, allocation, initial conditions
+    NBODY_PHASE_BUILD,          // program.build
+    NBODY_PHASE_UPLOAD,         // host to device
+    NBODY_PHASE_BINNING,        // grid or tree construction
+    NBODY_PHASE_FORCES,         // acceleration passes
+    NBODY_PHASE_INTEGRATE,      // kick and drift
+    NBODY_PHASE_DOWNLOAD,       // device to host
+    NBODY_PHASE_EXCHANGE,       // bodies and centres of mass between MPI ranks
+    NBODY_PHASE_OUTPUT,         // formatting and writing snapshots
+    NBODY_NUM_PHASES
+};
+
+struct nbody_timing
+{
+    double start;                           // nbody_now() at the start of the run
+    double phase[NBODY_NUM_PHASES];         // seconds
+    double interactions;                    // body-body and body-cell terms evaluated
+};
+
+//
+// Monotonic wall clock in seconds
+//
+double nbody_now (
+    void
+    );
+
+void nbody_timing_start (
+    struct nbody_timing * const timing
+    );
+
+//
+// Interactions of one force pass of the grid engines, given the number of
+// bodies in every bin: every body sees all centres of mass, one correction
+// per neighbour bin and the bodies of its neighbour bins.
+//
+double nbody_grid_interactions (
+    struct nbody_config const * const config,
+    int const * const counts
+    );
+
+//
+// Append one CSV row for the run to config->timing_path, with a header row
+// if the file is new. Does nothing when no timing file was asked for.
+//
+void nbody_timing_report (
+    struct nbody_config const * const config,
+    struct nbody_timing const * const timing,
+    char const * const engine
+    );
+
+#endif
@@ -0,0 +1,95 @@
+/* nbody simulation, accuracy check of a snapshot against the exact sum */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include "nbody-accuracy.h"
+
+static void usage (
+    char const * const name
+    )
+{
+    fprintf(stderr,
+        "usage: %s [options] FILE [RECORD]\n"
+        "Compares the accelerations in record RECORD (default 0) of snapshot FILE\n"
+        "with the exact direct sum and prints relative error percentiles.\n"
+        "  -S, --samples K          check K bodies picked at random (default 0: all)\n"
+        "  -r, --seed S             seed for picking the bodies (default 1)\n"
+        "  -m, --max-p99 E          exit with status 2 if the p99 error exceeds E\n",
+        name);
+}
+
+int main(int argc, char ** argv)
+{
+    static struct option const long_options[] =
+    {
+        {"samples", required_argument, NULL, 'S'},
+        {"seed",    required_argument, NULL, 'r'},
+        {"max-p99", required_argument, NULL, 'm'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct nbody_snapshot snapshot;
+    struct nbody_accuracy accuracy;
+    unsigned long long samples = 0;
+    unsigned long long seed = 1;
+    double max_p99 = -1.0;
+    int record;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "S:r:m:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            samples = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_p99 = atof(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 && optind != argc - 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    record = (optind == argc - 2) ? atoi(argv[optind + 1]) : 0;
+
+    if (nbody_snapshot_map(argv[optind], record, &snapshot) != 0)
+    {
+        fprintf(stderr, "cannot read record %d of %s\n", record, argv[optind]);
+        return 1;
+    }
+
+    if (nbody_check_accuracy(&snapshot, samples, seed, &accuracy) != 0)
+    {
+        fprintf(stderr, "record %d of %s has no accelerations\n", record, argv[optind]);
+        nbody_snapshot_unmap(&snapshot);
+        return 1;
+    }
+
+    printf("bodies:  %llu\n", (unsigned long long) snapshot.header.points);
+    printf("checked: %d\n", accuracy.samples);
+    printf("mean:    %e\n", accuracy.mean);
+    printf("p50:     %e\n", accuracy.p50);
+    printf("p90:     %e\n", accuracy.p90);
+    printf("p99:     %e\n", accuracy.p99);
+    printf("max:     %e (body %d)\n", accuracy.max, accuracy.worst);
+
+    nbody_snapshot_unmap(&snapshot);
+
+    return (max_p99 >= 0.0 && accuracy.p99 > max_p99) ? 2 : 0;
+}
@@ -3,14 +3,24 @@
 #include <CL/cl.hpp>
 
 #include <iostream>
-#include <fstream>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 #include <random>
 
-#define POINTS (500 * 64)
-#define SPACE (1000.0f)
+#include "nbody-common.h"
+#include "nbody-snapshot.h"
+#include "nbody-ic.h"
+#include "nbody-timing.h"
+#include "nbody-program.h"
+
+//
+// Kernel source, embedded at build time from src/nbody_kernel.cl
+//
+static char const kernel_source[] =
+#include "nbody_kernel.cl.h"
+;
 
 #define DEBUG_PRINT(str, ...) /**/
 //#define DEBUG_PRINT(str, ...) printf(str, ##__VA_ARGS__)
@@ -23,57 +33,314 @@
     } \
 }
 
-cl_float4 * initializePositions ()
+//
+// Execution time of a command from CL_QUEUE_PROFILING_ENABLE counters
+//
+double event_seconds (
+    cl::Event &event
+    )
 {
-    int i;
-    cl_float4 * pts;
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
 
-    //
-    // For deterministic results;
-    //
-    srand(42L);
+    return 1e-9 * (end - start);
+}
+
+//
+// Event for the next command of phase when profiling, else NULL. The
+// pointer is only valid until the next call.
+//
+cl::Event * profile_event (
+    std::vector<cl::Event> * const events,
+    int const phase
+    )
+{
+    if (events == NULL)
+    {
+        return NULL;
+    }
+
+    events[phase].push_back(cl::Event());
+    return &events[phase].back();
+}
+
+//
+// Copy the ensemble back and write every member out, one record each in
+// member order; the text dump marks where each member starts
+//
+void output_ensemble (
+    struct nbody_config const * const config,
+    cl::CommandQueue &queue,
+    cl::Buffer &x_buffer,
+    cl::Buffer &v_buffer,
+    cl::Buffer &a_buffer,
+    std::vector<cl_int> const &offsets,
+    std::vector<cl_float4> &x,
+    std::vector<cl_float4> &v,
+    std::vector<cl_float4> &a,
+    int const step,
+    bool const print_header,
+    std::vector<cl::Event> * const events,
+    struct nbody_timing * const timing
+    )
+{
+    size_t const size = x.size() * sizeof(cl_float4);
+    cl_int err;
+
+    DEBUG_PRINT("Read ensemble of step %d\n", step);
+    err = queue.enqueueReadBuffer(x_buffer, CL_FALSE, 0, size, &x[0], NULL, profile_event(events, NBODY_PHASE_DOWNLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueReadBuffer(v_buffer, CL_FALSE, 0, size, &v[0], NULL, profile_event(events, NBODY_PHASE_DOWNLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueReadBuffer(a_buffer, CL_TRUE, 0, size, &a[0], NULL, profile_event(events, NBODY_PHASE_DOWNLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    pts = (cl_float4 *) malloc(sizeof(cl_float4) * POINTS);
+    double const t = nbody_now();
 
-    for (i = 0; i < POINTS; ++i)
+    for (size_t k = 0; k + 1 < offsets.size(); ++k)
     {
-        pts[i].x = (((float) std::rand()) / RAND_MAX) * SPACE;
-        pts[i].y = (((float) std::rand()) / RAND_MAX) * SPACE;
-        pts[i].z = (((float) std::rand()) / RAND_MAX) * SPACE;
+        if (config->output_path == NULL)
+        {
+            printf("# member %d\n", (int) k);
+        }
 
-        //
-        // Size is 1.0f for simplicity.
-        //
-        pts[i].w = 1.0f;
+        nbody_output(config, &x[offsets[k]], &v[offsets[k]], &a[offsets[k]], offsets[k + 1] - offsets[k],
+            step, step * config->dt, print_header);
     }
 
-    return pts;
+    timing->phase[NBODY_PHASE_OUTPUT] += nbody_now() - t;
 }
 
-cl_float4 * initializeAccelerations ()
+//
+// --ensemble: config->ensemble independent systems in one set of buffers,
+// member after member. One upload, then every force pass is a single
+// nbody_ensemble launch over all of them and every step two more for the
+// integration; snapshots are one download each. Members may differ in size
+// when they come from an input file.
+//
+int run_ensemble (
+    struct nbody_config * const config,
+    cl::Context &context,
+    cl::Device &device,
+    cl::CommandQueue &queue,
+    cl::Program &program,
+    struct nbody_timing * const timing
+    )
 {
-    int i;
-    cl_float4 * pts;
+    double t = nbody_now();
+    std::vector<cl::Event> profile[NBODY_NUM_PHASES];
+    std::vector<cl::Event> * const events = config->timing_path != NULL ? profile : NULL;
+    int const members = config->ensemble;
+    std::vector<cl_int> offsets(members + 1);
+    std::vector<cl_int2> groups;
+    std::vector<cl_float4> x;
+    std::vector<cl_float4> v;
+    double pass_interactions = 0.0;
+    cl_int err = 0;
+
+    cl::Kernel nbody_kernel(program, "nbody_ensemble");
+    cl::Kernel kick_drift_kernel(program, "kick_drift");
+    cl::Kernel kick_kernel(program, "kick");
 
-    /*
-    pts = (cl_float4 *) malloc(sizeof(cl_float4) * POINTS);
+    size_t const local_size = nbody_tile_local_size(config, nbody_kernel, device);
 
-    for (i = 0; i < POINTS; ++i)
+    if (local_size == 0)
     {
-        pts[i].x = 0;
-        pts[i].y = 0;
-        pts[i].z = 0;
-        pts[i].w = 0;
+        return EXIT_FAILURE;
     }
-    */
 
-    pts = (cl_float4 *) calloc(POINTS, sizeof(cl_float4));
+    //
+    // Gather the members and give each the work-groups that tile its range
+    //
+    offsets[0] = 0;
+
+    for (int k = 0; k < members; ++k)
+    {
+        struct nbody_config member_config = *config;
+        struct nbody_ic ic;
+
+        if (nbody_ic_open_member(&member_config, &ic, k) != 0)
+        {
+            fprintf(stderr, "cannot read initial conditions of ensemble member %d\n", k);
+            return EXIT_FAILURE;
+        }
+
+        offsets[k + 1] = offsets[k] + ic.points;
+        x.resize(offsets[k + 1]);
+        v.resize(offsets[k + 1]);
+        nbody_ic_read(&ic, 0, ic.points, &x[offsets[k]], &v[offsets[k]]);
+        nbody_ic_close(&ic);
+
+        for (int first = offsets[k]; first < offsets[k + 1]; first += (int) local_size)
+        {
+            cl_int2 group;
+
+            group.s[0] = first;
+            group.s[1] = k;
+            groups.push_back(group);
+        }
+
+        pass_interactions += (double) ic.points * ic.points;
+    }
+
+    int points = offsets[members];
+    size_t const size = points * sizeof(cl_float4);
+    size_t const global_size = groups.size() * local_size;
+    std::vector<cl_float4> a(points);
+
+    //
+    // Bodies, velocities and accelerations of every member, back to back
+    //
+    cl::Buffer x_buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer v_buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    return pts;
+    cl::Buffer a_buffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer points_buffer(context, CL_MEM_READ_ONLY, sizeof(int), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    //
+    // First body of every member plus the end, and (first target, member)
+    // of every work-group
+    //
+    cl::Buffer offsets_buffer(context, CL_MEM_READ_ONLY, offsets.size() * sizeof(cl_int), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    cl::Buffer groups_buffer(context, CL_MEM_READ_ONLY, groups.size() * sizeof(cl_int2), NULL, &err);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    timing->phase[NBODY_PHASE_SETUP] += nbody_now() - t;
+
+    DEBUG_PRINT("Write ensemble of %d members, %d bodies\n", members, points);
+    err = queue.enqueueWriteBuffer(x_buffer, CL_FALSE, 0, size, &x[0], NULL, profile_event(events, NBODY_PHASE_UPLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueWriteBuffer(v_buffer, CL_FALSE, 0, size, &v[0], NULL, profile_event(events, NBODY_PHASE_UPLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueWriteBuffer(points_buffer, CL_FALSE, 0, sizeof(int), &points, NULL, profile_event(events, NBODY_PHASE_UPLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueWriteBuffer(offsets_buffer, CL_FALSE, 0, offsets.size() * sizeof(cl_int), &offsets[0],
+        NULL, profile_event(events, NBODY_PHASE_UPLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = queue.enqueueWriteBuffer(groups_buffer, CL_TRUE, 0, groups.size() * sizeof(cl_int2), &groups[0],
+        NULL, profile_event(events, NBODY_PHASE_UPLOAD));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Set args\n");
+    err = nbody_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(1, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(2, offsets_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(3, groups_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = nbody_kernel.setArg(4, local_size * sizeof(cl_float4), NULL);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(0, x_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(1, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(2, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(3, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_drift_kernel.setArg(4, config->dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(0, v_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(1, a_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(2, points_buffer);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    err = kick_kernel.setArg(3, config->dt);
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    DEBUG_PRINT("Run\n");
+    err = queue.enqueueNDRangeKernel(nbody_kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size),
+        NULL, profile_event(events, NBODY_PHASE_FORCES));
+    ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+    if (config->steps == 0 || config->output_interval > 0)
+    {
+        output_ensemble(config, queue, x_buffer, v_buffer, a_buffer, offsets, x, v, a, 0, config->steps > 0, events, timing);
+    }
+
+    for (int step = 1; step <= config->steps; ++step)
+    {
+        err = queue.enqueueNDRangeKernel(kick_drift_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+            NULL, profile_event(events, NBODY_PHASE_INTEGRATE));
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        err = queue.enqueueNDRangeKernel(nbody_kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size),
+            NULL, profile_event(events, NBODY_PHASE_FORCES));
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        err = queue.enqueueNDRangeKernel(kick_kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange,
+            NULL, profile_event(events, NBODY_PHASE_INTEGRATE));
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        if (step == config->steps || (config->output_interval > 0 && step % config->output_interval == 0))
+        {
+            output_ensemble(config, queue, x_buffer, v_buffer, a_buffer, offsets, x, v, a, step, true, events, timing);
+        }
+    }
+
+    if (events != NULL)
+    {
+        err = queue.finish();
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+
+        for (int phase = 0; phase < NBODY_NUM_PHASES; ++phase)
+        {
+            for (size_t i = 0; i < events[phase].size(); ++i)
+            {
+                timing->phase[phase] += event_seconds(events[phase][i]);
+            }
+        }
+
+        //
+        // The timing row reports the bodies of the whole ensemble
+        //
+        config->points = points;
+        timing->interactions = pass_interactions * (config->steps + 1);
+        nbody_timing_report(config, timing, "opencl-ensemble");
+    }
+
+    return EXIT_SUCCESS;
 }
 
+int main(int argc, char ** argv) {
+    struct nbody_config config;
+
+    struct nbody_timing timing;
+    double t;
+
+    nbody_parse_args(argc, argv, &config);
+    nbody_timing_start(&timing);
 
-int main() {
     try {
     // Get available platforms
     std::vector<cl::Platform> platforms;
@@ -92,51 +359,62 @@ int main() {
     std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
 
     // Create a command queue and use the first device
-    cl::CommandQueue queue = cl::CommandQueue(context, devices[0]);
+    cl::CommandQueue queue = cl::CommandQueue(context, devices[0],
+        config.timing_path != NULL ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+    // Build program for this device, or load it from the binary cache
+    t = nbody_now();
+    timing.phase[NBODY_PHASE_SETUP] = t - timing.start;
+
+    cl::Program program = nbody_build_program(&config, context, devices[0], kernel_source, "");
 
-    // Read source file
-    std::ifstream sourceFile("src/nbody_kernel.cl");
+    timing.phase[NBODY_PHASE_BUILD] = nbody_now() - t;
+    t = nbody_now();
 
-    if(!sourceFile.is_open()) {
-        std::cerr << "Cannot find kernel file" << std::endl;
-        throw;
+    if (config.ensemble > 0)
+    {
+        return run_ensemble(&config, context, devices[0], queue, program, &timing);
     }
 
-    std::string sourceCode(std::istreambuf_iterator<char>(sourceFile), (std::istreambuf_iterator<char>()));
-    cl::Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length() + 1));
+    // Make kernel
+    cl::Kernel kernel(program, config.tiled ? "nbody_tiled" : "nbody");
 
-    // Make program of the source code in the context
-    cl::Program program = cl::Program(context, source);
+    size_t local_size = nbody_tile_local_size(&config, kernel, devices[0]);
 
-    // Build program for these specific devices
-    try {
-        program.build(devices);
-    } catch(cl::Error error) {
-        std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
-        throw;
+    if (local_size == 0)
+    {
+        return EXIT_FAILURE;
     }
 
-    // Make kernel
-    cl::Kernel kernel(program, "nbody");
+    DEBUG_PRINT("Work-group size %lu\n", (unsigned long) local_size);
 
     // Create buffers
     cl_int err = 0;
 
     DEBUG_PRINT("Create buffers\n");
-    cl_float4 * x = initializePositions();
-    cl_float4 * a = initializeAccelerations();
-    int points = POINTS;
+    struct nbody_ic ic;
+
+    if (nbody_ic_open(&config, &ic) != 0)
+    {
+        fprintf(stderr, "cannot read initial conditions from %s\n", config.input_path);
+        return 1;
+    }
+
+    cl_float4 * x = nbody_ic_positions(&ic);
+    cl_float4 * a = initializeAccelerations(&config);
+    nbody_ic_close(&ic);
+    int points = config.points;
 
     //
     // Buffer for positions array
     //
-    cl::Buffer x_buffer(context, CL_MEM_READ_ONLY, POINTS * sizeof(cl_float4), &err);
+    cl::Buffer x_buffer(context, CL_MEM_READ_ONLY, points * sizeof(cl_float4), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
     // Buffer for acceleration array
     //
-    cl::Buffer a_buffer(context, CL_MEM_WRITE_ONLY, POINTS * sizeof(cl_float4), &err);
+    cl::Buffer a_buffer(context, CL_MEM_WRITE_ONLY, points * sizeof(cl_float4), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     //
@@ -145,15 +423,24 @@ int main() {
     cl::Buffer points_buffer(context, CL_MEM_READ_ONLY, sizeof(int), &err);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
+    //
+    // Commands whose profiling counters make up the device phases
+    //
+    cl::Event upload_events[3];
+    cl::Event kernel_event;
+    cl::Event download_events[2];
+
+    timing.phase[NBODY_PHASE_SETUP] += nbody_now() - t;
+
     // Write buffers
     DEBUG_PRINT("Write buffers\n");
-    err = queue.enqueueWriteBuffer(x_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), x);
+    err = queue.enqueueWriteBuffer(x_buffer, CL_TRUE, 0, points * sizeof(cl_float4), x, NULL, &upload_events[0]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = queue.enqueueWriteBuffer(a_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), a);
+    err = queue.enqueueWriteBuffer(a_buffer, CL_TRUE, 0, points * sizeof(cl_float4), a, NULL, &upload_events[1]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = queue.enqueueWriteBuffer(points_buffer,  CL_TRUE, 0, sizeof(int), &points);
+    err = queue.enqueueWriteBuffer(points_buffer,  CL_TRUE, 0, sizeof(int), &points, NULL, &upload_events[2]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     // Set arguments to kernel
@@ -167,24 +454,58 @@ int main() {
     err = kernel.setArg(2, points_buffer);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
+    if (config.tiled)
+    {
+        err = kernel.setArg(3, local_size * sizeof(cl_float4), NULL);
+        ASSERT(err == CL_SUCCESS, "err was %d\n", err);
+    }
+
     // Run the kernel on specific ND range
     DEBUG_PRINT("Run\n");
-    err = queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(POINTS), cl::NullRange);
+    if (config.tiled)
+    {
+        //
+        // Round the global size up to a whole number of work-groups
+        //
+        size_t global_size = ((points + local_size - 1) / local_size) * local_size;
+
+        err = queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(global_size), cl::NDRange(local_size),
+            NULL, &kernel_event);
+    }
+    else
+    {
+        err = queue.enqueueNDRangeKernel(kernel, cl::NDRange(0), cl::NDRange(points), cl::NullRange, NULL, &kernel_event);
+    }
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
     // Read buffer(s)
     DEBUG_PRINT("Read buffers\n");
-    err = queue.enqueueReadBuffer(x_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), x);
+    err = queue.enqueueReadBuffer(x_buffer, CL_TRUE, 0, points * sizeof(cl_float4), x, NULL, &download_events[0]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    err = queue.enqueueReadBuffer(a_buffer, CL_TRUE, 0, POINTS * sizeof(cl_float4), a);
+    err = queue.enqueueReadBuffer(a_buffer, CL_TRUE, 0, points * sizeof(cl_float4), a, NULL, &download_events[1]);
     ASSERT(err == CL_SUCCESS, "err was %d\n", err);
 
-    for (int i = 0; i < POINTS; ++i)
+    t = nbody_now();
+    nbody_output(&config, x, NULL, a, points, 0, 0.0, false);
+    timing.phase[NBODY_PHASE_OUTPUT] = nbody_now() - t;
+
+    if (config.timing_path != NULL)
     {
-        printf("(%2.2f,%2.2f,%2.2f,%2.2f) (%2.3f,%2.3f,%2.3f)\n",
-           x[i].x, x[i].y, x[i].z, x[i].w,
-           a[i].x, a[i].y, a[i].z);
+        for (int i = 0; i < 3; ++i)
+        {
+            timing.phase[NBODY_PHASE_UPLOAD] += event_seconds(upload_events[i]);
+        }
+
+        timing.phase[NBODY_PHASE_FORCES] = event_seconds(kernel_event);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            timing.phase[NBODY_PHASE_DOWNLOAD] += event_seconds(download_events[i]);
+        }
+
+        timing.interactions = (double) points * points;
+        nbody_timing_report(&config, &timing, config.tiled ? "opencl-tiled" : "opencl");
     }
 
     free(x);
@@ -192,6 +513,9 @@ int main() {
 
     } catch(cl::Error error) {
         std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+    } catch(std::runtime_error error) {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
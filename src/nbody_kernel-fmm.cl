@@ -0,0 +1,330 @@
+#define EPS (1e-10)
+
+//
+// Arithmetic of the force evaluation, passed in by the host as build options
+// (-D REAL=... -D ACCUM=..., see nbody-program.h): pair terms are computed in
+// REAL and summed in ACCUM. Bodies and accelerations stay float4 in memory.
+//
+#ifdef NBODY_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef REAL
+#define REAL float
+#endif
+
+#ifndef ACCUM
+#define ACCUM REAL
+#endif
+
+#define VEC4_(type) type##4
+#define VEC4(type) VEC4_(type)
+#define CONVERT4_(type) convert_##type##4
+#define CONVERT4(type) CONVERT4_(type)
+
+typedef REAL real_t;
+typedef VEC4(REAL) real4_t;
+typedef ACCUM accum_t;
+typedef VEC4(ACCUM) accum4_t;
+
+//
+// Expansion order and hierarchy depth are passed in by the host as build
+// options (-D ORDER=... -D NCOEF=... -D LEVELS=...); these are the defaults.
+// NCOEF is (ORDER + 1)(ORDER + 2)(ORDER + 3) / 6. The coefficient tables
+// (multi-indices, lookup, binomials, M2L terms) are the host's, see
+// nbody-expansion.h, converted to float. The expansions are float whatever
+// REAL is: their truncation error is far above float rounding, so REAL and
+// ACCUM only apply to the near field and the sum.
+//
+#ifndef ORDER
+#define ORDER (4)
+#endif
+
+#ifndef NCOEF
+#define NCOEF (35)
+#endif
+
+#ifndef LEVELS
+#define LEVELS (4)
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define FINEST_CELLS (1 << LEVELS)
+#define CELL_IDX(cells, x, y, z) (((x) * (cells) + (y)) * (cells) + (z))
+
+inline void body_body_interaction (
+    real4_t const bi,
+    real4_t const bj,
+    accum4_t * const ai
+    )
+{
+    real4_t r;
+    real_t dist_sqr;
+    real_t dist_sixth;
+    real_t inv_dist_cube;
+    real_t s;
+
+    r.x = bj.x - bi.x;
+    r.y = bj.y - bi.y;
+    r.z = bj.z - bi.z;
+    r.w = 1;
+
+    dist_sqr = r.x * r.x + r.y * r.y + r.z * r.z + (real_t) EPS;
+
+    dist_sixth = dist_sqr * dist_sqr * dist_sqr;
+    inv_dist_cube = 1 / sqrt(dist_sixth);
+
+    s = bj.w * inv_dist_cube;
+
+    ai->x += (accum_t) (r.x * s);
+    ai->y += (accum_t) (r.y * s);
+    ai->z += (accum_t) (r.z * s);
+}
+
+inline int coef_index (
+    global int const * const lookup,
+    int const kx,
+    int const ky,
+    int const kz
+    )
+{
+    return lookup[(kx * (ORDER + 1) + ky) * (ORDER + 1) + kz];
+}
+
+inline float4 cell_center (
+    float4 const origin,
+    float const bin_length,
+    int const level,
+    int const x,
+    int const y,
+    int const z
+    )
+{
+    float const size = bin_length * (1 << (LEVELS - level));
+
+    return origin + (float4) {(x + 0.5f) * size, (y + 0.5f) * size, (z + 0.5f) * size, 0.0f};
+}
+
+inline void powers (
+    float4 const v,
+    float pw[3][ORDER + 1]
+    )
+{
+    pw[0][0] = pw[1][0] = pw[2][0] = 1.0f;
+
+    for (int i = 1; i <= ORDER; ++i)
+    {
+        pw[0][i] = pw[0][i - 1] * v.x;
+        pw[1][i] = pw[1][i - 1] * v.y;
+        pw[2][i] = pw[2][i - 1] * v.z;
+    }
+}
+
+//
+// Kernel coefficients T_k(r), by the recurrence in nbody-expansion.h
+//
+inline void derivatives (
+    global int const * const k,
+    global int const * const lookup,
+    float4 const r,
+    float t[NCOEF]
+    )
+{
+    float const r2 = r.x * r.x + r.y * r.y + r.z * r.z;
+
+    t[0] = rsqrt(r2);
+
+    for (int i = 1; i < NCOEF; ++i)
+    {
+        int const kx = k[3 * i];
+        int const ky = k[3 * i + 1];
+        int const kz = k[3 * i + 2];
+        int const n = kx + ky + kz;
+        float s1 = 0.0f;
+        float s2 = 0.0f;
+
+        if (kx > 0) s1 += r.x * t[coef_index(lookup, kx - 1, ky, kz)];
+        if (ky > 0) s1 += r.y * t[coef_index(lookup, kx, ky - 1, kz)];
+        if (kz > 0) s1 += r.z * t[coef_index(lookup, kx, ky, kz - 1)];
+        if (kx > 1) s2 += t[coef_index(lookup, kx - 2, ky, kz)];
+        if (ky > 1) s2 += t[coef_index(lookup, kx, ky - 2, kz)];
+        if (kz > 1) s2 += t[coef_index(lookup, kx, ky, kz - 2)];
+
+        t[i] = ((2 * n - 1) * s1 - (n - 1) * s2) / (n * r2);
+    }
+}
+
+//
+// Local expansion of every cell of one level (2 and finer), one work-item
+// per cell: L2L from the parent, whose level has already run, plus M2L over
+// the interaction list. Levels are launched coarsest first.
+//
+__kernel void fmm_downward (
+    global float const * const global_multipole,
+    global float * const global_local,
+    global int const * const k,
+    global int const * const lookup,
+    global float const * const binomial,
+    global int const * const m2l_first,
+    global int const * const m2l_multipole,
+    global int const * const m2l_derivative,
+    global float const * const m2l_factor,
+    int const level,
+    int const level_offset,
+    int const parent_offset,
+    float4 const origin,
+    float const bin_length
+    )
+{
+    int const cells = 1 << level;
+    int const parents = cells / 2;
+    int const b = get_global_id(0);
+    int const x = b / (cells * cells);
+    int const y = (b / cells) % cells;
+    int const z = b % cells;
+    float4 const zc = cell_center(origin, bin_length, level, x, y, z);
+    float l[NCOEF];
+    float t[NCOEF];
+    float pw[3][ORDER + 1];
+
+    for (int g = 0; g < NCOEF; ++g)
+    {
+        l[g] = 0.0f;
+    }
+
+    if (level > 2)
+    {
+        global float const * const lp = &global_local[NCOEF * (parent_offset + CELL_IDX(parents, x / 2, y / 2, z / 2))];
+
+        powers(zc - cell_center(origin, bin_length, level - 1, x / 2, y / 2, z / 2), pw);
+
+        for (int g = 0; g < NCOEF; ++g)
+        {
+            int const gx = k[3 * g];
+            int const gy = k[3 * g + 1];
+            int const gz = k[3 * g + 2];
+
+            for (int bx = gx; bx <= ORDER; ++bx)
+            {
+                for (int by = gy; bx + by <= ORDER; ++by)
+                {
+                    for (int bz = gz; bx + by + bz <= ORDER; ++bz)
+                    {
+                        l[g] += binomial[bx * (ORDER + 1) + gx] * binomial[by * (ORDER + 1) + gy] * binomial[bz * (ORDER + 1) + gz]
+                                * lp[coef_index(lookup, bx, by, bz)]
+                                * pw[0][bx - gx] * pw[1][by - gy] * pw[2][bz - gz];
+                    }
+                }
+            }
+        }
+    }
+
+    for (int px = MAX(0, x / 2 - 1); px < MIN(parents, x / 2 + 2); ++px)
+    {
+        for (int py = MAX(0, y / 2 - 1); py < MIN(parents, y / 2 + 2); ++py)
+        {
+            for (int pz = MAX(0, z / 2 - 1); pz < MIN(parents, z / 2 + 2); ++pz)
+            {
+                for (int child = 0; child < 8; ++child)
+                {
+                    int const sx = 2 * px + (child >> 2);
+                    int const sy = 2 * py + ((child >> 1) & 1);
+                    int const sz = 2 * pz + (child & 1);
+
+                    if (abs(sx - x) <= 1 && abs(sy - y) <= 1 && abs(sz - z) <= 1)
+                    {
+                        continue;
+                    }
+
+                    global float const * const m = &global_multipole[NCOEF * (level_offset + CELL_IDX(cells, sx, sy, sz))];
+
+                    if (m[0] == 0.0f)
+                    {
+                        continue;   // empty cell
+                    }
+
+                    derivatives(k, lookup, zc - cell_center(origin, bin_length, level, sx, sy, sz), t);
+
+                    for (int bi = 0; bi < NCOEF; ++bi)
+                    {
+                        for (int term = m2l_first[bi]; term < m2l_first[bi + 1]; ++term)
+                        {
+                            l[bi] += m2l_factor[term] * m[m2l_multipole[term]] * t[m2l_derivative[term]];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (int g = 0; g < NCOEF; ++g)
+    {
+        global_local[NCOEF * (level_offset + b) + g] = l[g];
+    }
+}
+
+//
+// Acceleration on every bin-sorted body: L2P from its finest cell plus the
+// direct sum over the neighbouring cells, whose bodies are contiguous in
+// runs along z.
+//
+__kernel void fmm_evaluate (
+    global float4 const * const global_bin_pts,
+    global int const * const global_bin_pts_offsets,
+    global int const * const global_pt_bins,
+    global float const * const global_local,
+    global int const * const k,
+    global float4 * const global_a,
+    int const points,
+    int const level_offset,
+    float4 const origin,
+    float const bin_length
+    )
+{
+    int const i = get_global_id(0);
+
+    if (i >= points)
+    {
+        return;
+    }
+
+    int const b = global_pt_bins[i];
+    int const x = b / (FINEST_CELLS * FINEST_CELLS);
+    int const y = (b / FINEST_CELLS) % FINEST_CELLS;
+    int const z = b % FINEST_CELLS;
+    real4_t const my_position = CONVERT4(REAL)(global_bin_pts[i]);
+    global float const * const l = &global_local[NCOEF * (level_offset + b)];
+    accum4_t acc = (accum4_t) (0);
+    float pw[3][ORDER + 1];
+
+    powers(global_bin_pts[i] - cell_center(origin, bin_length, LEVELS, x, y, z), pw);
+
+    for (int bi = 1; bi < NCOEF; ++bi)
+    {
+        int const bx = k[3 * bi];
+        int const by = k[3 * bi + 1];
+        int const bz = k[3 * bi + 2];
+
+        if (bx > 0) acc.x += l[bi] * bx * pw[0][bx - 1] * pw[1][by] * pw[2][bz];
+        if (by > 0) acc.y += l[bi] * by * pw[0][bx] * pw[1][by - 1] * pw[2][bz];
+        if (bz > 0) acc.z += l[bi] * bz * pw[0][bx] * pw[1][by] * pw[2][bz - 1];
+    }
+
+    for (int nx = MAX(0, x - 1); nx < MIN(FINEST_CELLS, x + 2); ++nx)
+    {
+        for (int ny = MAX(0, y - 1); ny < MIN(FINEST_CELLS, y + 2); ++ny)
+        {
+            int const begin = global_bin_pts_offsets[CELL_IDX(FINEST_CELLS, nx, ny, MAX(0, z - 1))];
+            int const end = global_bin_pts_offsets[CELL_IDX(FINEST_CELLS, nx, ny, MIN(FINEST_CELLS, z + 2) - 1) + 1];
+
+            for (int j = begin; j < end; ++j)
+            {
+                body_body_interaction(my_position, CONVERT4(REAL)(global_bin_pts[j]), &acc);
+            }
+        }
+    }
+
+    global_a[i] = convert_float4(acc);
+}
@@ -1,243 +1,377 @@
 #define EPS (1e-10)
+
+//
+// Arithmetic of the force evaluation, passed in by the host as build options
+// (-D REAL=... -D ACCUM=..., see nbody-program.h): pair terms are computed in
+// REAL and summed in ACCUM. Bodies and accelerations stay float4 in memory.
+//
+#ifdef NBODY_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef REAL
+#define REAL float
+#endif
+
+#ifndef ACCUM
+#define ACCUM REAL
+#endif
+
+#define VEC4_(type) type##4
+#define VEC4(type) VEC4_(type)
+#define CONVERT4_(type) convert_##type##4
+#define CONVERT4(type) CONVERT4_(type)
+
+typedef REAL real_t;
+typedef VEC4(REAL) real4_t;
+typedef ACCUM accum_t;
+typedef VEC4(ACCUM) accum4_t;
+
+//
+// Grid dimensions are normally passed in by the host as build options
+// (-D BINS_PER_DIM=... -D BIN_LENGTH=...); these are the defaults.
+//
+#ifndef BIN_LENGTH
 #define BIN_LENGTH (100.0f)
+#endif
+
+#ifndef BINS_PER_DIM
 #define BINS_PER_DIM (10)
+#endif
 
-#define IS_IN(min_value, max_value, value)  \
-    (((value) >= (min_value)) && ((value) < (max_value)))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 typedef float4 (bins_t)[BINS_PER_DIM][BINS_PER_DIM];
 typedef int (bin_pts_offsets_t)[BINS_PER_DIM][BINS_PER_DIM];
 
-inline void get_global_ids (
-    int * const global_id
+#define NUM_BINS (BINS_PER_DIM * BINS_PER_DIM * BINS_PER_DIM)
+
+//
+// Bin a coordinate falls in along one dimension. Bodies outside the grid are
+// clamped into the edge bins so they are never lost.
+//
+inline int bin_coord (
+    float const pos
     )
 {
-    //
-    // x dim
-    //
-    global_id[0] = get_global_id(0);
-
-    //
-    // y dim
-    //
-    global_id[1] = get_global_id(1);
+    return clamp((int) (pos / BIN_LENGTH), 0, BINS_PER_DIM - 1);
+}
 
-    //
-    // z dim
-    //
-    global_id[2] = get_global_id(2);
+inline int bin_of (
+    float4 const pt
+    )
+{
+    return (bin_coord(pt.x) * BINS_PER_DIM + bin_coord(pt.y)) * BINS_PER_DIM + bin_coord(pt.z);
 }
 
+//
+// Binning is a counting sort in four O(N) passes:
+//   count_bins         histogram with atomics, remembering each point's bin and
+//                      its rank within the bin
+//   scan_bin_counts    exclusive scan of the histogram into bin offsets
+//   construct_bin_pts  scatter every body (position, velocity, id) to
+//                      offset + rank
+//   calculate_bins_cm  centre of mass of each bin from its contiguous slice
+// clear_bin_counts resets the histogram before each rebin. The host then
+// takes the scattered copies as the new state, so bodies stay in bin order
+// from one step to the next and only the few that changed bin move far.
+//
+__kernel void clear_bin_counts (
+    global int * const global_bin_counts
+    )
+{
+    global_bin_counts[get_global_id(0)] = 0;
+}
 
 //
-// Get sort out the points for each bin in a 1-D Array.
-// Doing this buy simply placing points in order of
-// what bin they are in. AN offset for each bin is used
-// to get the first index in the 1D array for the first
-// point
+// Bodies arrive mostly sorted by bin from the previous step, so a work-group
+// sees a few long runs of equal bins. Each run takes its ranks with one
+// atomic_add on the bin's count instead of one atomic_inc per body, and the
+// ranks within a run follow body order, keeping the sort close to stable.
+// Run heads are found with a max-scan of head indices in local memory.
 //
-__kernel void construct_bin_pts (
-    global float4 * const global_bin_pts,
-    global bin_pts_offsets_t * const global_bin_pts_offsets,
+__kernel void count_bins (
+    global int * const global_bin_counts,
+    global int2 * const global_pt_bins,
     global float4 const * const global_p,
     global int const * const points,
-    global bins_t const * const global_cm
+    local int * const scratch_bins,
+    local int * const scratch_heads
     )
 {
-    int global_id[3];
-    int i;
-    int x;
-    int y;
-    int z;
-    float max_x;
-    float min_x;
-    float max_y;
-    float min_y;
-    float max_z;
-    float min_z;
-    int counter;
-    int offset;
-    int idx;
-    global float4 const * temp_pt;
-
-    get_global_ids(global_id);
+    int global_id;
+    int local_id;
+    int local_size;
+    int bin;
+    int head;
+    int other;
+    bool last;
 
-    idx = global_id[0] * (BINS_PER_DIM * BINS_PER_DIM) + global_id[1] * BINS_PER_DIM + global_id[2];
+    global_id = get_global_id(0);
+    local_id = get_local_id(0);
+    local_size = get_local_size(0);
 
     //
-    // Calculate offset from beginning of bin_pts array to the beginning
-    // of where this bin's points start
+    // Work-items past the end take part in the barriers with no bin
     //
-    offset = 0;
-    temp_pt = (global float4 *) global_cm;
+    bin = (global_id < points[0]) ? bin_of(global_p[global_id]) : -1;
+
+    scratch_bins[local_id] = bin;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    head = (local_id == 0 || scratch_bins[local_id - 1] != bin) ? local_id : 0;
+    last = (local_id == local_size - 1 || scratch_bins[local_id + 1] != bin);
+
+    scratch_heads[local_id] = head;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (i = 0; i < idx; ++i)
+    for (int stride = 1; stride < local_size; stride <<= 1)
     {
-        offset += (int) temp_pt[i].w;
+        other = (local_id >= stride) ? scratch_heads[local_id - stride] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        scratch_heads[local_id] = max(scratch_heads[local_id], other);
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    global_bin_pts_offsets[global_id[0]][global_id[1]][global_id[2]] = offset;
+    head = scratch_heads[local_id];
+    barrier(CLK_LOCAL_MEM_FENCE);
 
     //
-    // Calculate bounds for the bin
+    // The last body of a run reserves the whole run and leaves the first
+    // rank in the head's slot
     //
-    min_x = (float) (global_id[0] * BIN_LENGTH);
-    max_x = min_x + BIN_LENGTH;
+    if (last && bin >= 0)
+    {
+        scratch_heads[head] = atomic_add(&global_bin_counts[bin], local_id - head + 1);
+    }
 
-    min_y = (float) (global_id[1] * BIN_LENGTH);
-    max_y = min_y + BIN_LENGTH;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    min_z = (float) (global_id[2] * BIN_LENGTH);
-    max_z = min_z + BIN_LENGTH;
+    if (bin >= 0)
+    {
+        global_pt_bins[global_id] = (int2) (bin, scratch_heads[head] + local_id - head);
+    }
+}
 
-    //
-    // Iterate through all the points and find the points that should lie within this bin
-    //
-    counter = 0;
+//
+// Exclusive scan run by a single work-group. The bins are walked in chunks of
+// the work-group size; each chunk is scanned in local memory (Hillis-Steele)
+// and offset by the running total of the chunks before it.
+//
+__kernel void scan_bin_counts (
+    global int * const global_bin_pts_offsets,
+    global int const * const global_bin_counts,
+    local int * const scratch
+    )
+{
+    int local_id;
+    int local_size;
+    int carry;
+    int base;
+    int idx;
+    int val;
+    int sum;
+
+    local_id = get_local_id(0);
+    local_size = get_local_size(0);
+    carry = 0;
 
-    for (i = 0; i < points[0]; ++i)
+    for (base = 0; base < NUM_BINS; base += local_size)
     {
-        if (IS_IN(min_x, max_x, global_p[i].x)
-            && IS_IN(min_y, max_y, global_p[i].y)
-            && IS_IN(min_z, max_z, global_p[i].z))
+        idx = base + local_id;
+        val = (idx < NUM_BINS) ? global_bin_counts[idx] : 0;
+
+        scratch[local_id] = val;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int stride = 1; stride < local_size; stride <<= 1)
         {
-            global_bin_pts[offset + counter] = global_p[i];
-            counter++;
+            sum = (local_id >= stride) ? scratch[local_id - stride] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            scratch[local_id] += sum;
+            barrier(CLK_LOCAL_MEM_FENCE);
         }
+
+        if (idx < NUM_BINS)
+        {
+            global_bin_pts_offsets[idx] = carry + scratch[local_id] - val;
+        }
+
+        carry += scratch[local_size - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    //
+    // The total closes the last bin, so every bin's population is the
+    // difference of two offsets
+    //
+    if (local_id == 0)
+    {
+        global_bin_pts_offsets[NUM_BINS] = carry;
     }
 }
 
 //
-// Calculate center mass for a bin
+// Get sort out the points for each bin in a 1-D Array.
+// Doing this buy simply placing points in order of
+// what bin they are in. AN offset for each bin is used
+// to get the first index in the 1D array for the first
+// point. Velocities, block timestep rungs and the bodies'
+// original indices are carried along so the sorted copies
+// are a whole state.
 //
-__kernel void calculate_bins_cm (
-    global bins_t * const global_cm,
+__kernel void construct_bin_pts (
+    global float4 * const global_bin_pts,
+    global float4 * const global_bin_v,
+    global int * const global_bin_ids,
+    global int * const global_bin_rung,
+    global int const * const global_bin_pts_offsets,
+    global int2 const * const global_pt_bins,
     global float4 const * const global_p,
+    global float4 const * const global_v,
+    global int const * const global_ids,
+    global int const * const global_rung,
     global int const * const points
     )
 {
-    int global_id[3];
-    int i;
-    float max_x;
-    float min_x;
-    float max_y;
-    float min_y;
-    float max_z;
-    float min_z;
-    float4 val;
+    int global_id;
+    int2 pt_bin;
+    int dst;
 
-    get_global_ids(global_id);
+    global_id = get_global_id(0);
 
-    //
-    // Calculate bounds for the bin
-    //
-    min_x = (float) (global_id[0] * BIN_LENGTH);
-    max_x = min_x + BIN_LENGTH;
+    if (global_id >= points[0])
+    {
+        return;
+    }
 
-    min_y = (float) (global_id[1] * BIN_LENGTH);
-    max_y = min_y + BIN_LENGTH;
+    pt_bin = global_pt_bins[global_id];
+    dst = global_bin_pts_offsets[pt_bin.x] + pt_bin.y;
 
-    min_z = (float) (global_id[2] * BIN_LENGTH);
-    max_z = min_z + BIN_LENGTH;
+    global_bin_pts[dst] = global_p[global_id];
+    global_bin_v[dst] = global_v[global_id];
+    global_bin_ids[dst] = global_ids[global_id];
+    global_bin_rung[dst] = global_rung[global_id];
+}
+
+//
+// Calculate center mass for a bin from its points, which are contiguous in
+// bin_pts after the scatter. Empty bins get a zero position and mass.
+//
+__kernel void calculate_bins_cm (
+    global float4 * const global_cm,
+    global float4 const * const global_bin_pts,
+    global int const * const global_bin_pts_offsets,
+    global int const * const global_bin_counts
+    )
+{
+    int global_id;
+    int offset;
+    int count;
+    float4 val;
+
+    global_id = get_global_id(0);
+
+    offset = global_bin_pts_offsets[global_id];
+    count = global_bin_counts[global_id];
 
     val = (float4) {0.0f, 0.0f, 0.0f, 0.0f};
 
+    for (int i = 0; i < count; ++i)
+    {
+        float4 const pt = global_bin_pts[offset + i];
+
+        val.x += pt.w * pt.x;
+        val.y += pt.w * pt.y;
+        val.z += pt.w * pt.z;
+        val.w += pt.w;
+    }
+
     //
-    // Iterate through all the points and find the points that should lie within this bin
+    // An empty (massless) bin keeps a zero position and contributes nothing
     //
-    for (i = 0; i < points[0]; ++i)
+    if (val.w > 0.0f)
     {
-        if (IS_IN(min_x, max_x, global_p[i].x)
-            && IS_IN(min_y, max_y, global_p[i].y)
-            && IS_IN(min_z, max_z, global_p[i].z))
-        {
-            val.x += global_p[i].x;
-            val.y += global_p[i].y;
-            val.z += global_p[i].z;
-            val.w += 1.0f;
-        }
+        val.x /= val.w;
+        val.y /= val.w;
+        val.z /= val.w;
     }
 
-    val.x /= val.w;
-    val.y /= val.w;
-    val.z /= val.w;
-
-    global_cm[global_id[0]][global_id[1]][global_id[2]] = val;
+    global_cm[global_id] = val;
 }
 
 inline void body_body_interaction (
-    float4 const bi,
-    float4 const bj,
-    float4 * const ai
+    real4_t const bi,
+    real4_t const bj,
+    accum4_t * const ai
     )
 {
-    float4 r;
-    float dist_sqr;
-    float dist_sixth;
-    float inv_dist_cube;
-    float s;
-
+    real4_t r;
+    real_t dist_sqr;
+    real_t dist_sixth;
+    real_t inv_dist_cube;
+    real_t s;
 
     r.x = bj.x - bi.x;
     r.y = bj.y - bi.y;
     r.z = bj.z - bi.z;
-    r.w = 1.0f;
+    r.w = 1;
 
-    dist_sqr = r.x * r.x + r.y * r.y + r.z * r.z + EPS;
+    dist_sqr = r.x * r.x + r.y * r.y + r.z * r.z + (real_t) EPS;
 
     dist_sixth = dist_sqr * dist_sqr * dist_sqr;
-    inv_dist_cube = 1.0f / sqrt(dist_sixth);
+    inv_dist_cube = 1 / sqrt(dist_sixth);
 
     s = bj.w * inv_dist_cube;
 
-    ai->x += r.x * s;
-    ai->y += r.y * s;
-    ai->z += r.z * s;
+    ai->x += (accum_t) (r.x * s);
+    ai->y += (accum_t) (r.y * s);
+    ai->z += (accum_t) (r.z * s);
 }
 
-__kernel void nbody (
-    global float4 const * const global_p,
+//
+// Acceleration at a body's position: every bin's centre of mass, with the
+// 27 neighbouring bins swapped for their bodies
+//
+inline float4 body_acceleration (
+    float4 const p,
     global bins_t const * const global_cm,
     global float4 const * const global_bin_pts,
-    global bin_pts_offsets_t const * const global_bin_pts_offsets,
-    global float4 * const global_a,
-    global int const * const points
+    global bin_pts_offsets_t const * const global_bin_pts_offsets
     )
 {
-    int global_id;
     int i;
-    int x;
-    int y;
-    int z;
-    float4 my_position;
-    float4 acc;
+    real4_t my_position;
+    accum4_t acc;
     int offset;
-    float4 neg_bin;
+    int count;
+    real4_t neg_bin;
     int x_bin;
     int y_bin;
     int z_bin;
     global float4 const * global_cm_linear;
-
-    global_id = get_global_id(0);
+    global int const * global_offsets_linear;
 
     global_cm_linear = (global float4 *) global_cm;
+    global_offsets_linear = (global int const *) global_bin_pts_offsets;
 
-    my_position = global_p[global_id];
+    my_position = CONVERT4(REAL)(p);
 
-    x_bin = (int) (my_position.x / BIN_LENGTH);
-    y_bin = (int) (my_position.y / BIN_LENGTH);
-    z_bin = (int) (my_position.z / BIN_LENGTH);
+    x_bin = bin_coord(p.x);
+    y_bin = bin_coord(p.y);
+    z_bin = bin_coord(p.z);
 
-    acc = (float4) {0.0f, 0.0f, 0.0f, 0.0f};
+    acc = (accum4_t) (0);
 
     //
     // Bin approx for all bins
     //
-    for (i = 0; i < (BINS_PER_DIM * BINS_PER_DIM * BINS_PER_DIM); ++i)
+    for (i = 0; i < NUM_BINS; ++i)
     {
-        body_body_interaction(my_position, global_cm_linear[i], &acc);
+        body_body_interaction(my_position, CONVERT4(REAL)(global_cm_linear[i]), &acc);
     }
 
     //
@@ -258,14 +392,337 @@ __kernel void nbody (
 
 
                 offset = global_bin_pts_offsets[x][y][z];
+                count = global_offsets_linear[(x * BINS_PER_DIM + y) * BINS_PER_DIM + z + 1] - offset;
 
-                for (i = 0; i < ((int) global_cm[x][y][z].w); ++i)
+                for (i = 0; i < count; ++i)
                 {
-                    body_body_interaction(my_position, global_bin_pts[offset + i], &acc);
+                    body_body_interaction(my_position, CONVERT4(REAL)(global_bin_pts[offset + i]), &acc);
                 }
             }
         }
     }
 
-    global_a[global_id] = acc;
+    return convert_float4(acc);
+}
+
+__kernel void nbody (
+    global float4 const * const global_p,
+    global bins_t const * const global_cm,
+    global float4 const * const global_bin_pts,
+    global bin_pts_offsets_t const * const global_bin_pts_offsets,
+    global float4 * const global_a,
+    global int const * const points
+    )
+{
+    int global_id;
+
+    global_id = get_global_id(0);
+
+    global_a[global_id] = body_acceleration(global_p[global_id], global_cm, global_bin_pts, global_bin_pts_offsets);
+}
+
+//
+// nbody for the bodies listed by collect_active only. The sources are still
+// every body, through the bins.
+//
+__kernel void nbody_active (
+    global float4 const * const global_p,
+    global bins_t const * const global_cm,
+    global float4 const * const global_bin_pts,
+    global bin_pts_offsets_t const * const global_bin_pts_offsets,
+    global float4 * const global_a,
+    global int const * const global_active,
+    global int const * const active_count
+    )
+{
+    int global_id;
+    int i;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= active_count[0])
+    {
+        return;
+    }
+
+    i = global_active[global_id];
+
+    global_a[i] = body_acceleration(global_p[i], global_cm, global_bin_pts, global_bin_pts_offsets);
+}
+
+//
+// First half of a velocity-Verlet step: kick the velocity by half a timestep
+// with the current acceleration, then drift the position a full timestep.
+// The mass in .w is left untouched.
+//
+__kernel void kick_drift (
+    global float4 * const global_p,
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int const * const points,
+    float const dt
+    )
+{
+    int global_id;
+    float4 v;
+    float4 p;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    v = global_v[global_id];
+    p = global_p[global_id];
+
+    v.x += 0.5f * dt * global_a[global_id].x;
+    v.y += 0.5f * dt * global_a[global_id].y;
+    v.z += 0.5f * dt * global_a[global_id].z;
+
+    p.x += dt * v.x;
+    p.y += dt * v.y;
+    p.z += dt * v.z;
+
+    global_v[global_id] = v;
+    global_p[global_id] = p;
+}
+
+//
+// Second half of a velocity-Verlet step: kick the velocity by half a
+// timestep with the acceleration at the new positions.
+//
+__kernel void kick (
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int const * const points,
+    float const dt
+    )
+{
+    int global_id;
+    float4 v;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    v = global_v[global_id];
+
+    v.x += 0.5f * dt * global_a[global_id].x;
+    v.y += 0.5f * dt * global_a[global_id].y;
+    v.z += 0.5f * dt * global_a[global_id].z;
+
+    global_v[global_id] = v;
+}
+
+//
+// Block timesteps: a body on rung r steps by dt / 2^r and is active after
+// the substeps where min_rung <= r (see nbody-common.h). collect_active
+// lists the active bodies in body order, which is bin order: each
+// work-group compacts its own in local memory with a scan and reserves
+// room for them with one atomic_add on the count, which the host clears.
+//
+__kernel void collect_active (
+    global int const * const global_rung,
+    global int const * const points,
+    int const min_rung,
+    global int * const global_active,
+    global int * const active_count,
+    local int * const scratch
+    )
+{
+    int global_id;
+    int local_id;
+    int local_size;
+    int flag;
+    int other;
+
+    global_id = get_global_id(0);
+    local_id = get_local_id(0);
+    local_size = get_local_size(0);
+
+    //
+    // Work-items past the end take part in the barriers with no body
+    //
+    flag = (global_id < points[0] && global_rung[global_id] >= min_rung) ? 1 : 0;
+
+    scratch[local_id] = flag;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = 1; stride < local_size; stride <<= 1)
+    {
+        other = (local_id >= stride) ? scratch[local_id - stride] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        scratch[local_id] += other;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    //
+    // The last work-item reserves the whole group's run and leaves its
+    // start past the inclusive sums
+    //
+    other = scratch[local_id] - flag;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_id == local_size - 1)
+    {
+        scratch[local_size - 1] = atomic_add(active_count, other + flag);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (flag)
+    {
+        global_active[scratch[local_size - 1] + other] = global_id;
+    }
+}
+
+//
+// Rung a body wants for acceleration a: the smallest r with
+// dt / 2^r <= sqrt(rung_scale / |a|), clamped to [0, max_rung]
+//
+inline int rung_of (
+    float4 const a,
+    float const dt,
+    float const rung_scale,
+    int const max_rung
+    )
+{
+    float const a_mag = sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+    float const r = ceil(0.5f * log2(dt * dt * a_mag / rung_scale));
+
+    if (!(r > 0.0f))
+    {
+        return 0;
+    }
+
+    return min((int) r, max_rung);
+}
+
+//
+// Opening half kick of every body, by its own rung's step
+//
+__kernel void kick_rungs (
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int const * const global_rung,
+    global int const * const points,
+    float const dt
+    )
+{
+    int global_id;
+    float h;
+    float4 v;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    h = ldexp(dt, -global_rung[global_id]);
+    v = global_v[global_id];
+
+    v.x += 0.5f * h * global_a[global_id].x;
+    v.y += 0.5f * h * global_a[global_id].y;
+    v.z += 0.5f * h * global_a[global_id].z;
+
+    global_v[global_id] = v;
+}
+
+//
+// Drift of every body by one substep
+//
+__kernel void drift (
+    global float4 * const global_p,
+    global float4 const * const global_v,
+    global int const * const points,
+    float const h
+    )
+{
+    int global_id;
+    float4 p;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    p = global_p[global_id];
+
+    p.x += h * global_v[global_id].x;
+    p.y += h * global_v[global_id].y;
+    p.z += h * global_v[global_id].z;
+
+    global_p[global_id] = p;
+}
+
+//
+// Listed bodies whose step ends: optionally the closing half kick, the move
+// to the rung they now want (no shallower than min_rung, so the next step
+// stays aligned) and optionally the opening half kick of the next step.
+// With neither kick it only assigns the rungs.
+//
+__kernel void kick_active (
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int * const global_rung,
+    global int const * const global_active,
+    global int const * const active_count,
+    float const dt,
+    float const rung_scale,
+    int const max_rung,
+    int const min_rung,
+    int const close,
+    int const reopen
+    )
+{
+    int global_id;
+    int i;
+    int rung;
+    float h;
+    float4 v;
+    float4 a;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= active_count[0])
+    {
+        return;
+    }
+
+    i = global_active[global_id];
+    v = global_v[i];
+    a = global_a[i];
+
+    if (close)
+    {
+        h = ldexp(dt, -global_rung[i]);
+
+        v.x += 0.5f * h * a.x;
+        v.y += 0.5f * h * a.y;
+        v.z += 0.5f * h * a.z;
+    }
+
+    rung = max(rung_of(a, dt, rung_scale, max_rung), min_rung);
+
+    if (reopen)
+    {
+        h = ldexp(dt, -rung);
+
+        v.x += 0.5f * h * a.x;
+        v.y += 0.5f * h * a.y;
+        v.z += 0.5f * h * a.z;
+    }
+
+    global_v[i] = v;
+    global_rung[i] = rung;
 }
@@ -1,33 +1,59 @@
 #define EPS (1e-10)
 
+//
+// Arithmetic of the force evaluation, passed in by the host as build options
+// (-D REAL=... -D ACCUM=..., see nbody-program.h): pair terms are computed in
+// REAL and summed in ACCUM. Bodies and accelerations stay float4 in memory.
+//
+#ifdef NBODY_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef REAL
+#define REAL float
+#endif
+
+#ifndef ACCUM
+#define ACCUM REAL
+#endif
+
+#define VEC4_(type) type##4
+#define VEC4(type) VEC4_(type)
+#define CONVERT4_(type) convert_##type##4
+#define CONVERT4(type) CONVERT4_(type)
+
+typedef REAL real_t;
+typedef VEC4(REAL) real4_t;
+typedef ACCUM accum_t;
+typedef VEC4(ACCUM) accum4_t;
+
 inline void body_body_interaction (
-    float4 bi,
-    float4 bj,
-    float4 * ai
+    real4_t const bi,
+    real4_t const bj,
+    accum4_t * const ai
     )
 {
-    float4 r;
-    float dist_sqr;
-    float dist_sixth;
-    float inv_dist_cube;
-    float s;
-
+    real4_t r;
+    real_t dist_sqr;
+    real_t dist_sixth;
+    real_t inv_dist_cube;
+    real_t s;
 
     r.x = bj.x - bi.x;
     r.y = bj.y - bi.y;
     r.z = bj.z - bi.z;
-    r.w = 1.0f;
+    r.w = 1;
 
-    dist_sqr = r.x * r.x + r.y * r.y + r.z * r.z + EPS;
+    dist_sqr = r.x * r.x + r.y * r.y + r.z * r.z + (real_t) EPS;
 
     dist_sixth = dist_sqr * dist_sqr * dist_sqr;
-    inv_dist_cube = 1.0f / sqrt(dist_sixth);
+    inv_dist_cube = 1 / sqrt(dist_sixth);
 
     s = bj.w * inv_dist_cube;
 
-    ai->x += r.x * s;
-    ai->y += r.y * s;
-    ai->z += r.z * s;
+    ai->x += (accum_t) (r.x * s);
+    ai->y += (accum_t) (r.y * s);
+    ai->z += (accum_t) (r.z * s);
 }
 
 __kernel void nbody (
@@ -38,16 +64,201 @@ __kernel void nbody (
 {
     int global_id;
     int i;
-    float4 my_position;
-    float4 acc;
+    real4_t my_position;
+    accum4_t acc;
 
     global_id = get_global_id(0);
-    my_position = global_p[global_id];
+    my_position = CONVERT4(REAL)(global_p[global_id]);
+    acc = (accum4_t) (0);
 
     for (i = 0; i < points[0]; ++i)
     {
-        body_body_interaction(my_position, global_p[i], &acc);
+        body_body_interaction(my_position, CONVERT4(REAL)(global_p[i]), &acc);
     }
 
-    global_a[global_id] = acc;
+    global_a[global_id] = convert_float4(acc);
+}
+
+//
+// Tiled version of nbody (GPU Gems 3, chapter 31). Each work-group stages
+// local_size bodies at a time into local memory and every work-item in the
+// group reuses them, so each body is read from global memory once per
+// work-group instead of once per work-item. The global size is rounded up
+// to a multiple of the local size; the extra work-items only help load tiles.
+//
+__kernel void nbody_tiled (
+    global float4 const * const global_p,
+    global float4 * const global_a,
+    global int const * const points,
+    local float4 * const tile
+    )
+{
+    int global_id;
+    int local_id;
+    int local_size;
+    int tile_size;
+    real4_t my_position;
+    accum4_t acc;
+
+    global_id = get_global_id(0);
+    local_id = get_local_id(0);
+    local_size = get_local_size(0);
+
+    my_position = (global_id < points[0]) ? CONVERT4(REAL)(global_p[global_id]) : (real4_t) (0);
+    acc = (accum4_t) (0);
+
+    for (int tile_start = 0; tile_start < points[0]; tile_start += local_size)
+    {
+        //
+        // Last tile may be partial; its size is the same for the whole group
+        //
+        tile_size = min(local_size, points[0] - tile_start);
+
+        if (local_id < tile_size)
+        {
+            tile[local_id] = global_p[tile_start + local_id];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int i = 0; i < tile_size; ++i)
+        {
+            body_body_interaction(my_position, CONVERT4(REAL)(tile[i]), &acc);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (global_id < points[0])
+    {
+        global_a[global_id] = convert_float4(acc);
+    }
+}
+
+//
+// nbody_tiled over an ensemble of independent systems stored one after the
+// other: system k holds bodies [offsets[k], offsets[k + 1]). Every
+// work-group works on targets of one system only, so a system of a few
+// hundred bodies takes a work-group or two and the whole ensemble fills
+// the device in one launch. groups gives each work-group its first target
+// and its system; the groups of a system tile its range, the last one
+// possibly partial.
+//
+__kernel void nbody_ensemble (
+    global float4 const * const global_p,
+    global float4 * const global_a,
+    global int const * const offsets,
+    global int2 const * const groups,
+    local float4 * const tile
+    )
+{
+    int global_id;
+    int local_id;
+    int local_size;
+    int tile_size;
+    int begin;
+    int end;
+    int2 group;
+    real4_t my_position;
+    accum4_t acc;
+
+    group = groups[get_group_id(0)];
+    local_id = get_local_id(0);
+    local_size = get_local_size(0);
+    global_id = group.x + local_id;
+
+    begin = offsets[group.y];
+    end = offsets[group.y + 1];
+
+    my_position = (global_id < end) ? CONVERT4(REAL)(global_p[global_id]) : (real4_t) (0);
+    acc = (accum4_t) (0);
+
+    for (int tile_start = begin; tile_start < end; tile_start += local_size)
+    {
+        tile_size = min(local_size, end - tile_start);
+
+        if (local_id < tile_size)
+        {
+            tile[local_id] = global_p[tile_start + local_id];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int i = 0; i < tile_size; ++i)
+        {
+            body_body_interaction(my_position, CONVERT4(REAL)(tile[i]), &acc);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (global_id < end)
+    {
+        global_a[global_id] = convert_float4(acc);
+    }
+}
+
+//
+// Velocity-Verlet halves for the ensemble, body by body, as in the opt
+// engine: half kick and full drift, then the closing half kick with the
+// new accelerations. The mass in .w is left untouched.
+//
+__kernel void kick_drift (
+    global float4 * const global_p,
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int const * const points,
+    float const dt
+    )
+{
+    int global_id;
+    float4 v;
+    float4 p;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    v = global_v[global_id];
+    p = global_p[global_id];
+
+    v.x += 0.5f * dt * global_a[global_id].x;
+    v.y += 0.5f * dt * global_a[global_id].y;
+    v.z += 0.5f * dt * global_a[global_id].z;
+
+    p.x += dt * v.x;
+    p.y += dt * v.y;
+    p.z += dt * v.z;
+
+    global_v[global_id] = v;
+    global_p[global_id] = p;
+}
+
+__kernel void kick (
+    global float4 * const global_v,
+    global float4 const * const global_a,
+    global int const * const points,
+    float const dt
+    )
+{
+    int global_id;
+    float4 v;
+
+    global_id = get_global_id(0);
+
+    if (global_id >= points[0])
+    {
+        return;
+    }
+
+    v = global_v[global_id];
+
+    v.x += 0.5f * dt * global_a[global_id].x;
+    v.y += 0.5f * dt * global_a[global_id].y;
+    v.z += 0.5f * dt * global_a[global_id].z;
+
+    global_v[global_id] = v;
 }